@@ -0,0 +1,49 @@
+#!/bin/sh
+# Builds the benchmark kernel, boots it headless and appends its results to bench_results.csv
+# (one row per value: commit,date,name,key,value). Exits non-zero if a self test failed or the run didn't finish
+set -e
+. ./config.sh
+
+LOG=${LOG:-bench.log}
+RESULTS=${RESULTS:-bench_results.csv}
+TIMEOUT=${TIMEOUT:-120}
+DISK=${DISK:-bench_disk.img} # scratch disk for the ATA and block cache benchmarks, recreated on every run
+SMP=${SMP:-4} # CPUs, smp_work_1 vs smp_work_all shows how the parallel benchmark scales
+
+./clean.sh
+BENCH=1 ./iso.sh
+rm -f $DISK
+truncate -s 16M $DISK
+
+# isa-debug-exit makes QEMU exit with (code << 1) | 1: 1 = all tests passed, 3 = failures
+set +e
+timeout $TIMEOUT qemu-system-$(./target-triplet-to-arch.sh $HOST) -cdrom nue_kernel.iso \
+  -display none -serial file:$LOG -no-reboot -smp $SMP \
+  -drive file=$DISK,format=raw,if=ide,index=0 \
+  -device isa-debug-exit,iobase=0xf4,iosize=0x04
+STATUS=$?
+set -e
+
+if [ ! -f $RESULTS ]; then
+  echo "commit,date,name,key,value" > $RESULTS
+fi
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+DATE=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+tr -d '\r' < $LOG | awk -v commit=$COMMIT -v date=$DATE '
+  $1 == "BENCH" && NF > 2 {
+    for (i = 3; i <= NF; i++) {
+      split($i, kv, "=")
+      print commit "," date "," $2 "," kv[1] "," kv[2]
+    }
+  }
+  $1 == "TEST" { print commit "," date ",test_" $2 ",result," $3 }
+' >> $RESULTS
+
+grep -E '^(BENCH|TEST)' $LOG | tr -d '\r'
+
+case $STATUS in
+  1) echo "bench: all tests passed, results in $RESULTS" ;;
+  3) echo "bench: self tests failed, see $LOG"; exit 1 ;;
+  124) echo "bench: timed out after ${TIMEOUT}s, see $LOG"; exit 1 ;;
+  *) echo "bench: qemu exited with $STATUS, see $LOG"; exit 1 ;;
+esac
@@ -7,9 +7,19 @@ mkdir -p isodir/boot
 mkdir -p isodir/boot/grub
 
 cp sysroot/boot/nue_kernel.kernel isodir/boot/nue_kernel.kernel
+# Everything under initrd/ is mounted read-only as / (the kernel reads ustar archives)
+tar --format=ustar -cf isodir/boot/initrd.tar -C initrd .
+# The kernel asks for a 1024x768x32 framebuffer and draws its console there; GFXPAYLOAD=text keeps VGA text mode
+GFXPAYLOAD_LINE=""
+if [ -n "$GFXPAYLOAD" ]; then
+	GFXPAYLOAD_LINE="set gfxpayload=$GFXPAYLOAD"
+fi
 cat > isodir/boot/grub/grub.cfg << EOF
+insmod all_video
+$GFXPAYLOAD_LINE
 menuentry "nue_kernel" {
 	multiboot /boot/nue_kernel.kernel
+	module /boot/initrd.tar initrd
 }
 EOF
 grub-mkrescue -o nue_kernel.iso isodir
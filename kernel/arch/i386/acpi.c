@@ -0,0 +1,106 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <kernel/acpi.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+
+#define BDA_EBDA_SEGMENT 0x40E // word in the BIOS data area: real mode segment of the EBDA
+#define BIOS_AREA_START 0xE0000
+#define BIOS_AREA_END 0x100000
+
+static const struct acpi_header* rsdt;
+
+static int checksum_ok(const void* data, uint32_t length)
+{
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        sum += ((const uint8_t*)data)[i];
+    }
+    return sum == 0;
+}
+
+// Tables usually sit at the top of RAM, next to but not inside what the identity map covers. Maps the missing
+// pages read-only. Everything from 2 GiB up belongs to other mappings, tables there are ignored
+static int map_range(uint32_t phys, uint32_t size)
+{
+    if (phys >= PMM_MAX_ADDR || size > PMM_MAX_ADDR - phys) {
+        return -1;
+    }
+    for (uint32_t page = PAGE_ALIGN_DOWN(phys); page < phys + size; page += PAGE_SIZE) {
+        uint32_t mapped, flags;
+        if (paging_query(page, &mapped, &flags) != 0 && paging_map(page, page, PAGE_SIZE, 0) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static const struct acpi_header* map_table(uint32_t phys)
+{
+    if (map_range(phys, sizeof(struct acpi_header)) != 0) {
+        return NULL;
+    }
+    const struct acpi_header* header = (const struct acpi_header*)phys;
+    if (header->length < sizeof(struct acpi_header) || map_range(phys, header->length) != 0
+        || !checksum_ok(header, header->length)) {
+        return NULL;
+    }
+    return header;
+}
+
+// The RSDP is 16 byte aligned
+static const struct acpi_rsdp* scan(uint32_t start, uint32_t end)
+{
+    for (uint32_t addr = start; addr + sizeof(struct acpi_rsdp) <= end; addr += 16) {
+        const struct acpi_rsdp* rsdp = (const struct acpi_rsdp*)addr;
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 && checksum_ok(rsdp, sizeof(*rsdp))) {
+            return rsdp;
+        }
+    }
+    return NULL;
+}
+
+int acpi_init(void)
+{
+    // Page 0 is kept unmapped to catch NULL pointers, borrow it for the one word we need from the BDA
+    paging_map(0, 0, PAGE_SIZE, 0);
+    volatile uint16_t* bda = (volatile uint16_t*)BDA_EBDA_SEGMENT;
+    __asm__ volatile("" : "+r"(bda)); // hide the constant address, gcc assumes nothing lives in the first page
+    uint32_t ebda = (uint32_t)*bda << 4;
+    paging_unmap(0, PAGE_SIZE);
+
+    const struct acpi_rsdp* rsdp = NULL;
+    if (ebda >= 0x80000 && ebda < BIOS_AREA_START) {
+        rsdp = scan(ebda, ebda + 1024);
+    }
+    if (rsdp == NULL) {
+        rsdp = scan(BIOS_AREA_START, BIOS_AREA_END);
+    }
+    if (rsdp == NULL) {
+        return -1;
+    }
+    rsdt = map_table(rsdp->rsdt_address);
+    if (rsdt == NULL || memcmp(rsdt->signature, "RSDT", 4) != 0) {
+        rsdt = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+const struct acpi_header* acpi_find_table(const char* signature)
+{
+    if (rsdt == NULL) {
+        return NULL;
+    }
+    const uint32_t* entries = (const uint32_t*)(rsdt + 1);
+    uint32_t count = (rsdt->length - sizeof(struct acpi_header)) / sizeof(uint32_t);
+    for (uint32_t i = 0; i < count; i++) {
+        const struct acpi_header* table = map_table(entries[i]);
+        if (table != NULL && memcmp(table->signature, signature, 4) == 0) {
+            return table;
+        }
+    }
+    return NULL;
+}
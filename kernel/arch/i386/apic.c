@@ -0,0 +1,280 @@
+#include <stdio.h>
+
+#include <kernel/acpi.h>
+#include <kernel/apic.h>
+#include <kernel/cpu.h>
+#include <kernel/idt.h>
+#include <kernel/paging.h>
+#include <kernel/pit.h>
+#include <kernel/pmm.h>
+
+#define CALIBRATE_MS 10
+#define CALIBRATE_COUNT (PIT_FREQUENCY * CALIBRATE_MS / 1000)
+#define CALIBRATE_RUNS 3
+
+struct ioapic {
+    volatile uint32_t* regs;
+    uint32_t gsi_base;
+    uint32_t entries;
+};
+
+static volatile uint32_t* lapic;
+static struct ioapic ioapics[APIC_MAX_IOAPICS];
+static int ioapic_count;
+static struct apic_cpu cpus[APIC_MAX_CPUS];
+static int cpu_count;
+static int active;
+static uint32_t timer_khz;
+
+// Where each ISA IRQ ends up: identity unless the MADT overrides it (IRQ0 -> GSI 2 on most machines)
+static uint32_t isa_gsi[IRQ_COUNT];
+static uint16_t isa_flags[IRQ_COUNT];
+
+static uint32_t lapic_read(uint32_t reg)
+{
+    return lapic[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value)
+{
+    lapic[reg / 4] = value;
+    (void)lapic[LAPIC_ID / 4]; // reading back makes sure the write reached the APIC before we go on
+}
+
+static uint32_t ioapic_read(struct ioapic* io, uint32_t reg)
+{
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    return io->regs[IOAPIC_WINDOW / 4];
+}
+
+static void ioapic_write(struct ioapic* io, uint32_t reg, uint32_t value)
+{
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    io->regs[IOAPIC_WINDOW / 4] = value;
+}
+
+static struct ioapic* ioapic_for(uint32_t gsi)
+{
+    for (int i = 0; i < ioapic_count; i++) {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].entries) {
+            return &ioapics[i];
+        }
+    }
+    return NULL;
+}
+
+// Programs the redirection entry of an ISA IRQ: same vector as with the PIC, fixed delivery to the boot CPU
+static void ioapic_route(uint8_t irq, int masked)
+{
+    struct ioapic* io = ioapic_for(isa_gsi[irq]);
+    if (io == NULL) {
+        return;
+    }
+    uint32_t pin = isa_gsi[irq] - io->gsi_base;
+    uint32_t low = IRQ_VECTOR(irq);
+    if ((isa_flags[irq] & MADT_FLAGS_ACTIVE_LOW) == MADT_FLAGS_ACTIVE_LOW) {
+        low |= IOAPIC_ACTIVE_LOW;
+    }
+    if ((isa_flags[irq] & MADT_FLAGS_LEVEL) == MADT_FLAGS_LEVEL) {
+        low |= IOAPIC_LEVEL;
+    }
+    if (masked) {
+        low |= IOAPIC_MASKED;
+    }
+    uint32_t flags = irq_save();
+    ioapic_write(io, IOAPIC_REDIRECTION(pin) + 1, lapic_id() << 24);
+    ioapic_write(io, IOAPIC_REDIRECTION(pin), low);
+    irq_restore(flags);
+}
+
+void ioapic_mask(uint8_t irq)
+{
+    ioapic_route(irq, 1);
+}
+
+void ioapic_unmask(uint8_t irq)
+{
+    ioapic_route(irq, 0);
+}
+
+void lapic_eoi(void)
+{
+    lapic[LAPIC_EOI / 4] = 0;
+}
+
+uint32_t lapic_id(void)
+{
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_init_cpu(void)
+{
+    wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE);
+    lapic_write(LAPIC_TPR, 0); // accept every priority
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED); // the BIOS left the PIC wired here (virtual wire mode)
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_eoi(); // in case something was left in service
+}
+
+// Same method as the TSC: count down over a PIT channel 2 window, keep the best of a few runs
+static void lapic_timer_calibrate(void)
+{
+    uint32_t best = 0;
+    for (int run = 0; run < CALIBRATE_RUNS; run++) {
+        uint32_t flags = irq_save();
+        pit_channel2_prepare(CALIBRATE_COUNT);
+        lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+        pit_channel2_start();
+        while (!pit_channel2_expired()) {
+        }
+        uint32_t counted = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+        lapic_write(LAPIC_TIMER_INITIAL, 0);
+        irq_restore(flags);
+        if (best == 0 || counted < best) { // anything that delayed us only makes the window look longer
+            best = counted;
+        }
+    }
+    timer_khz = (uint32_t)((uint64_t)best * PIT_FREQUENCY / CALIBRATE_COUNT / 1000);
+}
+
+uint32_t lapic_timer_khz(void)
+{
+    return timer_khz;
+}
+
+void lapic_timer_periodic(uint32_t count)
+{
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+void lapic_timer_oneshot(uint32_t count)
+{
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+uint32_t lapic_timer_current(void)
+{
+    return lapic_read(LAPIC_TIMER_CURRENT);
+}
+
+static void send_icr(uint32_t apic_id, uint32_t command)
+{
+    uint32_t flags = irq_save();
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    irq_restore(flags);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector)
+{
+    send_icr(apic_id, vector);
+}
+
+void lapic_send_init(uint32_t apic_id)
+{
+    send_icr(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL | LAPIC_ICR_ASSERT);
+}
+
+void lapic_send_startup(uint32_t apic_id, uint8_t page)
+{
+    send_icr(apic_id, LAPIC_ICR_STARTUP | page);
+}
+
+static void parse_madt(const struct acpi_madt* madt)
+{
+    for (int irq = 0; irq < IRQ_COUNT; irq++) {
+        isa_gsi[irq] = (uint32_t)irq;
+    }
+
+    const uint8_t* p = (const uint8_t*)(madt + 1);
+    const uint8_t* end = (const uint8_t*)madt + madt->header.length;
+    while (p + sizeof(struct madt_entry) <= end) {
+        const struct madt_entry* entry = (const struct madt_entry*)p;
+        if (entry->length < sizeof(struct madt_entry) || p + entry->length > end) {
+            break;
+        }
+        if (entry->type == MADT_LAPIC) {
+            const struct madt_lapic* cpu = (const struct madt_lapic*)entry;
+            if ((cpu->flags & MADT_LAPIC_ENABLED) && cpu_count < APIC_MAX_CPUS) {
+                cpus[cpu_count].apic_id = cpu->apic_id;
+                cpus[cpu_count].processor_id = cpu->processor_id;
+                cpu_count++;
+            }
+        } else if (entry->type == MADT_IOAPIC && ioapic_count < APIC_MAX_IOAPICS) {
+            const struct madt_ioapic* io = (const struct madt_ioapic*)entry;
+            ioapics[ioapic_count].regs = paging_map_mmio(io->address, PAGE_SIZE);
+            ioapics[ioapic_count].gsi_base = io->gsi_base;
+            if (ioapics[ioapic_count].regs != NULL) {
+                ioapic_count++;
+            }
+        } else if (entry->type == MADT_ISO) {
+            const struct madt_iso* iso = (const struct madt_iso*)entry;
+            if (iso->bus == 0 && iso->source < IRQ_COUNT) {
+                isa_gsi[iso->source] = iso->gsi;
+                isa_flags[iso->source] = iso->flags;
+            }
+        }
+        p += entry->length;
+    }
+}
+
+int apic_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_EDX_APIC) || !(edx & CPUID_EDX_MSR)) {
+        return -1;
+    }
+    if (acpi_init() != 0) {
+        return -1;
+    }
+    const struct acpi_madt* madt = (const struct acpi_madt*)acpi_find_table("APIC");
+    if (madt == NULL) {
+        return -1;
+    }
+    parse_madt(madt);
+    if (ioapic_count == 0) {
+        return -1;
+    }
+    lapic = paging_map_mmio(madt->lapic_address, PAGE_SIZE);
+    if (lapic == NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < ioapic_count; i++) { // everything masked until irq_register asks for it
+        ioapics[i].entries = ((ioapic_read(&ioapics[i], IOAPIC_REG_VERSION) >> 16) & 0xFF) + 1;
+        for (uint32_t pin = 0; pin < ioapics[i].entries; pin++) {
+            ioapic_write(&ioapics[i], IOAPIC_REDIRECTION(pin), IOAPIC_MASKED);
+        }
+    }
+    lapic_init_cpu();
+    lapic_timer_calibrate();
+
+    active = 1;
+    irq_use_apic(); // masks the PIC and moves the lines that are already in use over
+    return 0;
+}
+
+int apic_active(void)
+{
+    return active;
+}
+
+int apic_cpu_count(void)
+{
+    return cpu_count;
+}
+
+const struct apic_cpu* apic_get_cpu(int index)
+{
+    return index >= 0 && index < cpu_count ? &cpus[index] : NULL;
+}
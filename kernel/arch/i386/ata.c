@@ -0,0 +1,520 @@
+#include <errno.h>
+#include <string.h>
+
+#include <kernel/ata.h>
+#include <kernel/cpu.h>
+#include <kernel/idt.h>
+#include <kernel/klog.h>
+#include <kernel/pci.h>
+#include <kernel/pmm.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+
+struct ata_channel {
+    uint16_t io;
+    uint16_t ctrl;
+    uint16_t bm; // bus master registers, 0 without a PCI IDE controller
+    uint8_t irq;
+    int selected; // last value written to the drive register, -1 after a reset
+    struct list_node queue; // requests waiting for the channel
+    struct list_node active; // requests of the running command, empty = idle
+    enum ata_op op;
+    int dma; // the running command is a DMA transfer
+    uint32_t pio_left; // sectors the IRQ handler still has to move
+    struct ata_request* pio_req; // request the next PIO sector belongs to
+    uint32_t pio_offset; // byte offset of that sector in pio_req->buf
+    struct ata_prd* prdt; // one page, so it never crosses a 64 KiB boundary
+    struct timer timeout;
+};
+
+static struct ata_channel channels[2];
+static struct ata_drive drives[ATA_MAX_DRIVES];
+static struct wait_queue request_wait; // woken whenever a command completes
+static struct ata_stats stats;
+static int dma_available;
+static int dma_enabled;
+
+static struct ata_channel* channel_of(int drive)
+{
+    return &channels[drive >> 1];
+}
+
+// Reading the alternate status register takes ~100ns and has no side effects, 4 reads are the 400ns a drive
+// needs to put its status on the bus after being selected
+static void ata_delay(struct ata_channel* ch)
+{
+    for (int i = 0; i < 4; i++) {
+        inb(ch->ctrl);
+    }
+}
+
+static int wait_not_busy(struct ata_channel* ch, uint32_t us)
+{
+    for (uint32_t i = 0; i < us; i++) {
+        if (!(inb(ch->ctrl) & ATA_STATUS_BSY)) {
+            return 0;
+        }
+        udelay(1);
+    }
+    return -1;
+}
+
+// Waits for the drive to ask for (or offer) data, -1 on an error or timeout
+static int wait_drq(struct ata_channel* ch, uint32_t us)
+{
+    for (uint32_t i = 0; i < us; i++) {
+        uint8_t status = inb(ch->ctrl);
+        if (status & (ATA_STATUS_ERR | ATA_STATUS_DF)) {
+            return -1;
+        }
+        if (!(status & ATA_STATUS_BSY) && (status & ATA_STATUS_DRQ)) {
+            return 0;
+        }
+        udelay(1);
+    }
+    return -1;
+}
+
+static void select_drive(struct ata_channel* ch, uint8_t value)
+{
+    if (ch->selected != value) {
+        outb(ch->io + ATA_REG_DRIVE, value);
+        ata_delay(ch);
+        ch->selected = value;
+    }
+}
+
+// Polled IDENTIFY DEVICE at boot, with the channel's interrupt turned off. ATAPI drives abort it and are skipped
+static void identify(int index)
+{
+    struct ata_channel* ch = channel_of(index);
+    struct ata_drive* drive = &drives[index];
+    uint16_t id[256];
+
+    select_drive(ch, 0xA0 | ((index & 1) << 4));
+    outb(ch->io + ATA_REG_COUNT, 0);
+    outb(ch->io + ATA_REG_LBA0, 0);
+    outb(ch->io + ATA_REG_LBA1, 0);
+    outb(ch->io + ATA_REG_LBA2, 0);
+    outb(ch->io + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+    if (inb(ch->io + ATA_REG_STATUS) == 0 || wait_not_busy(ch, 100000) != 0) {
+        return; // no drive
+    }
+    if (inb(ch->io + ATA_REG_LBA1) != 0 || inb(ch->io + ATA_REG_LBA2) != 0) {
+        return; // ATAPI or SATA signature, not an ATA disk
+    }
+    if (wait_drq(ch, 100000) != 0) {
+        return;
+    }
+    insw(ch->io + ATA_REG_DATA, id, 256);
+
+    drive->lba48 = (id[83] & (1 << 10)) != 0;
+    if (drive->lba48) {
+        drive->sectors = (id[102] || id[103]) ? 0xFFFFFFFF : ((uint32_t)id[101] << 16 | id[100]);
+    } else {
+        drive->sectors = (uint32_t)id[61] << 16 | id[60];
+    }
+    for (int i = 0; i < 20; i++) { // the model string is stored with the bytes of each word swapped
+        drive->model[i * 2] = (char)(id[27 + i] >> 8);
+        drive->model[i * 2 + 1] = (char)id[27 + i];
+    }
+    drive->model[40] = '\0';
+    for (int i = 39; i >= 0 && drive->model[i] == ' '; i--) {
+        drive->model[i] = '\0';
+    }
+    drive->present = drive->sectors != 0;
+}
+
+// Fills the PRD table from the buffers of the active requests, every piece stays inside one 64 KiB window
+static int build_prdt(struct ata_channel* ch)
+{
+    uint32_t n = 0;
+    for (struct list_node* node = ch->active.next; node != &ch->active; node = node->next) {
+        struct ata_request* req = container_of(node, struct ata_request, node);
+        uint32_t addr = (uint32_t)req->buf;
+        uint32_t left = req->count * ATA_SECTOR_SIZE;
+        while (left > 0) {
+            uint32_t size = 0x10000 - (addr & 0xFFFF);
+            if (size > left) {
+                size = left;
+            }
+            if (n == ATA_PRD_MAX) {
+                return -1;
+            }
+            ch->prdt[n].addr = addr;
+            ch->prdt[n].size = (uint16_t)size; // 64 KiB wraps to 0, which is what the controller wants
+            ch->prdt[n].flags = 0;
+            addr += size;
+            left -= size;
+            n++;
+        }
+    }
+    ch->prdt[n - 1].flags = ATA_PRD_END;
+    return 0;
+}
+
+static void pio_transfer(struct ata_channel* ch)
+{
+    uint8_t* sector = (uint8_t*)ch->pio_req->buf + ch->pio_offset;
+    if (ch->op == ATA_READ) {
+        insw(ch->io + ATA_REG_DATA, sector, ATA_SECTOR_SIZE / 2);
+    } else {
+        outsw(ch->io + ATA_REG_DATA, sector, ATA_SECTOR_SIZE / 2);
+    }
+    ch->pio_offset += ATA_SECTOR_SIZE;
+    if (ch->pio_offset == ch->pio_req->count * ATA_SECTOR_SIZE && ch->pio_req->node.next != &ch->active) {
+        ch->pio_req = container_of(ch->pio_req->node.next, struct ata_request, node);
+        ch->pio_offset = 0;
+    }
+}
+
+// Sends the command for the active requests, which start with 'first' and cover 'count' sectors
+static int issue(struct ata_channel* ch, struct ata_request* first, uint32_t count)
+{
+    static const uint8_t commands[2][2][2] = { // [op][lba48][dma]
+        { { ATA_CMD_READ_PIO, ATA_CMD_READ_DMA }, { ATA_CMD_READ_PIO_EXT, ATA_CMD_READ_DMA_EXT } },
+        { { ATA_CMD_WRITE_PIO, ATA_CMD_WRITE_DMA }, { ATA_CMD_WRITE_PIO_EXT, ATA_CMD_WRITE_DMA_EXT } },
+    };
+    uint8_t slave = (first->drive & 1) << 4;
+    uint32_t lba = first->lba;
+
+    if (wait_not_busy(ch, 10000) != 0) {
+        return -1;
+    }
+    ch->op = first->op;
+    ch->dma = 0;
+    ch->pio_left = 0;
+    if (first->op == ATA_FLUSH) {
+        select_drive(ch, 0xE0 | slave);
+        outb(ch->io + ATA_REG_COMMAND, ATA_CMD_FLUSH);
+        return 0;
+    }
+
+    int lba48 = lba + count > 0x0FFFFFFF; // the 28 bit commands are shorter, use them wherever they reach
+    if (lba48 && !drives[first->drive].lba48) {
+        return -1;
+    }
+    ch->dma = dma_enabled && ch->bm != 0 && build_prdt(ch) == 0;
+    uint8_t direction = first->op == ATA_READ ? ATA_BM_CMD_READ : 0;
+    if (ch->dma) {
+        outl(ch->bm + ATA_BM_PRDT, (uint32_t)ch->prdt);
+        outb(ch->bm + ATA_BM_COMMAND, direction);
+        outb(ch->bm + ATA_BM_STATUS, ATA_BM_STATUS_ERR | ATA_BM_STATUS_IRQ); // write 1 to clear
+    }
+
+    if (lba48) {
+        select_drive(ch, 0xE0 | slave);
+        outb(ch->io + ATA_REG_COUNT, (uint8_t)(count >> 8)); // high bytes first, they share the registers
+        outb(ch->io + ATA_REG_LBA0, (uint8_t)(lba >> 24));
+        outb(ch->io + ATA_REG_LBA1, 0);
+        outb(ch->io + ATA_REG_LBA2, 0);
+    } else {
+        select_drive(ch, 0xE0 | slave | ((lba >> 24) & 0x0F));
+    }
+    outb(ch->io + ATA_REG_COUNT, (uint8_t)count); // 256 is sent as 0
+    outb(ch->io + ATA_REG_LBA0, (uint8_t)lba);
+    outb(ch->io + ATA_REG_LBA1, (uint8_t)(lba >> 8));
+    outb(ch->io + ATA_REG_LBA2, (uint8_t)(lba >> 16));
+    outb(ch->io + ATA_REG_COMMAND, commands[first->op == ATA_WRITE][lba48][ch->dma]);
+
+    if (ch->dma) {
+        outb(ch->bm + ATA_BM_COMMAND, direction | ATA_BM_CMD_START);
+        stats.dma_commands++;
+        return 0;
+    }
+    ch->pio_left = count;
+    ch->pio_req = first;
+    ch->pio_offset = 0;
+    if (first->op == ATA_WRITE) { // the first sector goes out now, each IRQ then asks for the next one
+        if (wait_drq(ch, 10000) != 0) {
+            return -1;
+        }
+        pio_transfer(ch);
+    }
+    return 0;
+}
+
+// Completes every active request with 'status', interrupts are disabled
+static void complete_active(struct ata_channel* ch, int status)
+{
+    timer_cancel(&ch->timeout);
+    if (status != 0) {
+        stats.errors++;
+    }
+    while (!list_empty(&ch->active)) {
+        struct ata_request* req = container_of(ch->active.next, struct ata_request, node);
+        list_remove(&req->node);
+        if (status == 0 && req->op == ATA_READ) {
+            stats.sectors_read += req->count;
+        } else if (status == 0 && req->op == ATA_WRITE) {
+            stats.sectors_written += req->count;
+        }
+        req->status = status;
+        req->done = 1;
+        if (req->complete != NULL) {
+            req->complete(req);
+        }
+    }
+    wake_up(&request_wait);
+}
+
+// Takes the request at the head of the queue plus every request right behind it that continues it on disk,
+// and issues them as one command. Interrupts are disabled
+static void start_command(struct ata_channel* ch)
+{
+    while (list_empty(&ch->active) && !list_empty(&ch->queue)) {
+        struct ata_request* first = container_of(ch->queue.next, struct ata_request, node);
+        uint32_t count = first->count;
+        list_remove(&first->node);
+        list_add_tail(&ch->active, &first->node);
+
+        while (first->op != ATA_FLUSH && !list_empty(&ch->queue)) {
+            struct ata_request* next = container_of(ch->queue.next, struct ata_request, node);
+            if (next->drive != first->drive || next->op != first->op || next->lba != first->lba + count
+                || count + next->count > ATA_MAX_SECTORS) {
+                break;
+            }
+            list_remove(&next->node);
+            list_add_tail(&ch->active, &next->node);
+            count += next->count;
+            stats.merged++;
+        }
+
+        stats.commands++;
+        if (issue(ch, first, count) == 0) {
+            timer_add(&ch->timeout, timer_ms_to_ticks(ATA_TIMEOUT_MS));
+        } else {
+            complete_active(ch, -EIO); // the drive didn't take the command, go on with the next one
+        }
+    }
+}
+
+static void finish(struct ata_channel* ch, int status)
+{
+    complete_active(ch, status);
+    start_command(ch);
+}
+
+static void ata_interrupt(struct interrupt_frame* frame, void* ctx)
+{
+    (void)frame;
+    struct ata_channel* ch = ctx;
+
+    if (list_empty(&ch->active)) {
+        inb(ch->io + ATA_REG_STATUS); // spurious, or late after a timeout: just acknowledge it
+        return;
+    }
+    if (ch->dma) {
+        uint8_t bm_status = inb(ch->bm + ATA_BM_STATUS);
+        if (!(bm_status & ATA_BM_STATUS_IRQ)) {
+            return; // not from the DMA transfer (yet)
+        }
+        outb(ch->bm + ATA_BM_COMMAND, 0); // stop the bus master
+        uint8_t status = inb(ch->io + ATA_REG_STATUS);
+        outb(ch->bm + ATA_BM_STATUS, ATA_BM_STATUS_ERR | ATA_BM_STATUS_IRQ);
+        int failed = (status & (ATA_STATUS_ERR | ATA_STATUS_DF)) || (bm_status & ATA_BM_STATUS_ERR);
+        finish(ch, failed ? -EIO : 0);
+        return;
+    }
+
+    uint8_t status = inb(ch->io + ATA_REG_STATUS);
+    if (status & (ATA_STATUS_ERR | ATA_STATUS_DF)) {
+        finish(ch, -EIO);
+    } else if (ch->op == ATA_READ) { // an IRQ per sector that is ready to be read
+        if (status & ATA_STATUS_DRQ) {
+            pio_transfer(ch);
+            if (--ch->pio_left == 0) {
+                finish(ch, 0);
+            }
+        }
+    } else if (ch->op == ATA_WRITE) { // an IRQ per sector that has been written
+        if (--ch->pio_left == 0) {
+            finish(ch, 0);
+        } else {
+            pio_transfer(ch);
+        }
+    } else {
+        finish(ch, 0);
+    }
+}
+
+// The drive never answered: reset the channel and fail the command
+static void ata_timeout(void* arg)
+{
+    struct ata_channel* ch = arg;
+    if (list_empty(&ch->active)) {
+        return;
+    }
+    stats.timeouts++;
+    if (ch->bm != 0) {
+        outb(ch->bm + ATA_BM_COMMAND, 0);
+    }
+    outb(ch->ctrl, ATA_CTRL_SRST);
+    udelay(5);
+    outb(ch->ctrl, 0);
+    ch->selected = -1;
+    finish(ch, -EIO);
+}
+
+int ata_init(void)
+{
+    static const uint16_t io[2] = { ATA_PRIMARY_IO, ATA_SECONDARY_IO };
+    static const uint16_t ctrl[2] = { ATA_PRIMARY_CTRL, ATA_SECONDARY_CTRL };
+    uint16_t bm = 0;
+    int found = 0;
+
+    wait_queue_init(&request_wait);
+
+    // A PIIX style controller keeps both channels at the legacy ports and IRQs, its BAR4 only adds bus mastering
+    struct pci_device dev;
+    if (pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &dev) == 0 && (dev.prog_if & 0x80)) {
+        bm = (uint16_t)pci_bar(&dev, 4);
+        if (bm != 0) {
+            pci_write16(&dev, PCI_COMMAND, pci_read16(&dev, PCI_COMMAND) | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+        }
+    }
+
+    for (int c = 0; c < 2; c++) {
+        struct ata_channel* ch = &channels[c];
+        ch->io = io[c];
+        ch->ctrl = ctrl[c];
+        ch->irq = c == 0 ? 14 : 15;
+        ch->selected = -1;
+        list_init(&ch->queue);
+        list_init(&ch->active);
+        timer_setup(&ch->timeout, ata_timeout, ch);
+
+        outb(ch->ctrl, ATA_CTRL_NIEN);
+        if (inb(ch->io + ATA_REG_STATUS) == 0xFF) {
+            continue; // floating bus, nothing attached
+        }
+        identify(c * 2);
+        identify(c * 2 + 1);
+        if (!drives[c * 2].present && !drives[c * 2 + 1].present) {
+            continue;
+        }
+
+        if (bm != 0) {
+            ch->prdt = (struct ata_prd*)pmm_alloc_page();
+            if (ch->prdt != NULL) {
+                ch->bm = (uint16_t)(bm + c * 8);
+                dma_available = 1;
+            }
+        }
+        irq_register(IRQ_VECTOR(ch->irq), ata_interrupt, ch);
+        outb(ch->ctrl, 0); // interrupts on
+        inb(ch->io + ATA_REG_STATUS); // drop anything the probing left pending
+        for (int d = c * 2; d <= c * 2 + 1; d++) {
+            if (drives[d].present) {
+                kprintf("[ATA] hd%c: %s, %lu MiB%s\n", 'a' + d, drives[d].model,
+                    (unsigned long)(drives[d].sectors / (1024 * 1024 / ATA_SECTOR_SIZE)), drives[d].lba48 ? ", lba48" : "");
+                found++;
+            }
+        }
+    }
+    dma_enabled = dma_available;
+    return found;
+}
+
+const struct ata_drive* ata_get_drive(int drive)
+{
+    if (drive < 0 || drive >= ATA_MAX_DRIVES || !drives[drive].present) {
+        return NULL;
+    }
+    return &drives[drive];
+}
+
+int ata_queue(struct ata_request* req)
+{
+    const struct ata_drive* drive = ata_get_drive(req->drive);
+    if (drive == NULL) {
+        return -ENODEV;
+    }
+    if (req->op != ATA_FLUSH && (req->count == 0 || req->count > ATA_MAX_SECTORS || req->lba >= drive->sectors
+        || req->count > drive->sectors - req->lba || ((uint32_t)req->buf & 1))) {
+        return -EINVAL;
+    }
+    req->done = 0;
+    req->status = 0;
+    uint32_t flags = irq_save();
+    list_add_tail(&channel_of(req->drive)->queue, &req->node);
+    stats.requests++;
+    irq_restore(flags);
+    return 0;
+}
+
+void ata_start(int drive)
+{
+    uint32_t flags = irq_save();
+    start_command(channel_of(drive));
+    irq_restore(flags);
+}
+
+int ata_wait(struct ata_request* req)
+{
+    if (sched_can_block()) {
+        wait_event(&request_wait, req->done);
+    } else {
+        while (!req->done) { // boot or idle thread, the IRQ still comes in
+            __asm__ volatile("pause");
+        }
+    }
+    return req->status;
+}
+
+static int ata_rw(int drive, enum ata_op op, uint32_t lba, uint32_t count, void* buf)
+{
+    while (count > 0) { // split into commands, each one still as large as a command gets
+        struct ata_request req;
+        memset(&req, 0, sizeof(req));
+        req.drive = (uint8_t)drive;
+        req.op = op;
+        req.lba = lba;
+        req.count = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+        req.buf = buf;
+        int err = ata_queue(&req);
+        if (err == 0) {
+            ata_start(drive);
+            err = ata_wait(&req);
+        }
+        if (err != 0 || op == ATA_FLUSH) {
+            return err;
+        }
+        lba += req.count;
+        count -= req.count;
+        buf = (uint8_t*)buf + req.count * ATA_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+int ata_read(int drive, uint32_t lba, uint32_t count, void* buf)
+{
+    return ata_rw(drive, ATA_READ, lba, count, buf);
+}
+
+int ata_write(int drive, uint32_t lba, uint32_t count, const void* buf)
+{
+    return ata_rw(drive, ATA_WRITE, lba, count, (void*)buf);
+}
+
+int ata_flush(int drive)
+{
+    return ata_rw(drive, ATA_FLUSH, 0, 1, NULL);
+}
+
+int ata_dma_available(void)
+{
+    return dma_available;
+}
+
+void ata_set_dma(int enable)
+{
+    dma_enabled = enable && dma_available;
+}
+
+void ata_get_stats(struct ata_stats* out)
+{
+    uint32_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
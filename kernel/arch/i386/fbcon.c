@@ -0,0 +1,369 @@
+#include <string.h>
+
+#include <kernel/fbcon.h>
+
+#include "font.h"
+
+#define BIOS_FONT_VECTOR 0x43 // INT 43h points at the graphics font of the mode the BIOS set last
+#define BDA_CHAR_HEIGHT 0x485 // word in the BIOS data area: character height of that mode
+#define BIOS_ROM_START 0xC0000
+#define BIOS_ROM_END 0x100000
+#define CP437_FULL_BLOCK 0xDB
+
+#define CURSOR_FIRST_LINE 14 // an underline, the same scanlines tty.c gives the VGA cursor
+#define DRAWN_UNKNOWN 0xFFFFFFFFu // no cell value, the pixels have to be drawn
+
+// A glyph expanded for one character and color pair, a row of it is one 32 byte copy
+struct glyph {
+    uint32_t pixels[FONT_HEIGHT][FONT_WIDTH];
+    uint32_t cell; // what it was expanded for, DRAWN_UNKNOWN while the slot is empty
+};
+
+static int active;
+static struct fbcon_info info;
+static uint8_t* framebuffer;
+static uint32_t palette[16]; // the VGA colors in the framebuffer's pixel format
+static uint8_t font[256][FONT_HEIGHT];
+static struct glyph glyph_cache[FBCON_GLYPH_CACHE] __attribute__((aligned(64)));
+static struct fbcon_stats stats;
+
+// What the pixels show, per cell. The rows form a ring starting at 'top', so a scroll only moves 'top' along
+// (and the pixels, on the next flush)
+static uint32_t drawn[FBCON_MAX_ROWS][FBCON_MAX_COLUMNS];
+static uint16_t dirty_first[FBCON_MAX_ROWS]; // per ring row, the columns [first, end) that may have changed
+static uint16_t dirty_end[FBCON_MAX_ROWS];
+static size_t top;
+static size_t pending_scroll; // rows the text moved up since the last flush
+static uint32_t pending_fill; // background of the rows that scrolled in
+
+static size_t cursor_x, cursor_y;
+static int cursor_visible;
+static int cursor_drawn; // the underline is on the screen at cursor_drawn_x / cursor_drawn_y
+static size_t cursor_drawn_x, cursor_drawn_y;
+
+static inline size_t ring_row(size_t row)
+{
+    size_t r = top + row;
+    return r < info.rows ? r : r - info.rows;
+}
+
+// 32 bit pattern fill, memset (which is SSE2 for big fills) whenever all four bytes are the same
+static void fill32(uint32_t* dst, uint32_t value, size_t count)
+{
+    if (value == (value & 0xFF) * 0x01010101u) {
+        memset(dst, (int)(value & 0xFF), count * sizeof(uint32_t));
+        return;
+    }
+    uint32_t ecx, edi;
+    __asm__ volatile("rep stosl" : "=&c"(ecx), "=&D"(edi) : "0"(count), "1"(dst), "a"(value) : "memory");
+}
+
+static void fill_cells(size_t x, size_t y, size_t count, uint32_t value)
+{
+    uint8_t* line = framebuffer + y * FONT_HEIGHT * info.pitch + x * FONT_WIDTH * sizeof(uint32_t);
+    for (int i = 0; i < FONT_HEIGHT; i++, line += info.pitch) {
+        fill32((uint32_t*)line, value, count * FONT_WIDTH);
+    }
+}
+
+static const struct glyph* glyph_lookup(uint16_t cell)
+{
+    // For a given color pair every character gets its own slot
+    struct glyph* glyph = &glyph_cache[(cell + (cell >> 8) * 97u) & (FBCON_GLYPH_CACHE - 1)];
+    if (glyph->cell != cell) {
+        uint32_t fg = palette[(cell >> 8) & 0x0F];
+        uint32_t bg = palette[cell >> 12];
+        const uint8_t* bits = font[cell & 0xFF];
+        for (int y = 0; y < FONT_HEIGHT; y++) {
+            for (int x = 0; x < FONT_WIDTH; x++) {
+                glyph->pixels[y][x] = (bits[y] & (0x80 >> x)) ? fg : bg;
+            }
+        }
+        glyph->cell = cell;
+        stats.glyph_misses++;
+    }
+    return glyph;
+}
+
+static void draw_cell(size_t x, size_t y, uint16_t cell)
+{
+    const struct glyph* glyph = glyph_lookup(cell);
+    uint8_t* line = framebuffer + y * FONT_HEIGHT * info.pitch + x * FONT_WIDTH * sizeof(uint32_t);
+    for (int i = 0; i < FONT_HEIGHT; i++, line += info.pitch) {
+        uint32_t* dst = (uint32_t*)line;
+        const uint32_t* src = glyph->pixels[i];
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = src[3];
+        dst[4] = src[4];
+        dst[5] = src[5];
+        dst[6] = src[6];
+        dst[7] = src[7];
+    }
+    stats.cells_drawn++;
+}
+
+static void draw_cursor(size_t x, size_t y, uint16_t cell)
+{
+    uint8_t* line = framebuffer + (y * FONT_HEIGHT + CURSOR_FIRST_LINE) * info.pitch + x * FONT_WIDTH * sizeof(uint32_t);
+    for (int i = CURSOR_FIRST_LINE; i < FONT_HEIGHT; i++, line += info.pitch) {
+        fill32((uint32_t*)line, palette[(cell >> 8) & 0x0F], FONT_WIDTH);
+    }
+}
+
+static inline int is_blank(uint16_t cell)
+{
+    return (cell & 0xFF) == ' ' || (cell & 0xFF) == 0;
+}
+
+// Makes the cell under the cursor get redrawn without it
+static void drop_cursor(void)
+{
+    if (cursor_drawn) {
+        size_t r = ring_row(cursor_drawn_y);
+        drawn[r][cursor_drawn_x] = DRAWN_UNKNOWN;
+        if (dirty_first[r] > cursor_drawn_x) {
+            dirty_first[r] = (uint16_t)cursor_drawn_x;
+        }
+        if (dirty_end[r] <= cursor_drawn_x) {
+            dirty_end[r] = (uint16_t)(cursor_drawn_x + 1);
+        }
+        cursor_drawn = 0;
+    }
+}
+
+void fbcon_dirty(size_t from, size_t to)
+{
+    while (from < to) {
+        size_t row = from / info.columns;
+        size_t first = from % info.columns;
+        size_t end = (to - row * info.columns < info.columns) ? to - row * info.columns : info.columns;
+        size_t r = ring_row(row);
+        if (dirty_first[r] > first) {
+            dirty_first[r] = (uint16_t)first;
+        }
+        if (dirty_end[r] < end) {
+            dirty_end[r] = (uint16_t)end;
+        }
+        from = (row + 1) * info.columns;
+    }
+}
+
+void fbcon_scroll(uint16_t blank)
+{
+    drop_cursor(); // its pixels move up with the rest, the cell gets redrawn wherever it ends up
+    size_t bottom = top; // the old top row leaves the screen, its ring row becomes the new bottom one
+    top = ring_row(1);
+
+    // The flush clears all uncovered rows in one color, a row that wanted another gets drawn cell by cell
+    uint32_t fill = palette[blank >> 12];
+    if (pending_scroll == 0) {
+        pending_fill = fill;
+    }
+    pending_scroll++;
+    uint32_t value = (fill == pending_fill) ? blank : DRAWN_UNKNOWN;
+    for (size_t x = 0; x < info.columns; x++) {
+        drawn[bottom][x] = value;
+    }
+    dirty_first[bottom] = 0;
+    dirty_end[bottom] = (uint16_t)info.columns;
+}
+
+void fbcon_invalidate(void)
+{
+    for (size_t r = 0; r < info.rows; r++) {
+        dirty_first[r] = 0;
+        dirty_end[r] = (uint16_t)info.columns;
+    }
+}
+
+void fbcon_set_cursor(size_t x, size_t y, int visible)
+{
+    if (x != cursor_x || y != cursor_y || !visible) {
+        drop_cursor();
+    }
+    cursor_x = x;
+    cursor_y = y;
+    cursor_visible = visible;
+}
+
+void fbcon_flush(const uint16_t* cells)
+{
+    if (!active) {
+        return;
+    }
+    stats.flushes++;
+
+    // Scrolls first: one block move for all of them, then the rows that came in are cleared with a span fill
+    if (pending_scroll > 0) {
+        size_t n = pending_scroll < info.rows ? pending_scroll : info.rows;
+        size_t text_row = FONT_HEIGHT * info.pitch;
+        if (n < info.rows) {
+            memmove(framebuffer, framebuffer + n * text_row, (info.rows - n) * text_row);
+            stats.scrolls += info.rows - n;
+        }
+        fill32((uint32_t*)(framebuffer + (info.rows - n) * text_row), pending_fill,
+            n * text_row / sizeof(uint32_t));
+        pending_scroll = 0;
+    }
+
+    for (size_t y = 0; y < info.rows; y++) {
+        size_t r = ring_row(y);
+        size_t end = dirty_end[r];
+        const uint16_t* line = cells + y * info.columns;
+        uint32_t* was = drawn[r];
+        for (size_t x = dirty_first[r]; x < end;) {
+            uint16_t cell = line[x];
+            if (cell == was[x]) {
+                x++;
+                continue;
+            }
+            if (cursor_drawn && cursor_drawn_y == y && cursor_drawn_x == x) {
+                cursor_drawn = 0; // gets painted over
+            }
+            if (is_blank(cell)) { // a run of the same blank cells is one rectangle fill
+                size_t n = 1;
+                while (x + n < end && line[x + n] == cell && was[x + n] != cell) {
+                    was[x + n] = cell;
+                    n++;
+                }
+                if (cursor_drawn && cursor_drawn_y == y && cursor_drawn_x > x && cursor_drawn_x < x + n) {
+                    cursor_drawn = 0;
+                }
+                fill_cells(x, y, n, palette[cell >> 12]);
+                stats.cells_filled += n;
+                was[x] = cell;
+                x += n;
+                continue;
+            }
+            draw_cell(x, y, cell);
+            was[x] = cell;
+            x++;
+        }
+        dirty_first[r] = (uint16_t)info.columns;
+        dirty_end[r] = 0;
+    }
+
+    if (cursor_visible && !cursor_drawn && cursor_x < info.columns && cursor_y < info.rows) {
+        draw_cursor(cursor_x, cursor_y, cells[cursor_y * info.columns + cursor_x]);
+        cursor_drawn = 1;
+        cursor_drawn_x = cursor_x;
+        cursor_drawn_y = cursor_y;
+    }
+}
+
+// A BIOS that set the video mode leaves INT 43h pointing at the font for the mode's character height. GRUB sets
+// the framebuffer mode through the VESA BIOS, so the full code page 437 font is usually there. Checked against a
+// few glyphs whose shape is known, anything else (no BIOS, another font) falls back to the built-in one
+static int load_bios_font(void)
+{
+    volatile uint16_t* vector = (volatile uint16_t*)(BIOS_FONT_VECTOR * 4);
+    volatile uint16_t* char_height = (volatile uint16_t*)BDA_CHAR_HEIGHT;
+    __asm__ volatile("" : "+r"(vector), "+r"(char_height)); // GCC considers fixed low addresses out of bounds
+    uint32_t addr = ((uint32_t)vector[1] << 4) + vector[0];
+    if (*char_height != FONT_HEIGHT || addr < BIOS_ROM_START || addr + sizeof(font) > BIOS_ROM_END) {
+        return -1;
+    }
+
+    const uint8_t* bios = (const uint8_t*)addr;
+    int space = 0, letter = 0, block = 0;
+    for (int i = 0; i < FONT_HEIGHT; i++) {
+        space |= bios[' ' * FONT_HEIGHT + i];
+        letter += bios['A' * FONT_HEIGHT + i] != 0;
+        block += bios[CP437_FULL_BLOCK * FONT_HEIGHT + i] == 0xFF;
+    }
+    if (space != 0 || letter < 6 || block != FONT_HEIGHT) {
+        return -1;
+    }
+    memcpy(font, bios, sizeof(font));
+    return 0;
+}
+
+static void load_builtin_font(void)
+{
+    for (int c = 0; c < 256; c++) {
+        const uint8_t* glyph = font8x16_missing;
+        if (c == 0) {
+            glyph = font8x16[0]; // blank, like ' '
+        } else if (c >= FONT_FIRST && c < FONT_FIRST + FONT_GLYPHS) {
+            glyph = font8x16[c - FONT_FIRST];
+        }
+        memcpy(font[c], glyph, FONT_HEIGHT);
+    }
+}
+
+// Scales an 8 bit channel into the field the framebuffer keeps it in
+static uint32_t channel(uint8_t value, uint8_t position, uint8_t size)
+{
+    return size >= 8 ? (uint32_t)value << (position + size - 8) : (uint32_t)(value >> (8 - size)) << position;
+}
+
+int fbcon_init(const struct multiboot_info* mbi)
+{
+    // The 16 VGA text colors
+    static const uint32_t vga_rgb[16] = {
+        0x000000, 0x0000AA, 0x00AA00, 0x00AAAA, 0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA,
+        0x555555, 0x5555FF, 0x55FF55, 0x55FFFF, 0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF
+    };
+
+    if (!(mbi->flags & MULTIBOOT_INFO_FRAMEBUFFER) || mbi->framebuffer_type != MULTIBOOT_FRAMEBUFFER_RGB
+        || mbi->framebuffer_bpp != 32) {
+        return -1;
+    }
+    uint64_t size = (uint64_t)mbi->framebuffer_pitch * mbi->framebuffer_height;
+    if (mbi->framebuffer_addr + size > 0x100000000ULL) {
+        return -1; // no PAE, it has to be below 4 GiB
+    }
+
+    info.phys = (uint32_t)mbi->framebuffer_addr;
+    info.size = (uint32_t)size;
+    info.width = mbi->framebuffer_width;
+    info.height = mbi->framebuffer_height;
+    info.pitch = mbi->framebuffer_pitch;
+    info.columns = info.width / FONT_WIDTH < FBCON_MAX_COLUMNS ? info.width / FONT_WIDTH : FBCON_MAX_COLUMNS;
+    info.rows = info.height / FONT_HEIGHT < FBCON_MAX_ROWS ? info.height / FONT_HEIGHT : FBCON_MAX_ROWS;
+    if (info.columns == 0 || info.rows == 0) {
+        return -1;
+    }
+    framebuffer = (uint8_t*)info.phys;
+
+    const uint8_t* fields = mbi->color_info; // red position and size, then green, then blue
+    for (int i = 0; i < 16; i++) {
+        palette[i] = channel((uint8_t)(vga_rgb[i] >> 16), fields[0], fields[1])
+            | channel((uint8_t)(vga_rgb[i] >> 8), fields[2], fields[3]) | channel((uint8_t)vga_rgb[i], fields[4], fields[5]);
+    }
+    info.bios_font = load_bios_font() == 0;
+    if (!info.bios_font) {
+        load_builtin_font();
+    }
+    for (int i = 0; i < FBCON_GLYPH_CACHE; i++) {
+        glyph_cache[i].cell = DRAWN_UNKNOWN;
+    }
+
+    // Whatever GRUB left on the screen goes, the cells get drawn on the first flush
+    fill32((uint32_t*)framebuffer, palette[0], info.size / sizeof(uint32_t));
+    for (size_t y = 0; y < info.rows; y++) {
+        for (size_t x = 0; x < info.columns; x++) {
+            drawn[y][x] = DRAWN_UNKNOWN;
+        }
+    }
+    fbcon_invalidate();
+    active = 1;
+    return 0;
+}
+
+int fbcon_active(void)
+{
+    return active;
+}
+
+void fbcon_get_info(struct fbcon_info* out)
+{
+    *out = info;
+}
+
+void fbcon_get_stats(struct fbcon_stats* out)
+{
+    *out = stats;
+}
@@ -0,0 +1,15 @@
+#ifndef ARCH_I386_FONT_H
+#define ARCH_I386_FONT_H
+
+#include <stdint.h>
+
+// The framebuffer console's built-in font, used when the video BIOS doesn't provide its code page 437 one
+#define FONT_WIDTH 8
+#define FONT_HEIGHT 16
+#define FONT_FIRST ' '
+#define FONT_GLYPHS 95 // ' ' to '~'
+
+extern const uint8_t font8x16[FONT_GLYPHS][FONT_HEIGHT];
+extern const uint8_t font8x16_missing[FONT_HEIGHT];
+
+#endif
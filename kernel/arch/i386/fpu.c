@@ -0,0 +1,153 @@
+#include <string.h>
+
+#include <kernel/fpu.h>
+#include <kernel/idt.h>
+#include <kernel/kmalloc.h>
+#include <kernel/thread.h>
+
+#define MXCSR_DEFAULT 0x1F80 // all SSE exceptions masked, round to nearest
+
+static uint32_t features;
+static struct thread* owner; // whose state is in the FPU registers, NULL = nobody's
+static struct fpu_stats stats;
+static uint8_t initial_state[FPU_STATE_SIZE] __attribute__((aligned(16))); // what a thread starts out with
+
+static void save(uint8_t* area)
+{
+    if (features & FPU_HAS_FXSR) {
+        __asm__ volatile("fxsave (%0)" : : "r"(area) : "memory");
+    } else {
+        __asm__ volatile("fnsave (%0)" : : "r"(area) : "memory");
+    }
+}
+
+static void restore(const uint8_t* area)
+{
+    if (features & FPU_HAS_FXSR) {
+        __asm__ volatile("fxrstor (%0)" : : "r"(area) : "memory");
+    } else {
+        __asm__ volatile("frstor (%0)" : : "r"(area) : "memory");
+    }
+}
+
+// #NM: the current thread used the FPU while CR0.TS was set
+static void fpu_trap(struct interrupt_frame* frame, void* ctx)
+{
+    (void)frame;
+    (void)ctx;
+    struct thread* thread = thread_current();
+    __asm__ volatile("clts");
+    stats.traps++;
+    if (thread == NULL || thread == owner) {
+        return;
+    }
+
+    if (owner != NULL && owner->fpu_state != NULL) {
+        save(owner->fpu_state);
+        stats.saves++;
+    }
+
+    restore(thread->fpu_state != NULL ? thread->fpu_state : initial_state);
+    stats.restores++;
+    owner = thread;
+}
+
+static void enable(void)
+{
+    write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+    if (features & FPU_HAS_SSE) {
+        write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    }
+}
+
+void fpu_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    features = FPU_HAS_FPU; // every CPU that runs this kernel (i686) has an x87
+    if (edx & CPUID_EDX_FXSR) {
+        features |= FPU_HAS_FXSR;
+        // SSE needs fxsave support from the OS, without OSFXSR every SSE instruction raises #UD
+        if (edx & CPUID_EDX_SSE) {
+            features |= FPU_HAS_SSE;
+        }
+        if (edx & CPUID_EDX_SSE2) {
+            features |= FPU_HAS_SSE2;
+        }
+    }
+
+    enable();
+
+    // Clean state for new threads, so nothing one thread left in the registers shows up in another
+    __asm__ volatile("fninit");
+    if (features & FPU_HAS_SSE) {
+        uint32_t mxcsr = MXCSR_DEFAULT;
+        __asm__ volatile("ldmxcsr %0\n\t"
+                         "xorps %%xmm0, %%xmm0\n\t"
+                         "xorps %%xmm1, %%xmm1\n\t"
+                         "xorps %%xmm2, %%xmm2\n\t"
+                         "xorps %%xmm3, %%xmm3\n\t"
+                         "xorps %%xmm4, %%xmm4\n\t"
+                         "xorps %%xmm5, %%xmm5\n\t"
+                         "xorps %%xmm6, %%xmm6\n\t"
+                         "xorps %%xmm7, %%xmm7"
+                         :
+                         : "m"(mxcsr));
+    }
+    save(initial_state);
+
+    irq_register(7, fpu_trap, NULL);
+}
+
+void fpu_init_cpu(void)
+{
+    enable();
+    restore(initial_state);
+}
+
+uint32_t fpu_features(void)
+{
+    return features;
+}
+
+void fpu_switch(struct thread* next)
+{
+    stats.switches++;
+    if (next == owner) {
+        __asm__ volatile("clts"); // its registers are still loaded
+        stats.owner_kept++;
+    } else {
+        write_cr0(read_cr0() | CR0_TS);
+    }
+}
+
+int fpu_thread_init(struct thread* thread)
+{
+    thread->fpu_alloc = kmalloc(FPU_STATE_SIZE + 15); // fxsave needs a 16 byte aligned area
+    if (thread->fpu_alloc == NULL) {
+        return -1;
+    }
+    thread->fpu_state = (uint8_t*)(((uint32_t)thread->fpu_alloc + 15) & ~15u);
+    memcpy(thread->fpu_state, initial_state, FPU_STATE_SIZE);
+    return 0;
+}
+
+void fpu_release(struct thread* thread)
+{
+    uint32_t flags = irq_save();
+    if (owner == thread) {
+        owner = NULL;
+    }
+    irq_restore(flags);
+    kfree(thread->fpu_alloc);
+    thread->fpu_alloc = NULL;
+    thread->fpu_state = NULL;
+}
+
+void fpu_get_stats(struct fpu_stats* out)
+{
+    uint32_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
@@ -1,24 +1,37 @@
 #include <kernel/gdt.h>
+#include <kernel/memops.h>
+#include <kernel/smp.h>
 
-struct gdt_entry gdt[5]; // Initialize the list of gdt entries
+struct gdt_entry gdt[GDT_ENTRIES]; // Initialize the list of gdt entries
 struct gdt_ptr gp; // Initialize the 'entry point' of the gdt
+struct tss_entry tss;
+struct tss_entry double_fault_tss;
 
 extern void gdt_init(uint32_t);
 
-void gdt_set_gate(int index, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
-    gdt[index].base_low    = (base & 0xFFFF);
-    gdt[index].base_middle = (base >> 16) & 0xFF;
-    gdt[index].base_high   = (base >> 24) & 0xFF;
+static void set_gate(struct gdt_entry* entry, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
+    entry->base_low    = (base & 0xFFFF);
+    entry->base_middle = (base >> 16) & 0xFF;
+    entry->base_high   = (base >> 24) & 0xFF;
+
+    entry->limit_low   = (limit & 0xFFFF);
+    entry->granularity = (limit >> 16) & 0x0F;
 
-    gdt[index].limit_low   = (limit & 0xFFFF);
-    gdt[index].granularity = (limit >> 16) & 0x0F;
+    entry->granularity |= gran & 0xF0;
+    entry->access      = access;
+}
+
+void gdt_set_gate(int index, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
+    set_gate(&gdt[index], base, limit, access, gran);
+}
 
-    gdt[index].granularity |= gran & 0xF0;
-    gdt[index].access      = access;
+static void load_percpu(void)
+{
+    __asm__ volatile("mov %w0, %%gs" : : "r"(PERCPU_SELECTOR) : "memory");
 }
 
 void gdt_install() { // sets up the gdt table and flushes it to the CPU
-    gp.limit = (sizeof(struct gdt_entry) * 5) - 1;
+    gp.limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
     gp.base  = (uint32_t)&gdt;
 
     // 0x00: Null descriptor
@@ -31,6 +44,35 @@ void gdt_install() { // sets up the gdt table and flushes it to the CPU
     gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xCF);
     // 0x20: User Data Segment (Access: 0xF2, Granularity: 0xCF)
     gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF);
+    // 0x28: TSS (Access: 0x89 = present, 32 bit available TSS, byte granularity)
+    tss.ss0 = KERNEL_DS;
+    tss.iomap_base = sizeof(struct tss_entry);
+    gdt_set_gate(5, (uint32_t)&tss, sizeof(struct tss_entry) - 1, 0x89, 0x00);
+    // 0x30: Per-CPU data (Access: 0x92, Granularity: 0x40 = 32 bit, byte granularity), covers just the struct cpu
+    gdt_set_gate(6, (uint32_t)smp_get_cpu(0), sizeof(struct cpu) - 1, 0x92, 0x40);
+    // 0x38: TSS of the double fault task (Access: 0x89), a fresh stack even when the kernel stack is gone
+    double_fault_tss.iomap_base = sizeof(struct tss_entry);
+    gdt_set_gate(7, (uint32_t)&double_fault_tss, sizeof(struct tss_entry) - 1, 0x89, 0x00);
 
     gdt_init((uint32_t)&gp); // pass the pointer to the gdt table so gdt_init can load it properly
-}
\ No newline at end of file
+    __asm__ volatile("ltr %w0" : : "r"(TSS_SELECTOR));
+    load_percpu(); // gdt_init set %gs to the flat data segment like the others
+}
+
+// Runs on an AP before its %gs and IDT are loaded: a memcpy here would read the per-CPU data through a flat %gs,
+// from page 0, and fault with no IDT to catch it. So the entries are copied by hand, and no string function is
+// called until load_percpu
+NO_LIBCALLS void gdt_install_cpu(struct gdt_entry* table, struct gdt_ptr* ptr, uint32_t percpu, uint32_t size)
+{
+    for (int i = 0; i < GDT_ENTRIES; i++) {
+        table[i] = gdt[i];
+    }
+    set_gate(&table[5], 0, 0, 0, 0);
+    set_gate(&table[7], 0, 0, 0, 0); // without a TSS of their own a double fault still resets the machine
+    set_gate(&table[6], percpu, size - 1, 0x92, 0x40);
+    ptr->limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
+    ptr->base = (uint32_t)table;
+
+    gdt_init((uint32_t)ptr);
+    load_percpu();
+}
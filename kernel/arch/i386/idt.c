@@ -1,16 +1,37 @@
+#include <kernel/apic.h>
+#include <kernel/cpu.h>
+#include <kernel/gdt.h>
 #include <kernel/idt.h>
-#include <kernel/tty.h>
+#include <kernel/klog.h>
+#include <kernel/ksyms.h>
+#include <kernel/smp.h>
+#include <kernel/syscall.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <kernel/user.h>
+#include <kernel/vmm.h>
 #include <stdint.h>
-#include <stdio.h>
-#include <string.h>
+
+#define DOUBLE_FAULT_STACK_SIZE 8192
 
 struct idt_entry idt[NO_IDT_ENTRIES]; // 256 descriptors to fulfill i386 arch.
 struct idt_ptr ip; // pointer to idt
 
 extern void idt_init(uint32_t);
 
-char cli_buffer[256]; // buffer for cli commands
-uint8_t cli_buffer_index = 0;
+static int apic_mode; // IRQs come through the IOAPIC, the PIC is masked
+
+// Dispatch table, one slot per vector so isr_handler is a single indexed call instead of an if-chain
+struct irq_slot {
+    irq_handler_t handler;
+    void* ctx;
+    uint64_t count; // times the vector fired
+    uint64_t cycles; // rdtsc cycles spent in isr_handler for it, dispatch and EOI included
+};
+
+static struct irq_slot irq_table[NO_IDT_ENTRIES];
+
+static uint8_t double_fault_stack[DOUBLE_FAULT_STACK_SIZE] __attribute__((aligned(16)));
 
 // Exception and interrupt handler stubs, based off i386 standards
 // Implemented in isr.s
@@ -23,7 +44,7 @@ extern void isr4(void); // Into Detected Overflow
 extern void isr5(void); // Bound Range Exceeded
 extern void isr6(void); // Invalid Opcode
 extern void isr7(void); // Coprocessor not available
-extern void isr8(void); // Double Fault
+extern void isr8(void); // Double Fault, unused: it gets a task gate
 extern void isr9(void); // Coprocessor Segment Overrun
 extern void isr10(void); // Invalid TSS
 extern void isr11(void); // Segment Not Present
@@ -66,6 +87,12 @@ extern void irq13(void); // IRQ13 - Coprocessor
 extern void irq14(void); // IRQ14 - ATA Primary
 extern void irq15(void); // IRQ15 - ATA Secondary
 
+extern void isr48(void); // TEST_VECTOR - software interrupt
+extern void isr128(void); // SYSCALL_VECTOR - int $0x80 from ring 3
+extern void isr224(void); // LAPIC_TIMER_VECTOR
+extern void isr225(void); // LAPIC_IPI_VECTOR
+extern void isr255(void); // LAPIC_SPURIOUS_VECTOR
+
 // Functions for direct hardware communication:
 
 // writes one byte of data to a specific hardware I/O port
@@ -82,6 +109,41 @@ uint8_t inb(uint16_t port)
     return value;
 }
 
+void outw(uint16_t port, uint16_t value)
+{
+    __asm__ volatile("outw %0, %1" : : "a"(value), "Nd"(port));
+}
+
+uint16_t inw(uint16_t port)
+{
+    uint16_t value;
+    __asm__ volatile("inw %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+void outl(uint16_t port, uint32_t value)
+{
+    __asm__ volatile("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+uint32_t inl(uint16_t port)
+{
+    uint32_t value;
+    __asm__ volatile("inl %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+// Moves 'count' 16 bit words between a port and memory with rep ins/outs (PIO data transfers)
+void insw(uint16_t port, void* buf, uint32_t count)
+{
+    __asm__ volatile("rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+void outsw(uint16_t port, const void* buf, uint32_t count)
+{
+    __asm__ volatile("rep outsw" : "+S"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
 // Creates a tiny delay to allow hardware to react to a previous I/O command
 static inline void io_wait(void)
 {
@@ -130,98 +192,264 @@ static void pic_send_eoi(uint8_t irq)
     outb(0x20, 0x20);
 }
 
-void isr_handler(struct interrupt_frame* frame) // handles the interrupt service routines passed back from the stubs
+// IRQ7 and IRQ15 can be spurious: the line dropped again before the PIC could say which IRQ it was. The in-service
+// bit isn't set then and no EOI may be sent for it (a spurious IRQ15 still needs one on the master for the cascade)
+static int pic_spurious(uint8_t irq)
+{
+    if (irq != 7 && irq != 15) {
+        return 0;
+    }
+    uint16_t port = irq == 7 ? 0x20 : 0xA0;
+    outb(port, 0x0B); // OCW3: next read returns the in-service register
+    if (inb(port) & 0x80) {
+        return 0;
+    }
+    if (irq == 15) {
+        outb(0x20, 0x20);
+    }
+    return 1;
+}
+
+void irq_mask(uint8_t irq)
+{
+    if (apic_mode) {
+        ioapic_mask(irq);
+        return;
+    }
+    uint16_t port = irq < 8 ? 0x21 : 0xA1;
+    uint32_t flags = irq_save();
+    outb(port, inb(port) | (1 << (irq & 7)));
+    irq_restore(flags);
+}
+
+void irq_unmask(uint8_t irq)
+{
+    if (apic_mode) {
+        ioapic_unmask(irq);
+        return;
+    }
+    uint16_t port = irq < 8 ? 0x21 : 0xA1;
+    uint32_t flags = irq_save();
+    outb(port, inb(port) & ~(1 << (irq & 7)));
+    if (irq >= 8) { // slave interrupts only get through if the cascade line on the master is open
+        outb(0x21, inb(0x21) & ~(1 << 2));
+    }
+    irq_restore(flags);
+}
+
+void irq_use_apic(void)
+{
+    uint32_t flags = irq_save();
+    outb(0x21, 0xFF); // the PIC stays remapped but never raises anything again
+    outb(0xA1, 0xFF);
+    apic_mode = 1;
+    for (uint8_t irq = 0; irq < IRQ_COUNT; irq++) {
+        if (irq_table[IRQ_VECTOR(irq)].handler != NULL) {
+            ioapic_unmask(irq);
+        }
+    }
+    irq_restore(flags);
+}
+
+int in_interrupt(void)
+{
+    return this_cpu()->irq_depth != 0;
+}
+
+int irq_register(uint8_t vector, irq_handler_t handler, void* ctx)
+{
+    uint32_t flags = irq_save();
+    if (irq_table[vector].handler != NULL) {
+        irq_restore(flags);
+        klog(KLOG_WARN, "[IDT] vector %u already has a handler\n", vector);
+        return -1;
+    }
+    irq_table[vector].ctx = ctx;
+    irq_table[vector].handler = handler;
+    irq_restore(flags);
+
+    if (vector >= IRQ_BASE && vector < IRQ_BASE + IRQ_COUNT) {
+        irq_unmask(vector - IRQ_BASE);
+    }
+    return 0;
+}
+
+void irq_unregister(uint8_t vector)
+{
+    if (vector >= IRQ_BASE && vector < IRQ_BASE + IRQ_COUNT) {
+        irq_mask(vector - IRQ_BASE);
+    }
+    uint32_t flags = irq_save();
+    irq_table[vector].handler = NULL;
+    irq_table[vector].ctx = NULL;
+    irq_restore(flags);
+}
+
+void irq_get_stats(uint8_t vector, struct irq_stats* stats)
+{
+    uint32_t flags = irq_save();
+    stats->count = irq_table[vector].count;
+    stats->cycles = irq_table[vector].cycles;
+    irq_restore(flags);
+}
+
+// maps each isr to a exception message, matches idt defined below
+static const char* exception_messages[32] = {
+    "Division By Zero",
+    "Debug",
+    "Non-Maskable Interrupt",
+    "Breakpoint",
+    "Overflow",
+    "Bound Range Exceeded",
+    "Invalid Opcode",
+    "Device Not Available",
+    "Double Fault",
+    "Coprocessor Segment Overrun",
+    "Invalid TSS",
+    "Segment Not Present",
+    "Stack-Segment Fault",
+    "General Protection Fault",
+    "Page Fault",
+    "Reserved",
+    "x87 Floating-Point Exception",
+    "Alignment Check",
+    "Machine Check",
+    "SIMD Floating-Point Exception",
+    "Virtualization Exception",
+    "Control Protection Exception",
+    "Reserved",
+    "Reserved",
+    "Reserved",
+    "Reserved",
+    "Reserved",
+    "Reserved",
+    "Reserved",
+    "Reserved",
+    "Security Exception",
+    "Reserved"
+};
+
+const char* irq_vector_name(uint8_t vector)
+{
+    static const char* irq_names[IRQ_COUNT] = {
+        "Timer", "Keyboard", "Cascade", "COM2", "COM1", "LPT2", "Floppy", "LPT1",
+        "RTC", "Peripheral", "Peripheral", "Peripheral", "Mouse", "Coprocessor", "ATA Primary", "ATA Secondary"
+    };
+    if (vector < 32) {
+        return exception_messages[vector];
+    }
+    if (vector < IRQ_BASE + IRQ_COUNT) {
+        return irq_names[vector - IRQ_BASE];
+    }
+    if (vector == LAPIC_TIMER_VECTOR) {
+        return "LAPIC Timer";
+    }
+    if (vector == LAPIC_IPI_VECTOR) {
+        return "IPI";
+    }
+    if (vector == LAPIC_SPURIOUS_VECTOR) {
+        return "LAPIC Spurious";
+    }
+    return "Software";
+}
+
+// An exception nobody registered for (or whose handler gave up): kills a user program, is unrecoverable in the kernel
+void exception_fatal(struct interrupt_frame* frame)
+{
+    if ((frame->cs & 3) == 3) {
+        user_fault(frame); // only the user program dies
+    }
+
+    uint32_t offset = 0;
+    const char* function = ksym_lookup(frame->eip, &offset);
+    klog(KLOG_ERR, "[EXCEPTION] #%lu: %s (err=0x%lx, eip=0x%lx %s+0x%lx)\n",
+        frame->int_no,
+        exception_messages[frame->int_no],
+        frame->err_code,
+        frame->eip,
+        function ? function : "?",
+        offset);
+    klog_panic(); // the kworker won't run again, print whatever is still queued
+
+    for (;;) {
+        __asm__ volatile("cli; hlt"); // halts everything since exceptions are unrecoverable at this stage
+    }
+}
+
+// Entered through the task gate on its own stack. Mostly a #PF that couldn't be delivered because the stack ran
+// into its guard page: the CPU had nowhere to push the frame. The state of the code that faulted is in 'tss'
+static __attribute__((noreturn)) void double_fault(void)
+{
+    this_cpu()->irq_depth++; // no SSE2 copies in the console code from here on, the task switch set CR0.TS
+    uint32_t addr = read_cr2();
+    const char* guard = vmm_guard_owner(addr);
+    uint32_t offset = 0;
+    const char* function = ksym_lookup(tss.eip, &offset);
+    klog(KLOG_ERR, "[EXCEPTION] #8: Double Fault (eip=0x%lx %s+0x%lx, esp=0x%lx, cr2=0x%lx)\n", tss.eip,
+        function ? function : "?", offset, tss.esp, addr);
+    if (guard != NULL) {
+        klog(KLOG_ERR, "[EXCEPTION] 0x%lx is the guard page below '%s', stack overflow\n", addr, guard);
+    }
+    klog_panic();
+
+    for (;;) {
+        __asm__ volatile("cli; hlt");
+    }
+}
+
+struct interrupt_frame* isr_handler(struct interrupt_frame* frame) // handles the interrupt service routines passed back from the stubs
 // Uses two-stage assembly wrapping method (stubs defined in assembly file and handler function in C)
 {
-    if (frame->int_no < 32) { // the interrupt is for a execption
-        // maps each isr to a exception message, matches idt defined below
-        static const char* exception_messages[32] = {
-            "Division By Zero",
-            "Debug",
-            "Non-Maskable Interrupt",
-            "Breakpoint",
-            "Overflow",
-            "Bound Range Exceeded",
-            "Invalid Opcode",
-            "Device Not Available",
-            "Double Fault",
-            "Coprocessor Segment Overrun",
-            "Invalid TSS",
-            "Segment Not Present",
-            "Stack-Segment Fault",
-            "General Protection Fault",
-            "Page Fault",
-            "Reserved",
-            "x87 Floating-Point Exception",
-            "Alignment Check",
-            "Machine Check",
-            "SIMD Floating-Point Exception",
-            "Virtualization Exception",
-            "Control Protection Exception",
-            "Reserved",
-            "Reserved",
-            "Reserved",
-            "Reserved",
-            "Reserved",
-            "Reserved",
-            "Reserved",
-            "Reserved",
-            "Security Exception",
-            "Reserved"
-        };
-
-        printf("[EXCEPTION] #%lu: %s (err=0x%lx)\n",
-            frame->int_no,
-            exception_messages[frame->int_no],
-            frame->err_code);
-
-        for (;;) {
-            __asm__ volatile("cli; hlt"); // halts everything since exceptions are unrecoverable at this stage
+    uint64_t start = rdtsc();
+    struct cpu* cpu = this_cpu();
+    uint32_t vector = frame->int_no;
+    struct irq_slot* slot = &irq_table[vector];
+    // the interrupt is from hardware (interrupt request (IRQ)), through the PIC / IOAPIC or from the local APIC
+    int is_irq = (vector >= IRQ_BASE && vector < IRQ_BASE + IRQ_COUNT) || vector >= LAPIC_VECTOR_BASE;
+
+    if (vector == LAPIC_SPURIOUS_VECTOR) {
+        slot->count++; // no EOI for these
+        return frame;
+    }
+    if (is_irq && !apic_mode && pic_spurious((uint8_t)(vector - IRQ_BASE))) {
+        return frame;
+    }
+
+    cpu->interrupts++;
+    // The timer and the scheduler belong to the boot CPU, the others only ever see IPIs and their own exceptions
+    int boot_cpu = cpu->id == 0;
+
+    if (is_irq) {
+        cpu->irq_depth++;
+        if (boot_cpu && vector != IRQ_VECTOR(0) && vector != LAPIC_TIMER_VECTOR) { // anything but the timer may have woken the CPU out of a long one-shot idle
+            timer_wake();
         }
     }
 
-    if (frame->int_no >= 32 && frame->int_no <= 47) { // the interrupt is from hardware (interrupt request (IRQ))
-        uint8_t irq = (uint8_t)(frame->int_no - 32);
-
-        if (irq == 1) { // if it is keyboard input
-            uint8_t scancode = inb(0x60);
-
-            char c = ps2_to_ascii(scancode); // convert the ps2 scancode to ascii character
-            if (c != 0) {
-                if (c == '\n') { // when the user presses enter key
-                    putchar(c); // write the newline to the screen
-                    cli_buffer[cli_buffer_index] = '\0'; // terminate cli command buffer
-
-                    // Refactor this into seperate command router
-                    if (cli_buffer_index == 4 && memcmp(cli_buffer, "info", 4) == 0) {
-                        printf("Nue Kernel v0.1\n");
-                    } else if (cli_buffer[0] != '\0') { // if the command buffer is not empty, then throw an error
-                        printf("command '%s' not recognized\n", cli_buffer);
-                    }
-
-                    cli_buffer_index = 0; // reset after enter pressed
-                    cli_buffer[0] = '\0';
-                    printf(">"); // new prompt
-                } else if (c == '\b') {
-                    if (cli_buffer_index > 0) {
-                        cli_buffer_index--;
-                        cli_buffer[cli_buffer_index] = '\0';
-                        putchar(c); // update the screen to erase the last character
-                    }
-                } else if (cli_buffer_index < sizeof(cli_buffer) - 1) {
-                    cli_buffer[cli_buffer_index++] = c;
-                    cli_buffer[cli_buffer_index] = '\0';
-                    putchar(c); // write the ascii character to the screen
-                }
-            }
+    if (slot->handler != NULL) {
+        slot->handler(frame, slot->ctx);
+    } else if (vector < 32) {
+        exception_fatal(frame);
+    }
+
+    if (is_irq) {
+        if (apic_mode) {
+            lapic_eoi(); // one MMIO write, no port I/O
+        } else {
+            pic_send_eoi((uint8_t)(vector - IRQ_BASE)); // tells the pic 'end of interrupt', that the interrupt has completed and that it can accept more interrupts from the same hardware
         }
+        cpu->irq_depth--;
+    }
 
-        // if (irq == 0) { // Makes sure the timer (IRQ0) is running, also confirms EOI is being sent so ticks are registered continously
-        //     printf("[IRQ] Timer tick\n");
-        // }
+    slot->count++; // not atomic, an IPI handled by several CPUs at once may be counted short
+    slot->cycles += rdtsc() - start;
 
-        pic_send_eoi(irq); // tells the pic 'end of interrupt', that the interrupt has completed and that it can accept more interrupts from the same hardware
+    // Preemption point: the EOI is already sent, so switching here doesn't hold up the next interrupt while
+    // another thread runs
+    if (is_irq && boot_cpu && sched_need_resched()) {
+        return sched_switch(frame);
     }
+    return frame;
 }
 
 void idt_set_entry(int index, uint32_t base, uint16_t seg_sel, uint8_t attributes)
@@ -238,6 +466,15 @@ void idt_install()
     ip.limit = (sizeof(struct idt_entry) * NO_IDT_ENTRIES) - 1;
     ip.base = (uint32_t)&idt;
 
+    // The double fault task starts at double_fault with interrupts off, on the boot CPU's per-CPU segment
+    double_fault_tss.eip = (uint32_t)double_fault;
+    double_fault_tss.esp = (uint32_t)double_fault_stack + DOUBLE_FAULT_STACK_SIZE;
+    double_fault_tss.eflags = 0x2; // bit 1 is always 1
+    double_fault_tss.cs = KERNEL_CS;
+    double_fault_tss.ds = double_fault_tss.es = double_fault_tss.fs = double_fault_tss.ss = KERNEL_DS;
+    double_fault_tss.gs = PERCPU_SELECTOR;
+    double_fault_tss.cr3 = read_cr3();
+
     // Set up CPU exceptions (0-31)
     // Includes index of IDT entry, address of interrupt handler code, the segment selector, and attributes
     // Reference 0x08 kernel code segment that was defined in the GDT -> knows what code segment to run the handler in
@@ -249,7 +486,7 @@ void idt_install()
     idt_set_entry(5, (uint32_t)isr5, 0x08, 0x8E); // Bound Range Exceeded Exception
     idt_set_entry(6, (uint32_t)isr6, 0x08, 0x8E); // Invalid Opcode Exception
     idt_set_entry(7, (uint32_t)isr7, 0x08, 0x8E); // Coprocessor Not Available Exception
-    idt_set_entry(8, (uint32_t)isr8, 0x08, 0x8E); // Double Fault Exception
+    idt_set_entry(8, 0, DOUBLE_FAULT_TSS_SELECTOR, 0x85); // Double Fault Exception, task gate: a stack that works
     idt_set_entry(9, (uint32_t)isr9, 0x08, 0x8E); // Coprocessor Segment Overrun Exception
     idt_set_entry(10, (uint32_t)isr10, 0x08, 0x8E); // Invalid TSS Exception
     idt_set_entry(11, (uint32_t)isr11, 0x08, 0x8E); // Segment Not Present Exception
@@ -292,13 +529,23 @@ void idt_install()
     idt_set_entry(46, (uint32_t)irq14, 0x08, 0x8E); // IRQ14 - ATA Primary
     idt_set_entry(47, (uint32_t)irq15, 0x08, 0x8E); // IRQ15 - ATA Secondary
 
+    idt_set_entry(TEST_VECTOR, (uint32_t)isr48, 0x08, 0x8E); // software interrupt, nothing else shares it
+    idt_set_entry(SYSCALL_VECTOR, (uint32_t)isr128, 0x08, 0xEE); // DPL 3, so user code may raise it with int
+    idt_set_entry(LAPIC_TIMER_VECTOR, (uint32_t)isr224, 0x08, 0x8E); // only used once apic_init switched over
+    idt_set_entry(LAPIC_IPI_VECTOR, (uint32_t)isr225, 0x08, 0x8E);
+    idt_set_entry(LAPIC_SPURIOUS_VECTOR, (uint32_t)isr255, 0x08, 0x8E);
+
     // 8259 PIC is the chip between hardware and the CPU, (signal from hardare -> pic -> interrupt index -> cpu)
     pic_remap(0x20, 0x28); // remaps IRQ to correct IRQ handler within the idt
-    outb(0x21, 0xFC); // masks everything on master except the timer and the keyboard
-    outb(0xA1, 0xFF); // masks everything on slave
+    outb(0x21, 0xFF); // masks every line, irq_register unmasks the ones that get a handler
+    outb(0xA1, 0xFF);
 
     idt_init((uint32_t)&ip);
 
     // Enable hardware interrupts after IDT + PIC are initialized.
     __asm__ volatile("sti"); // CPU will now respond to interrupts, previously they were ignored before setup was complete
-}
\ No newline at end of file
+}
+void idt_load(void)
+{
+    idt_init((uint32_t)&ip); // one IDT for every CPU, the handlers find their CPU through %gs
+}
@@ -3,11 +3,12 @@
 # Define ISR (Interrupt service routine) handler stubs for CPU exceptions (0-31)
 # These stubs are called by the IDT when an exception occurs
 
+# All IDT entries are interrupt gates, the CPU has already cleared IF when a stub runs, no cli needed
+
 # Exception handlers (no error code)
 .macro ISR_NOERRCODE num
 .global isr\num
 isr\num:
-    cli              # Clear interrupt flag to prevent nested interrupts
     push $0          # Push a dummy error code
     push $\num       # Push the interrupt number
     jmp isr_common_handler
@@ -17,7 +18,6 @@ isr\num:
 .macro ISR_ERRCODE num
 .global isr\num
 isr\num:
-    cli
     push $\num       # Push the interrupt number (error code already on stack)
     jmp isr_common_handler
 .endm
@@ -26,7 +26,6 @@ isr\num:
 .macro IRQ_HANDLER num offset
 .global irq\num
 irq\num:
-    cli
     push $0          # Push a dummy error code
     push $(\offset)  # Push the interrupt number
     jmp isr_common_handler
@@ -34,7 +33,7 @@ irq\num:
 
 # CPU Exceptions
 ISR_NOERRCODE 0    # Division by Zero
-ISR_NOERRCODE 1    # Debug
+# ISR 1 (Debug) is below, next to sysenter_entry
 ISR_NOERRCODE 2    # Non-Maskable Interrupt
 ISR_NOERRCODE 3    # Breakpoint
 ISR_NOERRCODE 4    # Into Detected Overflow
@@ -84,22 +83,26 @@ IRQ_HANDLER 13  45  # Coprocessor (IRQ13)
 IRQ_HANDLER 14  46  # ATA Primary (IRQ14)
 IRQ_HANDLER 15  47  # ATA Secondary (IRQ15)
 
+# Software interrupt vector, used by the interrupt round trip benchmark
+ISR_NOERRCODE 48
+
+# System calls from ring 3 (DPL 3 gate)
+ISR_NOERRCODE 128
+
+# Local APIC vectors: its timer, IPIs and the spurious interrupt
+ISR_NOERRCODE 224
+ISR_NOERRCODE 225
+ISR_NOERRCODE 255
+
 # Common handler called by all ISR/IRQ stubs
 .global isr_common_handler
 isr_common_handler: # Pushes additional data to stack so that it is consistent with the interrupt_frame structure expected by isr_handler in C
-    # Save all general-purpose registers
+    # Save all general-purpose registers. All of them, not just the ones C clobbers: the frame doubles as the
+    # saved context of a thread that gets switched out
     pusha                    # Push EAX, ECX, EDX, EBX, original ESP, EBP, ESI, EDI
     mov %ds, %ax
     push %eax                # Save data segment selector
 
-    # Load kernel data segment
-    mov $0x10, %ax          # Kernel data segment selector (from GDT)
-    mov %ax, %ds
-    mov %ax, %es
-    mov %ax, %fs
-    mov %ax, %gs
-
-    # Call the high-level interrupt handler
     # Stack layout at this point:
     # [ESP + 0] = DS
     # [ESP + 4] = EDI
@@ -116,21 +119,152 @@ isr_common_handler: # Pushes additional data to stack so that it is consistent w
     # [ESP + 48] = Code segment (CS)
     # [ESP + 52] = EFLAGS
 
+    # Coming from ring 0 the data segments already are the kernel's, only reload them when user code was interrupted
+    testl $3, 48(%esp)
+    jz 1f
+    mov $0x10, %ax          # Kernel data segment selector (from GDT)
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov $0x30, %ax          # PERCPU_SELECTOR, %gs:0 is this CPU's struct cpu
+    mov %ax, %gs
+1:
+    cld                      # C code expects DF clear, the interrupted code may be in the middle of a backward rep movs
     push %esp                # Push pointer to registers struct
     call isr_handler         # Call high-level handler, the stack is not set up correctly for the function to interpret the data
-    add $4, %esp             # Clean up
+    mov %eax, %esp           # isr_handler returns the frame to resume: ours, or another thread's after a context switch
 
-    # Restore all registers
-    pop %eax                 # Restore data segment selector
+.global isr_common_return
+isr_common_return:
+    # Restore the data segments only when returning to user code, same offsets as above
+    testl $3, 48(%esp)
+    jz 2f
+    mov (%esp), %eax
     mov %ax, %ds
     mov %ax, %es
     mov %ax, %fs
     mov %ax, %gs
+2:
+    add $4, %esp             # Skip the saved data segment selector
     popa                     # Pop all general-purpose registers
 
     # Remove error code and interrupt number from stack
     add $8, %esp
 
-    # Return from interrupt
-    sti
-    iret                     # Return from interrupt
+    # Return from interrupt. No sti: iret restores EFLAGS, IF included, atomically with the return, so there is no
+    # window for a nested interrupt on this (possibly almost full) stack
+    iret
+
+# Voluntary context switch, called from C as sched_yield_switch()
+# Builds the same frame an interrupt would (flags, cs, return eip, dummy error code and vector, registers, ds), so a
+# thread that gave up the CPU here is resumed by the same iret as one that was preempted, no separate switch path
+.global sched_yield_switch
+sched_yield_switch:
+    pushf
+    cli                      # interrupts stay off until the iret restores the saved flags
+    push $0x08               # kernel code segment
+    push $1f                 # resume at the ret below
+    push $0                  # dummy error code
+    push $0xFF               # not a real vector, isr_handler never sees this frame
+    pusha
+    mov %ds, %ax
+    push %eax
+
+    push %esp
+    call sched_switch        # saves this frame as the current thread's and returns the next thread's
+    mov %eax, %esp
+    jmp isr_common_return
+1:
+    ret
+
+# Fast system call entry. SYSENTER loads CS/SS from the MSRs and ESP from IA32_SYSENTER_ESP, which points at a
+# small entry stack (syscall.c) that only a debug trap ever uses, so the first instruction switches to the running
+# thread's kernel stack. Interrupts are off, the user's return address is in EDX and its stack pointer in ECX.
+# The frame built here matches one from int $0x80
+.global sysenter_entry
+sysenter_entry:
+    mov tss+4, %esp          # tss.esp0
+    push $0x23               # user SS
+    push %ecx                # user ESP
+    pushf
+    orl $0x200, (%esp)       # user code always runs with IF set, SYSENTER cleared it
+    push $2                  # SYSENTER leaves TF, NT and AC as the user had them, the kernel runs without
+    popf
+sysenter_flags_clean:
+    push $0x1B               # user CS
+    push %edx                # user EIP
+    push $0                  # dummy error code
+    push $0x80               # same vector as the int $0x80 path
+    pusha
+    mov %ds, %ax
+    push %eax
+    mov $0x10, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov $0x30, %ax           # PERCPU_SELECTOR
+    mov %ax, %gs
+    cld
+
+    push %esp
+    call syscall_sysenter    # result goes into the frame's EAX, interrupts are off again when it returns
+    add $4, %esp
+
+    testl $0x4100, 52(%esp)  # TF or NT in the user's flags: popf would load them in ring 0, leave through iret
+    jnz isr_common_return
+    pop %eax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov %ax, %gs
+    popa
+    add $8, %esp             # vector and error code
+    pop %edx                 # SYSEXIT returns to EDX with the stack in ECX
+    add $4, %esp             # CS
+    andl $~0x200, (%esp)
+    popf                     # the user's flags, IF stays off until the sti
+    pop %ecx
+    add $4, %esp             # SS
+    sti                      # takes effect after the next instruction, no interrupt can hit between the two
+    sysexit
+
+# Debug exception. SYSENTER doesn't clear TF, so a ring 3 program that sets it single steps into sysenter_entry,
+# possibly before the stack switch, with the trap frame on the entry stack. Those traps are dropped right here,
+# without touching the stack any further: TF is cleared in the frame and the entry goes on as if it wasn't set
+.global isr1
+isr1:
+    cmpl $sysenter_entry, (%esp)
+    jb 1f
+    cmpl $sysenter_flags_clean, (%esp)
+    ja 1f
+    andl $~0x100, 8(%esp)    # TF in the saved EFLAGS
+    iret
+1:
+    push $0                  # a real debug exception, same as ISR_NOERRCODE
+    push $1
+    jmp isr_common_handler
+
+# Drops to ring 3: user_enter(eip, esp, arg). iret with a user CS pops the user SS:ESP as well
+.global user_enter
+user_enter:
+    cli
+    mov 4(%esp), %ecx        # eip
+    mov 8(%esp), %edx        # esp
+    mov 12(%esp), %eax       # argument for the program
+    mov $0x23, %bx
+    mov %bx, %ds
+    mov %bx, %es
+    mov %bx, %fs
+    mov %bx, %gs
+    push $0x23               # SS
+    push %edx                # ESP
+    push $0x202              # EFLAGS, IF set
+    push $0x1B               # CS
+    push %ecx                # EIP
+    xor %ebx, %ebx           # nothing of the kernel's leaks into user registers
+    xor %ecx, %ecx
+    xor %edx, %edx
+    xor %esi, %esi
+    xor %edi, %edi
+    xor %ebp, %ebp
+    iret
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <kernel/console.h>
+#include <kernel/idt.h>
+#include <kernel/keyboard.h>
+#include <kernel/thread.h>
+#include <kernel/tty.h>
+#include <kernel/workqueue.h>
+
+#define KBD_DATA_PORT 0x60
+#define SCANCODE_RING_SIZE 128 // power of two, a couple of seconds of fast typing
+#define SCANCODE_RING_MASK (SCANCODE_RING_SIZE - 1)
+#define KBD_LINE_MAX 256
+#define COOKED_SIZE 1024 // finished lines waiting for read()
+
+// Scancode ring: only the IRQ handler writes ring_head and only the bottom half writes ring_tail, so neither side
+// needs a lock. The indices run freely and are masked on access, head - tail is the fill level
+static uint8_t scancode_ring[SCANCODE_RING_SIZE];
+static volatile uint32_t ring_head;
+static volatile uint32_t ring_tail;
+
+static struct keyboard_stats stats;
+static uint32_t dropped_reported;
+
+static struct work keyboard_work;
+
+// Line discipline state, only touched by the bottom half
+static char line[KBD_LINE_MAX];
+static size_t line_len;
+
+// Finished lines, filled by the bottom half and drained by read(), both under irq_save
+static char cooked[COOKED_SIZE];
+static uint32_t cooked_head;
+static uint32_t cooked_tail;
+static uint32_t cooked_lines; // number of '\n' in the cooked buffer
+static struct wait_queue read_wait;
+
+static void keyboard_interrupt(struct interrupt_frame* frame, void* ctx)
+{
+    (void)frame;
+    (void)ctx;
+    uint8_t scancode = inb(KBD_DATA_PORT); // has to be read even if it gets dropped, or the controller stalls
+    uint32_t head = ring_head;
+
+    stats.scancodes++;
+    if (head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) == SCANCODE_RING_SIZE) {
+        stats.dropped++;
+    } else {
+        scancode_ring[head & SCANCODE_RING_MASK] = scancode;
+        __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE); // publish the slot after it is written
+    }
+
+    schedule_work(&keyboard_work);
+}
+
+static void echo(const char* data, size_t size)
+{
+    console_write(1, data, size); // wherever stdout goes, so a serial console sees what is typed too
+}
+
+// Moves the finished line into the cooked buffer and wakes a reader
+static void commit_line(void)
+{
+    uint32_t flags = irq_save();
+    if (COOKED_SIZE - (cooked_head - cooked_tail) < line_len) {
+        stats.lines_dropped++;
+    } else {
+        for (size_t i = 0; i < line_len; i++) {
+            cooked[(cooked_head + i) % COOKED_SIZE] = line[i];
+        }
+        cooked_head += line_len;
+        cooked_lines++;
+    }
+    irq_restore(flags);
+    line_len = 0;
+    wake_up(&read_wait);
+}
+
+// Canonical mode line editing: characters are echoed as they are typed, backspace edits the pending line and
+// nothing is visible to read() until enter is pressed
+static void line_input(char c)
+{
+    if (c == '\n') {
+        line[line_len++] = '\n'; // there is always room, printable input stops one short of KBD_LINE_MAX
+        echo("\n", 1);
+        commit_line();
+    } else if (c == '\b') {
+        if (line_len > 0) {
+            line_len--;
+            echo("\b", 1);
+        }
+    } else if (line_len < KBD_LINE_MAX - 1) {
+        line[line_len++] = c;
+        echo(&c, 1);
+    }
+}
+
+// Bottom half: drains the scancode ring with interrupts enabled
+static void keyboard_bottom_half(struct work* work)
+{
+    (void)work;
+    uint32_t tail = ring_tail;
+
+    while (tail != __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE)) {
+        uint8_t scancode = scancode_ring[tail & SCANCODE_RING_MASK];
+        __atomic_store_n(&ring_tail, ++tail, __ATOMIC_RELEASE); // hand the slot back to the IRQ
+        char c = ps2_to_ascii(scancode);
+        if (c != 0) {
+            line_input(c);
+        }
+    }
+
+    uint32_t dropped = stats.dropped;
+    if (dropped != dropped_reported) {
+        char msg[64];
+        int len = snprintf(msg, sizeof(msg), "\n[KBD] scancode ring full, %lu keys dropped\n",
+            (unsigned long)(dropped - dropped_reported));
+        dropped_reported = dropped;
+        echo(msg, (size_t)len);
+    }
+}
+
+void keyboard_init(void)
+{
+    wait_queue_init(&read_wait);
+    work_init(&keyboard_work, keyboard_bottom_half);
+    while (inb(0x64) & 1) { // throw away whatever was typed during boot, IRQ1 was masked until now
+        inb(KBD_DATA_PORT);
+    }
+    irq_register(IRQ_VECTOR(1), keyboard_interrupt, NULL);
+}
+
+int keyboard_read(char* buf, size_t len)
+{
+    if (!sched_can_block() || len == 0) {
+        return 0;
+    }
+
+    uint32_t flags = irq_save(); // checking and taking the line in one go, another reader can't steal it in between
+    while (cooked_lines == 0) {
+        wait_queue_sleep(&read_wait);
+    }
+
+    size_t n = 0;
+    while (n < len && cooked_tail != cooked_head) {
+        char c = cooked[cooked_tail++ % COOKED_SIZE];
+        buf[n++] = c;
+        if (c == '\n') {
+            cooked_lines--;
+            break; // like a tty, one read never returns more than one line
+        }
+    }
+    irq_restore(flags);
+    return (int)n;
+}
+
+void keyboard_get_stats(struct keyboard_stats* out)
+{
+    uint32_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
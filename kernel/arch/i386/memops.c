@@ -0,0 +1,407 @@
+#include <string.h>
+
+#include <kernel/fpu.h>
+#include <kernel/idt.h>
+#include <kernel/klog.h>
+#include <kernel/memops.h>
+
+typedef uint32_t __attribute__((may_alias)) word_t;
+
+// Scalar: a word at a time when both pointers are aligned, bytes otherwise
+
+static NO_LIBCALLS void* memcpy_scalar(void* dst, const void* src, size_t size)
+{
+    unsigned char* d = dst;
+    const unsigned char* s = src;
+    if ((((uintptr_t)d | (uintptr_t)s) & 3) == 0) {
+        for (; size >= 4; size -= 4, d += 4, s += 4) {
+            *(word_t*)d = *(const word_t*)s;
+        }
+    }
+    while (size--) {
+        *d++ = *s++;
+    }
+    return dst;
+}
+
+static NO_LIBCALLS void* memset_scalar(void* dst, int value, size_t size)
+{
+    unsigned char* d = dst;
+    uint32_t pattern = (uint8_t)value * 0x01010101u;
+    for (; size > 0 && ((uintptr_t)d & 3); size--) {
+        *d++ = (unsigned char)value;
+    }
+    for (; size >= 4; size -= 4, d += 4) {
+        *(word_t*)d = pattern;
+    }
+    while (size--) {
+        *d++ = (unsigned char)value;
+    }
+    return dst;
+}
+
+static NO_LIBCALLS void* memmove_scalar(void* dst, const void* src, size_t size)
+{
+    unsigned char* d = dst;
+    const unsigned char* s = src;
+    if (d <= s || d >= s + size) {
+        return memcpy_scalar(dst, src, size);
+    }
+    while (size--) { // destination above an overlapping source: back to front
+        d[size] = s[size];
+    }
+    return dst;
+}
+
+// rep movs/stos: a dword at a time, then the 0-3 leftover bytes
+
+static void* memcpy_rep(void* dst, const void* src, size_t size)
+{
+    uint32_t ecx, edi, esi;
+    __asm__ volatile("rep movsl\n\t"
+                     "mov %6, %%ecx\n\t"
+                     "rep movsb"
+                     : "=&c"(ecx), "=&D"(edi), "=&S"(esi)
+                     : "0"(size >> 2), "1"(dst), "2"(src), "r"(size & 3)
+                     : "memory");
+    return dst;
+}
+
+static void* memset_rep(void* dst, int value, size_t size)
+{
+    uint32_t ecx, edi;
+    __asm__ volatile("rep stosl\n\t"
+                     "mov %5, %%ecx\n\t"
+                     "rep stosb"
+                     : "=&c"(ecx), "=&D"(edi)
+                     : "0"(size >> 2), "1"(dst), "a"((uint8_t)value * 0x01010101u), "r"(size & 3)
+                     : "memory");
+    return dst;
+}
+
+static void* memmove_rep(void* dst, const void* src, size_t size)
+{
+    if ((unsigned char*)dst <= (const unsigned char*)src || (unsigned char*)dst >= (const unsigned char*)src + size) {
+        return memcpy_rep(dst, src, size);
+    }
+    uint32_t ecx, edi, esi;
+    __asm__ volatile("std\n\t" // interrupts taken meanwhile are fine, isr_common_handler clears DF for the C code
+                     "rep movsb\n\t"
+                     "cld"
+                     : "=&c"(ecx), "=&D"(edi), "=&S"(esi)
+                     : "0"(size), "1"((unsigned char*)dst + size - 1), "2"((const unsigned char*)src + size - 1)
+                     : "memory");
+    return dst;
+}
+
+// SSE2: 64 bytes per iteration, aligned stores, unaligned loads. The unaligned head and tail go through the rep
+// variants. XMM0-3 are part of the current thread's FPU state (fpu.c switches it lazily), and for a thread in a
+// system call that is the user program's live state. So each loop saves the registers it uses on the stack and
+// puts them back afterwards, 64 bytes each way against a copy of 256 or more
+
+#define XMM_SAVE_0_3 \
+    "movdqu %%xmm0, (%[save])\n\t" \
+    "movdqu %%xmm1, 16(%[save])\n\t" \
+    "movdqu %%xmm2, 32(%[save])\n\t" \
+    "movdqu %%xmm3, 48(%[save])\n\t"
+#define XMM_RESTORE_0_3 \
+    "movdqu (%[save]), %%xmm0\n\t" \
+    "movdqu 16(%[save]), %%xmm1\n\t" \
+    "movdqu 32(%[save]), %%xmm2\n\t" \
+    "movdqu 48(%[save]), %%xmm3"
+
+static void* memcpy_sse2(void* dst, const void* src, size_t size)
+{
+    unsigned char* d = dst;
+    const unsigned char* s = src;
+    size_t head = (0u - (uintptr_t)d) & 15;
+    if (head > size) {
+        head = size;
+    }
+    memcpy_rep(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+
+    size_t blocks = size / 64;
+    if (blocks > 0) {
+        uint8_t xmm_save[64];
+        __asm__ volatile(XMM_SAVE_0_3
+                         "1:\n\t"
+                         "movdqu (%1), %%xmm0\n\t"
+                         "movdqu 16(%1), %%xmm1\n\t"
+                         "movdqu 32(%1), %%xmm2\n\t"
+                         "movdqu 48(%1), %%xmm3\n\t"
+                         "movdqa %%xmm0, (%0)\n\t"
+                         "movdqa %%xmm1, 16(%0)\n\t"
+                         "movdqa %%xmm2, 32(%0)\n\t"
+                         "movdqa %%xmm3, 48(%0)\n\t"
+                         "add $64, %1\n\t"
+                         "add $64, %0\n\t"
+                         "dec %2\n\t"
+                         "jnz 1b\n\t"
+                         XMM_RESTORE_0_3
+                         : "+r"(d), "+r"(s), "+r"(blocks)
+                         : [save] "r"(xmm_save)
+                         : "memory", "cc");
+        size &= 63;
+    }
+
+    memcpy_rep(d, s, size);
+    return dst;
+}
+
+static void* memset_sse2(void* dst, int value, size_t size)
+{
+    unsigned char* d = dst;
+    size_t head = (0u - (uintptr_t)d) & 15;
+    if (head > size) {
+        head = size;
+    }
+    memset_rep(d, value, head);
+    d += head;
+    size -= head;
+
+    uint32_t pattern[4]; // nothing keeps the stack 16 byte aligned, so it is loaded with movdqu
+    pattern[0] = pattern[1] = pattern[2] = pattern[3] = (uint8_t)value * 0x01010101u;
+    size_t blocks = size / 64;
+    if (blocks > 0) {
+        uint8_t xmm_save[16];
+        __asm__ volatile("movdqu %%xmm0, (%[save])\n\t"
+                         "movdqu (%2), %%xmm0\n\t"
+                         "1:\n\t"
+                         "movdqa %%xmm0, (%0)\n\t"
+                         "movdqa %%xmm0, 16(%0)\n\t"
+                         "movdqa %%xmm0, 32(%0)\n\t"
+                         "movdqa %%xmm0, 48(%0)\n\t"
+                         "add $64, %0\n\t"
+                         "dec %1\n\t"
+                         "jnz 1b\n\t"
+                         "movdqu (%[save]), %%xmm0"
+                         : "+r"(d), "+r"(blocks)
+                         : "r"(pattern), [save] "r"(xmm_save)
+                         : "memory", "cc");
+        size &= 63;
+    }
+
+    memset_rep(d, value, size);
+    return dst;
+}
+
+static void* memmove_sse2(void* dst, const void* src, size_t size)
+{
+    unsigned char* d = (unsigned char*)dst + size;
+    const unsigned char* s = (const unsigned char*)src + size;
+    if ((unsigned char*)dst <= (const unsigned char*)src || (unsigned char*)dst >= s) {
+        return memcpy_sse2(dst, src, size); // a forward copy is safe when the destination is below the source
+    }
+
+    // Back to front. Each block is loaded completely before it is stored, and the stores only hit source bytes
+    // that were already read
+    size_t tail = (uintptr_t)d & 15;
+    if (tail > size) {
+        tail = size;
+    }
+    d -= tail;
+    s -= tail;
+    memmove_rep(d, s, tail);
+    size -= tail;
+
+    size_t blocks = size / 64;
+    if (blocks > 0) {
+        uint8_t xmm_save[64];
+        __asm__ volatile(XMM_SAVE_0_3
+                         "1:\n\t"
+                         "sub $64, %1\n\t"
+                         "sub $64, %0\n\t"
+                         "movdqu 48(%1), %%xmm3\n\t"
+                         "movdqu 32(%1), %%xmm2\n\t"
+                         "movdqu 16(%1), %%xmm1\n\t"
+                         "movdqu (%1), %%xmm0\n\t"
+                         "movdqa %%xmm3, 48(%0)\n\t"
+                         "movdqa %%xmm2, 32(%0)\n\t"
+                         "movdqa %%xmm1, 16(%0)\n\t"
+                         "movdqa %%xmm0, (%0)\n\t"
+                         "dec %2\n\t"
+                         "jnz 1b\n\t"
+                         XMM_RESTORE_0_3
+                         : "+r"(d), "+r"(s), "+r"(blocks)
+                         : [save] "r"(xmm_save)
+                         : "memory", "cc");
+        size &= 63;
+    }
+
+    memmove_rep(dst, src, size); // what is left is at the very start
+    return dst;
+}
+
+static const struct memops variants[] = {
+    { "scalar", 0, memcpy_scalar, memset_scalar, memmove_scalar },
+    { "rep", 0, memcpy_rep, memset_rep, memmove_rep },
+    { "sse2", FPU_HAS_SSE2, memcpy_sse2, memset_sse2, memmove_sse2 },
+};
+
+#define VARIANT_COUNT (sizeof(variants) / sizeof(variants[0]))
+
+static const struct memops* bulk = &variants[1];
+
+static int supported(const struct memops* ops)
+{
+    return (fpu_features() & ops->requires) == ops->requires;
+}
+
+void memops_init(void)
+{
+    for (uint32_t i = 0; i < VARIANT_COUNT; i++) { // the table is ordered worst to best
+        if (supported(&variants[i])) {
+            bulk = &variants[i];
+        }
+    }
+}
+
+const struct memops* memops_current(void)
+{
+    return bulk;
+}
+
+const struct memops* memops_find(const char* name)
+{
+    for (uint32_t i = 0; i < VARIANT_COUNT; i++) {
+        if (strcmp(variants[i].name, name) == 0) {
+            return supported(&variants[i]) ? &variants[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+// The C library entry points. IRQ handlers stay on rep movs: SSE there would need the interrupted thread's
+// XMM registers saved first
+
+void* memcpy(void* restrict dst, const void* restrict src, size_t size)
+{
+    if (size < MEMOPS_REP_MIN) {
+        return memcpy_scalar(dst, src, size);
+    }
+    if (size < MEMOPS_BULK_MIN || in_interrupt()) {
+        return memcpy_rep(dst, src, size);
+    }
+    return bulk->memcpy(dst, src, size);
+}
+
+void* memset(void* dst, int value, size_t size)
+{
+    if (size < MEMOPS_REP_MIN) {
+        return memset_scalar(dst, value, size);
+    }
+    if (size < MEMOPS_BULK_MIN || in_interrupt()) {
+        return memset_rep(dst, value, size);
+    }
+    return bulk->memset(dst, value, size);
+}
+
+void* memmove(void* dst, const void* src, size_t size)
+{
+    if (size < MEMOPS_REP_MIN) {
+        return memmove_scalar(dst, src, size);
+    }
+    if (size < MEMOPS_BULK_MIN || in_interrupt()) {
+        return memmove_rep(dst, src, size);
+    }
+    return bulk->memmove(dst, src, size);
+}
+
+// Self test. The reference results are computed byte by byte right here, not with any of the variants
+
+#define TEST_MAX_SIZE 8192
+#define TEST_GUARD 32 // bytes on either side of the destination that must come back untouched
+#define TEST_BUFFER (TEST_MAX_SIZE + 16 + 2 * TEST_GUARD)
+
+static const uint32_t test_sizes[] = {
+    0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 127, 128, 129,
+    255, 256, 257, 511, 1000, 4095, 4096, 4097, 5000, 8191, 8192
+};
+
+static unsigned char test_src[TEST_BUFFER] __attribute__((aligned(16)));
+static unsigned char test_dst[TEST_BUFFER] __attribute__((aligned(16)));
+static unsigned char test_ref[TEST_BUFFER] __attribute__((aligned(16)));
+
+static NO_LIBCALLS void test_fill(unsigned char* buffer, uint32_t seed)
+{
+    for (uint32_t i = 0; i < TEST_BUFFER; i++) {
+        buffer[i] = (unsigned char)(i * 7 + seed);
+    }
+}
+
+static NO_LIBCALLS int test_compare(const char* variant, const char* op, uint32_t size, uint32_t dst_align,
+    uint32_t src_align)
+{
+    for (uint32_t i = 0; i < TEST_BUFFER; i++) {
+        if (test_dst[i] != test_ref[i]) {
+            klog(KLOG_ERR, "[MEMOPS] %s %s wrong at byte %lu: size %lu dst+%lu src+%lu\n", variant, op,
+                (unsigned long)i, (unsigned long)size, (unsigned long)dst_align, (unsigned long)src_align);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static NO_LIBCALLS int test_variant(const struct memops* ops, uint32_t size, uint32_t dst_align, uint32_t src_align)
+{
+    unsigned char* dst = test_dst + TEST_GUARD + dst_align;
+    unsigned char* ref = test_ref + TEST_GUARD + dst_align;
+
+    // memcpy
+    test_fill(test_src, size);
+    test_fill(test_dst, 0x55);
+    test_fill(test_ref, 0x55);
+    ops->memcpy(dst, test_src + src_align, size);
+    for (uint32_t i = 0; i < size; i++) {
+        ref[i] = test_src[src_align + i];
+    }
+    if (test_compare(ops->name, "memcpy", size, dst_align, src_align) != 0) {
+        return -1;
+    }
+
+    // memset, with a value that has the high bit set to catch sign extension
+    ops->memset(dst, 0x80 | size, size);
+    for (uint32_t i = 0; i < size; i++) {
+        ref[i] = (unsigned char)(0x80 | size);
+    }
+    if (test_compare(ops->name, "memset", size, dst_align, src_align) != 0) {
+        return -1;
+    }
+
+    // memmove within one buffer, overlapping forwards or backwards depending on the two offsets
+    test_fill(test_dst, size);
+    test_fill(test_ref, size);
+    ops->memmove(dst, test_dst + TEST_GUARD + src_align, size);
+    unsigned char* from = test_ref + TEST_GUARD + src_align;
+    if (ref < from) {
+        for (uint32_t i = 0; i < size; i++) {
+            ref[i] = from[i];
+        }
+    } else {
+        for (uint32_t i = size; i > 0; i--) {
+            ref[i - 1] = from[i - 1];
+        }
+    }
+    return test_compare(ops->name, "memmove", size, dst_align, src_align);
+}
+
+int memops_selftest(void)
+{
+    for (uint32_t v = 0; v < VARIANT_COUNT; v++) {
+        if (!supported(&variants[v])) {
+            continue;
+        }
+        for (uint32_t s = 0; s < sizeof(test_sizes) / sizeof(test_sizes[0]); s++) {
+            for (uint32_t align = 0; align < 16; align++) {
+                // every destination alignment, each with a different source alignment
+                if (test_variant(&variants[v], test_sizes[s], align, (align * 7) & 15) != 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,282 @@
+#include <string.h>
+
+#include <kernel/cpu.h>
+#include <kernel/fbcon.h>
+#include <kernel/gdt.h>
+#include <kernel/idt.h>
+#include <kernel/klog.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+#include <kernel/smp.h>
+#include <kernel/vmm.h>
+
+// x86 two level paging: the page directory has 1024 entries of 4 MiB each, every entry either maps a
+// 4 MiB page directly (PSE) or points to a page table of 1024 4 KiB entries.
+// Page tables are allocated from the pmm and reached through the identity map, so no recursive mapping is needed.
+
+#define LARGE_PAGE_MASK (LARGE_PAGE_SIZE - 1)
+#define ENTRY_FLAGS 0xFFF
+#define PAGE_FAULT_VECTOR 14
+
+// Error code the CPU pushes with a #PF
+#define PF_PRESENT 0x01 // the page was mapped, the access broke its protection (0: not mapped at all)
+#define PF_WRITE 0x02
+#define PF_USER 0x04 // from ring 3
+#define PF_RESERVED 0x08 // a paging entry had a reserved bit set
+#define PF_FETCH 0x10 // instruction fetch, only reported with NX
+
+static uint32_t page_directory[1024] __attribute__((aligned(PAGE_SIZE)));
+static uint32_t low_page_table[1024] __attribute__((aligned(PAGE_SIZE))); // first 4 MiB, static so it exists before the pmm
+
+static int pse_supported;
+static uint32_t global_flag; // PAGE_GLOBAL if the CPU supports it, kernel mappings then survive CR3 reloads
+
+// Replaces a 4 MiB page with a page table mapping the same memory, so part of it can be changed
+static uint32_t* split_large_page(uint32_t* pde, uint32_t virt)
+{
+    uint32_t* table = (uint32_t*)pmm_alloc_page();
+    if (table == NULL) {
+        return NULL;
+    }
+    uint32_t base = *pde & ~LARGE_PAGE_MASK;
+    uint32_t flags = *pde & ENTRY_FLAGS & ~PAGE_LARGE;
+    for (int i = 0; i < 1024; i++) {
+        table[i] = (base + i * PAGE_SIZE) | flags;
+    }
+    *pde = (uint32_t)table | PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER); // the PTEs decide the permissions
+    invlpg(virt & ~LARGE_PAGE_MASK);
+    return table;
+}
+
+// Returns the page table covering virt, optionally creating it (or splitting a large page) if it doesn't exist
+static uint32_t* get_table(uint32_t virt, int create, uint32_t flags)
+{
+    uint32_t* pde = &page_directory[virt >> 22];
+
+    if (*pde & PAGE_PRESENT) {
+        if (*pde & PAGE_LARGE) {
+            return create ? split_large_page(pde, virt) : NULL;
+        }
+        *pde |= flags & PAGE_USER; // user pages need the bit on the directory entry as well
+        return (uint32_t*)(*pde & ~ENTRY_FLAGS);
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    uint32_t* table = (uint32_t*)pmm_alloc_page();
+    if (table == NULL) {
+        return NULL;
+    }
+    memset(table, 0, PAGE_SIZE);
+    *pde = (uint32_t)table | PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER);
+    return table;
+}
+
+static int map_pages(uint32_t virt, uint32_t phys, size_t pages, uint32_t flags, int allow_large)
+{
+    flags = (flags | PAGE_PRESENT) & ENTRY_FLAGS & ~PAGE_LARGE;
+
+    while (pages > 0) {
+        if (allow_large && pse_supported && pages >= 1024 && !(virt & LARGE_PAGE_MASK) && !(phys & LARGE_PAGE_MASK)) {
+            uint32_t* pde = &page_directory[virt >> 22];
+            if ((*pde & PAGE_PRESENT) && !(*pde & PAGE_LARGE) && (uint32_t*)(*pde & ~ENTRY_FLAGS) != low_page_table) {
+                pmm_free_page(*pde & ~ENTRY_FLAGS); // the whole table is being replaced
+            }
+            *pde = phys | flags | PAGE_LARGE;
+            invlpg(virt);
+            virt += LARGE_PAGE_SIZE;
+            phys += LARGE_PAGE_SIZE;
+            pages -= 1024;
+            continue;
+        }
+
+        uint32_t* table = get_table(virt, 1, flags);
+        if (table == NULL) {
+            return -1;
+        }
+        table[(virt >> PAGE_SHIFT) & 1023] = phys | flags;
+        invlpg(virt);
+        virt += PAGE_SIZE;
+        phys += PAGE_SIZE;
+        pages--;
+    }
+    return 0;
+}
+
+int paging_map(uint32_t virt, uint32_t phys, size_t size, uint32_t flags)
+{
+    uint32_t irq = irq_save();
+    int ret = map_pages(PAGE_ALIGN_DOWN(virt), PAGE_ALIGN_DOWN(phys), PAGE_ALIGN_UP(size) >> PAGE_SHIFT, flags, 1);
+    irq_restore(irq);
+    return ret;
+}
+
+void* paging_map_mmio(uint32_t phys, size_t size)
+{
+    uint32_t start = PAGE_ALIGN_DOWN(phys);
+    size_t pages = PAGE_ALIGN_UP(phys + size - start) >> PAGE_SHIFT;
+    uint32_t irq = irq_save();
+    int ret = map_pages(start, start, pages, PAGE_WRITE | PAGE_UNCACHED | global_flag, 0);
+    irq_restore(irq);
+    return ret == 0 ? (void*)phys : NULL;
+}
+
+// Shared walker for unmap and protect: new_flags == 0 removes the mapping, otherwise the flags get replaced
+static int update_pages(uint32_t virt, size_t pages, uint32_t new_flags)
+{
+    while (pages > 0) {
+        uint32_t* pde = &page_directory[virt >> 22];
+        if (!(*pde & PAGE_PRESENT)) { // nothing mapped in this 4 MiB, skip to the next one
+            size_t skip = 1024 - ((virt >> PAGE_SHIFT) & 1023);
+            if (skip >= pages) {
+                break;
+            }
+            virt += skip * PAGE_SIZE;
+            pages -= skip;
+            continue;
+        }
+
+        if ((*pde & PAGE_LARGE) && !(virt & LARGE_PAGE_MASK) && pages >= 1024) { // whole large page
+            *pde = new_flags ? ((*pde & ~ENTRY_FLAGS) | new_flags | PAGE_LARGE) : 0;
+            invlpg(virt);
+            virt += LARGE_PAGE_SIZE;
+            pages -= 1024;
+            continue;
+        }
+
+        uint32_t* table = get_table(virt, 1, new_flags);
+        if (table == NULL) {
+            return -1;
+        }
+        uint32_t* pte = &table[(virt >> PAGE_SHIFT) & 1023];
+        if (*pte & PAGE_PRESENT) {
+            *pte = new_flags ? ((*pte & ~ENTRY_FLAGS) | new_flags) : 0;
+            invlpg(virt);
+        }
+        virt += PAGE_SIZE;
+        pages--;
+    }
+    return 0;
+}
+
+int paging_unmap(uint32_t virt, size_t size)
+{
+    uint32_t irq = irq_save();
+    int ret = update_pages(PAGE_ALIGN_DOWN(virt), PAGE_ALIGN_UP(size) >> PAGE_SHIFT, 0);
+    irq_restore(irq);
+    return ret;
+}
+
+int paging_protect(uint32_t virt, size_t size, uint32_t flags)
+{
+    flags = (flags | PAGE_PRESENT) & ENTRY_FLAGS & ~PAGE_LARGE;
+    uint32_t irq = irq_save();
+    int ret = update_pages(PAGE_ALIGN_DOWN(virt), PAGE_ALIGN_UP(size) >> PAGE_SHIFT, flags);
+    irq_restore(irq);
+    return ret;
+}
+
+int paging_query(uint32_t virt, uint32_t* phys, uint32_t* flags)
+{
+    uint32_t pde = page_directory[virt >> 22];
+    uint32_t entry;
+
+    if (!(pde & PAGE_PRESENT)) {
+        return -1;
+    }
+    if (pde & PAGE_LARGE) {
+        entry = pde;
+        if (phys) {
+            *phys = (pde & ~LARGE_PAGE_MASK) | (virt & LARGE_PAGE_MASK);
+        }
+    } else {
+        entry = ((uint32_t*)(pde & ~ENTRY_FLAGS))[(virt >> PAGE_SHIFT) & 1023];
+        if (!(entry & PAGE_PRESENT)) {
+            return -1;
+        }
+        if (phys) {
+            *phys = (entry & ~ENTRY_FLAGS) | (virt & (PAGE_SIZE - 1));
+        }
+    }
+    if (flags) {
+        *flags = entry & ENTRY_FLAGS;
+    }
+    return 0;
+}
+
+// A page that isn't mapped yet may belong to a reserved area (vmm.c), the first touch maps a zeroed frame and the
+// access is retried. Anything else is a bug in the kernel or the user program
+static void page_fault(struct interrupt_frame* frame, void* ctx)
+{
+    (void)ctx;
+    uint32_t addr = read_cr2();
+    uint32_t err = frame->err_code;
+    // Counts as an interrupt while the page gets mapped: the fault may have hit an SSE2 copy halfway, so memset
+    // must leave the XMM registers alone
+    struct cpu* cpu = this_cpu();
+    cpu->irq_depth++;
+    int mapped = !(err & (PF_PRESENT | PF_RESERVED)) && vmm_fault(addr, (err & PF_USER) != 0) == 0;
+    cpu->irq_depth--;
+    if (mapped) {
+        return;
+    }
+
+    const char* guard = vmm_guard_owner(addr);
+    enum klog_level level = (err & PF_USER) ? KLOG_WARN : KLOG_ERR;
+    klog(level, "[PAGING] %s %s at 0x%lx: %s%s\n", (err & PF_USER) ? "user" : "kernel",
+        (err & PF_FETCH) ? "instruction fetch" : (err & PF_WRITE) ? "write" : "read", addr,
+        (err & PF_PRESENT) ? "protection violation" : "page not mapped",
+        (err & PF_RESERVED) ? ", reserved bit set" : "");
+    if (guard != NULL) {
+        klog(level, "[PAGING] 0x%lx is the guard page below '%s', stack overflow\n", addr, guard);
+    }
+    exception_fatal(frame);
+}
+
+void paging_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    pse_supported = (edx & CPUID_EDX_PSE) != 0;
+    global_flag = (edx & CPUID_EDX_PGE) ? PAGE_GLOBAL : 0;
+
+    // First 4 MiB: page 0 stays unmapped so NULL pointer dereferences fault, the legacy VGA window is uncached
+    for (uint32_t i = 1; i < 1024; i++) {
+        uint32_t addr = i * PAGE_SIZE;
+        low_page_table[i] = addr | PAGE_PRESENT | PAGE_WRITE | global_flag;
+        if (addr >= 0xA0000 && addr < 0xC0000) {
+            low_page_table[i] |= PAGE_UNCACHED;
+        }
+    }
+    page_directory[0] = (uint32_t)low_page_table | PAGE_PRESENT | PAGE_WRITE;
+
+    // The rest of RAM, including the kernel image at 4 MiB, is covered by large pages (one TLB entry each)
+    uint32_t top = (pmm_memory_top() + LARGE_PAGE_MASK) & ~LARGE_PAGE_MASK;
+    if (top > LARGE_PAGE_SIZE) {
+        map_pages(LARGE_PAGE_SIZE, LARGE_PAGE_SIZE, (top - LARGE_PAGE_SIZE) >> PAGE_SHIFT, PAGE_WRITE | global_flag, 1);
+    }
+
+    // The framebuffer console draws at the framebuffer's physical address, usually in the PCI hole above RAM.
+    // Cached as far as the page tables go, the MTRRs the firmware set up for it have the last word
+    if (fbcon_active()) {
+        struct fbcon_info fb;
+        fbcon_get_info(&fb);
+        uint32_t start = PAGE_ALIGN_DOWN(fb.phys);
+        map_pages(start, start, PAGE_ALIGN_UP(fb.phys + fb.size - start) >> PAGE_SHIFT, PAGE_WRITE | global_flag, 1);
+    }
+
+    write_cr3((uint32_t)page_directory);
+    uint32_t cr4 = read_cr4();
+    if (pse_supported) {
+        cr4 |= CR4_PSE;
+    }
+    if (global_flag) {
+        cr4 |= CR4_PGE;
+    }
+    write_cr4(cr4);
+    write_cr0(read_cr0() | CR0_PG | CR0_WP);
+
+    double_fault_tss.cr3 = (uint32_t)page_directory; // the double fault task switch loads CR3 as well
+    irq_register(PAGE_FAULT_VECTOR, page_fault, NULL);
+}
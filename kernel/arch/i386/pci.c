@@ -0,0 +1,81 @@
+#include <kernel/cpu.h>
+#include <kernel/idt.h>
+#include <kernel/pci.h>
+
+// Every access is an address write followed by a data access, interrupts stay off in between so an IRQ handler
+// touching config space can't change the address under us
+static uint32_t config_address(const struct pci_device* dev, uint8_t offset)
+{
+    return (1u << 31) | ((uint32_t)dev->bus << 16) | ((uint32_t)dev->slot << 11) | ((uint32_t)dev->func << 8)
+        | (offset & 0xFC);
+}
+
+uint32_t pci_read32(const struct pci_device* dev, uint8_t offset)
+{
+    uint32_t flags = irq_save();
+    outl(PCI_CONFIG_ADDRESS, config_address(dev, offset));
+    uint32_t value = inl(PCI_CONFIG_DATA);
+    irq_restore(flags);
+    return value;
+}
+
+uint16_t pci_read16(const struct pci_device* dev, uint8_t offset)
+{
+    return (uint16_t)(pci_read32(dev, offset) >> ((offset & 2) * 8));
+}
+
+uint8_t pci_read8(const struct pci_device* dev, uint8_t offset)
+{
+    return (uint8_t)(pci_read32(dev, offset) >> ((offset & 3) * 8));
+}
+
+void pci_write32(const struct pci_device* dev, uint8_t offset, uint32_t value)
+{
+    uint32_t flags = irq_save();
+    outl(PCI_CONFIG_ADDRESS, config_address(dev, offset));
+    outl(PCI_CONFIG_DATA, value);
+    irq_restore(flags);
+}
+
+void pci_write16(const struct pci_device* dev, uint8_t offset, uint16_t value)
+{
+    uint32_t shift = (offset & 2) * 8;
+    uint32_t old = pci_read32(dev, offset);
+    pci_write32(dev, offset, (old & ~(0xFFFFu << shift)) | ((uint32_t)value << shift));
+}
+
+// Brute force scan of every bus/slot/function, only done a few times at boot
+int pci_find_class(uint8_t class, uint8_t subclass, struct pci_device* dev)
+{
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint8_t slot = 0; slot < 32; slot++) {
+            struct pci_device probe = { (uint8_t)bus, slot, 0, 0, 0, 0, 0, 0 };
+            if (pci_read16(&probe, PCI_VENDOR_ID) == 0xFFFF) {
+                continue; // nothing in this slot
+            }
+            uint8_t functions = (pci_read8(&probe, PCI_HEADER_TYPE) & 0x80) ? 8 : 1;
+            for (uint8_t func = 0; func < functions; func++) {
+                probe.func = func;
+                probe.vendor_id = pci_read16(&probe, PCI_VENDOR_ID);
+                if (probe.vendor_id == 0xFFFF) {
+                    continue;
+                }
+                probe.class = pci_read8(&probe, PCI_CLASS);
+                probe.subclass = pci_read8(&probe, PCI_SUBCLASS);
+                if (probe.class == class && probe.subclass == subclass) {
+                    probe.device_id = pci_read16(&probe, PCI_DEVICE_ID);
+                    probe.prog_if = pci_read8(&probe, PCI_PROG_IF);
+                    *dev = probe;
+                    return 0;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+uint32_t pci_bar(const struct pci_device* dev, int bar)
+{
+    uint32_t value = pci_read32(dev, (uint8_t)(PCI_BAR0 + bar * 4));
+    return (value & PCI_BAR_IO) ? (value & ~0x3u) : (value & ~0xFu);
+}
@@ -0,0 +1,61 @@
+#include <kernel/cpu.h>
+#include <kernel/idt.h>
+#include <kernel/pit.h>
+
+#define PIT_CHANNEL0 0x40
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+#define PIT_PORT_B 0x61 // bit 0 gates channel 2, bit 1 connects it to the speaker, bit 5 reads its output
+
+// Command byte: channel 0 (bits 7-6 = 00), access lobyte/hibyte (bits 5-4 = 11), operating mode in bits 3-1
+#define PIT_CMD_MODE0 0x30 // interrupt on terminal count
+#define PIT_CMD_MODE2 0x34 // rate generator
+#define PIT_CMD_LATCH 0x00 // latch the current count of channel 0
+#define PIT_CMD_CH2_MODE0 0xB0 // channel 2 (bits 7-6 = 10), lobyte/hibyte, mode 0
+
+static void pit_program(uint8_t command, uint16_t count)
+{
+    uint32_t flags = irq_save(); // the two data bytes must not be split by someone else touching the PIT
+    outb(PIT_COMMAND, command);
+    outb(PIT_CHANNEL0, (uint8_t)(count & 0xFF));
+    outb(PIT_CHANNEL0, (uint8_t)(count >> 8));
+    irq_restore(flags);
+}
+
+void pit_set_periodic(uint16_t divisor)
+{
+    pit_program(PIT_CMD_MODE2, divisor);
+}
+
+void pit_set_oneshot(uint16_t count)
+{
+    pit_program(PIT_CMD_MODE0, count);
+}
+
+uint16_t pit_read_count(void)
+{
+    uint32_t flags = irq_save();
+    outb(PIT_COMMAND, PIT_CMD_LATCH);
+    uint8_t low = inb(PIT_CHANNEL0);
+    uint8_t high = inb(PIT_CHANNEL0);
+    irq_restore(flags);
+    return ((uint16_t)high << 8) | low;
+}
+
+void pit_channel2_prepare(uint16_t count)
+{
+    outb(PIT_PORT_B, inb(PIT_PORT_B) & ~0x03); // gate low (counter holds) and speaker off
+    outb(PIT_COMMAND, PIT_CMD_CH2_MODE0);
+    outb(PIT_CHANNEL2, (uint8_t)(count & 0xFF));
+    outb(PIT_CHANNEL2, (uint8_t)(count >> 8));
+}
+
+void pit_channel2_start(void)
+{
+    outb(PIT_PORT_B, inb(PIT_PORT_B) | 0x01);
+}
+
+int pit_channel2_expired(void)
+{
+    return (inb(PIT_PORT_B) & 0x20) != 0; // mode 0 raises OUT at terminal count
+}
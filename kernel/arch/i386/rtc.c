@@ -0,0 +1,127 @@
+#include <string.h>
+
+#include <kernel/cpu.h>
+#include <kernel/idt.h>
+#include <kernel/rtc.h>
+
+#define CMOS_INDEX 0x70
+#define CMOS_DATA 0x71
+
+#define RTC_SECOND 0x00
+#define RTC_MINUTE 0x02
+#define RTC_HOUR 0x04
+#define RTC_DAY 0x07
+#define RTC_MONTH 0x08
+#define RTC_YEAR 0x09
+#define RTC_STATUS_A 0x0A
+#define RTC_STATUS_B 0x0B
+#define RTC_STATUS_C 0x0C
+
+#define RTC_A_UIP 0x80 // update in progress, the time registers are about to change
+#define RTC_B_24H 0x02
+#define RTC_B_BINARY 0x04 // BCD otherwise
+#define RTC_B_UIE 0x10 // update-ended interrupt enable
+#define RTC_C_UF 0x10 // an update ended
+#define RTC_HOUR_PM 0x80 // in 12 hour mode
+
+#define RTC_IRQ 8
+
+static const uint8_t time_regs[] = { RTC_SECOND, RTC_MINUTE, RTC_HOUR, RTC_DAY, RTC_MONTH, RTC_YEAR };
+
+static void (*second_fn)(const struct rtc_time* time);
+
+// Callers hold interrupts off: the index port is shared with the IRQ8 handler
+static uint8_t cmos_read(uint8_t reg)
+{
+    outb(CMOS_INDEX, reg);
+    return inb(CMOS_DATA);
+}
+
+static void cmos_write(uint8_t reg, uint8_t value)
+{
+    outb(CMOS_INDEX, reg);
+    outb(CMOS_DATA, value);
+}
+
+static void read_regs(uint8_t* regs)
+{
+    while (cmos_read(RTC_STATUS_A) & RTC_A_UIP) {
+    }
+    for (size_t i = 0; i < sizeof(time_regs); i++) {
+        regs[i] = cmos_read(time_regs[i]);
+    }
+}
+
+static uint8_t from_bcd(uint8_t value)
+{
+    return (uint8_t)((value >> 4) * 10 + (value & 0x0F));
+}
+
+int rtc_read(struct rtc_time* time)
+{
+    uint8_t regs[sizeof(time_regs)], again[sizeof(time_regs)];
+    uint32_t flags = irq_save();
+    // An update can still start between the UIP check and the last register, so read until two reads agree
+    read_regs(again);
+    do {
+        memcpy(regs, again, sizeof(regs));
+        read_regs(again);
+    } while (memcmp(regs, again, sizeof(regs)) != 0);
+    uint8_t status = cmos_read(RTC_STATUS_B);
+    irq_restore(flags);
+
+    int pm = !(status & RTC_B_24H) && (regs[2] & RTC_HOUR_PM);
+    regs[2] &= (uint8_t)~RTC_HOUR_PM;
+    if (!(status & RTC_B_BINARY)) {
+        for (size_t i = 0; i < sizeof(regs); i++) {
+            regs[i] = from_bcd(regs[i]);
+        }
+    }
+    if (!(status & RTC_B_24H)) {
+        regs[2] = (uint8_t)(regs[2] % 12 + (pm ? 12 : 0)); // 12 AM is 0:00, 12 PM is 12:00
+    }
+
+    time->second = regs[0];
+    time->minute = regs[1];
+    time->hour = regs[2];
+    time->day = regs[3];
+    time->month = regs[4];
+    time->year = (uint16_t)(regs[5] + (regs[5] < 70 ? 2000 : 1900));
+    if (time->second > 59 || time->minute > 59 || time->hour > 23 || time->day < 1 || time->day > 31
+        || time->month < 1 || time->month > 12 || regs[5] > 99) {
+        return -1;
+    }
+    return 0;
+}
+
+static void rtc_interrupt(struct interrupt_frame* frame, void* ctx)
+{
+    (void)frame;
+    (void)ctx;
+    // Reading status C acknowledges the interrupt, the RTC raises no other until it is read
+    if (!(cmos_read(RTC_STATUS_C) & RTC_C_UF) || second_fn == NULL) {
+        return;
+    }
+    cmos_write(RTC_STATUS_B, cmos_read(RTC_STATUS_B) & (uint8_t)~RTC_B_UIE);
+    irq_unregister(IRQ_VECTOR(RTC_IRQ));
+
+    struct rtc_time time;
+    void (*fn)(const struct rtc_time* time) = second_fn;
+    second_fn = NULL;
+    if (rtc_read(&time) == 0) { // the update just ended, nothing waits on UIP for the next 999 ms
+        fn(&time);
+    }
+}
+
+int rtc_on_next_second(void (*fn)(const struct rtc_time* time))
+{
+    if (irq_register(IRQ_VECTOR(RTC_IRQ), rtc_interrupt, NULL) != 0) {
+        return -1;
+    }
+    uint32_t flags = irq_save();
+    second_fn = fn;
+    cmos_read(RTC_STATUS_C); // drop whatever was latched before
+    cmos_write(RTC_STATUS_B, cmos_read(RTC_STATUS_B) | RTC_B_UIE);
+    irq_restore(flags);
+    return 0;
+}
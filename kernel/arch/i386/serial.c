@@ -0,0 +1,177 @@
+#include <kernel/idt.h>
+#include <kernel/serial.h>
+#include <kernel/thread.h>
+
+#define COM1 0x3F8
+#define UART_DATA (COM1 + 0) // THR on write, divisor low byte while DLAB is set
+#define UART_IER (COM1 + 1) // interrupt enable, divisor high byte while DLAB is set
+#define UART_FCR (COM1 + 2) // FIFO control on write, interrupt identification (IIR) on read
+#define UART_IIR (COM1 + 2)
+#define UART_LCR (COM1 + 3)
+#define UART_MCR (COM1 + 4)
+#define UART_LSR (COM1 + 5)
+#define UART_SCR (COM1 + 7) // scratch register, used to see if the UART exists at all
+
+#define LCR_DLAB 0x80
+#define LCR_8N1 0x03
+#define FCR_ENABLE_CLEAR 0xC7 // enable + clear both FIFOs, RX trigger at 14 bytes
+#define MCR_DTR_RTS_OUT2 0x0B // OUT2 gates the UART interrupt line to the PIC
+#define IER_THRE 0x02
+#define LSR_THRE 0x20 // transmit holding register (the whole TX FIFO on a 16550) is empty
+#define LSR_TEMT 0x40 // and the shift register too, the last bit has left
+#define IIR_FIFO_MASK 0xC0
+
+#define TX_RING_SIZE 4096 // power of two
+#define TX_RING_MASK (TX_RING_SIZE - 1)
+
+// TX ring, indices run freely: head - tail is the fill level. Both sides run with interrupts disabled
+static char tx_ring[TX_RING_SIZE];
+static uint32_t tx_head;
+static uint32_t tx_tail;
+
+static int present;
+static int irq_mode;
+static int tx_active; // THRE interrupt is enabled and will refill the FIFO
+static uint32_t fifo_size = 1; // 16 on a 16550A, an old 8250/16450 only has the holding register
+static struct wait_queue tx_wait;
+static struct serial_stats stats;
+
+// Moves up to a FIFO's worth of bytes into the UART, the caller made sure the FIFO is empty
+static void fill_fifo(void)
+{
+    for (uint32_t i = 0; i < fifo_size && tx_tail != tx_head; i++) {
+        outb(UART_DATA, (uint8_t)tx_ring[tx_tail++ & TX_RING_MASK]);
+        stats.bytes++;
+    }
+}
+
+// Fallback for when the interrupt can't be used (before serial_enable_irq, or with interrupts disabled and a full ring)
+static void poll_fifo(void)
+{
+    while (!(inb(UART_LSR) & LSR_THRE)) {
+    }
+    fill_fifo();
+}
+
+static void kick(void)
+{
+    if (!irq_mode) {
+        while (tx_tail != tx_head) {
+            poll_fifo();
+        }
+        return;
+    }
+    if (!tx_active && tx_tail != tx_head) {
+        tx_active = 1;
+        if (inb(UART_LSR) & LSR_THRE) { // idle UART, start right away, the interrupt takes it from there
+            fill_fifo();
+        }
+        outb(UART_IER, IER_THRE);
+    }
+}
+
+static void serial_irq(struct interrupt_frame* frame, void* ctx)
+{
+    (void)frame;
+    (void)ctx;
+    stats.interrupts++;
+    inb(UART_IIR); // reading IIR acknowledges a THRE interrupt
+    if (inb(UART_LSR) & LSR_THRE) {
+        fill_fifo();
+    }
+    if (tx_tail == tx_head) { // drained, stop the interrupt until there is more to send
+        outb(UART_IER, 0);
+        tx_active = 0;
+    }
+    wake_up(&tx_wait);
+}
+
+static void put(char c)
+{
+    if (tx_head - tx_tail == TX_RING_SIZE) {
+        stats.ring_full++;
+        do {
+            if (irq_mode && sched_can_block()) {
+                kick();
+                wait_queue_sleep(&tx_wait);
+            } else {
+                poll_fifo();
+            }
+        } while (tx_head - tx_tail == TX_RING_SIZE);
+    }
+    tx_ring[tx_head++ & TX_RING_MASK] = c;
+}
+
+int serial_init(void)
+{
+    outb(UART_SCR, 0x5A);
+    if (inb(UART_SCR) != 0x5A) {
+        return -1;
+    }
+
+    outb(UART_IER, 0);
+    outb(UART_LCR, LCR_DLAB);
+    outb(UART_DATA, 1); // divisor 1 = 115200 baud
+    outb(UART_IER, 0);
+    outb(UART_LCR, LCR_8N1);
+    outb(UART_FCR, FCR_ENABLE_CLEAR);
+    outb(UART_MCR, MCR_DTR_RTS_OUT2);
+    if ((inb(UART_IIR) & IIR_FIFO_MASK) == IIR_FIFO_MASK) {
+        fifo_size = 16;
+    }
+
+    wait_queue_init(&tx_wait);
+    present = 1;
+    return 0;
+}
+
+void serial_enable_irq(void)
+{
+    if (!present) {
+        return;
+    }
+    irq_register(IRQ_VECTOR(4), serial_irq, NULL);
+    irq_mode = 1;
+}
+
+int serial_present(void)
+{
+    return present;
+}
+
+void serial_write(const char* data, size_t size)
+{
+    if (!present) {
+        return;
+    }
+    uint32_t flags = irq_save();
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] == '\n') {
+            put('\r');
+        }
+        put(data[i]);
+    }
+    kick();
+    irq_restore(flags);
+}
+
+void serial_flush(void)
+{
+    if (!present) {
+        return;
+    }
+    uint32_t flags = irq_save();
+    while (tx_tail != tx_head) {
+        poll_fifo();
+    }
+    while (!(inb(UART_LSR) & LSR_TEMT)) {
+    }
+    irq_restore(flags);
+}
+
+void serial_get_stats(struct serial_stats* out)
+{
+    uint32_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
@@ -0,0 +1,179 @@
+#include <string.h>
+
+#include <kernel/apic.h>
+#include <kernel/cpu.h>
+#include <kernel/fpu.h>
+#include <kernel/idt.h>
+#include <kernel/klog.h>
+#include <kernel/kmalloc.h>
+#include <kernel/smp.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+
+#define STARTUP_TIMEOUT_US 100000
+
+// Filled in for one AP at a time, the layout matches the end of smp_trampoline.S
+struct trampoline_params {
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t stack;
+    uint32_t cpu;
+};
+
+extern char smp_trampoline_start[];
+extern char smp_trampoline_params[];
+extern char smp_trampoline_end[];
+
+void smp_ap_main(struct cpu* cpu);
+
+// cpus[0] has to be usable before gdt_install points %gs at it, hence the initializer
+static struct cpu cpus[SMP_MAX_CPUS] = { [0] = { .self = &cpus[0], .online = 1 } };
+static int cpu_count = 1;
+static int run_busy; // an smp_run is in progress, protected by irq_save (only the boot CPU calls it)
+static struct wait_queue run_wait;
+
+static void ipi_handler(struct interrupt_frame* frame, void* ctx)
+{
+    (void)frame;
+    (void)ctx;
+    this_cpu()->ipis++; // the idle loop picks up the work once we return
+}
+
+// Where the APs spend their time: run the work smp_run left, otherwise halt until the next IPI. Interrupts are
+// off between the check and the hlt, and sti only takes effect after the hlt, so no IPI can slip in between
+__attribute__((noreturn)) static void ap_idle(struct cpu* cpu)
+{
+    for (;;) {
+        __asm__ volatile("cli");
+        smp_work_fn fn = __atomic_load_n(&cpu->work, __ATOMIC_ACQUIRE);
+        if (fn != NULL) {
+            __asm__ volatile("sti");
+            fn(cpu->work_arg);
+            cpu->work_done++;
+            __atomic_store_n(&cpu->work, NULL, __ATOMIC_RELEASE);
+            continue;
+        }
+        uint64_t start = rdtsc();
+        __asm__ volatile("sti; hlt" : : : "memory");
+        cpu->idle_cycles += rdtsc() - start;
+    }
+}
+
+// C entry point of an AP, called by the trampoline on the CPU's own stack with paging already on
+void smp_ap_main(struct cpu* cpu)
+{
+    gdt_install_cpu(cpu->gdt, &cpu->gdt_ptr, (uint32_t)cpu, sizeof(*cpu));
+    idt_load();
+    fpu_init_cpu();
+    lapic_init_cpu();
+    __atomic_store_n(&cpu->online, 1, __ATOMIC_RELEASE);
+    ap_idle(cpu);
+}
+
+static int start_ap(struct cpu* cpu)
+{
+    cpu->stack = kmalloc(SMP_STACK_SIZE);
+    if (cpu->stack == NULL) {
+        return -1;
+    }
+
+    struct trampoline_params* params =
+        (struct trampoline_params*)(SMP_TRAMPOLINE_ADDR + (smp_trampoline_params - smp_trampoline_start));
+    params->cr0 = read_cr0() & ~CR0_TS; // the AP has no thread whose FPU state could be someone else's
+    params->cr3 = read_cr3();
+    params->cr4 = read_cr4();
+    params->stack = (uint32_t)cpu->stack + SMP_STACK_SIZE;
+    params->cpu = (uint32_t)cpu;
+
+    // The universal startup algorithm: INIT, 10 ms, then STARTUP twice (the second one is ignored if the first worked)
+    lapic_send_init(cpu->apic_id);
+    udelay(10000);
+    for (int i = 0; i < 2 && !__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE); i++) {
+        lapic_send_startup(cpu->apic_id, SMP_TRAMPOLINE_ADDR >> 12);
+        udelay(200);
+    }
+    for (uint32_t waited = 0; waited < STARTUP_TIMEOUT_US; waited += 100) {
+        if (__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        udelay(100);
+    }
+    kfree(cpu->stack); // never came up, nothing runs on it
+    cpu->stack = NULL;
+    return -1;
+}
+
+int smp_init(void)
+{
+    struct cpu* boot = &cpus[0];
+    wait_queue_init(&run_wait);
+    if (!apic_active()) {
+        return cpu_count;
+    }
+    boot->apic_id = lapic_id();
+    irq_register(LAPIC_IPI_VECTOR, ipi_handler, NULL);
+
+    memcpy((void*)SMP_TRAMPOLINE_ADDR, smp_trampoline_start, smp_trampoline_end - smp_trampoline_start);
+    for (int i = 0; i < apic_cpu_count() && cpu_count < SMP_MAX_CPUS; i++) {
+        const struct apic_cpu* info = apic_get_cpu(i);
+        if (info->apic_id == boot->apic_id) {
+            continue;
+        }
+        struct cpu* cpu = &cpus[cpu_count];
+        cpu->self = cpu;
+        cpu->id = (uint32_t)cpu_count;
+        cpu->apic_id = info->apic_id;
+        if (start_ap(cpu) != 0) {
+            kprintf("[SMP] cpu with apic id %u didn't start\n", info->apic_id);
+            continue;
+        }
+        kprintf("[OK] smp: cpu%lu online (apic id %lu)\n", (unsigned long)cpu->id, (unsigned long)cpu->apic_id);
+        cpu_count++;
+    }
+    return cpu_count;
+}
+
+int smp_cpu_count(void)
+{
+    return cpu_count;
+}
+
+struct cpu* smp_get_cpu(int id)
+{
+    return id >= 0 && id < cpu_count ? &cpus[id] : NULL;
+}
+
+int smp_run(int cpus_wanted, smp_work_fn fn, void* arg)
+{
+    if (smp_processor_id() != 0) {
+        return -1;
+    }
+    int n = cpus_wanted < 1 ? 1 : cpus_wanted > cpu_count ? cpu_count : cpus_wanted;
+
+    uint32_t flags = irq_save();
+    while (run_busy) {
+        wait_queue_sleep(&run_wait);
+    }
+    run_busy = 1;
+    irq_restore(flags);
+
+    for (int i = 1; i < n; i++) {
+        cpus[i].work_arg = arg;
+        __atomic_store_n(&cpus[i].work, fn, __ATOMIC_RELEASE);
+        lapic_send_ipi(cpus[i].apic_id, LAPIC_IPI_VECTOR);
+    }
+    fn(arg);
+    cpus[0].work_done++;
+    for (int i = 1; i < n; i++) {
+        while (__atomic_load_n(&cpus[i].work, __ATOMIC_ACQUIRE) != NULL) {
+            __asm__ volatile("pause");
+        }
+    }
+
+    flags = irq_save();
+    run_busy = 0;
+    wake_up(&run_wait);
+    irq_restore(flags);
+    return n;
+}
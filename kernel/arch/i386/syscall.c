@@ -0,0 +1,197 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <kernel/console.h>
+#include <kernel/cpu.h>
+#include <kernel/gdt.h>
+#include <kernel/keyboard.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+#include <kernel/syscall.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <kernel/user.h>
+#include <kernel/vmm.h>
+
+#define SYSCALL_BUFFER 256 // bytes moved per copy on the kernel stack for read/write
+
+typedef int32_t (*syscall_fn)(uint32_t a, uint32_t b, uint32_t c);
+
+extern void sysenter_entry(void); // isr.s
+
+static int sysenter_supported;
+// IA32_SYSENTER_ESP points at the top. sysenter_entry switches to the thread's stack in its first instruction, the
+// only thing that ever lands here is the frame of a single step trap on that instruction (isr1 in isr.s)
+static uint32_t sysenter_stack[16];
+static struct syscall_stats stats;
+
+// Checks that every page of [addr, addr + size) is mapped for ring 3 (and writable if asked). Demand-zero pages
+// the program hasn't touched yet (its stack) are faulted in, as if it had touched them itself
+static int user_range_ok(uint32_t addr, size_t size, int write)
+{
+    if (addr < USER_BASE || addr > USER_TOP || size > USER_TOP - addr) {
+        return 0;
+    }
+    uint32_t need = PAGE_PRESENT | PAGE_USER | (write ? PAGE_WRITE : 0);
+    for (uint32_t page = PAGE_ALIGN_DOWN(addr); page < addr + size; page += PAGE_SIZE) {
+        uint32_t phys, flags;
+        if (paging_query(page, &phys, &flags) != 0
+            && (vmm_fault(page, 1) != 0 || paging_query(page, &phys, &flags) != 0)) {
+            return 0;
+        }
+        if ((flags & need) != need) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int copy_from_user(void* dst, uint32_t src, size_t size)
+{
+    if (!user_range_ok(src, size, 0)) {
+        return -EFAULT;
+    }
+    memcpy(dst, (const void*)src, size);
+    return 0;
+}
+
+int copy_to_user(uint32_t dst, const void* src, size_t size)
+{
+    if (!user_range_ok(dst, size, 1)) {
+        return -EFAULT;
+    }
+    memcpy((void*)dst, src, size);
+    return 0;
+}
+
+static int32_t sys_exit(uint32_t code, uint32_t b, uint32_t c)
+{
+    (void)b;
+    (void)c;
+    user_exit((int)code);
+}
+
+static int32_t sys_write(uint32_t fd, uint32_t buf, uint32_t len)
+{
+    char chunk[SYSCALL_BUFFER];
+    for (uint32_t done = 0; done < len;) {
+        uint32_t n = len - done < sizeof(chunk) ? len - done : sizeof(chunk);
+        if (copy_from_user(chunk, buf + done, n) != 0) {
+            return -EFAULT;
+        }
+        if (console_write((int)fd, chunk, n) < 0) {
+            return -EBADF;
+        }
+        done += n;
+    }
+    return (int32_t)len;
+}
+
+static int32_t sys_read(uint32_t fd, uint32_t buf, uint32_t len)
+{
+    char chunk[SYSCALL_BUFFER];
+    if (fd != 0) {
+        return -EBADF;
+    }
+    if (!user_range_ok(buf, len, 1)) { // before blocking, not after a line was typed
+        return -EFAULT;
+    }
+    int n = keyboard_read(chunk, len < sizeof(chunk) ? len : sizeof(chunk));
+    if (n > 0 && copy_to_user(buf, chunk, (size_t)n) != 0) {
+        return -EFAULT;
+    }
+    return n;
+}
+
+static int32_t sys_null(uint32_t a, uint32_t b, uint32_t c)
+{
+    (void)a;
+    (void)b;
+    (void)c;
+    return 0;
+}
+
+static int32_t sys_yield(uint32_t a, uint32_t b, uint32_t c)
+{
+    (void)a;
+    (void)b;
+    (void)c;
+    thread_yield();
+    return 0;
+}
+
+static int32_t sys_sleep(uint32_t ms, uint32_t b, uint32_t c)
+{
+    (void)b;
+    (void)c;
+    sleep_ms(ms);
+    return 0;
+}
+
+static const syscall_fn syscall_table[SYSCALL_COUNT] = {
+    [SYS_EXIT] = sys_exit,
+    [SYS_WRITE] = sys_write,
+    [SYS_READ] = sys_read,
+    [SYS_NULL] = sys_null,
+    [SYS_YIELD] = sys_yield,
+    [SYS_SLEEP] = sys_sleep,
+};
+
+void syscall_dispatch(struct interrupt_frame* frame)
+{
+    uint32_t nr = frame->eax;
+
+    // Both entry paths arrive with interrupts off. A system call runs like any other thread code from here on:
+    // it can be preempted and it can block
+    __asm__ volatile("sti");
+    if (nr < SYSCALL_COUNT && syscall_table[nr] != NULL) {
+        frame->eax = (uint32_t)syscall_table[nr](frame->ebx, frame->esi, frame->edi);
+    } else {
+        frame->eax = (uint32_t)-ENOSYS;
+    }
+    __asm__ volatile("cli");
+}
+
+static void syscall_interrupt(struct interrupt_frame* frame, void* ctx)
+{
+    (void)ctx;
+    stats.int80++;
+    syscall_dispatch(frame);
+}
+
+void syscall_sysenter(struct interrupt_frame* frame)
+{
+    stats.sysenter++;
+    syscall_dispatch(frame);
+}
+
+void syscall_init(void)
+{
+    irq_register(SYSCALL_VECTOR, syscall_interrupt, NULL);
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    uint32_t family = (eax >> 8) & 0xF;
+    uint32_t model = (eax >> 4) & 0xF;
+    uint32_t stepping = eax & 0xF;
+    // The original Pentium Pro sets the SEP bit without actually supporting the instructions
+    sysenter_supported = (edx & CPUID_EDX_SEP) && !(family == 6 && model < 3 && stepping < 3);
+    if (sysenter_supported) {
+        wrmsr(MSR_SYSENTER_CS, KERNEL_CS);
+        wrmsr(MSR_SYSENTER_ESP, (uint32_t)&sysenter_stack[16]); // sysenter_entry loads tss.esp0 right away
+        wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+    }
+}
+
+int syscall_has_sysenter(void)
+{
+    return sysenter_supported;
+}
+
+void syscall_get_stats(struct syscall_stats* out)
+{
+    uint32_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
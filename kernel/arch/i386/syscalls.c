@@ -2,36 +2,100 @@
 
 #include <stddef.h> // provides size_t and NULL
 #include <stdint.h> // intptr_t and uint8_t
-// #include <sys/stat.h> // gives structs
-#include <kernel/tty.h> // get terminal_write
+#include <sys/stat.h> // gives structs
+#include <sys/time.h> // struct timeval for gettimeofday
+#include <sys/times.h> // struct tms for times
+#include <time.h> // struct timespec and the clock ids for clock_gettime
+#include <kernel/clock.h> // the time of day comes from the TSC, no port I/O to read it
+#include <kernel/console.h> // stdout / stderr go to VGA, serial or both
+#include <kernel/keyboard.h> // stdin reads finished lines from the keyboard
+#include <kernel/kmalloc.h> // newlib's malloc family is routed to the kernel heap
+#include <kernel/thread.h> // times reports the calling thread's CPU time
+#include <kernel/timer.h> // which is counted in timer ticks
+#include <kernel/vfs.h> // every other file descriptor is a file on the initrd
+#include <kernel/vmm.h> // the heap arena is reserved address space, backed as it gets used
 #include <string.h>
 
 int errno; // will be intialized to 0 since its in BSS, set to associated error numbers when necessary
-extern uint8_t _kernel_end[]; // for compiler to dereference where kernel ends
-static uint8_t* heap_ptr = _kernel_end; // define where the heap begins
+static uint8_t* heap_start; // start of the heap arena, reserved on the first sbrk call
+static uint8_t* heap_ptr;
 
-#define HEAP_MAX 0x100000 // 1 MiB
+#define HEAP_MAX (16 * 1024 * 1024) // only the pages sbrk's callers touch get frames
 #define EBADF 9
-#define S_IFCHR 0020000
+#define EINVAL 22
+#define EROFS 30
+#define O_ACCMODE 3 // O_RDONLY is 0, anything else wants to write
+#define NSEC_PER_SEC 1000000000ull
 
-struct stat {
-    int st_mode;
-};
+#ifndef CLOCK_REALTIME
+#define CLOCK_REALTIME ((clockid_t)1)
+#endif
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC ((clockid_t)4) // newlib's value, it only defines it when built with _POSIX_MONOTONIC_CLOCK
+#endif
+
+// The vfs returns negative errno values, newlib wants -1 with errno set
+static int vfs_result(int ret)
+{
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
 
 void* sbrk(intptr_t increment) // move heap pointer
 {
+    if (heap_start == NULL) { // a reserved area, so it can't collide with anything else handed out
+        heap_start = vmm_reserve(HEAP_MAX, 0, "sbrk");
+        if (heap_start == NULL) {
+            return (void*)-1;
+        }
+        heap_ptr = heap_start;
+    }
+
     uint8_t* prev = heap_ptr; // assign the current heap pointer to a temporary prev variable
-    if (heap_ptr + increment > _kernel_end + HEAP_MAX) { // remember to start at _kernel_end memory address
+    if (heap_ptr + increment > heap_start + HEAP_MAX || heap_ptr + increment < heap_start) {
         return (void*)-1; // out of heap space
     }
     heap_ptr += increment; // move the heap pointer
     return (void*)prev; // return the previous position as the start of the new block
 }
 
+// newlib's malloc/free/realloc/calloc all go through these reentrant hooks, defining them here replaces
+// newlib's own sbrk based allocator with kmalloc so freed memory is actually reused
+struct _reent;
+
+void* _malloc_r(struct _reent* r, size_t size)
+{
+    (void)r;
+    return kmalloc(size);
+}
+
+void _free_r(struct _reent* r, void* ptr)
+{
+    (void)r;
+    kfree(ptr);
+}
+
+void* _realloc_r(struct _reent* r, void* ptr, size_t size)
+{
+    (void)r;
+    return krealloc(ptr, size);
+}
+
+void* _calloc_r(struct _reent* r, size_t count, size_t size)
+{
+    (void)r;
+    if (size != 0 && count > SIZE_MAX / size) {
+        return NULL; // count * size would overflow
+    }
+    return kzalloc(count * size);
+}
+
 int write(int fd, const char* buf, int len)
-{ // write to the terminal
-    if (fd == 1 || fd == 2) {
-        terminal_write(buf, (size_t)len);
+{ // write to the console (VGA terminal and / or serial port)
+    if (len >= 0 && console_write(fd, buf, (size_t)len) >= 0) {
         return len;
     }
     errno = EBADF; // bad file descriptor error, "I don't know what file you're talking about"
@@ -39,9 +103,26 @@ int write(int fd, const char* buf, int len)
 }
 
 int read(int fd, char* buf, int len)
-{
-    (void)fd; (void)buf; (void)len; // void unused args
-    return -1; // not necessary at the moment since idt writes directly to the screen buffer, not file descriptor
+{ // stdin blocks the calling thread until a line has been typed, so fgets / getchar work
+    if (fd == 0) {
+        if (len < 0) {
+            return 0;
+        }
+        return keyboard_read(buf, (size_t)len);
+    }
+    if (len < 0) {
+        return 0;
+    }
+    return vfs_result(vfs_read(fd, buf, (size_t)len));
+}
+
+int open(const char* name, int flags, ...)
+{ // read-only files from the initrd
+    if (flags & O_ACCMODE) {
+        errno = EROFS;
+        return -1;
+    }
+    return vfs_result(vfs_open(name));
 }
 
 // completely stops the kernel and halts the cpu indefinitely
@@ -54,15 +135,23 @@ __attribute__((noreturn)) void _exit(int status)
 
 int close(int fd)
 { // close a file descriptor
-    (void)fd;
-    return -1; // has nothing to close at the moment
+    return vfs_result(vfs_close(fd));
 }
 
 int fstat(int fd, struct stat* st)
 {
-    (void)fd;
     memset(st, 0, sizeof(struct stat));
-    st->st_mode = S_IFCHR;
+    if (fd >= 0 && fd < VFS_FD_BASE) {
+        st->st_mode = S_IFCHR; // the console
+        return 0;
+    }
+    struct vfs_stat vs;
+    if (vfs_result(vfs_fstat(fd, &vs)) < 0) {
+        return -1;
+    }
+    st->st_mode = vs.type == VNODE_DIR ? S_IFDIR : S_IFREG;
+    st->st_ino = vs.ino;
+    st->st_size = vs.size;
     return 0;
 }
 
@@ -75,9 +164,8 @@ int isatty(int fd)
 }
 
 int lseek(int fd, int offset, int whence)
-{ // can't seek on a character device like i386
-    (void)fd; (void)offset; (void)whence;
-    return -1;
+{ // can't seek on the console, only on files
+    return vfs_result(vfs_lseek(fd, offset, whence));
 }
 
 int kill(int pid, int sig)
@@ -90,3 +178,40 @@ int getpid(void)
 { // always return 1, we're the only process
     return 1;
 }
+
+int gettimeofday(struct timeval* tv, void* tz)
+{ // time() ends up here too
+    (void)tz; // no time zones, the clock runs on UTC
+    if (tv != NULL) {
+        uint64_t us = clock_realtime_ns() / 1000;
+        tv->tv_sec = (time_t)(us / 1000000);
+        tv->tv_usec = (suseconds_t)(us % 1000000);
+    }
+    return 0;
+}
+
+int clock_gettime(clockid_t clock_id, struct timespec* tp)
+{ // newlib doesn't provide it on a bare target, the rest of POSIX timers isn't needed
+    uint64_t ns;
+    if (clock_id == CLOCK_MONOTONIC) {
+        ns = clock_monotonic_ns();
+    } else if (clock_id == CLOCK_REALTIME) {
+        ns = clock_realtime_ns();
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    tp->tv_sec = (time_t)(ns / NSEC_PER_SEC);
+    tp->tv_nsec = (long)(ns % NSEC_PER_SEC);
+    return 0;
+}
+
+clock_t times(struct tms* buf)
+{ // clock() adds up the fields, all in CLOCKS_PER_SEC units. No user / system split: it's all kernel code
+    struct thread* self = thread_current();
+    memset(buf, 0, sizeof(struct tms));
+    if (self != NULL && timer_hz() != 0) {
+        buf->tms_utime = (clock_t)(self->cpu_ticks * CLOCKS_PER_SEC / timer_hz());
+    }
+    return (clock_t)(clock_monotonic_ns() / (NSEC_PER_SEC / CLOCKS_PER_SEC));
+}
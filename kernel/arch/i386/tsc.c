@@ -0,0 +1,52 @@
+#include <kernel/pit.h>
+#include <kernel/tsc.h>
+
+#define CALIBRATE_MS 10
+#define CALIBRATE_COUNT (PIT_FREQUENCY * CALIBRATE_MS / 1000)
+#define CALIBRATE_RUNS 3
+
+static uint32_t khz;
+struct tsc_scale tsc_ns_scale;
+
+uint32_t tsc_calibrate(void)
+{
+    // Shortest of a few runs: an SMI or a slow emulator exit can only ever make a window look longer
+    uint64_t best = UINT64_MAX;
+    for (int run = 0; run < CALIBRATE_RUNS; run++) {
+        uint32_t flags = irq_save();
+        pit_channel2_prepare(CALIBRATE_COUNT);
+        uint64_t start = rdtsc();
+        pit_channel2_start();
+        while (!pit_channel2_expired()) {
+        }
+        uint64_t cycles = rdtsc() - start;
+        irq_restore(flags);
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+
+    khz = (uint32_t)(best * PIT_FREQUENCY / CALIBRATE_COUNT / 1000);
+    if (khz == 0) {
+        return 0;
+    }
+
+    // The biggest shift whose multiplier still fits in 32 bits, which rounds to better than 1 ppb below 4 GHz
+    uint32_t shift = 32;
+    while (shift > 0 && (1000000ull << shift) / khz > UINT32_MAX) {
+        shift--;
+    }
+    tsc_ns_scale.mult = (uint32_t)((1000000ull << shift) / khz);
+    tsc_ns_scale.shift = shift;
+    return khz;
+}
+
+uint32_t tsc_khz(void)
+{
+    return khz;
+}
+
+uint64_t tsc_cycles_to_us(uint64_t cycles)
+{
+    return tsc_cycles_to_ns(cycles) / 1000;
+}
@@ -3,21 +3,68 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <kernel/cpu.h>
+#include <kernel/fbcon.h>
 #include <kernel/idt.h>
+#include <kernel/timer.h>
 #include <kernel/tty.h>
+#include <kernel/workqueue.h>
 
 #include "vga.h"
 
-static const size_t VGA_WIDTH = 80;
-static const size_t VGA_HEIGHT = 25;
+#define VGA_WIDTH 80
+#define VGA_HEIGHT 25
+#define VGA_MEMORY_CELLS (0x8000 / 2) // 32 KiB of text memory at 0xB8000 holds 204 rows
+#define FB_TEXT_CELLS (3 * FBCON_MAX_COLUMNS * FBCON_MAX_ROWS) // room to slide and for the scrollback view next to it
+#define SCROLLBACK_CELLS (1000 * VGA_WIDTH) // 1000 lines in text mode, fewer of the framebuffer console's longer ones
+#define REFRESH_MS 20 // once deferred, the framebuffer console is redrawn at most every 20 ms
 static uint16_t* const VGA_MEMORY = (uint16_t*)0xB8000;
 
+// The screen is terminal_width x terminal_height cells of character + VGA attribute. In text mode they are
+// VGA memory itself, with the framebuffer console they live in fb_text and fbcon draws them
+static size_t terminal_width;
+static size_t terminal_height;
+static bool framebuffer;
+static uint16_t* text_memory; // VGA memory or fb_text
+static size_t text_rows; // how many rows of terminal_width cells it holds
+static uint16_t fb_text[FB_TEXT_CELLS];
+
 static size_t terminal_row;
 static size_t terminal_column;
 static uint8_t terminal_color;
-static uint16_t* terminal_buffer;
+static uint16_t* terminal_buffer; // first cell of the live screen inside text memory
+static bool cursor_visible = true;
+
+// The live screen is a window that slides down through text memory, the CRTC start address register (or the row
+// fbcon draws from) is moved along with it so scrolling doesn't copy anything until the window hits the end
+static size_t screen_top; // text memory row the live screen starts at
+static size_t display_top; // text memory row shown at the top of the screen, differs while browsing the scrollback
+
+// Lines that scrolled off the top are kept here so they can be browsed with Shift+PgUp/PgDn
+static uint16_t scrollback[SCROLLBACK_CELLS];
+static size_t scrollback_lines; // capacity, SCROLLBACK_CELLS / terminal_width
+static size_t scrollback_head; // next line to overwrite
+static size_t scrollback_count;
+static size_t view_offset; // how many lines back in history the display is, 0 = live screen
+
+// Framebuffer console redraws: after every write until terminal_defer_refresh, then from the kworker
+static bool refresh_deferred;
+static struct timer refresh_timer;
+static struct work refresh_work;
+
+// Escape sequence parser state
+#define ANSI_MAX_PARAMS 8
+enum ansi_state { ANSI_NORMAL, ANSI_ESCAPE, ANSI_CSI };
+static enum ansi_state ansi_state = ANSI_NORMAL;
+static int ansi_params[ANSI_MAX_PARAMS];
+static size_t ansi_param_count;
+static bool ansi_private; // sequence started with '?'
+static bool ansi_bold;
+static size_t saved_row;
+static size_t saved_column;
 
 static bool shift_pressed = false;
+static bool extended_pending = false; // last scancode was the 0xE0 prefix
 
 // IMPLEMENT PS/2 scancode to ASCII conversion table
 
@@ -40,6 +87,45 @@ const char ascii_shift_map[] = {
 
 char ps2_to_ascii(uint8_t scancode)
 {
+    if (scancode == 0xE0) { // extended key, the real scancode follows
+        extended_pending = true;
+        return 0;
+    }
+    if (extended_pending) {
+        extended_pending = false;
+        if (scancode & 0x80) {
+            return 0; // extended key released
+        }
+        switch (scancode) {
+        case 0x49: // Page Up
+            if (shift_pressed) {
+                terminal_scroll_view((int)terminal_height - 1);
+            }
+            return 0;
+        case 0x51: // Page Down
+            if (shift_pressed) {
+                terminal_scroll_view(-((int)terminal_height - 1));
+            }
+            return 0;
+        case 0x48: // Up arrow
+            if (shift_pressed) {
+                terminal_scroll_view(1);
+            }
+            return 0;
+        case 0x50: // Down arrow
+            if (shift_pressed) {
+                terminal_scroll_view(-1);
+            }
+            return 0;
+        case 0x1C: // Keypad Enter
+            return '\n';
+        case 0x35: // Keypad /
+            return '/';
+        default: // fake shifts (E0 2A) and keys we don't map yet
+            return 0;
+        }
+    }
+
     // Check for Break codes (Key Released)
     if (scancode & 0x80) {
         uint8_t released = scancode & 0x7F;
@@ -67,38 +153,202 @@ char ps2_to_ascii(uint8_t scancode)
 
 // Additional helper functionality (scrolling)
 
+void update_cursor(size_t x, size_t y);
+
+// Shows the text memory row 'row' at the top of the screen: points the CRTC at it, or has fbcon compare the
+// whole screen on the next flush
+static void set_display_start(size_t row)
+{
+    display_top = row;
+    if (framebuffer) {
+        fbcon_invalidate();
+        return;
+    }
+    uint16_t pos = row * VGA_WIDTH;
+    outb(0x3D4, 0x0C);
+    outb(0x3D5, (uint8_t)((pos >> 8) & 0xFF));
+    outb(0x3D4, 0x0D);
+    outb(0x3D5, (uint8_t)(pos & 0xFF));
+}
+
+static inline void mark_dirty(size_t from, size_t to)
+{
+    if (framebuffer) {
+        fbcon_dirty(from, to);
+    }
+}
+
+// Draws the cells that changed, VGA text mode shows them as soon as they are written. Interrupts are off
+static void terminal_flush(void)
+{
+    if (framebuffer) {
+        fbcon_flush(text_memory + display_top * terminal_width);
+    }
+}
+
+// End of a write: with deferred refreshes the drawing is left to the kworker, unless the caller runs with
+// interrupts off (IRQ handlers, a dying kernel) and may not see the timer fire at all
+static void terminal_refresh(uint32_t irq_flags)
+{
+    if (!framebuffer) {
+        return;
+    }
+    if (refresh_deferred && (irq_flags & EFLAGS_IF)) {
+        if (!timer_pending(&refresh_timer)) {
+            timer_add(&refresh_timer, timer_ms_to_ticks(REFRESH_MS));
+        }
+        return;
+    }
+    terminal_flush();
+}
+
+static void refresh_work_fn(struct work* work)
+{
+    (void)work;
+    uint32_t flags = irq_save();
+    terminal_flush();
+    irq_restore(flags);
+}
+
+static void refresh_timer_fn(void* arg)
+{
+    (void)arg;
+    schedule_work(&refresh_work); // the kworker can use the SSE memmove for the scrolling, an IRQ handler can't
+}
+
+void terminal_defer_refresh(void)
+{
+    if (framebuffer) {
+        work_init(&refresh_work, refresh_work_fn);
+        timer_setup(&refresh_timer, refresh_timer_fn, NULL);
+        refresh_deferred = true;
+    }
+}
+
 void scrollup(void)
 {
-    for (size_t y = 1; y < VGA_HEIGHT; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            const size_t index = y * VGA_WIDTH + x;
-            terminal_buffer[index - VGA_WIDTH] = terminal_buffer[index];
-            terminal_buffer[index] = vga_entry(' ', terminal_color);
+    // keep the line that is about to disappear in the scrollback ring
+    memcpy(scrollback + scrollback_head * terminal_width, terminal_buffer, terminal_width * sizeof(uint16_t));
+    scrollback_head = (scrollback_head + 1) % scrollback_lines;
+    if (scrollback_count < scrollback_lines) {
+        scrollback_count++;
+    }
+
+    if (screen_top + terminal_height < text_rows) {
+        screen_top++; // slide the window down a row, the old top row just stops being displayed
+    } else {
+        // out of text memory: move the rows that stay visible back to the start in one block copy
+        memmove(text_memory, terminal_buffer + terminal_width,
+            (terminal_height - 1) * terminal_width * sizeof(uint16_t));
+        screen_top = 0;
+    }
+    terminal_buffer = text_memory + screen_top * terminal_width;
+
+    uint16_t blank = vga_entry(' ', terminal_color);
+    uint16_t* bottom = terminal_buffer + (terminal_height - 1) * terminal_width;
+    for (size_t x = 0; x < terminal_width; x++) {
+        bottom[x] = blank;
+    }
+
+    if (view_offset == 0) {
+        if (framebuffer) {
+            display_top = screen_top;
+            fbcon_scroll(blank); // the pixels move along, only the new bottom row gets drawn
+        } else {
+            set_display_start(screen_top);
+        }
+    }
+}
+
+// Shows older output: lines > 0 moves back into the scrollback, < 0 moves towards the live screen
+void terminal_scroll_view(int lines)
+{
+    uint32_t flags = irq_save();
+    int offset = (int)view_offset + lines;
+    if (offset < 0) {
+        offset = 0;
+    }
+    if ((size_t)offset > scrollback_count) {
+        offset = scrollback_count;
+    }
+    view_offset = offset;
+
+    if (view_offset == 0) {
+        set_display_start(screen_top);
+        update_cursor(terminal_column, terminal_row);
+        terminal_flush();
+        irq_restore(flags);
+        return;
+    }
+
+    // Render the history into VGA rows the live screen isn't using and pan to them. The hardware cursor stays
+    // at its position on the live screen, which is outside the displayed rows, so it disappears on its own
+    size_t view_row = (screen_top + 2 * terminal_height <= text_rows) ? screen_top + terminal_height : 0;
+    uint16_t* view = text_memory + view_row * terminal_width;
+    size_t first = scrollback_count - view_offset; // index of the top line in history + live screen
+    for (size_t y = 0; y < terminal_height; y++) {
+        size_t line = first + y;
+        const uint16_t* src;
+        if (line < scrollback_count) {
+            src = scrollback
+                + (scrollback_head + scrollback_lines - scrollback_count + line) % scrollback_lines * terminal_width;
+        } else {
+            src = terminal_buffer + (line - scrollback_count) * terminal_width;
         }
+        memcpy(view + y * terminal_width, src, terminal_width * sizeof(uint16_t));
     }
+    set_display_start(view_row);
+    update_cursor(terminal_column, terminal_row);
+    terminal_flush();
+    irq_restore(flags);
 }
 
 // Basic functions for terminal I/O
 
 void terminal_initialize(void)
 {
+    framebuffer = fbcon_active();
+    if (framebuffer) {
+        struct fbcon_info info;
+        fbcon_get_info(&info);
+        terminal_width = info.columns;
+        terminal_height = info.rows;
+        text_memory = fb_text;
+        text_rows = FB_TEXT_CELLS / terminal_width;
+    } else {
+        terminal_width = VGA_WIDTH;
+        terminal_height = VGA_HEIGHT;
+        text_memory = VGA_MEMORY;
+        text_rows = VGA_MEMORY_CELLS / VGA_WIDTH;
+    }
+    scrollback_lines = SCROLLBACK_CELLS / terminal_width;
+
     terminal_row = 0;
     terminal_column = 0;
     terminal_color = vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
-    terminal_buffer = VGA_MEMORY;
-    for (size_t y = 0; y < VGA_HEIGHT; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            const size_t index = y * VGA_WIDTH + x;
+    screen_top = 0;
+    view_offset = 0;
+    terminal_buffer = text_memory;
+    for (size_t y = 0; y < terminal_height; y++) {
+        for (size_t x = 0; x < terminal_width; x++) {
+            const size_t index = y * terminal_width + x;
             terminal_buffer[index] = vga_entry(' ', terminal_color);
         }
     }
+    set_display_start(0);
+    update_cursor(0, 0);
+    terminal_flush();
 }
 
 // moves the cusor to the given cursor location
 // column, row
 void update_cursor(size_t x, size_t y)
 {
-    uint16_t pos = y * VGA_WIDTH + x;
+    if (framebuffer) {
+        fbcon_set_cursor(x, y, cursor_visible && view_offset == 0); // VGA hides it by leaving the displayed rows
+        return;
+    }
+    uint16_t pos = (screen_top + y) * VGA_WIDTH + x; // the cursor address is absolute in VGA memory
     // x86 assembly to perform change
     outb(0x3D4, 0x0F);
     outb(0x3D5, (uint8_t)(pos & 0xFF));
@@ -113,13 +363,220 @@ void terminal_setcolor(uint8_t color)
 
 void terminal_putentryat(unsigned char c, uint8_t color, size_t x, size_t y)
 {
-    const size_t index = y * VGA_WIDTH + x;
+    const size_t index = y * terminal_width + x;
     terminal_buffer[index] = vga_entry(c, color);
+    mark_dirty(index, index + 1);
 }
 
-void terminal_putchar(char c)
+static void terminal_newline(void)
 {
-    unsigned char uc = c;
+    terminal_column = 0;
+    if (++terminal_row == terminal_height) {
+        scrollup();
+        terminal_row = terminal_height - 1;
+    }
+}
+
+// Blanks the cells [from, to) of the live screen, counted from the top left corner
+static void terminal_clear_cells(size_t from, size_t to)
+{
+    uint16_t blank = vga_entry(' ', terminal_color);
+    for (size_t i = from; i < to; i++) {
+        terminal_buffer[i] = blank;
+    }
+    mark_dirty(from, to);
+}
+
+// ANSI / VT100 escape sequences: ESC [ params final
+// Supported: SGR colors (m), cursor position (H f), cursor moves (A B C D G), erase (J K), save/restore (s u)
+// and showing / hiding the cursor (?25h ?25l). Anything else is swallowed so it doesn't end up on screen
+
+static void ansi_select_graphics(void)
+{
+    // ANSI color order is black red green yellow blue magenta cyan white, VGA swaps red/blue and yellow/cyan
+    static const uint8_t ansi_to_vga[8] = {
+        VGA_COLOR_BLACK, VGA_COLOR_RED, VGA_COLOR_GREEN, VGA_COLOR_BROWN,
+        VGA_COLOR_BLUE, VGA_COLOR_MAGENTA, VGA_COLOR_CYAN, VGA_COLOR_LIGHT_GREY
+    };
+    uint8_t fg = terminal_color & 0x0F;
+    uint8_t bg = terminal_color >> 4;
+
+    for (size_t i = 0; i < ansi_param_count; i++) {
+        int p = ansi_params[i];
+        if (p == 0) {
+            fg = VGA_COLOR_LIGHT_GREY;
+            bg = VGA_COLOR_BLACK;
+            ansi_bold = false;
+        } else if (p == 1) {
+            ansi_bold = true;
+            fg |= 8;
+        } else if (p == 22) {
+            ansi_bold = false;
+            fg &= 7;
+        } else if (p == 7) { // reverse video
+            uint8_t tmp = fg;
+            fg = bg;
+            bg = tmp;
+        } else if (p >= 30 && p <= 37) {
+            fg = ansi_to_vga[p - 30] | (ansi_bold ? 8 : 0);
+        } else if (p == 39) {
+            fg = VGA_COLOR_LIGHT_GREY | (ansi_bold ? 8 : 0);
+        } else if (p >= 40 && p <= 47) {
+            bg = ansi_to_vga[p - 40];
+        } else if (p == 49) {
+            bg = VGA_COLOR_BLACK;
+        } else if (p >= 90 && p <= 97) {
+            fg = ansi_to_vga[p - 90] | 8;
+        } else if (p >= 100 && p <= 107) {
+            bg = ansi_to_vga[p - 100] | 8;
+        }
+    }
+    terminal_setcolor(vga_entry_color(fg, bg));
+}
+
+static void set_cursor_visible(bool visible)
+{
+    cursor_visible = visible;
+    if (framebuffer) {
+        return; // fbcon picks it up with the next update_cursor
+    }
+    outb(0x3D4, 0x0A); // cursor start register, bit 5 disables the cursor
+    outb(0x3D5, visible ? 14 : 0x20);
+    outb(0x3D4, 0x0B); // cursor end scanline
+    outb(0x3D5, 15);
+}
+
+static void ansi_execute(char final)
+{
+    int n = (ansi_param_count > 0 && ansi_params[0] > 0) ? ansi_params[0] : 1; // count for the cursor moves
+
+    if (ansi_private) {
+        if (ansi_param_count > 0 && ansi_params[0] == 25 && (final == 'h' || final == 'l')) {
+            set_cursor_visible(final == 'h');
+        }
+        return;
+    }
+
+    switch (final) {
+    case 'm':
+        ansi_select_graphics();
+        break;
+    case 'H':
+    case 'f': { // row;col, both 1-based
+        int row = (ansi_param_count > 0 && ansi_params[0] > 0) ? ansi_params[0] : 1;
+        int col = (ansi_param_count > 1 && ansi_params[1] > 0) ? ansi_params[1] : 1;
+        terminal_row = ((size_t)row > terminal_height ? terminal_height : (size_t)row) - 1;
+        terminal_column = ((size_t)col > terminal_width ? terminal_width : (size_t)col) - 1;
+        break;
+    }
+    case 'A':
+        terminal_row = ((size_t)n > terminal_row) ? 0 : terminal_row - n;
+        break;
+    case 'B':
+        terminal_row = (terminal_row + n >= terminal_height) ? terminal_height - 1 : terminal_row + n;
+        break;
+    case 'C':
+        terminal_column = (terminal_column + n >= terminal_width) ? terminal_width - 1 : terminal_column + n;
+        break;
+    case 'D':
+        terminal_column = ((size_t)n > terminal_column) ? 0 : terminal_column - n;
+        break;
+    case 'G':
+        terminal_column = ((size_t)n > terminal_width ? terminal_width : (size_t)n) - 1;
+        break;
+    case 'J': { // erase in display: 0 = to the end, 1 = from the start, 2 = everything
+        int mode = ansi_param_count > 0 ? ansi_params[0] : 0;
+        size_t cursor = terminal_row * terminal_width + terminal_column;
+        if (mode == 0) {
+            terminal_clear_cells(cursor, terminal_width * terminal_height);
+        } else if (mode == 1) {
+            terminal_clear_cells(0, cursor + 1);
+        } else {
+            terminal_clear_cells(0, terminal_width * terminal_height);
+            if (mode == 3) {
+                scrollback_count = 0;
+            }
+        }
+        break;
+    }
+    case 'K': { // erase in line, same modes as J
+        int mode = ansi_param_count > 0 ? ansi_params[0] : 0;
+        size_t line = terminal_row * terminal_width;
+        if (mode == 0) {
+            terminal_clear_cells(line + terminal_column, line + terminal_width);
+        } else if (mode == 1) {
+            terminal_clear_cells(line, line + terminal_column + 1);
+        } else {
+            terminal_clear_cells(line, line + terminal_width);
+        }
+        break;
+    }
+    case 's':
+        saved_row = terminal_row;
+        saved_column = terminal_column;
+        break;
+    case 'u':
+        terminal_row = saved_row;
+        terminal_column = saved_column;
+        break;
+    default:
+        break;
+    }
+}
+
+// Feeds one byte through the escape sequence parser, returns true if it was consumed
+static bool ansi_feed(char c)
+{
+    switch (ansi_state) {
+    case ANSI_NORMAL:
+        if (c != 0x1B) {
+            return false;
+        }
+        ansi_state = ANSI_ESCAPE;
+        return true;
+    case ANSI_ESCAPE:
+        if (c == '[') {
+            ansi_state = ANSI_CSI;
+            ansi_param_count = 0;
+            ansi_private = false;
+            ansi_params[0] = 0;
+        } else {
+            ansi_state = ANSI_NORMAL; // not a CSI sequence, drop it
+        }
+        return true;
+    case ANSI_CSI:
+        if (c >= '0' && c <= '9') {
+            if (ansi_param_count == 0) {
+                ansi_param_count = 1;
+            }
+            int* p = &ansi_params[ansi_param_count - 1];
+            *p = *p * 10 + (c - '0');
+        } else if (c == ';') {
+            if (ansi_param_count == 0) {
+                ansi_param_count = 1; // empty first parameter
+            }
+            if (ansi_param_count < ANSI_MAX_PARAMS) {
+                ansi_params[ansi_param_count++] = 0;
+            }
+        } else if (c == '?') {
+            ansi_private = true;
+        } else if (c >= 0x40 && c <= 0x7E) { // final byte
+            ansi_execute(c);
+            ansi_state = ANSI_NORMAL;
+        } else {
+            ansi_state = ANSI_NORMAL; // malformed, give up on it
+        }
+        return true;
+    }
+    return false;
+}
+
+// Handles one non-printable character (or the start / continuation of an escape sequence)
+static void terminal_control(char c)
+{
+    if (ansi_feed(c)) {
+        return;
+    }
 
     if (c == '\b') {
         // Backspace: move cursor back and erase
@@ -128,46 +585,75 @@ void terminal_putchar(char c)
         } else if (terminal_row > 0) {
             // Wrap to end of previous line
             terminal_row--;
-            terminal_column = VGA_WIDTH - 1;
+            terminal_column = terminal_width - 1;
         }
         // Erase the character at the new cursor position
         terminal_putentryat(' ', terminal_color, terminal_column, terminal_row);
     } else if (c == '\n') {
         // Newline: move to next line
+        terminal_newline();
+    } else if (c == '\r') {
         terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) {
-            scrollup();
-            terminal_row = VGA_HEIGHT - 1;
-        }
     } else if (c == '\t') {
         // Tab: advance to next multiple of 8
         terminal_column += 8 - (terminal_column % 8);
-        if (terminal_column >= VGA_WIDTH) {
-            terminal_column = 0;
-            if (++terminal_row == VGA_HEIGHT) {
-                scrollup();
-                terminal_row = VGA_HEIGHT - 1;
-            }
+        if (terminal_column >= terminal_width) {
+            terminal_newline();
         }
     } else {
-        // Regular character: print and advance cursor
-        terminal_putentryat(uc, terminal_color, terminal_column, terminal_row);
-        if (++terminal_column == VGA_WIDTH) {
-            terminal_column = 0;
-            if (++terminal_row == VGA_HEIGHT) {
-                scrollup();
-                terminal_row = VGA_HEIGHT - 1;
-            }
+        // Any other control character is printed as its code page 437 glyph
+        terminal_putentryat((unsigned char)c, terminal_color, terminal_column, terminal_row);
+        if (++terminal_column == terminal_width) {
+            terminal_newline();
         }
     }
 }
 
+static inline bool is_printable(unsigned char c)
+{
+    return c >= 0x20 && c != 0x7F;
+}
+
+void terminal_putchar(char c)
+{
+    terminal_write(&c, 1);
+}
+
+// Writes a whole buffer: runs of printable characters go straight into text memory in a tight loop, and the
+// hardware cursor (4 port writes) is only moved once at the end instead of after every character. The framebuffer
+// console draws the result once per write, or once per REFRESH_MS for all writes in between once deferred
 void terminal_write(const char* data, size_t size)
 {
-    for (size_t i = 0; i < size; i++) {
-        terminal_putchar(data[i]);
-        update_cursor(terminal_column, terminal_row); // moves the cursor to the new location after placing character
+    uint32_t flags = irq_save(); // threads and the keyboard echo share the screen, keep each write in one piece
+    if (view_offset != 0) { // new output snaps the display back to the live screen
+        view_offset = 0;
+        set_display_start(screen_top);
+    }
+
+    size_t i = 0;
+    while (i < size) {
+        if (ansi_state == ANSI_NORMAL && is_printable(data[i])) {
+            uint16_t* cell = terminal_buffer + terminal_row * terminal_width + terminal_column;
+            uint16_t attr = (uint16_t)terminal_color << 8;
+            size_t room = terminal_width - terminal_column;
+            size_t n = 0;
+            while (n < room && i < size && is_printable(data[i])) {
+                cell[n++] = attr | (unsigned char)data[i++];
+            }
+            size_t index = terminal_row * terminal_width + terminal_column;
+            mark_dirty(index, index + n);
+            terminal_column += n;
+            if (terminal_column == terminal_width) {
+                terminal_newline();
+            }
+        } else {
+            terminal_control(data[i++]);
+        }
     }
+
+    update_cursor(terminal_column, terminal_row);
+    terminal_refresh(flags);
+    irq_restore(flags);
 }
 
 void terminal_writestring(const char* data)
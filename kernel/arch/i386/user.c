@@ -0,0 +1,155 @@
+#include <string.h>
+
+#include <kernel/fpu.h>
+#include <kernel/gdt.h>
+#include <kernel/klog.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+#include <kernel/syscall.h>
+#include <kernel/thread.h>
+#include <kernel/user.h>
+#include <kernel/vmm.h>
+
+// user_programs.S
+extern const uint8_t user_hello[], user_hello_end[];
+extern const uint8_t user_nullsys_int80[], user_nullsys_int80_end[];
+extern const uint8_t user_nullsys_sysenter[], user_nullsys_sysenter_end[];
+extern const uint8_t user_xmm_keep[], user_xmm_keep_end[];
+
+static const struct user_program programs[] = {
+    { "hello", user_hello, user_hello_end },
+    { "nullsys_int80", user_nullsys_int80, user_nullsys_int80_end },
+    { "nullsys_sysenter", user_nullsys_sysenter, user_nullsys_sysenter_end },
+    { "xmm_keep", user_xmm_keep, user_xmm_keep_end },
+};
+
+// The one running program. 'busy' stays set from user_spawn until user_wait collected the exit code
+static int busy;
+static int exited;
+static int exit_code;
+static const struct user_program* running;
+static uint32_t running_arg;
+static uint32_t code_phys, code_pages;
+static int stack_reserved;
+static struct wait_queue exit_wait;
+
+// Whether this CPU has what the program needs
+static int runnable(const struct user_program* program)
+{
+    if (program->start == user_nullsys_sysenter && !syscall_has_sysenter()) {
+        return 0;
+    }
+    if (program->start == user_xmm_keep && !(fpu_features() & FPU_HAS_SSE2)) {
+        return 0;
+    }
+    return 1;
+}
+
+const struct user_program* user_find(const char* name)
+{
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+        if (strcmp(programs[i].name, name) == 0) {
+            return runnable(&programs[i]) ? &programs[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+void user_for_each(void (*fn)(const struct user_program* program, void* arg), void* arg)
+{
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+        if (runnable(&programs[i])) {
+            fn(&programs[i], arg);
+        }
+    }
+}
+
+static void free_memory(void)
+{
+    if (code_phys != 0) {
+        paging_unmap(USER_BASE, code_pages * PAGE_SIZE);
+        pmm_free_pages(code_phys, code_pages);
+        code_phys = 0;
+    }
+    if (stack_reserved) {
+        vmm_release((void*)(USER_TOP - USER_STACK_SIZE));
+        stack_reserved = 0;
+    }
+}
+
+static void finish(int code)
+{
+    free_memory();
+    uint32_t flags = irq_save();
+    exit_code = code;
+    exited = 1;
+    wake_up(&exit_wait);
+    irq_restore(flags);
+}
+
+// Thread body: sets up the address space and drops to ring 3, never comes back here
+static void user_thread(void* arg)
+{
+    (void)arg;
+    size_t size = running->end - running->start;
+    code_pages = PAGE_ALIGN_UP(size) / PAGE_SIZE;
+    code_phys = pmm_alloc_pages(code_pages);
+    stack_reserved = vmm_reserve_at(USER_TOP - USER_STACK_SIZE, USER_STACK_SIZE, VMM_USER | VMM_GUARD, "user stack") == 0;
+    // RAM is identity mapped, so the frames can be filled through their physical addresses
+    if (code_phys == 0 || !stack_reserved
+        || paging_map(USER_BASE, code_phys, code_pages * PAGE_SIZE, PAGE_USER) != 0) { // read-only code
+        klog(KLOG_WARN, "[USER] out of memory starting '%s'\n", running->name);
+        finish(-1);
+        return;
+    }
+    memset((void*)code_phys, 0, code_pages * PAGE_SIZE);
+    memcpy((void*)code_phys, running->start, size);
+
+    uint32_t low, high;
+    thread_stack_bounds(thread_current(), &low, &high);
+    tss_set_kernel_stack(high); // the scheduler keeps this up to date from now on
+    user_enter(USER_BASE, USER_TOP, running_arg);
+}
+
+int user_spawn(const struct user_program* program, uint32_t arg)
+{
+    uint32_t flags = irq_save();
+    if (busy) {
+        irq_restore(flags);
+        return -1;
+    }
+    busy = 1;
+    exited = 0;
+    irq_restore(flags);
+
+    wait_queue_init(&exit_wait);
+    running = program;
+    running_arg = arg;
+    if (thread_create(program->name, user_thread, NULL, THREAD_PRIO_NORMAL) == NULL) {
+        busy = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int user_wait(void)
+{
+    wait_event(&exit_wait, exited);
+    int code = exit_code;
+    busy = 0;
+    return code;
+}
+
+void user_exit(int code)
+{
+    finish(code);
+    thread_exit();
+}
+
+void user_fault(struct interrupt_frame* frame)
+{
+    klog(KLOG_WARN, "[USER] '%s' killed: %s at eip=0x%lx (err=0x%lx)\n", running->name, irq_vector_name((uint8_t)frame->int_no),
+        frame->eip, frame->err_code);
+    __asm__ volatile("sti"); // exceptions arrive with interrupts off, freeing the memory may need them
+    user_exit(-1);
+}
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Turns `nm -n` output (on stdin) into an assembly file holding a table of the kernel's code symbols, sorted by
+# address, which ksyms.c uses to turn addresses into function names (profiler reports, backtraces, exceptions)
+awk '
+BEGIN { n = 0 }
+$2 ~ /^[TtWw]$/ && $3 !~ /^\./ { addr[n] = $1; name[n] = $3; n++ }
+END {
+	print "# Generated by gensyms.sh, do not edit"
+	print "\t.section .rodata"
+	print "\t.align 4"
+	print "\t.global ksyms_count"
+	print "ksyms_count:"
+	printf "\t.long %d\n", n
+	print "\t.global ksyms"
+	print "ksyms:"
+	for (i = 0; i < n; i++) {
+		printf "\t.long 0x%s, .Lksym_name%d\n", addr[i], i
+	}
+	for (i = 0; i < n; i++) {
+		printf ".Lksym_name%d:\t.asciz \"%s\"\n", i, name[i]
+	}
+}'
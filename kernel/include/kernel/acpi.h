@@ -0,0 +1,81 @@
+#ifndef _KERNEL_ACPI_H
+#define _KERNEL_ACPI_H
+
+#include <stdint.h>
+
+// Just enough ACPI to read static tables: the RSDP is searched for in the EBDA and the BIOS area, the RSDT
+// it points to lists every other table. Nothing here runs AML
+
+struct acpi_rsdp {
+    char signature[8]; // "RSD PTR "
+    uint8_t checksum; // first 20 bytes
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+} __attribute__((packed));
+
+struct acpi_header {
+    char signature[4];
+    uint32_t length; // header included
+    uint8_t revision;
+    uint8_t checksum; // whole table
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+// MADT ("APIC"): the interrupt controllers and processors of the machine
+struct acpi_madt {
+    struct acpi_header header;
+    uint32_t lapic_address;
+    uint32_t flags; // bit 0: there are 8259 PICs as well
+} __attribute__((packed));
+
+#define MADT_LAPIC 0
+#define MADT_IOAPIC 1
+#define MADT_ISO 2 // interrupt source override
+#define MADT_LAPIC_NMI 4
+
+#define MADT_LAPIC_ENABLED 0x1
+
+// Polarity (bits 0-1) and trigger mode (bits 2-3) of an override, 0 means "as the bus says"
+#define MADT_FLAGS_ACTIVE_LOW 0x3
+#define MADT_FLAGS_LEVEL 0xC
+
+struct madt_entry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct madt_lapic {
+    struct madt_entry entry;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_ioapic {
+    struct madt_entry entry;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base; // first global system interrupt it handles
+} __attribute__((packed));
+
+struct madt_iso {
+    struct madt_entry entry;
+    uint8_t bus; // 0 = ISA
+    uint8_t source; // ISA IRQ
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed));
+
+// Finds the RSDP and RSDT, returns 0, or -1 on a machine without ACPI
+int acpi_init(void);
+
+// Returns the first table with this signature (checksum verified), mapped and readable, or NULL
+const struct acpi_header* acpi_find_table(const char* signature);
+
+#endif
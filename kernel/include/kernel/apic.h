@@ -0,0 +1,96 @@
+#ifndef _KERNEL_APIC_H
+#define _KERNEL_APIC_H
+
+#include <stdint.h>
+
+// Local APIC and IOAPIC
+// apic_init finds them through CPUID and the ACPI MADT. If both are there, the ISA IRQs are routed through the
+// IOAPIC to the same vectors the PIC used (32-47, MADT overrides applied), the PIC is masked for good and an
+// interrupt is acknowledged with a single MMIO write instead of one or two port writes. Without an APIC, or
+// without a MADT, everything stays on the 8259 PIC
+
+#define LAPIC_VECTOR_BASE 0xE0 // vectors from here up are raised by the local APIC itself
+#define LAPIC_TIMER_VECTOR 0xE0
+#define LAPIC_IPI_VECTOR 0xE1 // inter-processor interrupt: wakes a CPU that has work waiting (smp.c)
+#define LAPIC_SPURIOUS_VECTOR 0xFF // needs no EOI
+
+#define MSR_APIC_BASE 0x1B
+#define APIC_BASE_ENABLE (1 << 11)
+
+// Local APIC registers, offsets into its MMIO page
+#define LAPIC_ID 0x020
+#define LAPIC_TPR 0x080
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SVR 0x0F0
+#define LAPIC_ESR 0x280
+#define LAPIC_ICR_LOW 0x300 // interrupt command register, writing the low half sends the IPI
+#define LAPIC_ICR_HIGH 0x310 // bits 24-31: destination APIC id
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_ERROR 0x370
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_SVR_ENABLE 0x100
+#define LAPIC_LVT_MASKED 0x10000
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+#define LAPIC_ICR_INIT 0x500
+#define LAPIC_ICR_STARTUP 0x600 // vector field = page number of the real mode entry point
+#define LAPIC_ICR_PENDING 0x1000 // delivery status: the previous IPI hasn't been accepted yet
+#define LAPIC_ICR_ASSERT 0x4000
+#define LAPIC_ICR_LEVEL 0x8000
+
+// IOAPIC: an index register and a data window
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WINDOW 0x10
+#define IOAPIC_REG_VERSION 0x01 // bits 16-23: number of redirection entries - 1
+#define IOAPIC_REDIRECTION(n) (0x10 + (n) * 2) // low dword, the high one (destination) follows
+
+#define IOAPIC_ACTIVE_LOW (1 << 13)
+#define IOAPIC_LEVEL (1 << 15)
+#define IOAPIC_MASKED (1 << 16)
+
+#define APIC_MAX_CPUS 16
+#define APIC_MAX_IOAPICS 4
+
+struct apic_cpu {
+    uint8_t apic_id;
+    uint8_t processor_id; // ACPI processor id
+};
+
+// Switches interrupt delivery to the APICs if the machine has them and calibrates the LAPIC timer with PIT
+// channel 2. Needs paging for the MMIO mappings. Returns 0 if the APIC path is active, -1 if the PIC stays
+int apic_init(void);
+
+int apic_active(void);
+
+// Per CPU part of the setup: enables the local APIC and programs its LVT entries
+void lapic_init_cpu(void);
+
+uint32_t lapic_id(void);
+
+void lapic_eoi(void);
+
+// Masks / unmasks the IOAPIC entry an ISA IRQ (0-15) is routed to
+void ioapic_mask(uint8_t irq);
+void ioapic_unmask(uint8_t irq);
+
+// Local APIC timer, counting down at the bus clock / 16. Calibrated against PIT channel 2 by apic_init
+uint32_t lapic_timer_khz(void); // counts per millisecond
+void lapic_timer_periodic(uint32_t count); // LAPIC_TIMER_VECTOR every 'count' counts
+void lapic_timer_oneshot(uint32_t count);
+uint32_t lapic_timer_current(void); // counts left until the next interrupt
+
+// Inter-processor interrupts, each waits until the previous one has been accepted
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector); // fixed delivery of 'vector'
+void lapic_send_init(uint32_t apic_id); // resets the target into its wait-for-STARTUP state
+void lapic_send_startup(uint32_t apic_id, uint8_t page); // starts it in real mode at page * 4 KiB
+
+// Processors listed in the MADT (the boot CPU included), for SMP bring-up
+int apic_cpu_count(void);
+const struct apic_cpu* apic_get_cpu(int index);
+
+#endif
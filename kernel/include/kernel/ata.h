@@ -0,0 +1,139 @@
+#ifndef _KERNEL_ATA_H
+#define _KERNEL_ATA_H
+
+#include <stdint.h>
+
+#include <kernel/list.h>
+
+// ATA/IDE disks on the two legacy channels (QEMU's -hda .. -hdd)
+// Drives are identified with polled PIO at boot. Transfers go through a per channel request queue: a command is
+// built from the request at the head and every queued request after it that continues it on disk, so adjacent
+// sectors go out as one command. With a PCI bus master IDE controller (PIIX) the command is a DMA transfer with
+// one PRD entry per buffer piece, otherwise the sectors are moved with rep insw/outsw from the IRQ handler.
+// Either way the command completes on IRQ14/15 and requests are never polled for
+
+#define ATA_SECTOR_SIZE 512
+#define ATA_MAX_DRIVES 4 // primary master, primary slave, secondary master, secondary slave
+#define ATA_MAX_SECTORS 256 // per command, merged requests included (128 KiB)
+#define ATA_TIMEOUT_MS 5000 // a command that hasn't completed by then fails with -EIO and the channel is reset
+
+#define ATA_PRIMARY_IO 0x1F0
+#define ATA_PRIMARY_CTRL 0x3F6
+#define ATA_SECONDARY_IO 0x170
+#define ATA_SECONDARY_CTRL 0x376
+
+// Task file registers, offsets from the I/O base
+#define ATA_REG_DATA 0
+#define ATA_REG_ERROR 1
+#define ATA_REG_COUNT 2
+#define ATA_REG_LBA0 3
+#define ATA_REG_LBA1 4
+#define ATA_REG_LBA2 5
+#define ATA_REG_DRIVE 6
+#define ATA_REG_STATUS 7 // reading it acknowledges the interrupt
+#define ATA_REG_COMMAND 7
+
+#define ATA_STATUS_ERR 0x01
+#define ATA_STATUS_DRQ 0x08
+#define ATA_STATUS_DF 0x20
+#define ATA_STATUS_BSY 0x80
+
+#define ATA_CTRL_NIEN 0x02 // interrupts off
+#define ATA_CTRL_SRST 0x04 // software reset of both drives
+
+#define ATA_CMD_READ_PIO 0x20
+#define ATA_CMD_READ_PIO_EXT 0x24
+#define ATA_CMD_READ_DMA 0xC8
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_PIO 0x30
+#define ATA_CMD_WRITE_PIO_EXT 0x34
+#define ATA_CMD_WRITE_DMA 0xCA
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_FLUSH 0xE7
+#define ATA_CMD_IDENTIFY 0xEC
+
+// Bus master IDE registers, offsets from BAR4 (+8 for the secondary channel)
+#define ATA_BM_COMMAND 0
+#define ATA_BM_STATUS 2
+#define ATA_BM_PRDT 4
+
+#define ATA_BM_CMD_START 0x01
+#define ATA_BM_CMD_READ 0x08 // the controller writes to memory
+#define ATA_BM_STATUS_ERR 0x02
+#define ATA_BM_STATUS_IRQ 0x04
+
+#define ATA_PRD_END 0x8000 // flags of the last PRD entry
+#define ATA_PRD_MAX 512 // entries in the one page PRD table of a channel
+
+struct ata_prd {
+    uint32_t addr; // physical address of the piece, may not cross a 64 KiB boundary
+    uint16_t size; // 0 means 64 KiB
+    uint16_t flags;
+} __attribute__((packed));
+
+struct ata_drive {
+    int present;
+    int lba48;
+    uint32_t sectors; // capacity (only the first 2 TiB of an LBA48 disk is usable)
+    char model[41];
+};
+
+enum ata_op {
+    ATA_READ,
+    ATA_WRITE,
+    ATA_FLUSH, // drive write cache flush, lba / count / buf unused
+};
+
+// One transfer of whole sectors. buf has to be physically contiguous and 2 byte aligned: kmalloc and pmm memory
+// is, since all RAM is identity mapped
+struct ata_request {
+    struct list_node node; // channel queue, then the command it is part of
+    uint8_t drive;
+    enum ata_op op;
+    uint32_t lba;
+    uint32_t count; // sectors, at most ATA_MAX_SECTORS
+    void* buf;
+    volatile int done; // set once status is final
+    int status; // 0 or -errno
+    void (*complete)(struct ata_request* req); // optional, called from the IRQ handler with interrupts disabled
+    void* ctx; // for the owner of the request
+};
+
+struct ata_stats {
+    uint32_t commands;
+    uint32_t requests;
+    uint32_t merged; // requests that went out as part of a command started for an earlier one
+    uint32_t dma_commands;
+    uint32_t sectors_read;
+    uint32_t sectors_written;
+    uint32_t errors;
+    uint32_t timeouts;
+};
+
+// Finds the bus master controller and identifies the drives, needs the timer. Returns the number of drives found
+int ata_init(void);
+
+const struct ata_drive* ata_get_drive(int drive); // NULL if there is no such drive
+
+// Queues a request without starting the channel, so several requests can be queued and merged before ata_start.
+// Returns -EINVAL / -ENODEV right away (without calling complete) if the request can't be valid
+int ata_queue(struct ata_request* req);
+
+// Starts the channel of 'drive' if it is idle
+void ata_start(int drive);
+
+// Blocks until a queued request is done and returns its status. Interrupts have to be enabled
+int ata_wait(struct ata_request* req);
+
+// Synchronous read / write of 'count' sectors (queue, start, wait), returns 0 or -errno
+int ata_read(int drive, uint32_t lba, uint32_t count, void* buf);
+int ata_write(int drive, uint32_t lba, uint32_t count, const void* buf);
+int ata_flush(int drive);
+
+// DMA is used whenever the controller supports it, turning it off forces PIO (for comparisons)
+int ata_dma_available(void);
+void ata_set_dma(int enable);
+
+void ata_get_stats(struct ata_stats* stats);
+
+#endif
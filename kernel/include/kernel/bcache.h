@@ -0,0 +1,67 @@
+#ifndef _KERNEL_BCACHE_H
+#define _KERNEL_BCACHE_H
+
+#include <stdint.h>
+
+#include <kernel/ata.h>
+#include <kernel/list.h>
+
+// Write-back block cache in front of the ATA driver
+// Blocks are 4 KiB (8 sectors), each buffer is its own page. Lookups go through a hash of (drive, block), and
+// every buffer sits on an LRU list that eviction takes the least recently used unreferenced buffer from.
+// Modified blocks are only written when they get evicted, on bcache_sync, and every BCACHE_FLUSH_MS by the
+// kworker. A miss right after the previous block of the same drive reads ahead, and since the read ahead
+// blocks are queued together they reach the disk as one DMA command
+
+#define BCACHE_BLOCK_SIZE 4096
+#define BCACHE_SECTORS (BCACHE_BLOCK_SIZE / ATA_SECTOR_SIZE)
+#define BCACHE_BLOCKS 256 // 1 MiB of cache
+#define BCACHE_HASH_BUCKETS 64
+#define BCACHE_READAHEAD 32 // blocks per sequential miss, 128 KiB = one full size ATA command
+#define BCACHE_FLUSH_MS 5000
+
+#define BUF_VALID 0x1 // data matches the disk (or is newer)
+#define BUF_DIRTY 0x2 // has to be written back
+#define BUF_BUSY 0x4 // I/O in flight, wait for it before touching data
+
+struct buf {
+    uint8_t drive;
+    uint32_t block;
+    volatile uint32_t flags;
+    uint32_t refs; // bread without brelse yet, an unreferenced buffer can be evicted
+    uint8_t* data; // BCACHE_BLOCK_SIZE bytes
+    struct buf* hash_next;
+    struct list_node lru; // head = most recently used
+    struct ata_request req;
+};
+
+struct bcache_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t readahead; // blocks read ahead of a sequential miss
+    uint32_t writebacks; // blocks written to the disk
+    uint32_t evictions;
+    uint32_t errors;
+};
+
+// Allocates the buffers, needs the pmm. The periodic write-back starts with the workqueue
+void bcache_init(void);
+
+// Returns the block with valid data and a reference held, or NULL on an I/O error or a block past the end of the
+// drive. Blocks, so only for threads
+struct buf* bread(int drive, uint32_t block);
+
+// Marks a referenced buffer modified, call after changing b->data
+void bdirty(struct buf* b);
+
+void brelse(struct buf* b);
+
+// Writes back every dirty block (of 'drive', or of all drives for -1) and waits for it, 0 or -EIO
+int bcache_sync(int drive);
+
+// Syncs and then drops every unreferenced block of 'drive' from the cache, so the next reads come from the disk
+int bcache_invalidate(int drive);
+
+void bcache_get_stats(struct bcache_stats* stats);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _KERNEL_BENCH_H
+#define _KERNEL_BENCH_H
+
+#include <stdint.h>
+
+// Microbenchmarks and self tests
+// Both are always compiled in. A kernel built with -DKERNEL_BENCH (make BENCH=1, see bench.sh) runs them all at
+// boot instead of starting the shell, prints the results on the console in a line format meant for scripts:
+//   BENCH <name> ops=<n> bytes=<n> cycles=<n> ns_per_op=<n> mb_per_s=<n>
+//   TEST <name> PASS|FAIL
+// and then exits QEMU through the isa-debug-exit device with the number of failed tests. Benchmarks and tests that
+// didn't fit in the tables are logged and count as failures
+
+#define BENCH_MAX 48
+#define SELFTEST_MAX 32
+
+#define QEMU_DEBUG_EXIT_PORT 0xF4 // -device isa-debug-exit,iobase=0xf4,iosize=0x04
+
+struct bench_result {
+    uint64_t ops; // operations done, for ns_per_op
+    uint64_t bytes; // bytes processed, for mb_per_s (0 if it doesn't apply)
+    uint64_t cycles; // TSC cycles the operations took
+};
+
+typedef void (*bench_fn)(struct bench_result* result);
+typedef int (*selftest_fn)(void); // 0 = pass
+
+void bench_register(const char* name, bench_fn fn);
+void selftest_register(const char* name, selftest_fn fn);
+
+// Runs one benchmark (or all of them for NULL) and prints its result line, -1 if there is none with that name
+int bench_run(const char* name);
+
+// Prints the names of the registered benchmarks on one line
+void bench_list(void);
+
+// Runs every self test, returns the number of failures
+int selftest_run_all(void);
+
+// Registers the built-in benchmarks and tests, called once at boot
+void bench_init(void);
+
+// Thread body of the KERNEL_BENCH variant: tests, benchmarks, then qemu_exit. Halts the CPU if QEMU didn't go away
+__attribute__((noreturn)) void bench_main(void* arg);
+
+// Leaves QEMU with exit status (code << 1) | 1. Without the isa-debug-exit device this does nothing and returns
+void qemu_exit(uint8_t code);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _KERNEL_BOOTTRACE_H
+#define _KERNEL_BOOTTRACE_H
+
+#include <stdint.h>
+
+#include <kernel/cpu.h>
+
+// Boot time instrumentation: _start in boot.S stamps the TSC first thing, and every init stage in kernel_main is
+// wrapped in BOOT_STAGE, which records its start and end. boot_trace_report prints the table once the TSC is
+// calibrated, so stamps are taken as raw cycles and only converted at the end
+
+#define BOOT_STAGE_MAX 32
+
+// Runs 'call' (any statement, e.g. an assignment) as the boot stage 'name'
+#define BOOT_STAGE(name, call)                                \
+    do {                                                      \
+        uint64_t __stage_start = rdtsc();                     \
+        call;                                                 \
+        boot_trace_record(name, __stage_start, rdtsc());      \
+    } while (0)
+
+extern uint64_t boot_tsc; // boot.S, TSC at _start
+
+void boot_trace_record(const char* name, uint64_t start, uint64_t end);
+
+// Prints every stage with its offset from _start and its duration
+void boot_trace_report(void);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef _KERNEL_CLOCK_H
+#define _KERNEL_CLOCK_H
+
+#include <stdint.h>
+
+// Nanosecond clocks on top of the calibrated TSC (tsc.h). The monotonic clock counts from clock_init and never
+// jumps. The realtime clock is the wall clock: the CMOS RTC read at boot, pinned to the exact second boundary by
+// the first RTC update interrupt. Reading either is an rdtsc, two multiplies and a shift, without a lock or any
+// port I/O, so it is fine from interrupts and on any CPU (the TSCs of all CPUs are assumed to run in sync)
+
+// After tsc_calibrate and apic_init (an IRQ8 raised on the PIC would be lost in the switch to the IOAPIC).
+// Returns -1 if the RTC couldn't be read, the wall clock starts at the epoch then
+int clock_init(void);
+
+uint64_t clock_monotonic_ns(void); // since clock_init
+uint64_t clock_realtime_ns(void); // since 1970-01-01 00:00:00 UTC
+
+// True once the RTC interrupt pinned the wall clock, before that it can be up to a second behind
+int clock_realtime_exact(void);
+
+#endif
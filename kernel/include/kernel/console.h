@@ -0,0 +1,24 @@
+#ifndef _KERNEL_CONSOLE_H
+#define _KERNEL_CONSOLE_H
+
+#include <stddef.h>
+
+// Routes stdout / stderr to the VGA terminal, the serial port or both
+
+#define CONSOLE_VGA (1 << 0)
+#define CONSOLE_SERIAL (1 << 1)
+
+#ifndef CONSOLE_DEFAULT
+#define CONSOLE_DEFAULT (CONSOLE_VGA | CONSOLE_SERIAL)
+#endif
+
+// Picks up "console=vga", "console=serial" or "console=both" from the kernel command line (applies to fd 1 and 2)
+void console_parse_cmdline(const char* cmdline);
+
+void console_set_route(int fd, int targets);
+int console_get_route(int fd);
+
+// Returns -1 for file descriptors that aren't console outputs
+int console_write(int fd, const char* data, size_t size);
+
+#endif
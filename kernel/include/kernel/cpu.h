@@ -0,0 +1,125 @@
+#ifndef _KERNEL_CPU_H
+#define _KERNEL_CPU_H
+
+#include <stdint.h>
+
+// Small inline helpers around privileged x86 instructions
+
+// CPUID leaf 1 feature bits (EDX)
+#define CPUID_EDX_PSE (1 << 3)  // 4 MiB pages
+#define CPUID_EDX_MSR (1 << 5) // rdmsr/wrmsr
+#define CPUID_EDX_APIC (1 << 9) // on-chip local APIC
+#define CPUID_EDX_SEP (1 << 11) // sysenter/sysexit
+#define CPUID_EDX_PGE (1 << 13) // global pages
+#define CPUID_EDX_FXSR (1 << 24) // fxsave/fxrstor
+#define CPUID_EDX_SSE (1 << 25)
+#define CPUID_EDX_SSE2 (1 << 26)
+
+// Control register bits
+#define CR0_MP (1 << 1) // wait/fwait honor TS
+#define CR0_EM (1 << 2) // no FPU, every FPU/SSE instruction raises #UD
+#define CR0_TS (1 << 3) // task switched, the next FPU/SSE instruction raises #NM
+#define CR0_NE (1 << 5) // native x87 error reporting (#MF instead of IRQ13)
+#define CR0_WP (1 << 16) // honor read-only pages in ring 0 too
+#define CR0_PG (1u << 31) // paging enable
+#define CR4_PSE (1 << 4)
+#define CR4_PGE (1 << 7)
+#define CR4_OSFXSR (1 << 9) // OS saves SSE state with fxsave, enables SSE instructions
+#define CR4_OSXMMEXCPT (1 << 10) // unmasked SSE exceptions raise #XM
+
+#define EFLAGS_IF (1 << 9) // interrupts enabled
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx)
+{
+    __asm__ volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+// Model specific registers
+#define MSR_SYSENTER_CS 0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+static inline uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t low, high;
+    __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline uint32_t read_cr0(void)
+{
+    uint32_t value;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(uint32_t value)
+{
+    __asm__ volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline uint32_t read_cr2(void) // faulting address after a page fault
+{
+    uint32_t value;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+static inline uint32_t read_cr3(void)
+{
+    uint32_t value;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr3(uint32_t value) // also flushes every non-global TLB entry
+{
+    __asm__ volatile("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+static inline uint32_t read_cr4(void)
+{
+    uint32_t value;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(uint32_t value)
+{
+    __asm__ volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+// Time stamp counter, counts CPU cycles since reset
+static inline uint64_t rdtsc(void)
+{
+    uint32_t low, high;
+    __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Drops the TLB entry for a single page (or the 4 MiB page containing addr)
+static inline void invlpg(uint32_t addr)
+{
+    __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+// Disables interrupts and returns the previous EFLAGS so the caller can restore them (safe to nest)
+static inline uint32_t irq_save(void)
+{
+    uint32_t flags;
+    __asm__ volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Re-enables interrupts only if they were enabled when irq_save was called
+static inline void irq_restore(uint32_t flags)
+{
+    __asm__ volatile("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+#endif
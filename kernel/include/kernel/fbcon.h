@@ -0,0 +1,65 @@
+#ifndef _KERNEL_FBCON_H
+#define _KERNEL_FBCON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kernel/multiboot.h>
+
+// Framebuffer console
+// When GRUB switched to the linear framebuffer mode boot.S asks for, the terminal's character cells (the same
+// char + VGA attribute pairs text mode uses) are drawn into it with an 8x16 font. tty.c keeps working on cells and
+// tells fbcon what changed; nothing reaches the screen until fbcon_flush, which only draws the cells that differ
+// from what is already there. Glyphs are expanded to pixels once per character and color pair and kept in a cache,
+// scrolling moves the pixels with memmove and clears the new rows with span fills. Only 32 bits per pixel is
+// supported, anything else stays on VGA text mode
+
+#define FBCON_MAX_COLUMNS 240 // 1920 pixels
+#define FBCON_MAX_ROWS 96 // 1536 pixels
+#define FBCON_GLYPH_CACHE 256 // power of two, 512 bytes each
+
+struct fbcon_info {
+    uint32_t phys; // framebuffer address
+    uint32_t size; // bytes, pitch * height
+    uint32_t width; // pixels
+    uint32_t height;
+    uint32_t pitch; // bytes per pixel row
+    uint32_t columns; // character cells
+    uint32_t rows;
+    int bios_font; // 1 if the glyphs came from the video BIOS, 0 for the built-in ASCII font
+};
+
+struct fbcon_stats {
+    uint64_t flushes;
+    uint64_t cells_drawn; // glyphs copied to the framebuffer
+    uint64_t cells_filled; // blank cells cleared with span fills instead
+    uint64_t glyph_misses; // glyph cache misses, each one expands a glyph
+    uint64_t scrolls; // rows moved with memmove instead of being redrawn
+};
+
+// Takes over the framebuffer GRUB describes in the multiboot info. Returns 0 if the console now draws there,
+// -1 if there is none (or it has an unsupported format) and the terminal stays in VGA text mode.
+// Runs before paging, paging_init maps the framebuffer
+int fbcon_init(const struct multiboot_info* mbi);
+
+int fbcon_active(void);
+void fbcon_get_info(struct fbcon_info* info);
+void fbcon_get_stats(struct fbcon_stats* stats);
+
+// For tty.c, called with interrupts off. Cell positions are counted from the top left corner of the screen
+
+// Cells [from, to) changed
+void fbcon_dirty(size_t from, size_t to);
+
+// The text moved up a row and the new bottom row is all 'blank'
+void fbcon_scroll(uint16_t blank);
+
+// The screen shows something else entirely (the scrollback), compare every cell on the next flush
+void fbcon_invalidate(void);
+
+void fbcon_set_cursor(size_t x, size_t y, int visible);
+
+// Draws the changes since the last flush. 'cells' is the first cell of the screen, columns * rows of them
+void fbcon_flush(const uint16_t* cells);
+
+#endif
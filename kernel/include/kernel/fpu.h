@@ -0,0 +1,52 @@
+#ifndef _KERNEL_FPU_H
+#define _KERNEL_FPU_H
+
+#include <stdint.h>
+
+#include <kernel/cpu.h>
+
+// x87/SSE setup and lazy FPU switching
+// The FPU registers belong to one thread at a time (the owner). A context switch only sets CR0.TS, and the first
+// FPU/SSE instruction of the next thread raises #NM, which saves the owner's registers and loads the new thread's.
+// Threads that never touch the FPU never trap. Every thread gets its save area when it is created: the trap can hit
+// anywhere, the allocator included, so it never allocates. IRQ handlers must not use the FPU at all
+
+#define FPU_HAS_FPU (1 << 0)
+#define FPU_HAS_FXSR (1 << 1)
+#define FPU_HAS_SSE (1 << 2)
+#define FPU_HAS_SSE2 (1 << 3)
+
+#define FPU_STATE_SIZE 512 // fxsave area, fnsave only needs the first 108 bytes
+
+struct thread;
+
+struct fpu_stats {
+    uint32_t switches; // context switches
+    uint32_t owner_kept; // switches back to the thread whose state was still loaded: no trap, no save
+    uint32_t traps; // #NM
+    uint32_t saves; // owner state written to memory
+    uint32_t restores; // state loaded, the initial state for a thread's first use
+};
+
+// Reads the CPUID feature bits, turns on the FPU and, if the CPU has them, SSE/fxsave (CR4.OSFXSR/OSXMMEXCPT).
+// Also installs the #NM handler
+void fpu_init(void);
+
+// The same for another CPU (smp.c), using what fpu_init found out. The lazy switching only happens on the boot
+// CPU, the others don't run threads and keep CR0.TS clear
+void fpu_init_cpu(void);
+
+uint32_t fpu_features(void); // FPU_HAS_* bits, 0 before fpu_init
+
+// Called by the scheduler with interrupts off whenever 'next' is about to run instead of another thread
+void fpu_switch(struct thread* next);
+
+// Gives a new thread its save area, holding the clean initial state. -1 if memory ran out
+int fpu_thread_init(struct thread* thread);
+
+// Forgets a thread that has exited and frees its save area
+void fpu_release(struct thread* thread);
+
+void fpu_get_stats(struct fpu_stats* stats);
+
+#endif
@@ -21,7 +21,52 @@ struct gdt_ptr {
     uint32_t base;                // The address of the first gdt_entry_t struct.
 } __attribute__((packed));
 
-// Function to be called from kernel_main
+// Task state segment. The main one only uses esp0/ss0: the stack the CPU switches to when an interrupt or system
+// call arrives while user code runs. The only hardware task switch is the double fault's (double_fault_tss)
+struct tss_entry {
+    uint32_t prev_tss;
+    uint32_t esp0;
+    uint32_t ss0;
+    uint32_t esp1;
+    uint32_t ss1;
+    uint32_t esp2;
+    uint32_t ss2;
+    uint32_t cr3;
+    uint32_t eip;
+    uint32_t eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs;
+    uint32_t ldt;
+    uint16_t trap;
+    uint16_t iomap_base; // past the end of the TSS: no I/O permission bitmap, every port access from ring 3 faults
+} __attribute__((packed));
+
+// Segment selectors, the user ones with RPL 3. SYSENTER/SYSEXIT rely on this exact order: kernel code, kernel data,
+// user code, user data
+#define KERNEL_CS 0x08
+#define KERNEL_DS 0x10
+#define USER_CS 0x1B
+#define USER_DS 0x23
+#define TSS_SELECTOR 0x28
+#define PERCPU_SELECTOR 0x30 // %gs in the kernel, based at the running CPU's struct cpu (smp.h)
+#define DOUBLE_FAULT_TSS_SELECTOR 0x38 // the task gate for #DF switches to it (idt.c)
+
+#define GDT_ENTRIES 8
+
+extern struct tss_entry tss;
+extern struct tss_entry double_fault_tss; // idt.c fills in where the task starts, paging_init its CR3
+
+// Function to be called from kernel_main, before anything uses this_cpu(): points %gs at the boot CPU's data
 void gdt_install(void);
 
+// Loads a copy of the boot GDT on an application processor, with the per-CPU segment based at 'percpu' instead.
+// The copy has no TSS, the other CPUs never run user code
+void gdt_install_cpu(struct gdt_entry* table, struct gdt_ptr* ptr, uint32_t percpu, uint32_t size);
+
+// Sets the stack the next ring 3 -> ring 0 transition lands on (the running thread's kernel stack top)
+static inline void tss_set_kernel_stack(uint32_t esp0)
+{
+    tss.esp0 = esp0;
+}
+
 #endif
\ No newline at end of file
@@ -41,12 +41,58 @@ struct interrupt_frame {
     uint32_t eflags;      // EFLAGS register
 } __attribute__((packed));
 
+// Hardware IRQs 0-15 are remapped to vectors 32-47
+#define IRQ_BASE 32
+#define IRQ_COUNT 16
+#define IRQ_VECTOR(irq) (IRQ_BASE + (irq))
+
+#define TEST_VECTOR 48 // free software interrupt vector (int $0x30) for measuring the bare interrupt path
+
+// Called with interrupts disabled. IRQ handlers don't send the EOI themselves, isr_handler does that after they return
+typedef void (*irq_handler_t)(struct interrupt_frame* frame, void* ctx);
+
+struct irq_stats {
+    uint64_t count;
+    uint64_t cycles; // rdtsc cycles, dispatch and EOI included
+};
+
 // Function to initialize idt from kernel_main
 void idt_install(void);
 
-// High-level interrupt handler
-void isr_handler(struct interrupt_frame *frame);
+// Loads the IDT idt_install built on another CPU
+void idt_load(void);
+
+// Installs the handler for a vector (exception, IRQ or software interrupt), one handler per vector.
+// Registering an IRQ vector also unmasks the line on the PIC. Returns -1 if the vector is taken
+int irq_register(uint8_t vector, irq_handler_t handler, void* ctx);
+void irq_unregister(uint8_t vector);
+
+void irq_mask(uint8_t irq); // irq is the ISA line (0-15), not the vector
+void irq_unmask(uint8_t irq);
+
+// Called by apic_init: masks the PIC and routes the ISA IRQs through the IOAPIC from now on, IRQs that already
+// have a handler are unmasked there
+void irq_use_apic(void);
+
+void irq_get_stats(uint8_t vector, struct irq_stats* stats);
+const char* irq_vector_name(uint8_t vector);
+
+// The end for an exception nobody could handle: kills a user program, stops the kernel otherwise
+__attribute__((noreturn)) void exception_fatal(struct interrupt_frame* frame);
+
+// High-level interrupt handler, returns the frame isr_common_handler should resume (a different one after a context switch)
+struct interrupt_frame* isr_handler(struct interrupt_frame *frame);
+
+// True while an IRQ handler is running on this CPU, code that may block or switch threads must check this
+int in_interrupt(void);
 
 void outb(uint16_t port, uint8_t value);
+uint8_t inb(uint16_t port);
+void outw(uint16_t port, uint16_t value);
+uint16_t inw(uint16_t port);
+void outl(uint16_t port, uint32_t value);
+uint32_t inl(uint16_t port);
+void insw(uint16_t port, void* buf, uint32_t count);
+void outsw(uint16_t port, const void* buf, uint32_t count);
 
 #endif
\ No newline at end of file
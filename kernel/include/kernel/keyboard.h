@@ -0,0 +1,26 @@
+#ifndef _KERNEL_KEYBOARD_H
+#define _KERNEL_KEYBOARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// PS/2 keyboard driver
+// IRQ1 only reads the scancode and pushes it into a lock-free single producer / single consumer ring. Decoding,
+// echo and line editing happen later on the kworker thread, finished lines are handed to read() on fd 0
+
+struct keyboard_stats {
+    uint32_t scancodes; // scancodes received by the IRQ handler
+    uint32_t dropped; // scancodes lost because the ring was full
+    uint32_t lines_dropped; // finished lines lost because nobody was reading
+};
+
+// Registers the IRQ1 handler, call after workqueue_init
+void keyboard_init(void);
+
+// Blocks until a line has been typed, then returns up to 'len' bytes of it (including the '\n').
+// Returns 0 when called from a context that can't block
+int keyboard_read(char* buf, size_t len);
+
+void keyboard_get_stats(struct keyboard_stats* stats);
+
+#endif
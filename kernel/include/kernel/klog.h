@@ -0,0 +1,66 @@
+#ifndef _KERNEL_KLOG_H
+#define _KERNEL_KLOG_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernel log
+// kprintf formats straight into a slot of a fixed ring of records (timestamp, level, CPU, text), no locks and no
+// newlib: a writer reserves the next sequence number with one atomic add and marks the slot complete when done, so
+// IRQ handlers and other CPUs can log at any time. The console gets the records later from the kworker; during
+// boot (until klog_start) they are printed right away, in order with everything else. The ring keeps the last
+// KLOG_RECORDS messages for dmesg, whatever has scrolled off the screen
+
+#define KLOG_RECORDS 1024 // power of two
+#define KLOG_TEXT_MAX 112 // longer messages are cut, the record is 128 bytes
+#define KLOG_POLL_MS 100 // how late a message logged on another CPU may reach the console
+
+enum klog_level {
+    KLOG_ERR = 0,
+    KLOG_WARN = 1,
+    KLOG_INFO = 2,
+    KLOG_DEBUG = 3 // only kept in the ring, never printed on the console
+};
+
+struct klog_entry {
+    uint32_t seq;
+    uint64_t tsc; // when it was logged
+    uint8_t level;
+    uint8_t cpu;
+    uint8_t length;
+    char text[KLOG_TEXT_MAX];
+};
+
+struct klog_stats {
+    uint32_t records; // logged since boot
+    uint32_t truncated; // didn't fit into KLOG_TEXT_MAX
+    uint32_t lost; // overwritten before they reached the console
+};
+
+// The freestanding formatter behind kprintf: %d %i %u %x %X %p %s %c %% with '-', '0', width, precision (for %s)
+// and the l, ll, z and h length modifiers. Returns the length the whole output would have had, like vsnprintf
+int kvsnprintf(char* buf, size_t size, const char* fmt, va_list args);
+int ksnprintf(char* buf, size_t size, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+
+int klog(enum klog_level level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+int kprintf(const char* fmt, ...) __attribute__((format(printf, 1, 2))); // KLOG_INFO
+
+// Starts draining to the console on the kworker (needs workqueue_init), call when the boot output is done
+void klog_start(void);
+
+// Writes every complete record that hasn't been printed yet to the console, in the caller's context
+void klog_flush(void);
+
+// The same for a dying kernel: doesn't care whether a drain was interrupted halfway
+void klog_panic(void);
+
+// Sequence number the next record will get; records from klog_seq() - KLOG_RECORDS on may still be in the ring
+uint32_t klog_seq(void);
+
+// Copies record 'seq' out of the ring. Returns 0, or -1 if it's been overwritten or isn't complete yet
+int klog_get(uint32_t seq, struct klog_entry* entry);
+
+void klog_get_stats(struct klog_stats* stats);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef _KERNEL_KMALLOC_H
+#define _KERNEL_KMALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernel heap: small objects (16 B - 2 KiB) come from per size class slabs, anything bigger is
+// page granular and comes straight from the physical memory manager (page aligned)
+// Build with -DKMALLOC_DEBUG to surround every small object with redzones that are checked on kfree
+
+#define KMALLOC_MIN_SIZE 16
+#define KMALLOC_MAX_SMALL 2048
+#define KMALLOC_CLASSES 8 // 16, 32, 64, ... 2048
+
+struct kmalloc_stats {
+    uint32_t allocs;       // successful kmalloc calls
+    uint32_t frees;        // kfree calls
+    uint32_t failures;     // kmalloc calls that returned NULL
+    size_t bytes_in_use;   // usable bytes currently handed out
+    size_t high_water;     // largest bytes_in_use seen
+    size_t slab_pages;     // frames owned by slabs
+    size_t large_pages;    // frames owned by large allocations
+};
+
+void* kmalloc(size_t size);
+void* kzalloc(size_t size);
+void* krealloc(void* ptr, size_t size);
+void kfree(void* ptr);
+
+// Number of bytes that can actually be used at ptr (the size class, or the whole pages for large allocations)
+size_t kmalloc_usable_size(void* ptr);
+
+void kmalloc_get_stats(struct kmalloc_stats* stats);
+
+#endif
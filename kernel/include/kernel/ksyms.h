@@ -0,0 +1,23 @@
+#ifndef _KERNEL_KSYMS_H
+#define _KERNEL_KSYMS_H
+
+#include <stdint.h>
+
+// Kernel symbol table for turning code addresses into function names
+// The table is generated at build time from `nm -n nue_kernel.kernel` (see gensyms.sh and the Makefile) and
+// linked into the final image; a kernel linked without it simply has no symbols
+
+struct ksym {
+    uint32_t addr;
+    const char* name;
+};
+
+// Returns the function containing 'addr' and the offset into it, or NULL if the address isn't known
+const char* ksym_lookup(uint32_t addr, uint32_t* offset);
+
+// Index of the symbol containing 'addr' in the table, -1 if none, for callers that aggregate per function
+int ksym_index(uint32_t addr);
+const struct ksym* ksym_get(int index);
+uint32_t ksym_count(void);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef _KERNEL_LIST_H
+#define _KERNEL_LIST_H
+
+#include <stddef.h>
+
+// Intrusive circular doubly linked list: embed a struct list_node in an object and use container_of to
+// get back to the object. A list head is just a node that points at itself when the list is empty
+
+struct list_node {
+    struct list_node* next;
+    struct list_node* prev;
+};
+
+#define container_of(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+
+static inline void list_init(struct list_node* head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static inline int list_empty(const struct list_node* head)
+{
+    return head->next == head;
+}
+
+static inline void list_insert_between(struct list_node* node, struct list_node* prev, struct list_node* next)
+{
+    node->prev = prev;
+    node->next = next;
+    prev->next = node;
+    next->prev = node;
+}
+
+static inline void list_add_head(struct list_node* head, struct list_node* node)
+{
+    list_insert_between(node, head, head->next);
+}
+
+static inline void list_add_tail(struct list_node* head, struct list_node* node)
+{
+    list_insert_between(node, head->prev, head);
+}
+
+// Unlinks a node and points it at itself, so removing it twice is harmless
+static inline void list_remove(struct list_node* node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = node;
+    node->prev = node;
+}
+
+// Moves every node from src to the tail of dst, leaving src empty
+static inline void list_splice_tail(struct list_node* dst, struct list_node* src)
+{
+    if (list_empty(src)) {
+        return;
+    }
+    src->next->prev = dst->prev;
+    dst->prev->next = src->next;
+    src->prev->next = dst;
+    dst->prev = src->prev;
+    list_init(src);
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef _KERNEL_MEMOPS_H
+#define _KERNEL_MEMOPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The kernel's memcpy/memset/memmove (they replace newlib's, which copy a byte or a word at a time)
+// Copies below MEMOPS_REP_MIN bytes are done inline byte by byte, up to MEMOPS_BULK_MIN with rep movsl/stosl,
+// and anything bigger with the bulk variant memops_init picks from the CPUID bits (SSE2 if the CPU has it)
+// IRQ handlers never get the SSE variant: the XMM registers hold the interrupted thread's state (see fpu.h)
+
+// GCC turns plain copy loops into memcpy/memset calls. Functions that must not end up in memops (the variants
+// themselves, and code that runs before %gs points at the per-CPU data memcpy reads) are marked with this
+#define NO_LIBCALLS __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+#define MEMOPS_REP_MIN 16
+#define MEMOPS_BULK_MIN 256
+
+typedef void* (*memcpy_fn)(void* dst, const void* src, size_t size);
+typedef void* (*memset_fn)(void* dst, int value, size_t size);
+typedef void* (*memmove_fn)(void* dst, const void* src, size_t size);
+
+struct memops {
+    const char* name;
+    uint32_t requires; // FPU_HAS_* bits the variant needs
+    memcpy_fn memcpy;
+    memset_fn memset;
+    memmove_fn memmove;
+};
+
+// Picks the bulk variant, call after fpu_init. Until then every copy uses rep movs
+void memops_init(void);
+
+const struct memops* memops_current(void);
+
+// Variant by name ("scalar", "rep", "sse2"), NULL if there is none or the CPU can't run it
+const struct memops* memops_find(const char* name);
+
+// Compares every variant against a byte by byte reference over a range of sizes and alignments,
+// returns 0 if they all agree and nothing outside the destination was touched
+int memops_selftest(void);
+
+#endif
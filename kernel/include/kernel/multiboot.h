@@ -0,0 +1,72 @@
+#ifndef _KERNEL_MULTIBOOT_H
+#define _KERNEL_MULTIBOOT_H
+
+#include <stdint.h>
+
+// Multiboot (version 1) information structure that GRUB leaves in memory and passes in %ebx
+// Only the fields marked valid by 'flags' can be trusted
+
+#define MULTIBOOT_INFO_MEMORY      (1 << 0)  // mem_lower / mem_upper are valid
+#define MULTIBOOT_INFO_CMDLINE     (1 << 2)  // cmdline is valid
+#define MULTIBOOT_INFO_MODS        (1 << 3)  // mods_count / mods_addr are valid
+#define MULTIBOOT_INFO_MEM_MAP     (1 << 6)  // mmap_length / mmap_addr are valid
+#define MULTIBOOT_INFO_FRAMEBUFFER (1 << 12) // framebuffer_* fields are valid
+
+#define MULTIBOOT_MEMORY_AVAILABLE        1 // usable RAM
+#define MULTIBOOT_MEMORY_RESERVED         2
+#define MULTIBOOT_MEMORY_ACPI_RECLAIMABLE 3
+#define MULTIBOOT_MEMORY_NVS              4
+#define MULTIBOOT_MEMORY_BADRAM           5
+
+#define MULTIBOOT_FRAMEBUFFER_INDEXED  0 // palette based
+#define MULTIBOOT_FRAMEBUFFER_RGB      1 // direct color, color_info has the position and size of each channel
+#define MULTIBOOT_FRAMEBUFFER_EGA_TEXT 2 // still in text mode
+
+struct multiboot_info {
+    uint32_t flags;             // which of the fields below are present
+    uint32_t mem_lower;         // KiB of memory below 1 MiB
+    uint32_t mem_upper;         // KiB of memory above 1 MiB
+    uint32_t boot_device;
+    uint32_t cmdline;           // physical address of the kernel command line (C string)
+    uint32_t mods_count;        // number of boot modules loaded
+    uint32_t mods_addr;         // physical address of the first struct multiboot_module
+    uint32_t syms[4];           // a.out / ELF symbol info (unused)
+    uint32_t mmap_length;       // size of the memory map buffer in bytes
+    uint32_t mmap_addr;         // physical address of the first struct multiboot_mmap_entry
+    uint32_t drives_length;
+    uint32_t drives_addr;
+    uint32_t config_table;
+    uint32_t boot_loader_name;
+    uint32_t apm_table;
+    uint32_t vbe_control_info;
+    uint32_t vbe_mode_info;
+    uint16_t vbe_mode;
+    uint16_t vbe_interface_seg;
+    uint16_t vbe_interface_off;
+    uint16_t vbe_interface_len;
+    uint64_t framebuffer_addr;
+    uint32_t framebuffer_pitch;
+    uint32_t framebuffer_width;
+    uint32_t framebuffer_height;
+    uint8_t  framebuffer_bpp;
+    uint8_t  framebuffer_type;
+    uint8_t  color_info[6];     // RGB: red position, red size, green position, green size, blue position, blue size
+} __attribute__((packed));
+
+// One entry of the BIOS (e820) memory map. 'size' does not count itself, so the next entry is at (addr + size + 4)
+struct multiboot_mmap_entry {
+    uint32_t size;
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+} __attribute__((packed));
+
+// A boot module (e.g. an initrd) GRUB loaded into memory for us
+struct multiboot_module {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t cmdline;
+    uint32_t reserved;
+} __attribute__((packed));
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef _KERNEL_PAGING_H
+#define _KERNEL_PAGING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Page directory / page table entry flags
+#define PAGE_PRESENT  0x001
+#define PAGE_WRITE    0x002
+#define PAGE_USER     0x004
+#define PAGE_PWT      0x008 // write-through
+#define PAGE_PCD      0x010 // cache disable
+#define PAGE_ACCESSED 0x020
+#define PAGE_DIRTY    0x040
+#define PAGE_LARGE    0x080 // PDE only: maps a 4 MiB page directly (PSE)
+#define PAGE_GLOBAL   0x100 // survives CR3 reloads
+#define PAGE_UNCACHED (PAGE_PCD | PAGE_PWT) // for memory mapped IO
+
+#define LARGE_PAGE_SIZE 0x400000 // 4 MiB
+
+// Builds the kernel page directory and turns paging on. Physical RAM is identity mapped with 4 MiB
+// pages, the first 4 MiB uses 4 KiB pages so page 0 can stay unmapped and VGA memory can be uncached
+void paging_init(void);
+
+// Maps [virt, virt + size) to [phys, phys + size). 4 MiB pages are used wherever both addresses are
+// 4 MiB aligned and the range allows it, 4 KiB pages otherwise. Returns 0, or -1 if a page table couldn't be allocated
+int paging_map(uint32_t virt, uint32_t phys, size_t size, uint32_t flags);
+
+// Removes mappings, large pages that are only partially covered get split first
+int paging_unmap(uint32_t virt, size_t size);
+
+// Changes the flags of existing mappings (e.g. make a range read-only), the physical addresses stay the same
+int paging_protect(uint32_t virt, size_t size, uint32_t flags);
+
+// Looks up a virtual address, returns 0 and fills phys / flags if it is mapped, -1 if not
+int paging_query(uint32_t virt, uint32_t* phys, uint32_t* flags);
+
+// Identity maps a device's registers as uncached 4 KiB pages and returns a pointer to them
+void* paging_map_mmio(uint32_t phys, size_t size);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef _KERNEL_PCI_H
+#define _KERNEL_PCI_H
+
+#include <stdint.h>
+
+// PCI configuration space through the legacy 0xCF8/0xCFC mechanism (configuration mechanism #1)
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+// Configuration header offsets
+#define PCI_VENDOR_ID 0x00
+#define PCI_DEVICE_ID 0x02
+#define PCI_COMMAND 0x04
+#define PCI_PROG_IF 0x09
+#define PCI_SUBCLASS 0x0A
+#define PCI_CLASS 0x0B
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0 0x10
+#define PCI_INTERRUPT_LINE 0x3C
+
+#define PCI_COMMAND_IO (1 << 0) // respond to I/O space accesses
+#define PCI_COMMAND_MEMORY (1 << 1)
+#define PCI_COMMAND_MASTER (1 << 2) // allowed to do bus master DMA
+
+#define PCI_BAR_IO 0x1 // bit 0 of a BAR: I/O space, the address is in bits 2..31
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+
+struct pci_device {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class;
+    uint8_t subclass;
+    uint8_t prog_if;
+};
+
+uint32_t pci_read32(const struct pci_device* dev, uint8_t offset);
+uint16_t pci_read16(const struct pci_device* dev, uint8_t offset);
+uint8_t pci_read8(const struct pci_device* dev, uint8_t offset);
+void pci_write32(const struct pci_device* dev, uint8_t offset, uint32_t value);
+void pci_write16(const struct pci_device* dev, uint8_t offset, uint16_t value);
+
+// Finds the first function with this class and subclass (bus 0 first), returns 0 and fills dev, -1 if there is none
+int pci_find_class(uint8_t class, uint8_t subclass, struct pci_device* dev);
+
+// Base address register 'bar' (0-5) without its flag bits
+uint32_t pci_bar(const struct pci_device* dev, int bar);
+
+#endif
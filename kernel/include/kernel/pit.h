@@ -0,0 +1,26 @@
+#ifndef _KERNEL_PIT_H
+#define _KERNEL_PIT_H
+
+#include <stdint.h>
+
+// 8253/8254 Programmable Interval Timer, channel 0 is wired to IRQ0
+
+#define PIT_FREQUENCY 1193182 // input clock in Hz
+
+// Mode 2 (rate generator): IRQ0 fires every 'divisor' input clocks
+void pit_set_periodic(uint16_t divisor);
+
+// Mode 0 (interrupt on terminal count): IRQ0 fires once after 'count' input clocks
+void pit_set_oneshot(uint16_t count);
+
+// Current value of the channel 0 down counter
+uint16_t pit_read_count(void);
+
+// Channel 2 isn't wired to an interrupt, only to the speaker and port 0x61, which makes it a free stopwatch for
+// calibrating other clocks: prepare loads 'count' with the gate closed, start opens it, and expired turns true
+// 'count' input clocks later
+void pit_channel2_prepare(uint16_t count);
+void pit_channel2_start(void);
+int pit_channel2_expired(void);
+
+#endif
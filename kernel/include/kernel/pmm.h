@@ -0,0 +1,41 @@
+#ifndef _KERNEL_PMM_H
+#define _KERNEL_PMM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kernel/multiboot.h>
+
+// Physical memory manager: hands out 4 KiB page frames of RAM
+// Frames are tracked in a bitmap (1 = used) and kept on buddy free lists so an allocation never scans memory
+
+#define PAGE_SIZE 4096
+#define PAGE_SHIFT 12
+#define PMM_MAX_ORDER 10 // largest contiguous block is 2^10 frames (4 MiB)
+#define PMM_MAX_ADDR 0x80000000u // RAM above 2 GiB is ignored, the kernel address space is carved up above it
+
+#define PAGE_ALIGN_UP(x) (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+#define PAGE_ALIGN_DOWN(x) ((x) & ~(PAGE_SIZE - 1))
+
+// Parses the multiboot memory map and marks the kernel image, boot modules and reserved regions as used
+void pmm_init(struct multiboot_info* mbi);
+
+// Single frame allocation, returns the physical address or 0 when out of memory
+uint32_t pmm_alloc_page(void);
+void pmm_free_page(uint32_t addr);
+
+// Physically contiguous allocation of 'count' frames (at most 2^PMM_MAX_ORDER), aligned to the next power of two
+uint32_t pmm_alloc_pages(size_t count);
+void pmm_free_pages(uint32_t addr, size_t count);
+
+int pmm_is_used(uint32_t addr);
+
+// End of the highest usable RAM the pmm tracks (the paging code identity maps everything below it)
+uint32_t pmm_memory_top(void);
+
+// Statistics, all counted in frames
+size_t pmm_total_frames(void);
+size_t pmm_free_frames(void);
+size_t pmm_used_frames(void);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef _KERNEL_PROFILE_H
+#define _KERNEL_PROFILE_H
+
+#include <stdint.h>
+
+#include <kernel/idt.h>
+
+// Sampling profiler: on every timer tick the interrupted EIP goes into a histogram over the kernel's code
+// (PROFILE_BUCKET_SIZE bytes per bucket). The report adds the buckets up per function using the embedded symbol
+// table. Optionally every sample also records the EBP chain, which can be dumped as folded stacks for flame graphs
+// (needs the kernel built with -fno-omit-frame-pointer, which the Makefile does)
+
+#define PROFILE_BUCKET_SHIFT 4
+#define PROFILE_BUCKET_SIZE (1 << PROFILE_BUCKET_SHIFT)
+#define PROFILE_BUCKETS 16384 // 256 KiB of code
+#define PROFILE_MAX_DEPTH 16 // frames per backtrace
+#define PROFILE_MAX_STACKS 2048 // backtraces kept, later samples still count in the histogram
+
+// Starts (or continues) sampling, with backtraces if 'backtraces' is set. Returns -1 if the backtrace buffer
+// couldn't be allocated
+int profile_start(int backtraces);
+void profile_stop(void);
+void profile_reset(void);
+int profile_running(void);
+
+// Called from the IRQ0 handler
+void profile_sample(const struct interrupt_frame* frame);
+
+// Prints the 'top' functions with the most samples
+void profile_report(unsigned top);
+
+// Writes the recorded backtraces as folded stacks ("outer;...;inner 1" per line, the input format of
+// flamegraph.pl) to the serial port, or stdout without one, between "# profile stacks begin/end" lines
+void profile_dump_stacks(void);
+
+#endif
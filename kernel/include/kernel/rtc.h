@@ -0,0 +1,26 @@
+#ifndef _KERNEL_RTC_H
+#define _KERNEL_RTC_H
+
+#include <stdint.h>
+
+// MC146818 compatible CMOS real time clock, the battery backed wall clock on IRQ8. Reading it takes a dozen
+// port accesses and it only counts whole seconds, so clock.c reads it once at boot and runs off the TSC after that
+
+struct rtc_time {
+    uint16_t year; // 1970-2069, the RTC only keeps two digits
+    uint8_t month; // 1-12
+    uint8_t day; // 1-31
+    uint8_t hour; // 0-23
+    uint8_t minute;
+    uint8_t second;
+};
+
+// Reads the date and time (UTC, unless another OS set the RTC to local time). -1 if the values make no sense,
+// no RTC or a dead battery. Waits for an update in progress to finish, up to 2 ms with interrupts disabled
+int rtc_read(struct rtc_time* time);
+
+// Turns on the update-ended interrupt: fn runs once, from IRQ8, right after the RTC ticked over to a new second,
+// which is the only moment the sub-second part of the time is known. -1 if IRQ8 is taken
+int rtc_on_next_second(void (*fn)(const struct rtc_time* time));
+
+#endif
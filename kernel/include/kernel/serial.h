@@ -0,0 +1,35 @@
+#ifndef _KERNEL_SERIAL_H
+#define _KERNEL_SERIAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 16550 UART on COM1, transmit only
+// Output goes into a TX ring and the UART is refilled 16 bytes at a time (a full FIFO) from the THRE interrupt,
+// so writers never sit in a loop polling the line status register for every byte
+
+struct serial_stats {
+    uint32_t bytes; // bytes handed to the UART
+    uint32_t interrupts; // THRE interrupts taken
+    uint32_t ring_full; // writes that had to wait for room in the TX ring
+};
+
+// Programs COM1 (115200 8N1, FIFOs on). Until serial_enable_irq is called output is sent by polling
+// Returns -1 if no UART answers
+int serial_init(void);
+
+// Switches to interrupt driven transmission, needs the IDT
+void serial_enable_irq(void);
+
+int serial_present(void);
+
+// Queues 'size' bytes, '\n' is sent as "\r\n". Blocks (or falls back to polling where it can't block) while the
+// TX ring is full, nothing is dropped
+void serial_write(const char* data, size_t size);
+
+// Waits until everything queued has left the UART, e.g. before shutting down
+void serial_flush(void);
+
+void serial_get_stats(struct serial_stats* stats);
+
+#endif
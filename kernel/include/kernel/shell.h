@@ -0,0 +1,30 @@
+#ifndef _KERNEL_SHELL_H
+#define _KERNEL_SHELL_H
+
+// Interactive command line, runs as its own thread and reads commands through stdin
+// Commands are registered by name and looked up in a hash table. A line is split into arguments at spaces and
+// tabs, double quotes keep spaces inside one argument. The last SHELL_HISTORY lines are kept: "history" lists
+// them, "!!" runs the previous one again and "!<n>" line n
+
+#define SHELL_LINE_MAX 256
+#define SHELL_MAX_ARGS 16
+#define SHELL_MAX_COMMANDS 64
+#define SHELL_HASH_BUCKETS 64 // power of two
+#define SHELL_HISTORY 32
+
+// argv[0] is the command's name, argv[argc] is NULL. Returns 0 on success
+typedef int (*shell_command_fn)(int argc, char** argv);
+
+// Registers the built-in commands, other subsystems can add theirs with shell_register afterwards
+void shell_init(void);
+
+// 'name' and 'help' must stay valid (string literals). Returns -1 if the name is taken or the table is full
+int shell_register(const char* name, const char* help, shell_command_fn fn);
+
+// Runs a line as if it had been typed (without putting it into the history). Returns the command's result, or -1
+// if there is no such command
+int shell_execute(const char* line);
+
+void shell_main(void* arg);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef _KERNEL_SMP_H
+#define _KERNEL_SMP_H
+
+#include <stdint.h>
+
+#include <kernel/apic.h>
+#include <kernel/gdt.h>
+
+// Application processor bring-up and per-CPU data
+// smp_init wakes every other processor in the MADT with INIT and two STARTUP IPIs. They start in real mode in a
+// trampoline copied below 1 MiB, switch to protected mode with the boot CPU's page directory, load their own copy
+// of the GDT (whose per-CPU segment puts their struct cpu at %gs:0) and the shared IDT, enable their local APIC
+// and end up in an idle loop that runs whatever smp_run hands them.
+// Threads, the timer tick and device IRQs all stay on the boot CPU: the rest of the kernel locks with irq_save,
+// which only keeps out the local CPU. Work sent to the others must not touch any of it (no kmalloc, printf,
+// wait queues), it gets its input through the argument and leaves its results in memory of its own
+
+#define SMP_MAX_CPUS APIC_MAX_CPUS
+#define SMP_STACK_SIZE 16384
+#define SMP_TRAMPOLINE_ADDR 0x8000 // real mode entry point of the APs, inside the 1 MiB the pmm never hands out
+
+typedef void (*smp_work_fn)(void* arg);
+
+struct cpu {
+    struct cpu* self; // %gs:0, so this_cpu() is a single load
+    uint32_t id; // 0 is the boot CPU
+    uint32_t apic_id;
+    volatile uint32_t irq_depth; // > 0 while an IRQ handler runs on this CPU (in_interrupt)
+    volatile int online;
+    void* stack;
+    uint64_t interrupts; // taken on this CPU, exceptions included
+    uint64_t ipis; // LAPIC_IPI_VECTOR received
+    uint64_t idle_cycles; // TSC cycles spent halted in the AP idle loop
+    uint64_t work_done; // smp_run calls this CPU ran its part of
+    smp_work_fn volatile work; // set by smp_run, cleared by this CPU once the function returned
+    void* work_arg;
+    struct gdt_entry gdt[GDT_ENTRIES]; // this CPU's own GDT, the boot CPU uses the global one
+    struct gdt_ptr gdt_ptr;
+} __attribute__((aligned(64))); // one cache line apart, so counters of different CPUs never share a line
+
+static inline struct cpu* this_cpu(void)
+{
+    struct cpu* cpu;
+    __asm__("mov %%gs:0, %0" : "=r"(cpu)); // not volatile, it's the same for as long as the caller runs
+    return cpu;
+}
+
+static inline uint32_t smp_processor_id(void)
+{
+    return this_cpu()->id;
+}
+
+// Starts the application processors (needs the APIC, paging, kmalloc and udelay), prints a line for each one
+// that came up and returns the number of CPUs online, the boot CPU included
+int smp_init(void);
+
+int smp_cpu_count(void); // online CPUs
+struct cpu* smp_get_cpu(int id); // NULL if there's no such CPU online (cpu 0 always exists)
+
+// Runs fn(arg) on CPUs 0 to cpus - 1 at the same time, the caller being CPU 0, and returns once every one of them
+// is done. fn tells the CPUs apart with smp_processor_id(). Only threads on the boot CPU may call it, one call at a
+// time (others wait). Returns the number of CPUs that ran fn (fewer if fewer are online), -1 off the boot CPU
+int smp_run(int cpus, smp_work_fn fn, void* arg);
+
+#endif
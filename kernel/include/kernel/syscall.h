@@ -0,0 +1,50 @@
+#ifndef _KERNEL_SYSCALL_H
+#define _KERNEL_SYSCALL_H
+
+// System calls from ring 3. Two entry paths share one table:
+//   int $0x80            any CPU, DPL 3 interrupt gate
+//   sysenter             if CPUID reports SEP. The caller puts its return address in EDX and its stack pointer in ECX
+// The number goes in EAX, up to three arguments in EBX, ESI, EDI (ECX/EDX are taken by sysenter, so they are not used
+// on either path). The result comes back in EAX, negative errno values are errors. Every other register is preserved
+
+#define SYSCALL_VECTOR 0x80
+
+#define SYS_EXIT 0 // (code), never returns
+#define SYS_WRITE 1 // (fd, buf, len)
+#define SYS_READ 2 // (fd, buf, len), fd 0 blocks until a line was typed
+#define SYS_NULL 3 // (), does nothing: measures the entry and exit cost
+#define SYS_YIELD 4 // ()
+#define SYS_SLEEP 5 // (ms)
+#define SYSCALL_COUNT 6
+
+#ifndef __ASSEMBLER__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kernel/idt.h>
+
+struct syscall_stats {
+    uint32_t int80; // entries through int $0x80
+    uint32_t sysenter; // entries through sysenter
+};
+
+// Installs the int $0x80 handler and, when the CPU supports it, programs the SYSENTER MSRs
+void syscall_init(void);
+
+int syscall_has_sysenter(void);
+
+// Called from both entry paths with the user registers in the frame, the result is stored in frame->eax
+void syscall_dispatch(struct interrupt_frame* frame);
+void syscall_sysenter(struct interrupt_frame* frame); // the C half of sysenter_entry, counts and dispatches
+
+void syscall_get_stats(struct syscall_stats* stats);
+
+// Copy between kernel memory and a user pointer. The whole range has to be mapped user accessible (and writable
+// for copy_to_user), otherwise nothing is copied and -EFAULT is returned. 0 on success
+int copy_from_user(void* dst, uint32_t src, size_t size);
+int copy_to_user(uint32_t dst, const void* src, size_t size);
+
+#endif
+
+#endif
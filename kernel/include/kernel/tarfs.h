@@ -0,0 +1,12 @@
+#ifndef _KERNEL_TARFS_H
+#define _KERNEL_TARFS_H
+
+#include <stddef.h>
+
+// ustar archive mounted read-only at /, used for the initrd GRUB loads as a multiboot module.
+// File data stays where GRUB put it, the vnodes point into the archive
+
+// Adds every file and directory in the archive to the VFS. Returns the number of files, -1 if it isn't a tar
+int tarfs_mount(const void* image, size_t size);
+
+#endif
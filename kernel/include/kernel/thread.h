@@ -0,0 +1,116 @@
+#ifndef _KERNEL_THREAD_H
+#define _KERNEL_THREAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kernel/cpu.h>
+#include <kernel/idt.h>
+#include <kernel/list.h>
+#include <kernel/timer.h>
+
+// Kernel threads and a preemptive priority scheduler
+// A switched out thread is nothing more than the interrupt_frame at the top of its stack: preemption reuses the
+// frame isr_common_handler already built, and a voluntary yield builds an identical one, so every thread
+// resumes through the same iret path
+
+#define THREAD_STACK_SIZE 16384
+#define THREAD_NAME_LEN 16
+#define SCHED_SLICE_MS 10 // round robin time slice within a priority level
+
+enum thread_priority { // lower value runs first
+    THREAD_PRIO_HIGH = 0,
+    THREAD_PRIO_NORMAL = 1,
+    THREAD_PRIO_LOW = 2,
+    THREAD_PRIO_IDLE = 3, // only the idle thread
+    THREAD_PRIORITIES = 4
+};
+
+enum thread_state {
+    THREAD_RUNNING,
+    THREAD_READY,
+    THREAD_BLOCKED,
+    THREAD_DEAD
+};
+
+struct thread {
+    struct interrupt_frame* frame; // saved context while not running
+    uint32_t id;
+    char name[THREAD_NAME_LEN];
+    enum thread_state state;
+    enum thread_priority priority;
+    uint32_t slice; // ticks left in the current time slice
+    uint64_t cpu_ticks; // timer ticks this thread was running for
+    void* stack; // NULL for the boot thread, which runs on the stack from boot.S
+    void (*entry)(void* arg);
+    void* arg;
+    struct list_node run_node; // run queue or wait queue
+    struct list_node all_node; // list of every thread
+    struct timer sleep_timer;
+    void* fpu_alloc; // kmalloc'd block fpu_state lives in
+    uint8_t* fpu_state; // 16 byte aligned FPU/SSE save area, NULL until the thread first uses the FPU (fpu.c)
+};
+
+struct wait_queue {
+    struct list_node waiters;
+};
+
+// Turns the caller (kernel_main) into the idle thread and starts scheduling on the next timer tick
+void sched_init(void);
+
+struct thread* thread_create(const char* name, void (*entry)(void* arg), void* arg, enum thread_priority priority);
+__attribute__((noreturn)) void thread_exit(void);
+struct thread* thread_current(void);
+
+// Gives up the CPU to the next ready thread (of equal or higher priority)
+void thread_yield(void);
+
+// Blocks the current thread for at least 'ticks' timer ticks
+void thread_sleep(uint32_t ticks);
+
+// The idle thread's loop (kernel_main ends here): reaps exited threads and halts the CPU when nothing is runnable
+__attribute__((noreturn)) void sched_idle(void);
+
+// Frees the stacks of threads that have exited, called from the idle loop
+void thread_reap(void);
+
+// True once threads exist and the caller is one that is allowed to block (not the idle thread, not an IRQ)
+int sched_can_block(void);
+
+// Called from the IRQ0 handler to charge the tick to the running thread and expire its time slice
+void sched_tick(void);
+
+// Set when a switch should happen at the next interrupt return
+int sched_need_resched(void);
+
+// Saves 'frame' as the current thread's context and returns the frame of the thread to run next
+struct interrupt_frame* sched_switch(struct interrupt_frame* frame);
+
+// Stack range [low, high) of a thread (NULL means the boot stack from boot.S, which the idle thread runs on)
+void thread_stack_bounds(const struct thread* thread, uint32_t* low, uint32_t* high);
+
+// Iterates over all threads for statistics (callback runs with interrupts disabled)
+void thread_for_each(void (*fn)(struct thread* thread, void* arg), void* arg);
+
+uint32_t sched_context_switches(void);
+
+void wait_queue_init(struct wait_queue* wq);
+
+// Puts the current thread to sleep on 'wq'. Must be called with interrupts disabled (irq_save) after checking the
+// condition, so a wake_up between the check and the sleep can't be lost; returns with interrupts still disabled
+void wait_queue_sleep(struct wait_queue* wq);
+
+void wake_up(struct wait_queue* wq); // wakes every waiter
+void wake_up_one(struct wait_queue* wq);
+
+// Sleeps on 'wq' until 'cond' is true
+#define wait_event(wq, cond)                   \
+    do {                                       \
+        uint32_t __flags = irq_save();         \
+        while (!(cond)) {                      \
+            wait_queue_sleep(wq);              \
+        }                                      \
+        irq_restore(__flags);                  \
+    } while (0)
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _KERNEL_TIMER_H
+#define _KERNEL_TIMER_H
+
+#include <stdint.h>
+
+#include <kernel/list.h>
+
+// Kernel time keeping driven by the PIT on IRQ0, or by the local APIC timer once apic_init switched to the APIC
+// Timers live in a hierarchical timer wheel (256 slots for the next 256 ticks, then 4 levels of 64 slots
+// for further out), so adding and cancelling a timer is O(1) no matter how many are pending
+
+#ifndef TIMER_HZ
+#define TIMER_HZ 1000 // default tick rate, override with -DTIMER_HZ=...
+#endif
+
+struct timer {
+    struct list_node node; // links the timer into its wheel slot
+    uint32_t expires; // tick (low 32 bits of the tick counter) the timer fires at
+    void (*fn)(void* arg); // called from the timer interrupt, keep it short
+    void* arg;
+};
+
+// Programs the tick timer to interrupt 'hz' times per second
+void timer_init(uint32_t hz);
+
+void timer_setup(struct timer* timer, void (*fn)(void* arg), void* arg);
+
+// (Re)arms a timer to fire 'ticks' ticks from now, if it was already pending it is moved
+void timer_add(struct timer* timer, uint32_t ticks);
+
+// Returns 1 if the timer was pending and got cancelled, 0 if it had already fired (or was never added)
+int timer_cancel(struct timer* timer);
+
+int timer_pending(const struct timer* timer);
+
+// Called by the tick interrupt handler (registered by timer_init)
+void timer_interrupt(void);
+
+uint64_t timer_ticks(void); // ticks since timer_init (monotonic)
+uint32_t timer_hz(void);
+uint64_t timer_uptime_ms(void);
+uint32_t timer_ms_to_ticks(uint32_t ms); // rounded up, so a delay is never shorter than asked
+
+// Sleeps for at least 'ms' milliseconds. Blocks the calling thread once the scheduler runs, before that (and in
+// the idle thread) it idles the CPU instead of spinning
+void sleep_ms(uint32_t ms);
+
+// Busy waits for 'us' microseconds by watching the PIT counter, for short hardware delays
+void udelay(uint32_t us);
+
+// Idles the CPU until the next interrupt. If no timer is due on the next tick, the tick timer is switched to
+// one-shot mode to skip the ticks in between, so an idle kernel doesn't wake up HZ times a second for nothing
+void timer_idle(void);
+
+// Leaves the one-shot mode of timer_idle if it is active, called on every interrupt other than the tick
+void timer_wake(void);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef _KERNEL_TSC_H
+#define _KERNEL_TSC_H
+
+#include <stdint.h>
+
+#include <kernel/cpu.h>
+
+// Time stamp counter frequency, measured against PIT channel 2
+
+// ns = cycles * mult >> shift, set by tsc_calibrate so converting a timestamp needs no division
+struct tsc_scale {
+    uint32_t mult;
+    uint32_t shift; // at most 32
+};
+
+extern struct tsc_scale tsc_ns_scale;
+
+// Measures the TSC rate (a few 10 ms windows with interrupts off), returns it in kHz
+uint32_t tsc_calibrate(void);
+
+uint32_t tsc_khz(void); // 0 until tsc_calibrate ran
+
+// Converts a cycle count to nanoseconds with two 32x32 bit multiplies, 0 if the TSC isn't calibrated yet
+static inline uint64_t tsc_cycles_to_ns(uint64_t cycles)
+{
+    uint32_t mult = tsc_ns_scale.mult;
+    uint32_t shift = tsc_ns_scale.shift;
+    uint64_t low = (uint64_t)(uint32_t)cycles * mult;
+    uint64_t high = (uint64_t)(uint32_t)(cycles >> 32) * mult;
+    return (low >> shift) + (high << (32 - shift));
+}
+
+// Converts a cycle count to microseconds, 0 if the TSC isn't calibrated yet
+uint64_t tsc_cycles_to_us(uint64_t cycles);
+
+#endif
@@ -10,6 +10,10 @@ void terminal_write(const char* data, size_t size);
 void terminal_writestring(const char* data);
 size_t terminal_get_row(void);
 size_t terminal_get_column(void);
+void terminal_scroll_view(int lines); // browse the scrollback, positive = older output
+// Framebuffer console: from now on the kworker draws the output at most every 20 ms instead of each write doing
+// it, so a burst of lines scrolls the pixels once (needs the workqueue). Nothing changes in VGA text mode
+void terminal_defer_refresh(void);
 char ps2_to_ascii(uint8_t scancode);
 
 #endif
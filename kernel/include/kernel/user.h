@@ -0,0 +1,46 @@
+#ifndef _KERNEL_USER_H
+#define _KERNEL_USER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kernel/idt.h>
+
+// Ring 3 programs. There is one address space, so one user program runs at a time: its code is copied to
+// USER_BASE and it gets a stack right below USER_TOP, both mapped with PAGE_USER. The region sits above the
+// identity mapped RAM (which the pmm caps at 2 GiB) and below the usual MMIO windows. The stack is a demand-zero
+// area (vmm.h) with a guard page below it: pages appear as the program touches them
+
+#define USER_BASE 0x80000000u
+#define USER_TOP 0xA0000000u
+#define USER_STACK_SIZE (64 * 1024)
+
+// A flat, position independent binary, started at its first byte with the argument in EAX
+struct user_program {
+    const char* name;
+    const uint8_t* start;
+    const uint8_t* end;
+};
+
+// Built-in programs (user_programs.S) by name, NULL if there is no such program or the CPU can't run it
+const struct user_program* user_find(const char* name);
+
+// Calls fn for every built-in program the CPU can run, in table order
+void user_for_each(void (*fn)(const struct user_program* program, void* arg), void* arg);
+
+// Starts the program on a new thread. -1 if another user program is still running or memory ran out
+int user_spawn(const struct user_program* program, uint32_t arg);
+
+// Blocks until the running user program exits, returns its exit code
+int user_wait(void);
+
+// SYS_EXIT: frees the program's memory and ends its thread
+__attribute__((noreturn)) void user_exit(int code);
+
+// An exception in ring 3 kills the program instead of the kernel
+__attribute__((noreturn)) void user_fault(struct interrupt_frame* frame);
+
+// Enters ring 3 at eip with the given stack, the argument in EAX (isr.s)
+__attribute__((noreturn)) void user_enter(uint32_t eip, uint32_t esp, uint32_t arg);
+
+#endif
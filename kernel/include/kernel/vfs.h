@@ -0,0 +1,88 @@
+#ifndef _KERNEL_VFS_H
+#define _KERNEL_VFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kernel/list.h>
+
+// Virtual file system, read-only. Files and directories are vnodes, names are dentries. Every dentry is also in
+// a hash table keyed by (parent, name), so each step of a path lookup is one hash probe instead of a scan of the
+// directory. Filesystems that keep their data in memory (the initrd) hand out a data pointer on the vnode, reads
+// are then served straight from it
+
+#define VFS_PATH_MAX 256
+#define VFS_MAX_FILES 32 // open files
+#define VFS_FD_BASE 3 // 0-2 are stdin / stdout / stderr
+#define DCACHE_BUCKETS 256 // power of two
+
+enum vnode_type {
+    VNODE_FILE,
+    VNODE_DIR
+};
+
+struct vnode;
+
+struct vnode_ops {
+    // Reads up to size bytes at offset, returns the number read (0 at the end of the file) or a negative errno.
+    // Only needed when the vnode has no data pointer
+    int (*read)(struct vnode* node, void* buf, size_t size, uint32_t offset);
+};
+
+struct vnode {
+    enum vnode_type type;
+    uint32_t ino;
+    uint32_t size;
+    const uint8_t* data; // the contents, if they are in memory
+    const struct vnode_ops* ops;
+};
+
+struct dentry {
+    char* name;
+    uint32_t hash;
+    struct dentry* parent;
+    struct vnode* node;
+    struct dentry* hash_next; // dentry cache bucket chain
+    struct list_node sibling; // in the parent's children
+    struct list_node children; // directories only
+};
+
+struct vfs_stat {
+    enum vnode_type type;
+    uint32_t ino;
+    uint32_t size;
+};
+
+struct vfs_stats {
+    uint32_t lookups; // path components resolved
+    uint32_t hits; // found in the dentry cache
+    uint32_t dentries;
+};
+
+void vfs_init(void);
+
+struct dentry* vfs_root(void);
+
+// For filesystems: adds 'name' (length bytes, no NUL needed) under parent. Returns the existing dentry if there
+// already is one with that name, NULL if out of memory
+struct dentry* vfs_add(struct dentry* parent, const char* name, size_t length, struct vnode* node);
+
+// Resolves an absolute path ("/" separated, empty components are skipped), NULL if it doesn't exist
+struct dentry* vfs_lookup(const char* path);
+
+// Calls fn for every entry of a directory, -ENOTDIR / -ENOENT otherwise
+int vfs_readdir(const char* path, void (*fn)(const struct dentry* entry, void* arg), void* arg);
+
+// Zero copy access: the file's contents and size if they are in memory, NULL otherwise
+const void* vfs_map(const char* path, size_t* size);
+
+// File descriptors, shared by the whole kernel. All return a negative errno on failure
+int vfs_open(const char* path);
+int vfs_read(int fd, void* buf, size_t size);
+int vfs_lseek(int fd, int32_t offset, int whence);
+int vfs_fstat(int fd, struct vfs_stat* stat);
+int vfs_close(int fd);
+
+void vfs_get_stats(struct vfs_stats* stats);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef _KERNEL_VMM_H
+#define _KERNEL_VMM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reserved virtual memory with demand-zero paging
+// vmm_reserve only carves an area out of the kernel's virtual window, no frames are taken and nothing is mapped.
+// The first touch of a page raises a #PF, the handler (paging.c) asks vmm_fault for a zeroed frame and the access
+// is retried. Reserving a big buffer costs nothing until it is used. An area can get a guard page below it that
+// is never mapped, touching it is reported as a stack overflow instead of corrupting whatever lies below.
+// Areas are not identity mapped: no DMA into them, and the physical address isn't the pointer
+
+#define VMM_BASE 0xA0000000u // the window above the user region (user.h), below the usual MMIO windows
+#define VMM_END 0xC0000000u
+#define VMM_MAX_AREAS 256
+#define VMM_NAME_LEN 16
+
+#define VMM_GUARD 0x1 // leave an unmapped page below the area
+#define VMM_USER 0x2 // ring 3 may touch it (and fault its pages in)
+#define VMM_COMMIT 0x4 // map every page right away: kernel stacks, a #PF can't be taken on the stack that faulted
+
+struct vmm_area {
+    uint32_t start;
+    uint32_t size; // bytes, whole pages, the guard page not included
+    uint32_t resident; // pages with a frame behind them
+    unsigned flags;
+    char name[VMM_NAME_LEN];
+};
+
+struct vmm_stats {
+    uint32_t areas;
+    uint32_t reserved_pages; // in all areas, resident or not
+    uint32_t resident_pages;
+    uint32_t minor_faults; // first touches that got a zeroed frame
+    uint32_t failed_faults; // first touches the pmm had no frame for
+};
+
+// Takes 'size' bytes (rounded up to pages) somewhere in [VMM_BASE, VMM_END). NULL if the window is full
+void* vmm_reserve(size_t size, unsigned flags, const char* name);
+
+// The same at a fixed, page aligned address outside the window (the user stack). -1 if it overlaps an area
+int vmm_reserve_at(uint32_t addr, size_t size, unsigned flags, const char* name);
+
+// Unmaps the area that starts at addr and gives its frames back to the pmm
+void vmm_release(void* addr);
+
+// Called by the #PF handler for an access to a page that isn't mapped. Returns 0 if addr is in an area (and a
+// user access may touch it) and a zeroed frame is mapped there now, -1 for a real fault
+int vmm_fault(uint32_t addr, int user);
+
+// Name of the area whose guard page holds addr, NULL if it isn't a guard page
+const char* vmm_guard_owner(uint32_t addr);
+
+// Calls fn for every area in address order, with interrupts disabled
+void vmm_for_each(void (*fn)(const struct vmm_area* area, void* arg), void* arg);
+
+void vmm_get_stats(struct vmm_stats* stats);
+
+#endif
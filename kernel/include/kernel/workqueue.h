@@ -0,0 +1,24 @@
+#ifndef _KERNEL_WORKQUEUE_H
+#define _KERNEL_WORKQUEUE_H
+
+#include <kernel/list.h>
+
+// Deferred work ("bottom halves"): an interrupt handler does the bare minimum with interrupts off and queues a
+// work item, which the kworker thread then runs with interrupts enabled. Slow processing no longer delays other IRQs
+
+struct work {
+    struct list_node node;
+    void (*fn)(struct work* work);
+    volatile int pending; // queued and not started yet, scheduling it again is a no-op
+};
+
+// Starts the kworker thread, needs the scheduler
+void workqueue_init(void);
+
+void work_init(struct work* work, void (*fn)(struct work* work));
+
+// Queues 'work' to run on the kworker thread, safe to call from interrupt handlers.
+// Returns 0 if it was already pending (it will still run once, after this call)
+int schedule_work(struct work* work);
+
+#endif
@@ -0,0 +1,355 @@
+#include <errno.h>
+#include <string.h>
+
+#include <kernel/bcache.h>
+#include <kernel/cpu.h>
+#include <kernel/klog.h>
+#include <kernel/pmm.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <kernel/workqueue.h>
+
+#define NO_DRIVE 0xFF // buffer doesn't hold a block
+
+// Everything here is protected by irq_save, buffers are only waited for with interrupts disabled so a completion
+// can't slip in between the check and the sleep
+static struct buf bufs[BCACHE_BLOCKS];
+static uint32_t buf_count;
+static struct buf* hash[BCACHE_HASH_BUCKETS];
+static struct list_node lru;
+static struct wait_queue buf_wait; // woken when I/O completes or a buffer loses its last reference
+static struct bcache_stats stats;
+static uint32_t last_block[ATA_MAX_DRIVES]; // block of the previous bread, a miss right after it reads ahead
+static uint32_t writes_in_flight;
+static struct buf* sync_list[BCACHE_BLOCKS]; // only used with interrupts disabled, so one is enough
+static struct timer flush_timer;
+static struct work flush_work;
+
+static uint32_t hash_of(uint8_t drive, uint32_t block)
+{
+    return (block + drive * 7919u) % BCACHE_HASH_BUCKETS; // consecutive blocks land in consecutive buckets
+}
+
+static struct buf* lookup(uint8_t drive, uint32_t block)
+{
+    for (struct buf* b = hash[hash_of(drive, block)]; b != NULL; b = b->hash_next) {
+        if (b->drive == drive && b->block == block) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void hash_remove(struct buf* b)
+{
+    if (b->drive == NO_DRIVE) {
+        return;
+    }
+    struct buf** link = &hash[hash_of(b->drive, b->block)];
+    while (*link != b) {
+        link = &(*link)->hash_next;
+    }
+    *link = b->hash_next;
+    b->drive = NO_DRIVE;
+}
+
+static void touch(struct buf* b)
+{
+    list_remove(&b->lru);
+    list_add_head(&lru, &b->lru);
+}
+
+// Gives a free buffer a new identity, the data isn't valid yet
+static void claim(struct buf* b, uint8_t drive, uint32_t block, uint32_t refs)
+{
+    if (b->flags & BUF_VALID) {
+        stats.evictions++;
+    }
+    hash_remove(b);
+    b->drive = drive;
+    b->block = block;
+    b->flags = 0;
+    b->refs = refs;
+    uint32_t bucket = hash_of(drive, block);
+    b->hash_next = hash[bucket];
+    hash[bucket] = b;
+    touch(b);
+}
+
+// Least recently used buffer that can be reused without writing it back first
+static struct buf* get_free(void)
+{
+    for (struct list_node* node = lru.prev; node != &lru; node = node->prev) {
+        struct buf* b = container_of(node, struct buf, lru);
+        if (b->refs == 0 && !(b->flags & (BUF_BUSY | BUF_DIRTY))) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static struct buf* oldest_dirty(void)
+{
+    for (struct list_node* node = lru.prev; node != &lru; node = node->prev) {
+        struct buf* b = container_of(node, struct buf, lru);
+        if (b->refs == 0 && (b->flags & (BUF_BUSY | BUF_DIRTY)) == BUF_DIRTY) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// ATA completion, runs in the IRQ handler
+static void io_done(struct ata_request* req)
+{
+    struct buf* b = req->ctx;
+    if (req->op == ATA_WRITE) {
+        writes_in_flight--;
+        if (req->status == 0) {
+            stats.writebacks++;
+        } else {
+            b->flags |= BUF_DIRTY; // try again with the next write-back
+            stats.errors++;
+        }
+    } else if (req->status == 0) {
+        b->flags |= BUF_VALID;
+    } else {
+        stats.errors++;
+    }
+    b->flags &= ~BUF_BUSY;
+    wake_up(&buf_wait);
+}
+
+// Queues a read or write-back of one buffer, ata_start sends it
+static void submit(struct buf* b, enum ata_op op)
+{
+    b->flags |= BUF_BUSY;
+    if (op == ATA_WRITE) {
+        b->flags &= ~BUF_DIRTY; // a bdirty during the write sets it again
+        writes_in_flight++;
+    }
+    memset(&b->req, 0, sizeof(b->req));
+    b->req.drive = b->drive;
+    b->req.op = op;
+    b->req.lba = b->block * BCACHE_SECTORS;
+    b->req.count = BCACHE_SECTORS;
+    b->req.buf = b->data;
+    b->req.complete = io_done;
+    b->req.ctx = b;
+    if (ata_queue(&b->req) != 0) {
+        b->req.status = -EIO;
+        io_done(&b->req);
+    }
+}
+
+static void wait_idle(struct buf* b)
+{
+    while (b->flags & BUF_BUSY) {
+        wait_queue_sleep(&buf_wait);
+    }
+}
+
+// Queues reads for the blocks after a sequential miss, up to the first one that is already cached. They are
+// queued right behind the missed block, so the driver merges them all into its command
+static void readahead(uint8_t drive, uint32_t block, uint32_t blocks)
+{
+    for (uint32_t i = 1; i < BCACHE_READAHEAD && block + i < blocks; i++) {
+        if (lookup(drive, block + i) != NULL) {
+            break;
+        }
+        struct buf* b = get_free();
+        if (b == NULL) {
+            break; // never write back for a read ahead
+        }
+        claim(b, drive, block + i, 0);
+        submit(b, ATA_READ);
+        stats.readahead++;
+    }
+}
+
+struct buf* bread(int drive, uint32_t block)
+{
+    const struct ata_drive* info = ata_get_drive(drive);
+    if (info == NULL || buf_count == 0 || block >= info->sectors / BCACHE_SECTORS) {
+        return NULL;
+    }
+
+    uint32_t flags = irq_save();
+    int sequential = block == last_block[drive] + 1;
+    last_block[drive] = block;
+
+    struct buf* b;
+    for (;;) {
+        b = lookup((uint8_t)drive, block);
+        if (b != NULL) {
+            b->refs++;
+            touch(b);
+            if (b->flags & (BUF_VALID | BUF_BUSY)) {
+                stats.hits++; // a block still on its way from a read ahead counts too
+            } else {
+                submit(b, ATA_READ); // an earlier read of it failed, try again
+                ata_start(drive);
+                stats.misses++;
+            }
+            break;
+        }
+
+        b = get_free();
+        if (b != NULL) {
+            claim(b, (uint8_t)drive, block, 1);
+            submit(b, ATA_READ);
+            stats.misses++;
+            if (sequential) {
+                readahead((uint8_t)drive, block, info->sectors / BCACHE_SECTORS);
+            }
+            ata_start(drive);
+            break;
+        }
+
+        // Everything clean is in use: write back the oldest dirty block and look again, the world may have
+        // changed while we slept
+        struct buf* victim = oldest_dirty();
+        if (victim != NULL) {
+            submit(victim, ATA_WRITE);
+            ata_start(victim->drive);
+            wait_idle(victim);
+        } else {
+            wait_queue_sleep(&buf_wait); // every buffer is referenced or busy
+        }
+    }
+
+    wait_idle(b);
+    if (!(b->flags & BUF_VALID)) {
+        b->refs--;
+        b = NULL;
+    }
+    irq_restore(flags);
+    return b;
+}
+
+void bdirty(struct buf* b)
+{
+    uint32_t flags = irq_save();
+    b->flags |= BUF_DIRTY | BUF_VALID;
+    irq_restore(flags);
+}
+
+void brelse(struct buf* b)
+{
+    uint32_t flags = irq_save();
+    if (--b->refs == 0) {
+        wake_up(&buf_wait);
+    }
+    irq_restore(flags);
+}
+
+int bcache_sync(int drive)
+{
+    uint32_t flags = irq_save();
+    uint32_t errors = stats.errors;
+    uint32_t count = 0;
+
+    // Sorted by position, so runs of adjacent dirty blocks merge into single commands
+    for (uint32_t i = 0; i < buf_count; i++) {
+        struct buf* b = &bufs[i];
+        if ((b->flags & (BUF_BUSY | BUF_DIRTY)) != BUF_DIRTY || (drive >= 0 && b->drive != drive)) {
+            continue;
+        }
+        uint32_t j = count++;
+        while (j > 0 && (sync_list[j - 1]->drive > b->drive
+            || (sync_list[j - 1]->drive == b->drive && sync_list[j - 1]->block > b->block))) {
+            sync_list[j] = sync_list[j - 1];
+            j--;
+        }
+        sync_list[j] = b;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        submit(sync_list[i], ATA_WRITE);
+    }
+    for (int d = 0; d < ATA_MAX_DRIVES; d += 2) { // one per channel
+        ata_start(d);
+    }
+    while (writes_in_flight > 0) { // also waits for write-backs someone else started
+        wait_queue_sleep(&buf_wait);
+    }
+    int result = stats.errors != errors ? -EIO : 0;
+    irq_restore(flags);
+
+    for (int d = 0; d < ATA_MAX_DRIVES; d++) { // and out of the drive's own write cache
+        if (count > 0 && (drive < 0 || d == drive) && ata_get_drive(d) != NULL && ata_flush(d) != 0) {
+            result = -EIO;
+        }
+    }
+    return result;
+}
+
+int bcache_invalidate(int drive)
+{
+    int result = bcache_sync(drive);
+    uint32_t flags = irq_save();
+    for (uint32_t i = 0; i < buf_count; i++) {
+        struct buf* b = &bufs[i];
+        if (b->drive == drive && b->refs == 0 && !(b->flags & (BUF_BUSY | BUF_DIRTY))) {
+            hash_remove(b);
+            b->flags = 0;
+        }
+    }
+    if (drive >= 0 && drive < ATA_MAX_DRIVES) {
+        last_block[drive] = 0;
+    }
+    irq_restore(flags);
+    return result;
+}
+
+void bcache_get_stats(struct bcache_stats* out)
+{
+    uint32_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
+
+static void flush_fn(struct work* work)
+{
+    (void)work;
+    if (bcache_sync(-1) != 0) {
+        kprintf("[BCACHE] write-back failed, will retry\n");
+    }
+    timer_add(&flush_timer, timer_ms_to_ticks(BCACHE_FLUSH_MS));
+}
+
+static void flush_tick(void* arg)
+{
+    (void)arg;
+    schedule_work(&flush_work);
+}
+
+void bcache_init(void)
+{
+    list_init(&lru);
+    wait_queue_init(&buf_wait);
+    int drives = 0;
+    for (int d = 0; d < ATA_MAX_DRIVES; d++) {
+        drives += ata_get_drive(d) != NULL;
+    }
+    if (drives == 0) {
+        return; // nothing to cache, don't take the memory
+    }
+
+    while (buf_count < BCACHE_BLOCKS) {
+        uint32_t page = pmm_alloc_page();
+        if (page == 0) {
+            break;
+        }
+        struct buf* b = &bufs[buf_count++];
+        b->drive = NO_DRIVE;
+        b->data = (uint8_t*)page; // identity mapped, so DMA can use the address as is
+        list_init(&b->lru);
+        list_add_tail(&lru, &b->lru);
+    }
+    kprintf("[OK] bcache: %lu KiB in %lu blocks\n", (unsigned long)(buf_count * BCACHE_BLOCK_SIZE / 1024),
+        (unsigned long)buf_count);
+
+    work_init(&flush_work, flush_fn);
+    timer_setup(&flush_timer, flush_tick, NULL);
+    timer_add(&flush_timer, timer_ms_to_ticks(BCACHE_FLUSH_MS));
+}
@@ -0,0 +1,1087 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <kernel/apic.h>
+#include <kernel/ata.h>
+#include <kernel/bcache.h>
+#include <kernel/bench.h>
+#include <kernel/clock.h>
+#include <kernel/fbcon.h>
+#include <kernel/fpu.h>
+#include <kernel/idt.h>
+#include <kernel/klog.h>
+#include <kernel/kmalloc.h>
+#include <kernel/ksyms.h>
+#include <kernel/memops.h>
+#include <kernel/pmm.h>
+#include <kernel/serial.h>
+#include <kernel/smp.h>
+#include <kernel/syscall.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <kernel/tsc.h>
+#include <kernel/tty.h>
+#include <kernel/user.h>
+#include <kernel/vfs.h>
+#include <kernel/vmm.h>
+
+struct bench {
+    const char* name;
+    bench_fn fn;
+};
+
+struct selftest {
+    const char* name;
+    selftest_fn fn;
+};
+
+static struct bench benches[BENCH_MAX];
+static uint32_t bench_count;
+static struct selftest selftests[SELFTEST_MAX];
+static uint32_t selftest_count;
+static uint32_t dropped; // registrations that didn't fit, bench_main counts them as failures
+
+void bench_register(const char* name, bench_fn fn)
+{
+    if (bench_count == BENCH_MAX) {
+        klog(KLOG_ERR, "[BENCH] table full, benchmark '%s' dropped (raise BENCH_MAX)\n", name);
+        dropped++;
+        return;
+    }
+    benches[bench_count].name = name;
+    benches[bench_count].fn = fn;
+    bench_count++;
+}
+
+void selftest_register(const char* name, selftest_fn fn)
+{
+    if (selftest_count == SELFTEST_MAX) {
+        klog(KLOG_ERR, "[BENCH] table full, self test '%s' dropped (raise SELFTEST_MAX)\n", name);
+        dropped++;
+        return;
+    }
+    selftests[selftest_count].name = name;
+    selftests[selftest_count].fn = fn;
+    selftest_count++;
+}
+
+static void print_result(const char* name, const struct bench_result* result)
+{
+    uint64_t ns = tsc_cycles_to_ns(result->cycles);
+    uint64_t ns_per_op = result->ops ? ns / result->ops : 0;
+    uint64_t mb_per_s = (result->bytes && ns) ? result->bytes * 1000 / ns : 0; // bytes per ns * 1000 = MB/s
+
+    printf("BENCH %s ops=%llu bytes=%llu cycles=%llu ns_per_op=%llu mb_per_s=%llu\n", name,
+        (unsigned long long)result->ops, (unsigned long long)result->bytes, (unsigned long long)result->cycles,
+        (unsigned long long)ns_per_op, (unsigned long long)mb_per_s);
+}
+
+int bench_run(const char* name)
+{
+    int found = -1;
+    for (uint32_t i = 0; i < bench_count; i++) {
+        if (name != NULL && strcmp(name, benches[i].name) != 0) {
+            continue;
+        }
+        struct bench_result result = { 0, 0, 0 };
+        benches[i].fn(&result);
+        print_result(benches[i].name, &result);
+        found = 0;
+    }
+    return found;
+}
+
+void bench_list(void)
+{
+    for (uint32_t i = 0; i < bench_count; i++) {
+        printf("%s%s", benches[i].name, i + 1 < bench_count ? " " : "\n");
+    }
+}
+
+int selftest_run_all(void)
+{
+    int failures = 0;
+    for (uint32_t i = 0; i < selftest_count; i++) {
+        int ok = selftests[i].fn() == 0;
+        printf("TEST %s %s\n", selftests[i].name, ok ? "PASS" : "FAIL");
+        if (!ok) {
+            failures++;
+        }
+    }
+    return failures;
+}
+
+// Benchmarks
+
+#define BENCH_BUFFER_SIZE 65536
+
+static void bench_terminal_write(struct bench_result* result)
+{
+    char line[80];
+    memset(line, '#', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\n';
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 1000; i++) {
+        terminal_write(line, sizeof(line));
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 1000;
+    result->bytes = 1000 * sizeof(line);
+}
+
+static void bench_scrollup(struct bench_result* result)
+{
+    terminal_write("\n", 1); // the previous output left the cursor on the last row, every newline scrolls now
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 1000; i++) {
+        terminal_write("\n", 1);
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 1000;
+}
+
+// Full screen redraws in the framebuffer console, every cell changes between two screens of text
+static void bench_fbcon_redraw(struct bench_result* result)
+{
+    static uint16_t screens[2][FBCON_MAX_COLUMNS * FBCON_MAX_ROWS];
+    if (!fbcon_active()) {
+        return; // VGA text mode
+    }
+    struct fbcon_info info;
+    fbcon_get_info(&info);
+    size_t cells = info.columns * info.rows;
+    for (size_t i = 0; i < cells; i++) {
+        screens[0][i] = (uint16_t)(('a' + i % 26) | 0x0700);
+        screens[1][i] = (uint16_t)(('A' + i % 26) | 0x1F00);
+    }
+
+    uint32_t flags = irq_save();
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 100; i++) {
+        fbcon_dirty(0, cells);
+        fbcon_flush(screens[i & 1]);
+    }
+    result->cycles = rdtsc() - start;
+    fbcon_invalidate(); // the terminal's own text again
+    irq_restore(flags);
+    terminal_write("", 0);
+    result->ops = 100;
+    result->bytes = 100 * (uint64_t)info.size;
+}
+
+static void bench_nop_handler(struct interrupt_frame* frame, void* ctx)
+{
+    (void)frame;
+    (void)ctx;
+}
+
+static void bench_irq_roundtrip(struct bench_result* result)
+{
+    if (irq_register(TEST_VECTOR, bench_nop_handler, NULL) != 0) {
+        return;
+    }
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 10000; i++) {
+        __asm__ volatile("int %0" : : "i"(TEST_VECTOR) : "memory");
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 10000;
+    irq_unregister(TEST_VECTOR);
+}
+
+// Average cost of the tick interrupt (dispatch, timer wheel, scheduler tick and EOI), whichever timer drives it
+static void bench_tick_irq(struct bench_result* result)
+{
+    uint8_t vector = apic_active() ? LAPIC_TIMER_VECTOR : IRQ_VECTOR(0);
+    struct irq_stats before, after;
+    irq_get_stats(vector, &before);
+    sleep_ms(200);
+    irq_get_stats(vector, &after);
+    result->ops = after.count - before.count;
+    result->cycles = after.cycles - before.cycles;
+}
+
+static void bench_copy(struct bench_result* result, memcpy_fn copy)
+{
+    char* src = kmalloc(BENCH_BUFFER_SIZE);
+    char* dst = kmalloc(BENCH_BUFFER_SIZE);
+    if (src != NULL && dst != NULL) {
+        memset(src, 0x5A, BENCH_BUFFER_SIZE);
+        copy(dst, src, BENCH_BUFFER_SIZE); // fault everything in / warm the cache first
+        uint64_t start = rdtsc();
+        for (int i = 0; i < 256; i++) {
+            copy(dst, src, BENCH_BUFFER_SIZE);
+        }
+        result->cycles = rdtsc() - start;
+        result->ops = 256;
+        result->bytes = 256ull * BENCH_BUFFER_SIZE;
+    }
+    kfree(src);
+    kfree(dst);
+}
+
+static void bench_memcpy(struct bench_result* result)
+{
+    bench_copy(result, memcpy);
+}
+
+// The variants on their own, the memcpy above only reaches the bulk one for big copies
+static void bench_copy_variant(struct bench_result* result, const char* name)
+{
+    const struct memops* ops = memops_find(name);
+    if (ops != NULL) {
+        bench_copy(result, ops->memcpy);
+    }
+}
+
+static void bench_memcpy_scalar(struct bench_result* result)
+{
+    bench_copy_variant(result, "scalar");
+}
+
+static void bench_memcpy_rep(struct bench_result* result)
+{
+    bench_copy_variant(result, "rep");
+}
+
+static void bench_memcpy_sse2(struct bench_result* result)
+{
+    bench_copy_variant(result, "sse2");
+}
+
+static void bench_memset(struct bench_result* result)
+{
+    char* dst = kmalloc(BENCH_BUFFER_SIZE);
+    if (dst != NULL) {
+        memset(dst, 0, BENCH_BUFFER_SIZE);
+        uint64_t start = rdtsc();
+        for (int i = 0; i < 256; i++) {
+            memset(dst, i, BENCH_BUFFER_SIZE);
+        }
+        result->cycles = rdtsc() - start;
+        result->ops = 256;
+        result->bytes = 256ull * BENCH_BUFFER_SIZE;
+    }
+    kfree(dst);
+}
+
+static void bench_kmalloc(struct bench_result* result)
+{
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 100000; i++) {
+        kfree(kmalloc(64));
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 100000;
+}
+
+// A window of live objects of every size class, closer to real use than alloc/free of one size
+static void bench_kmalloc_mixed(struct bench_result* result)
+{
+    void* live[64] = { NULL };
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 100000; i++) {
+        int slot = (i * 7) & 63;
+        kfree(live[slot]);
+        live[slot] = kmalloc(KMALLOC_MIN_SIZE << (i % KMALLOC_CLASSES));
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 100000;
+    for (int i = 0; i < 64; i++) {
+        kfree(live[i]);
+    }
+}
+
+static void bench_pmm_page(struct bench_result* result)
+{
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 10000; i++) {
+        pmm_free_page(pmm_alloc_page());
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 10000;
+}
+
+// First touches of a reserved area: a #PF, a zeroed frame and a mapping each
+static void bench_vmm_fault(struct bench_result* result)
+{
+    volatile uint8_t* area = vmm_reserve(1024 * PAGE_SIZE, 0, "bench");
+    if (area == NULL) {
+        return;
+    }
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 1024; i++) {
+        area[i * PAGE_SIZE] = 1;
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 1024;
+    result->bytes = 1024 * PAGE_SIZE;
+    vmm_release((void*)area);
+}
+
+static void bench_yield(struct bench_result* result)
+{
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 10000; i++) {
+        thread_yield();
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 10000;
+}
+
+// Timestamps: the raw counter, the clocks built on it, and newlib's view of the wall clock
+static void bench_rdtsc(struct bench_result* result)
+{
+    volatile uint64_t sink;
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 100000; i++) {
+        sink = rdtsc();
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 100000;
+    (void)sink;
+}
+
+static void bench_clock_monotonic(struct bench_result* result)
+{
+    volatile uint64_t sink;
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 100000; i++) {
+        sink = clock_monotonic_ns();
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 100000;
+    (void)sink;
+}
+
+static void bench_clock_realtime(struct bench_result* result)
+{
+    volatile uint64_t sink;
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 100000; i++) {
+        sink = clock_realtime_ns();
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 100000;
+    (void)sink;
+}
+
+static void bench_gettimeofday(struct bench_result* result)
+{
+    struct timeval tv;
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 100000; i++) {
+        gettimeofday(&tv, NULL);
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 100000;
+}
+
+// A typical kernel message into the log ring. Debug records never reach the console, so this is the caller's
+// cost only. Half the ring, so the boot messages are still there for dmesg afterwards
+static void bench_kprintf(struct bench_result* result)
+{
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < KLOG_RECORDS / 2; i++) {
+        klog(KLOG_DEBUG, "[BENCH] message %lu of %u at %p\n", (unsigned long)i, KLOG_RECORDS / 2, (void*)result);
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = KLOG_RECORDS / 2;
+}
+
+// The same formatting with our formatter and with newlib's
+static void bench_format(struct bench_result* result, int newlib)
+{
+    char buf[KLOG_TEXT_MAX];
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < 10000; i++) {
+        if (newlib) {
+            snprintf(buf, sizeof(buf), "[BENCH] message %lu of %u at %p\n", (unsigned long)i, 10000u, (void*)buf);
+        } else {
+            ksnprintf(buf, sizeof(buf), "[BENCH] message %lu of %u at %p\n", (unsigned long)i, 10000u, (void*)buf);
+        }
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 10000;
+}
+
+static void bench_ksnprintf(struct bench_result* result)
+{
+    bench_format(result, 0);
+}
+
+static void bench_snprintf(struct bench_result* result)
+{
+    bench_format(result, 1);
+}
+
+// Null system call latency from ring 3. The program's start and exit cost is measured with 0 calls and taken out
+#define BENCH_SYSCALLS 100000
+
+static uint64_t run_user(const struct user_program* program, uint32_t arg)
+{
+    uint64_t start = rdtsc();
+    if (user_spawn(program, arg) != 0) {
+        return 0;
+    }
+    user_wait();
+    return rdtsc() - start;
+}
+
+static void bench_syscall(struct bench_result* result, const char* name)
+{
+    const struct user_program* program = user_find(name);
+    if (program == NULL) {
+        return; // no sysenter on this CPU
+    }
+    uint64_t base = run_user(program, 0);
+    uint64_t total = run_user(program, BENCH_SYSCALLS);
+    result->cycles = total > base ? total - base : 0;
+    result->ops = BENCH_SYSCALLS;
+}
+
+static void bench_syscall_int80(struct bench_result* result)
+{
+    bench_syscall(result, "nullsys_int80");
+}
+
+static void bench_syscall_sysenter(struct bench_result* result)
+{
+    bench_syscall(result, "nullsys_sysenter");
+}
+
+// Path resolution through the dentry cache
+static void bench_vfs_lookup(struct bench_result* result)
+{
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 100000; i++) {
+        vfs_lookup("/etc/motd");
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 100000;
+}
+
+// Disk benchmarks on the first drive (bench.sh attaches a scratch disk), they do nothing without one
+#define BENCH_DISK_BYTES (4 * 1024 * 1024)
+#define BENCH_DISK_CHUNK (ATA_MAX_SECTORS * ATA_SECTOR_SIZE) // one full size command
+
+static void bench_ata_read(struct bench_result* result, int dma)
+{
+    const struct ata_drive* drive = ata_get_drive(0);
+    if (drive == NULL || drive->sectors < BENCH_DISK_BYTES / ATA_SECTOR_SIZE || (dma && !ata_dma_available())) {
+        return;
+    }
+    uint32_t buffer = pmm_alloc_pages(BENCH_DISK_CHUNK / PAGE_SIZE);
+    if (buffer == 0) {
+        return;
+    }
+    ata_set_dma(dma);
+    uint64_t start = rdtsc();
+    for (uint32_t offset = 0; offset < BENCH_DISK_BYTES; offset += BENCH_DISK_CHUNK) {
+        ata_read(0, offset / ATA_SECTOR_SIZE, BENCH_DISK_CHUNK / ATA_SECTOR_SIZE, (void*)buffer);
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = BENCH_DISK_BYTES / BENCH_DISK_CHUNK;
+    result->bytes = BENCH_DISK_BYTES;
+    ata_set_dma(1);
+    pmm_free_pages(buffer, BENCH_DISK_CHUNK / PAGE_SIZE);
+}
+
+static void bench_ata_read_dma(struct bench_result* result)
+{
+    bench_ata_read(result, 1);
+}
+
+static void bench_ata_read_pio(struct bench_result* result)
+{
+    bench_ata_read(result, 0);
+}
+
+// Cold sequential reads a block at a time, the read ahead is what turns them into full size commands
+static void bench_bcache_seq_read(struct bench_result* result)
+{
+    const struct ata_drive* drive = ata_get_drive(0);
+    if (drive == NULL || drive->sectors < BENCH_DISK_BYTES / ATA_SECTOR_SIZE) {
+        return;
+    }
+    bcache_invalidate(0);
+    uint64_t start = rdtsc();
+    for (uint32_t block = 0; block < BENCH_DISK_BYTES / BCACHE_BLOCK_SIZE; block++) {
+        struct buf* b = bread(0, block);
+        if (b != NULL) {
+            brelse(b);
+        }
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = BENCH_DISK_BYTES / BCACHE_BLOCK_SIZE;
+    result->bytes = BENCH_DISK_BYTES;
+}
+
+static void bench_bcache_hit(struct bench_result* result)
+{
+    struct buf* b = bread(0, 0);
+    if (b == NULL) {
+        return;
+    }
+    brelse(b);
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 100000; i++) {
+        brelse(bread(0, 0));
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 100000;
+}
+
+#define SMP_WORK_UNITS 16384 // total for the scaling benchmarks, split evenly between the CPUs
+#define SMP_WORK_ROUNDS 1000
+
+// One cache line per CPU, so the CPUs don't slow each other down writing their results
+struct smp_slot {
+    uint32_t sum;
+    uint32_t apic_id;
+} __attribute__((aligned(64)));
+
+static struct smp_slot smp_slots[SMP_MAX_CPUS];
+
+static uint32_t smp_work_unit(uint32_t unit)
+{
+    uint32_t x = unit + 1;
+    for (int i = 0; i < SMP_WORK_ROUNDS; i++) { // xorshift, registers only
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+    }
+    return x;
+}
+
+// Runs on every CPU taking part, arg is their number. Touches nothing shared but its own slot
+static void smp_work(void* arg)
+{
+    uint32_t cpus = (uint32_t)*(int*)arg;
+    uint32_t id = smp_processor_id();
+    uint32_t sum = 0;
+    for (uint32_t unit = SMP_WORK_UNITS * id / cpus; unit < SMP_WORK_UNITS * (id + 1) / cpus; unit++) {
+        sum += smp_work_unit(unit);
+    }
+    smp_slots[id].sum = sum;
+    smp_slots[id].apic_id = apic_active() ? lapic_id() : 0;
+}
+
+// The same work on one CPU and on all of them: ns_per_op of smp_work_all times the CPU count should come
+// close to that of smp_work_1
+static void bench_smp_work(struct bench_result* result, int cpus)
+{
+    cpus = cpus < smp_cpu_count() ? cpus : smp_cpu_count();
+    uint64_t start = rdtsc();
+    smp_run(cpus, smp_work, &cpus);
+    result->cycles = rdtsc() - start;
+    result->ops = SMP_WORK_UNITS;
+}
+
+static void bench_smp_work_1(struct bench_result* result)
+{
+    bench_smp_work(result, 1);
+}
+
+static void bench_smp_work_all(struct bench_result* result)
+{
+    bench_smp_work(result, SMP_MAX_CPUS);
+}
+
+static void smp_nop(void* arg)
+{
+    (void)arg;
+}
+
+// IPI to another CPU, it wakes up, runs an empty function and reports back
+static void bench_ipi_roundtrip(struct bench_result* result)
+{
+    if (smp_cpu_count() < 2) {
+        return;
+    }
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 1000; i++) {
+        smp_run(2, smp_nop, NULL);
+    }
+    result->cycles = rdtsc() - start;
+    result->ops = 1000;
+}
+
+// Self tests
+
+static int test_kmalloc(void)
+{
+    struct kmalloc_stats before, after;
+    kmalloc_get_stats(&before);
+
+    for (size_t size = 1; size <= 8192; size = size * 3 + 1) {
+        unsigned char* p = kmalloc(size);
+        if (p == NULL || kmalloc_usable_size(p) < size) {
+            return -1;
+        }
+        memset(p, (int)size, size);
+        p = krealloc(p, size * 2);
+        if (p == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < size; i++) {
+            if (p[i] != (unsigned char)size) {
+                return -1;
+            }
+        }
+        kfree(p);
+    }
+
+    unsigned char* zero = kzalloc(300);
+    int dirty = zero == NULL;
+    for (int i = 0; zero != NULL && i < 300; i++) {
+        dirty |= zero[i];
+    }
+    kfree(zero);
+
+    kmalloc_get_stats(&after);
+    return (dirty || after.bytes_in_use != before.bytes_in_use) ? -1 : 0;
+}
+
+static int test_pmm(void)
+{
+    size_t free_before = pmm_free_frames();
+    uint32_t block = pmm_alloc_pages(8);
+    if (block == 0 || (block & (8 * PAGE_SIZE - 1)) != 0 || !pmm_is_used(block)) {
+        return -1;
+    }
+    pmm_free_pages(block, 8);
+    return pmm_free_frames() == free_before ? 0 : -1;
+}
+
+// Reserving costs no frames, every page read or written reads zero, releasing gives the frames back
+static int test_vmm(void)
+{
+    size_t pages = 16;
+    int ok = 1;
+    for (int round = 0; round < 2 && ok; round++) { // the first round may leave a new page table behind
+        size_t free_before = pmm_free_frames();
+        struct vmm_stats before, after;
+        vmm_get_stats(&before);
+        volatile uint32_t* area = vmm_reserve(pages * PAGE_SIZE, VMM_GUARD, "selftest");
+        if (area == NULL) {
+            return -1;
+        }
+        ok = pmm_free_frames() == free_before;
+        for (size_t i = 0; i < pages; i++) {
+            volatile uint32_t* page = area + i * (PAGE_SIZE / sizeof(uint32_t));
+            ok = ok && page[i] == 0 && page[PAGE_SIZE / sizeof(uint32_t) - 1] == 0;
+            page[i] = (uint32_t)i + 1;
+            ok = ok && page[i] == i + 1;
+        }
+        vmm_get_stats(&after);
+        ok = ok && after.minor_faults - before.minor_faults == pages
+            && after.resident_pages - before.resident_pages == pages
+            && after.reserved_pages - before.reserved_pages == pages
+            && vmm_guard_owner((uint32_t)area - 1) != NULL;
+        vmm_release((void*)area);
+        ok = ok && (round == 0 || pmm_free_frames() == free_before);
+    }
+    return ok ? 0 : -1;
+}
+
+static int test_sleep(void)
+{
+    uint64_t start = timer_uptime_ms();
+    sleep_ms(20);
+    uint64_t slept = timer_uptime_ms() - start;
+    return (slept >= 20 && slept < 200) ? 0 : -1;
+}
+
+static struct wait_queue test_wait;
+static volatile int test_flag;
+
+static void test_thread_body(void* arg)
+{
+    (void)arg;
+    test_flag = 1;
+    wake_up(&test_wait);
+}
+
+static int test_threads(void)
+{
+    wait_queue_init(&test_wait);
+    test_flag = 0;
+    if (thread_create("selftest", test_thread_body, NULL, THREAD_PRIO_NORMAL) == NULL) {
+        return -1;
+    }
+    wait_event(&test_wait, test_flag);
+    return 0;
+}
+
+// Two threads keep a different value in XMM5 while yielding to each other, lazy switching must preserve both
+static volatile int fpu_test_errors;
+static volatile int fpu_test_done;
+
+static void fpu_test_round(uint32_t seed)
+{
+    uint32_t in[4] = { seed, seed + 1, seed + 2, seed + 3 };
+    uint32_t out[4];
+    __asm__ volatile("movdqu %0, %%xmm5" : : "m"(in));
+    for (int i = 0; i < 100; i++) {
+        thread_yield();
+        __asm__ volatile("movdqu %%xmm5, %0" : "=m"(out));
+        if (out[0] != in[0] || out[3] != in[3]) {
+            fpu_test_errors++;
+        }
+    }
+}
+
+static void fpu_test_body(void* arg)
+{
+    (void)arg;
+    fpu_test_round(0x1000);
+    fpu_test_done = 1;
+    wake_up(&test_wait);
+}
+
+static int test_fpu(void)
+{
+    if (!(fpu_features() & FPU_HAS_SSE2)) {
+        return 0;
+    }
+    wait_queue_init(&test_wait);
+    fpu_test_errors = 0;
+    fpu_test_done = 0;
+    if (thread_create("fputest", fpu_test_body, NULL, THREAD_PRIO_NORMAL) == NULL) {
+        return -1;
+    }
+    fpu_test_round(0x2000);
+    wait_event(&test_wait, fpu_test_done);
+    return fpu_test_errors == 0 ? 0 : -1;
+}
+
+// Runs the hello program and checks the user copy helpers refuse kernel addresses
+static int test_user(void)
+{
+    char buffer[4];
+    if (copy_from_user(buffer, (uint32_t)test_user, sizeof(buffer)) == 0 || copy_to_user(0, buffer, 1) == 0) {
+        return -1;
+    }
+    const struct user_program* hello = user_find("hello");
+    if (hello == NULL || user_spawn(hello, 0) != 0) {
+        return -1;
+    }
+    return user_wait();
+}
+
+// A system call that copies with SSE2 leaves the program's XMM registers alone
+static int test_user_xmm(void)
+{
+    const struct user_program* program = user_find("xmm_keep");
+    if (program == NULL) {
+        return 0; // no SSE2, the copies never touch the XMM registers
+    }
+    if (user_spawn(program, 0) != 0) {
+        return -1;
+    }
+    return user_wait();
+}
+
+// Reads a file from the initrd through a file descriptor and compares it with the mapped contents
+static int test_vfs(void)
+{
+    size_t size;
+    const char* data = vfs_map("/etc/motd", &size);
+    if (data == NULL) {
+        return vfs_lookup("/") == vfs_root() ? 0 : -1; // booted without an initrd
+    }
+    int fd = vfs_open("//etc/./motd");
+    if (fd < 0) {
+        return -1;
+    }
+    char buffer[64];
+    int ok = vfs_lseek(fd, -1, SEEK_END) == (int)size - 1 && vfs_read(fd, buffer, sizeof(buffer)) == 1
+        && buffer[0] == data[size - 1] && vfs_lseek(fd, 0, SEEK_SET) == 0;
+    size_t done = 0;
+    int n;
+    while (ok && (n = vfs_read(fd, buffer, sizeof(buffer))) > 0) {
+        ok = memcmp(buffer, data + done, (size_t)n) == 0;
+        done += (size_t)n;
+    }
+    ok = ok && done == size && vfs_close(fd) == 0 && vfs_close(fd) < 0 && vfs_open("/etc/nonexistent") < 0;
+    return ok ? 0 : -1;
+}
+
+// Writes a pattern to the end of the first disk with DMA and reads it back with PIO (and the other way around),
+// then puts the original sectors back
+#define TEST_DISK_SECTORS 64
+
+static int test_ata(void)
+{
+    const struct ata_drive* drive = ata_get_drive(0);
+    if (drive == NULL || drive->sectors < TEST_DISK_SECTORS) {
+        return 0;
+    }
+    uint32_t lba = drive->sectors - TEST_DISK_SECTORS;
+    size_t size = TEST_DISK_SECTORS * ATA_SECTOR_SIZE;
+    uint8_t* saved = kmalloc(size);
+    uint8_t* pattern = kmalloc(size);
+    uint8_t* check = kmalloc(size);
+    int ok = saved != NULL && pattern != NULL && check != NULL && ata_read(0, lba, TEST_DISK_SECTORS, saved) == 0;
+    for (int dma = 0; ok && dma <= ata_dma_available(); dma++) {
+        for (size_t i = 0; i < size; i++) {
+            pattern[i] = (uint8_t)(i * 7 + dma);
+        }
+        ata_set_dma(dma);
+        ok = ata_write(0, lba, TEST_DISK_SECTORS, pattern) == 0;
+        ata_set_dma(!dma);
+        ok = ok && ata_read(0, lba, TEST_DISK_SECTORS, check) == 0 && memcmp(pattern, check, size) == 0;
+    }
+    ata_set_dma(1);
+    if (saved != NULL && ata_write(0, lba, TEST_DISK_SECTORS, saved) != 0) {
+        ok = 0;
+    }
+    ok = ok && ata_read(0, 0xFFFFFFF0, 1, check) < 0; // past the end
+    kfree(saved);
+    kfree(pattern);
+    kfree(check);
+    return ok ? 0 : -1;
+}
+
+// A change through the cache reaches the disk on sync, and sequential misses get merged by the driver
+static int test_bcache(void)
+{
+    const struct ata_drive* drive = ata_get_drive(0);
+    if (drive == NULL || drive->sectors < 64 * BCACHE_SECTORS) {
+        return 0;
+    }
+    uint8_t* check = kmalloc(BCACHE_BLOCK_SIZE);
+    bcache_invalidate(0);
+    struct ata_stats ata_before, ata_after;
+    ata_get_stats(&ata_before);
+    struct buf* b = bread(0, 0);
+    int ok = check != NULL && b != NULL;
+    if (b != NULL) {
+        brelse(b);
+    }
+    b = ok ? bread(0, 1) : NULL; // sequential, reads ahead
+    ok = ok && b != NULL;
+    ata_get_stats(&ata_after);
+    ok = ok && ata_after.merged > ata_before.merged;
+
+    if (ok) {
+        uint8_t old = b->data[100];
+        b->data[100] = (uint8_t)~old;
+        bdirty(b);
+        ok = bcache_sync(0) == 0 && ata_read(0, BCACHE_SECTORS, BCACHE_SECTORS, check) == 0
+            && memcmp(check, b->data, BCACHE_BLOCK_SIZE) == 0;
+        b->data[100] = old;
+        bdirty(b);
+        ok = bcache_sync(0) == 0 && ok;
+    }
+    if (b != NULL) {
+        brelse(b);
+    }
+    kfree(check);
+    return ok ? 0 : -1;
+}
+
+// The ns scale matches the calibrated rate, the monotonic clock never goes back and keeps pace with the tick,
+// and the wall clock came from a working RTC
+static int test_clock(void)
+{
+    uint64_t second = tsc_cycles_to_ns((uint64_t)tsc_khz() * 1000);
+    if (second < 999999000 || second > 1000001000) {
+        return -1;
+    }
+    uint64_t last = clock_monotonic_ns();
+    for (int i = 0; i < 10000; i++) {
+        uint64_t now = clock_monotonic_ns();
+        if (now < last) {
+            return -1;
+        }
+        last = now;
+    }
+    uint64_t start = clock_monotonic_ns();
+    uint64_t start_ms = timer_uptime_ms();
+    sleep_ms(20);
+    uint64_t slept = clock_monotonic_ns() - start;
+    uint64_t slept_ms = timer_uptime_ms() - start_ms;
+    if (slept < 20000000 || slept > 200000000 || slept / 1000000 + 2 < slept_ms || slept_ms + 2 < slept / 1000000) {
+        return -1;
+    }
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec >= 1577836800 ? 0 : -1; // 2020-01-01
+}
+
+static volatile uint64_t cascade_fired;
+
+static void cascade_timer_fn(void* arg)
+{
+    cascade_fired = timer_ticks();
+    wake_up((struct wait_queue*)arg);
+}
+
+// A timer past tv1 comes down through a cascade and still fires on its tick, while the CPU sits in nohz idle
+// across the tv1 wrap (any 300 tick window holds one)
+static int test_timer_cascade(void)
+{
+    struct wait_queue wait;
+    struct timer timer;
+    wait_queue_init(&wait);
+    timer_setup(&timer, cascade_timer_fn, &wait);
+    cascade_fired = 0;
+    uint32_t flags = irq_save();
+    uint64_t start = timer_ticks();
+    timer_add(&timer, 300);
+    irq_restore(flags);
+    wait_event(&wait, cascade_fired != 0);
+    uint64_t late = cascade_fired - start - 300;
+    return late <= 1 ? 0 : -1;
+}
+
+// The tick runs at the rate it was asked for, measured against the TSC (which is calibrated independently)
+static int test_tick_rate(void)
+{
+    uint64_t ticks = timer_ticks();
+    uint64_t start = rdtsc();
+    while (timer_ticks() - ticks < timer_hz() / 10) {
+        thread_yield();
+    }
+    uint64_t us = tsc_cycles_to_us(rdtsc() - start);
+    return (us >= 90000 && us <= 110000) ? 0 : -1;
+}
+
+// Every CPU ran its share (the total matches a single CPU's) and found its own struct cpu through %gs
+static int test_smp(void)
+{
+    int cpus = smp_cpu_count();
+    if (smp_run(cpus, smp_work, &cpus) != cpus) {
+        return -1;
+    }
+    uint32_t sum = 0, expected = 0;
+    for (int id = 0; id < cpus; id++) {
+        sum += smp_slots[id].sum;
+        if (apic_active() && smp_slots[id].apic_id != smp_get_cpu(id)->apic_id) {
+            return -1;
+        }
+    }
+    for (uint32_t unit = 0; unit < SMP_WORK_UNITS; unit++) {
+        expected += smp_work_unit(unit);
+    }
+    return sum == expected ? 0 : -1;
+}
+
+static int test_ksyms(void)
+{
+    if (ksym_count() == 0) {
+        return 0; // kernel linked without a symbol table, nothing to check
+    }
+    uint32_t offset;
+    const char* name = ksym_lookup((uint32_t)test_ksyms + 1, &offset);
+    return (name != NULL && strcmp(name, "test_ksyms") == 0 && offset == 1) ? 0 : -1;
+}
+
+// The formatter agrees with printf on what the kernel uses, and a message comes back out of the ring intact
+static int test_klog(void)
+{
+    char buf[32];
+    if (ksnprintf(buf, sizeof(buf), "%d|%5u|%-4s|%08lx|%c%%", -42, 7u, "ab", 0xbeefUL, 'z') != 26
+        || strcmp(buf, "-42|    7|ab  |0000beef|z%") != 0) {
+        return -1;
+    }
+    if (ksnprintf(buf, sizeof(buf), "%llu %.3s %-3d|", 12345678901234ULL, "abcdef", 5) != 23
+        || strcmp(buf, "12345678901234 abc 5  |") != 0) {
+        return -1;
+    }
+    if (ksnprintf(buf, 4, "%s", "truncated") != 9 || strcmp(buf, "tru") != 0) {
+        return -1;
+    }
+
+    uint32_t seq = klog_seq();
+    klog(KLOG_DEBUG, "[TEST] klog %p\n", (void*)buf);
+    struct klog_entry entry;
+    char expected[32];
+    int length = ksnprintf(expected, sizeof(expected), "[TEST] klog %p\n", (void*)buf);
+    return (klog_get(seq, &entry) == 0 && entry.level == KLOG_DEBUG && entry.cpu == smp_processor_id()
+               && entry.length == length && strcmp(entry.text, expected) == 0)
+        ? 0
+        : -1;
+}
+
+void bench_init(void)
+{
+    bench_register("terminal_write", bench_terminal_write);
+    bench_register("scrollup", bench_scrollup);
+    bench_register("fbcon_redraw", bench_fbcon_redraw);
+    bench_register("irq_roundtrip", bench_irq_roundtrip);
+    bench_register("tick_irq", bench_tick_irq);
+    bench_register("memcpy", bench_memcpy);
+    bench_register("memcpy_scalar", bench_memcpy_scalar);
+    bench_register("memcpy_rep", bench_memcpy_rep);
+    bench_register("memcpy_sse2", bench_memcpy_sse2);
+    bench_register("memset", bench_memset);
+    bench_register("kmalloc", bench_kmalloc);
+    bench_register("kmalloc_mixed", bench_kmalloc_mixed);
+    bench_register("pmm_page", bench_pmm_page);
+    bench_register("vmm_fault", bench_vmm_fault);
+    bench_register("yield", bench_yield);
+    bench_register("rdtsc", bench_rdtsc);
+    bench_register("clock_monotonic", bench_clock_monotonic);
+    bench_register("clock_realtime", bench_clock_realtime);
+    bench_register("gettimeofday", bench_gettimeofday);
+    bench_register("kprintf", bench_kprintf);
+    bench_register("ksnprintf", bench_ksnprintf);
+    bench_register("snprintf", bench_snprintf);
+    bench_register("syscall_int80", bench_syscall_int80);
+    bench_register("syscall_sysenter", bench_syscall_sysenter);
+    bench_register("vfs_lookup", bench_vfs_lookup);
+    bench_register("ata_read_dma", bench_ata_read_dma);
+    bench_register("ata_read_pio", bench_ata_read_pio);
+    bench_register("bcache_seq_read", bench_bcache_seq_read);
+    bench_register("bcache_hit", bench_bcache_hit);
+    bench_register("smp_work_1", bench_smp_work_1);
+    bench_register("smp_work_all", bench_smp_work_all);
+    bench_register("ipi_roundtrip", bench_ipi_roundtrip);
+
+    selftest_register("memops", memops_selftest);
+    selftest_register("kmalloc", test_kmalloc);
+    selftest_register("pmm", test_pmm);
+    selftest_register("vmm", test_vmm);
+    selftest_register("sleep", test_sleep);
+    selftest_register("tick_rate", test_tick_rate);
+    selftest_register("timer_cascade", test_timer_cascade);
+    selftest_register("clock", test_clock);
+    selftest_register("threads", test_threads);
+    selftest_register("fpu", test_fpu);
+    selftest_register("user", test_user);
+    selftest_register("user_xmm", test_user_xmm);
+    selftest_register("vfs", test_vfs);
+    selftest_register("ata", test_ata);
+    selftest_register("bcache", test_bcache);
+    selftest_register("smp", test_smp);
+    selftest_register("ksyms", test_ksyms);
+    selftest_register("klog", test_klog);
+}
+
+void qemu_exit(uint8_t code)
+{
+    outb(QEMU_DEBUG_EXIT_PORT, code);
+}
+
+void bench_main(void* arg)
+{
+    (void)arg;
+    printf("BENCH_START tsc_khz=%lu\n", (unsigned long)tsc_khz());
+    int failures = selftest_run_all() + (int)dropped;
+    bench_run(NULL);
+    printf("BENCH_DONE failures=%d\n", failures);
+    fflush(stdout);
+    serial_flush(); // the results have to be out of the UART before QEMU goes away
+
+    qemu_exit((uint8_t)(failures > 0 ? 1 : 0));
+    printf("isa-debug-exit not present, halting\n");
+    fflush(stdout);
+    serial_flush();
+    __asm__ volatile("cli; 1: hlt; jmp 1b");
+    __builtin_unreachable();
+}
@@ -0,0 +1,38 @@
+#include <stdio.h>
+
+#include <kernel/boottrace.h>
+#include <kernel/tsc.h>
+
+struct boot_stage {
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+};
+
+static struct boot_stage stages[BOOT_STAGE_MAX];
+static uint32_t stage_count;
+
+void boot_trace_record(const char* name, uint64_t start, uint64_t end)
+{
+    if (stage_count < BOOT_STAGE_MAX) {
+        stages[stage_count].name = name;
+        stages[stage_count].start = start;
+        stages[stage_count].end = end;
+        stage_count++;
+    }
+}
+
+void boot_trace_report(void)
+{
+    uint64_t last = boot_tsc;
+    printf("boot stages (TSC %lu.%03lu MHz):\n", (unsigned long)(tsc_khz() / 1000), (unsigned long)(tsc_khz() % 1000));
+    printf("  %-12s %10s %10s\n", "stage", "at (us)", "took (us)");
+    for (uint32_t i = 0; i < stage_count; i++) {
+        printf("  %-12s %10lu %10lu\n",
+            stages[i].name,
+            (unsigned long)tsc_cycles_to_us(stages[i].start - boot_tsc),
+            (unsigned long)tsc_cycles_to_us(stages[i].end - stages[i].start));
+        last = stages[i].end;
+    }
+    printf("  %-12s %10lu\n", "total", (unsigned long)tsc_cycles_to_us(last - boot_tsc));
+}
@@ -0,0 +1,93 @@
+#include <kernel/clock.h>
+#include <kernel/cpu.h>
+#include <kernel/klog.h>
+#include <kernel/rtc.h>
+#include <kernel/tsc.h>
+
+#define NSEC_PER_SEC 1000000000ull
+
+// A reader needs the TSC value at clock_init and the wall clock time at that moment. The first never changes
+// after boot, the second is 64 bits (two loads on i386) and the RTC interrupt moves it, so it is published with a
+// sequence count: the writer makes seq odd, updates, makes it even again, and a reader that saw an odd seq or a
+// different one afterwards read a torn value and retries. Readers never wait on the writer, nor block it
+
+static uint64_t base_tsc;
+static uint64_t realtime_base; // ns since the epoch at base_tsc
+static uint32_t seq;
+static int exact;
+
+// Days from 1970-01-01 to a date in the Gregorian calendar. Counting years from March puts the leap day last,
+// so the days before a month follow (153 * month + 2) / 5
+static uint32_t days_since_epoch(uint32_t year, uint32_t month, uint32_t day)
+{
+    if (month <= 2) {
+        year--;
+        month += 12;
+    }
+    return 365 * year + year / 4 - year / 100 + year / 400 + (153 * (month - 3) + 2) / 5 + day - 1 - 719468;
+}
+
+static uint64_t rtc_to_ns(const struct rtc_time* time)
+{
+    uint64_t seconds = (uint64_t)days_since_epoch(time->year, time->month, time->day) * 86400
+        + time->hour * 3600u + time->minute * 60u + time->second;
+    return seconds * NSEC_PER_SEC;
+}
+
+static void set_realtime_base(uint64_t base)
+{
+    uint32_t flags = irq_save();
+    __atomic_store_n(&seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    realtime_base = base;
+    __atomic_store_n(&seq, seq + 1, __ATOMIC_RELEASE);
+    irq_restore(flags);
+}
+
+// IRQ8, the RTC just started counting this second: now the time is known to the interrupt latency
+static void pin_second(const struct rtc_time* time)
+{
+    uint64_t old = realtime_base;
+    set_realtime_base(rtc_to_ns(time) - clock_monotonic_ns());
+    __atomic_store_n(&exact, 1, __ATOMIC_RELEASE);
+    klog(KLOG_INFO, "[CLOCK] wall clock pinned to the RTC second, moved by %ld us\n",
+        (long)((int64_t)(realtime_base - old) / 1000));
+}
+
+int clock_init(void)
+{
+    struct rtc_time now;
+    base_tsc = rdtsc();
+    if (rtc_read(&now) != 0) {
+        klog(KLOG_WARN, "[CLOCK] RTC unreadable, the wall clock starts at the epoch\n");
+        return -1;
+    }
+    // Somewhere in the second the RTC shows, take the middle until the update interrupt says where exactly
+    set_realtime_base(rtc_to_ns(&now) + NSEC_PER_SEC / 2);
+    if (rtc_on_next_second(pin_second) != 0) {
+        klog(KLOG_WARN, "[CLOCK] IRQ8 is taken, the wall clock is only good to half a second\n");
+    }
+    return 0;
+}
+
+uint64_t clock_monotonic_ns(void)
+{
+    return tsc_cycles_to_ns(rdtsc() - base_tsc);
+}
+
+uint64_t clock_realtime_ns(void)
+{
+    uint32_t start;
+    uint64_t base;
+    do {
+        start = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+        base = realtime_base;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((start & 1) || __atomic_load_n(&seq, __ATOMIC_RELAXED) != start);
+    return base + clock_monotonic_ns();
+}
+
+int clock_realtime_exact(void)
+{
+    return __atomic_load_n(&exact, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,58 @@
+#include <string.h>
+
+#include <kernel/console.h>
+#include <kernel/serial.h>
+#include <kernel/tty.h>
+
+static int routes[3] = { 0, CONSOLE_DEFAULT, CONSOLE_DEFAULT }; // indexed by fd, stdin has no output
+
+void console_parse_cmdline(const char* cmdline)
+{
+    if (cmdline == NULL) {
+        return;
+    }
+    const char* option = strstr(cmdline, "console=");
+    if (option == NULL) {
+        return;
+    }
+    option += strlen("console=");
+
+    int targets;
+    if (strncmp(option, "vga", 3) == 0) {
+        targets = CONSOLE_VGA;
+    } else if (strncmp(option, "serial", 6) == 0) {
+        targets = CONSOLE_SERIAL;
+    } else if (strncmp(option, "both", 4) == 0) {
+        targets = CONSOLE_VGA | CONSOLE_SERIAL;
+    } else {
+        return;
+    }
+    console_set_route(1, targets);
+    console_set_route(2, targets);
+}
+
+void console_set_route(int fd, int targets)
+{
+    if (fd == 1 || fd == 2) {
+        routes[fd] = targets;
+    }
+}
+
+int console_get_route(int fd)
+{
+    return (fd == 1 || fd == 2) ? routes[fd] : 0;
+}
+
+int console_write(int fd, const char* data, size_t size)
+{
+    if (fd != 1 && fd != 2) {
+        return -1;
+    }
+    if (routes[fd] & CONSOLE_VGA) {
+        terminal_write(data, size);
+    }
+    if (routes[fd] & CONSOLE_SERIAL) {
+        serial_write(data, size);
+    }
+    return (int)size;
+}
@@ -1,31 +1,153 @@
 #include <stdio.h>
+#include <time.h>
 
+#include <kernel/apic.h>
+#include <kernel/ata.h>
+#include <kernel/bcache.h>
+#include <kernel/bench.h>
+#include <kernel/boottrace.h>
+#include <kernel/clock.h>
+#include <kernel/console.h>
+#include <kernel/fbcon.h>
+#include <kernel/fpu.h>
 #include <kernel/gdt.h>
 #include <kernel/idt.h>
+#include <kernel/keyboard.h>
+#include <kernel/klog.h>
+#include <kernel/memops.h>
+#include <kernel/multiboot.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+#include <kernel/serial.h>
+#include <kernel/shell.h>
+#include <kernel/smp.h>
+#include <kernel/syscall.h>
+#include <kernel/tarfs.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <kernel/tsc.h>
 #include <kernel/tty.h>
+#include <kernel/vfs.h>
+#include <kernel/workqueue.h>
+
+static char stdout_buffer[1024]; // printf output is collected here and handed to terminal_write a line at a time
+
+// The first boot module is the initrd (iso.sh puts it there), mounted at /
+static int mount_initrd(struct multiboot_info* mbi)
+{
+    if (!(mbi->flags & MULTIBOOT_INFO_MODS) || mbi->mods_count == 0) {
+        return -1;
+    }
+    struct multiboot_module* mod = (struct multiboot_module*)mbi->mods_addr;
+    return tarfs_mount((const void*)mod->mod_start, mod->mod_end - mod->mod_start);
+}
 
 void kernel_main(uint32_t multiboot_info_addr) // accepts multiboot info address from boot.S
 {
-    terminal_initialize();
-    setvbuf(stdout, NULL, _IONBF, 0); // disable stdout buffering so putchar writes immediately
-    printf("[OK] terminal initialized\n");
-    gdt_install();
-    printf("[OK] gdt installed\n");
-    idt_install();
-    printf("[OK] idt installed\n");
-
-    printf("                   __                    __\n");
-    printf("  ___  __ _____   / /_____ _______  ___ / /\n");
-    printf(" / _ \\/ // / -_) /  '_/ -_) __/ _ \\/ -_) / \n");
-    printf("/_//_/\\_,_/\\__/ /_/\\_\\\\__/_/ /_//_/\\__/_/  \n");
-
-    printf("booted\n\n");
-    printf("READY\n>");
+    struct multiboot_info* mbi = (struct multiboot_info*)multiboot_info_addr;
+    int serial_ok;
+    int initrd_files;
+    int clock_ok;
+    int disks;
+    int cpus;
+
+    boot_trace_record("entry", boot_tsc, rdtsc()); // boot.S and the global constructors
+
+    // Each init stage is timed, add new subsystems with another BOOT_STAGE line
+    BOOT_STAGE("gdt", gdt_install()); // first, in_interrupt() (memcpy, memset) reads the per-CPU data through %gs
+    BOOT_STAGE("fbcon", fbcon_init(mbi)); // before the terminal, which takes the framebuffer console's size
+    BOOT_STAGE("terminal", terminal_initialize());
+    BOOT_STAGE("serial", serial_ok = serial_init()); // polled until the IDT is up, so even the first boot messages reach COM1
+    if (mbi->flags & MULTIBOOT_INFO_CMDLINE) {
+        console_parse_cmdline((const char*)mbi->cmdline);
+    }
+    setvbuf(stdout, stdout_buffer, _IOLBF, sizeof(stdout_buffer)); // line buffered, flush explicitly for partial lines
+    kprintf("[OK] gdt installed\n"); // the first stage, reported once there is a terminal to report it on
+    kprintf("[OK] terminal initialized\n");
+    if (fbcon_active()) {
+        struct fbcon_info fb;
+        fbcon_get_info(&fb);
+        kprintf("[OK] framebuffer console: %lux%lu, %lux%lu cells, %s font\n", (unsigned long)fb.width,
+            (unsigned long)fb.height, (unsigned long)fb.columns, (unsigned long)fb.rows,
+            fb.bios_font ? "BIOS" : "built-in");
+    }
+    BOOT_STAGE("fpu", fpu_init());
+    BOOT_STAGE("memops", memops_init());
+    kprintf("[OK] fpu: %s, memcpy/memset: %s\n", (fpu_features() & FPU_HAS_SSE2) ? "sse2" : "x87 only",
+        memops_current()->name);
+    BOOT_STAGE("idt", idt_install());
+    kprintf("[OK] idt installed\n");
+    if (serial_ok == 0) {
+        serial_enable_irq();
+        kprintf("[OK] serial console on COM1\n");
+    }
+    BOOT_STAGE("pmm", pmm_init(mbi));
+    kprintf("[OK] pmm: %lu MiB free of %lu MiB\n",
+        (unsigned long)(pmm_free_frames() * PAGE_SIZE >> 20),
+        (unsigned long)(pmm_total_frames() * PAGE_SIZE >> 20));
+    BOOT_STAGE("paging", paging_init());
+    kprintf("[OK] paging enabled\n");
+    vfs_init();
+    BOOT_STAGE("initrd", initrd_files = mount_initrd(mbi));
+    if (initrd_files >= 0) {
+        kprintf("[OK] initrd: %d files\n", initrd_files);
+    } else {
+        kprintf("[VFS] no initrd, / is empty\n");
+    }
+    BOOT_STAGE("tsc", tsc_calibrate());
+    kprintf("[OK] tsc: %lu kHz\n", (unsigned long)tsc_khz());
+    BOOT_STAGE("apic", apic_init()); // before the timer, so the tick can come from the LAPIC timer
+    if (apic_active()) {
+        kprintf("[OK] apic: %d cpu%s, IRQs through the IOAPIC, lapic timer %lu kHz\n", apic_cpu_count(),
+            apic_cpu_count() == 1 ? "" : "s", (unsigned long)lapic_timer_khz());
+    } else {
+        kprintf("[APIC] no local APIC / IOAPIC found, staying on the 8259 PIC\n");
+    }
+    BOOT_STAGE("clock", clock_ok = clock_init()); // after apic, IRQ8 must not be pending on the PIC when the IOAPIC takes over
+    if (clock_ok == 0) {
+        time_t now = (time_t)(clock_realtime_ns() / 1000000000);
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        kprintf("[OK] clock: %04d-%02d-%02d %02d:%02d:%02d UTC from the RTC, ns = cycles * %lu >> %lu\n",
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+            (unsigned long)tsc_ns_scale.mult, (unsigned long)tsc_ns_scale.shift);
+    }
+    BOOT_STAGE("timer", timer_init(TIMER_HZ));
+    kprintf("[OK] timer running at %lu Hz\n", timer_hz());
+    BOOT_STAGE("smp", cpus = smp_init());
+    kprintf("[OK] smp: %d cpu%s online\n", cpus, cpus == 1 ? "" : "s");
+    BOOT_STAGE("sched", sched_init());
+    kprintf("[OK] scheduler started\n");
+    BOOT_STAGE("workqueue", workqueue_init());
+    BOOT_STAGE("ata", disks = ata_init());
+    kprintf("[OK] ata: %d disk%s%s\n", disks, disks == 1 ? "" : "s",
+        disks == 0 ? "" : ata_dma_available() ? ", bus master DMA" : ", PIO only");
+    BOOT_STAGE("bcache", bcache_init());
+    BOOT_STAGE("syscall", syscall_init());
+    kprintf("[OK] system calls: int 0x80%s\n", syscall_has_sysenter() ? ", sysenter" : "");
+    BOOT_STAGE("keyboard", keyboard_init());
+    kprintf("[OK] keyboard ready\n");
+    BOOT_STAGE("shell", shell_init());
+    BOOT_STAGE("bench", bench_init());
+
+    kprintf("                   __                    __\n");
+    kprintf("  ___  __ _____   / /_____ _______  ___ / /\n");
+    kprintf(" / _ \\/ // / -_) /  '_/ -_) __/ _ \\/ -_) / \n");
+    kprintf("/_//_/\\_,_/\\__/ /_/\\_\\\\__/_/ /_//_/\\__/_/  \n");
+
+    kprintf("booted\n\n");
+    boot_trace_report();
+    kprintf("READY\n");
+    terminal_defer_refresh(); // the framebuffer console redraws from the kworker as well
+    klog_start(); // from here on kernel messages reach the console through the kworker
+#ifdef KERNEL_BENCH
+    thread_create("bench", bench_main, NULL, THREAD_PRIO_NORMAL); // headless run, exits QEMU when done
+#else
+    thread_create("shell", shell_main, NULL, THREAD_PRIO_NORMAL);
+#endif
 
     // Tests the IDT exception handler with a division by 0 exception
     // __asm__ volatile ("movl $1, %%eax; xorl %%edx, %%edx; movl $0, %%ecx; divl %%ecx" ::: "eax", "ecx", "edx");
 
-    for (;;) { // halts the program so it can observe IRQ interrupts for keyboard testing
-        __asm__ volatile("hlt");
-    }
-}
\ No newline at end of file
+    sched_idle(); // from here on the boot context is the idle thread
+}
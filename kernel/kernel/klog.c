@@ -0,0 +1,373 @@
+#include <string.h>
+
+#include <kernel/console.h>
+#include <kernel/cpu.h>
+#include <kernel/klog.h>
+#include <kernel/smp.h>
+#include <kernel/timer.h>
+#include <kernel/workqueue.h>
+
+#define RECORD_BUSY 0xFFFFFFFFu // in a record's seq while its text is being written
+
+// A slot of the ring. seq works like a seqlock: readers copy the record and check seq didn't change meanwhile
+struct record {
+    volatile uint32_t seq;
+    uint8_t level;
+    uint8_t cpu;
+    uint8_t length;
+    uint8_t reserved;
+    uint64_t tsc;
+    char text[KLOG_TEXT_MAX];
+};
+
+_Static_assert(sizeof(struct record) == 128, "klog records are meant to be two cache lines");
+
+static struct record ring[KLOG_RECORDS];
+static uint32_t next_seq; // reserved by writers with an atomic add
+static uint32_t console_seq; // next record for the console, only touched by whoever holds 'draining'
+static int draining;
+static int async; // set by klog_start, before that every message is printed right away
+static uint32_t truncated;
+static uint32_t lost;
+static struct work drain_work;
+static struct timer poll_timer;
+
+// Formatter
+
+struct output {
+    char* buf;
+    size_t size;
+    size_t length; // what the whole output needs, may be more than fits
+};
+
+static void put(struct output* out, char c)
+{
+    if (out->length + 1 < out->size) {
+        out->buf[out->length] = c;
+    }
+    out->length++;
+}
+
+static void pad(struct output* out, char c, int count)
+{
+    while (count-- > 0) {
+        put(out, c);
+    }
+}
+
+static void put_number(struct output* out, unsigned long long value, int negative, unsigned base, int upper,
+    int width, int zero, int left)
+{
+    const char* set = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char digits[24];
+    int count = 0;
+    if (value <= 0xFFFFFFFFu) { // 32 bit divisions, no libgcc call for the common case
+        uint32_t small = (uint32_t)value;
+        do {
+            digits[count++] = set[small % base];
+            small /= base;
+        } while (small != 0);
+    } else {
+        do {
+            digits[count++] = set[value % base];
+            value /= base;
+        } while (value != 0);
+    }
+
+    int length = count + negative;
+    if (!left && !zero) {
+        pad(out, ' ', width - length);
+    }
+    if (negative) {
+        put(out, '-');
+    }
+    if (!left && zero) {
+        pad(out, '0', width - length);
+    }
+    while (count > 0) {
+        put(out, digits[--count]);
+    }
+    if (left) {
+        pad(out, ' ', width - length);
+    }
+}
+
+int kvsnprintf(char* buf, size_t size, const char* fmt, va_list args)
+{
+    struct output out = { buf, size, 0 };
+
+    for (; *fmt != '\0'; fmt++) {
+        if (*fmt != '%') {
+            put(&out, *fmt);
+            continue;
+        }
+        fmt++;
+
+        int left = 0, zero = 0, width = 0, precision = -1, longs = 0;
+        for (;; fmt++) {
+            if (*fmt == '-') {
+                left = 1;
+            } else if (*fmt == '0') {
+                zero = 1;
+            } else {
+                break;
+            }
+        }
+        if (*fmt == '*') {
+            width = va_arg(args, int);
+            fmt++;
+        } else {
+            while (*fmt >= '0' && *fmt <= '9') {
+                width = width * 10 + (*fmt++ - '0');
+            }
+        }
+        if (*fmt == '.') {
+            fmt++;
+            precision = 0;
+            if (*fmt == '*') {
+                precision = va_arg(args, int);
+                fmt++;
+            } else {
+                while (*fmt >= '0' && *fmt <= '9') {
+                    precision = precision * 10 + (*fmt++ - '0');
+                }
+            }
+        }
+        for (;; fmt++) { // h and z change nothing here, short and size_t arrive as int
+            if (*fmt == 'l') {
+                longs++;
+            } else if (*fmt != 'h' && *fmt != 'z') {
+                break;
+            }
+        }
+
+        switch (*fmt) {
+        case 'd':
+        case 'i': {
+            long long value = longs >= 2 ? va_arg(args, long long) : longs ? va_arg(args, long) : va_arg(args, int);
+            unsigned long long magnitude = value < 0 ? 0 - (unsigned long long)value : (unsigned long long)value;
+            put_number(&out, magnitude, value < 0, 10, 0, width, zero, left);
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X': {
+            unsigned long long value = longs >= 2 ? va_arg(args, unsigned long long)
+                : longs ? va_arg(args, unsigned long) : va_arg(args, unsigned int);
+            put_number(&out, value, 0, *fmt == 'u' ? 10 : 16, *fmt == 'X', width, zero, left);
+            break;
+        }
+        case 'p':
+            put(&out, '0');
+            put(&out, 'x');
+            put_number(&out, (uint32_t)va_arg(args, void*), 0, 16, 0, width - 2, zero, left);
+            break;
+        case 's': {
+            const char* s = va_arg(args, const char*);
+            if (s == NULL) {
+                s = "(null)";
+            }
+            int length = 0;
+            while (s[length] != '\0' && (precision < 0 || length < precision)) {
+                length++;
+            }
+            if (!left) {
+                pad(&out, ' ', width - length);
+            }
+            for (int i = 0; i < length; i++) {
+                put(&out, s[i]);
+            }
+            if (left) {
+                pad(&out, ' ', width - length);
+            }
+            break;
+        }
+        case 'c':
+            put(&out, (char)va_arg(args, int));
+            break;
+        case '%':
+            put(&out, '%');
+            break;
+        case '\0':
+            fmt--; // a lone '%' at the end, let the loop stop
+            break;
+        default: // unknown conversion, printed as it was written
+            put(&out, '%');
+            put(&out, *fmt);
+            break;
+        }
+    }
+
+    if (size > 0) {
+        buf[out.length < size ? out.length : size - 1] = '\0';
+    }
+    return (int)out.length;
+}
+
+int ksnprintf(char* buf, size_t size, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int length = kvsnprintf(buf, size, fmt, args);
+    va_end(args);
+    return length;
+}
+
+// Ring
+
+int klog_get(uint32_t seq, struct klog_entry* entry)
+{
+    const struct record* r = &ring[seq & (KLOG_RECORDS - 1)];
+    if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != seq) {
+        return -1;
+    }
+    entry->seq = seq;
+    entry->tsc = r->tsc;
+    entry->level = r->level;
+    entry->cpu = r->cpu;
+    entry->length = r->length < KLOG_TEXT_MAX ? r->length : KLOG_TEXT_MAX - 1; // a torn read may see anything
+    memcpy(entry->text, r->text, entry->length);
+    entry->text[entry->length] = '\0';
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&r->seq, __ATOMIC_RELAXED) == seq ? 0 : -1; // rewritten while we copied it
+}
+
+uint32_t klog_seq(void)
+{
+    return __atomic_load_n(&next_seq, __ATOMIC_ACQUIRE);
+}
+
+// Prints records until the first one that isn't complete yet, its writer flushes (or schedules a flush) when done
+static void drain(void)
+{
+    struct klog_entry entry;
+    for (;;) {
+        uint32_t head = klog_seq();
+        if (console_seq == head) {
+            return;
+        }
+        if (head - console_seq > KLOG_RECORDS) { // the writers lapped the console
+            uint32_t skipped = head - KLOG_RECORDS - console_seq;
+            lost += skipped;
+            console_seq += skipped;
+            char msg[48];
+            int length = ksnprintf(msg, sizeof(msg), "[KLOG] %lu messages lost\n", (unsigned long)skipped);
+            console_write(1, msg, (size_t)length);
+            continue;
+        }
+        if (klog_get(console_seq, &entry) != 0) {
+            if (klog_seq() - console_seq > KLOG_RECORDS) {
+                continue; // overwritten, not unfinished
+            }
+            return;
+        }
+        console_seq++;
+        if (entry.level <= KLOG_INFO) {
+            console_write(1, entry.text, entry.length);
+        }
+    }
+}
+
+static int next_complete(void)
+{
+    uint32_t seq = console_seq;
+    return seq != klog_seq() && __atomic_load_n(&ring[seq & (KLOG_RECORDS - 1)].seq, __ATOMIC_ACQUIRE) == seq;
+}
+
+void klog_flush(void)
+{
+    // One drainer at a time. A record completed just before the holder lets go would wait for the next message,
+    // so look again after letting go
+    do {
+        if (__atomic_exchange_n(&draining, 1, __ATOMIC_ACQUIRE)) {
+            return; // whoever has it prints ours as well
+        }
+        drain();
+        __atomic_store_n(&draining, 0, __ATOMIC_RELEASE);
+    } while (next_complete());
+}
+
+void klog_panic(void)
+{
+    __atomic_store_n(&draining, 1, __ATOMIC_RELAXED); // never given back, nothing else should print any more
+    drain();
+}
+
+static int vlog(enum klog_level level, const char* fmt, va_list args)
+{
+    uint32_t seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+    struct record* r = &ring[seq & (KLOG_RECORDS - 1)];
+    __atomic_store_n(&r->seq, RECORD_BUSY, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // a reader that sees the new text sees RECORD_BUSY too
+
+    r->tsc = rdtsc();
+    r->level = (uint8_t)level;
+    r->cpu = (uint8_t)smp_processor_id();
+    int length = kvsnprintf(r->text, KLOG_TEXT_MAX, fmt, args);
+    if (length >= KLOG_TEXT_MAX) {
+        __atomic_fetch_add(&truncated, 1, __ATOMIC_RELAXED);
+        length = KLOG_TEXT_MAX - 1;
+        r->text[length - 1] = '\n';
+    }
+    r->length = (uint8_t)length;
+    __atomic_store_n(&r->seq, seq, __ATOMIC_RELEASE);
+
+    if (!async) {
+        klog_flush();
+    } else if (level <= KLOG_INFO && smp_processor_id() == 0) { // the workqueue is the boot CPU's, see poll_tick
+        schedule_work(&drain_work);
+    }
+    return length;
+}
+
+int klog(enum klog_level level, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int length = vlog(level, fmt, args);
+    va_end(args);
+    return length;
+}
+
+int kprintf(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int length = vlog(KLOG_INFO, fmt, args);
+    va_end(args);
+    return length;
+}
+
+static void drain_fn(struct work* work)
+{
+    (void)work;
+    klog_flush();
+}
+
+// Messages from the other CPUs can't schedule work themselves, this picks them up
+static void poll_tick(void* arg)
+{
+    (void)arg;
+    if (console_seq != klog_seq()) {
+        schedule_work(&drain_work);
+    }
+    timer_add(&poll_timer, timer_ms_to_ticks(KLOG_POLL_MS));
+}
+
+void klog_start(void)
+{
+    work_init(&drain_work, drain_fn);
+    klog_flush();
+    async = 1;
+    if (smp_cpu_count() > 1) { // a single CPU doesn't need the wakeups, timer_idle can skip more ticks without it
+        timer_setup(&poll_timer, poll_tick, NULL);
+        timer_add(&poll_timer, timer_ms_to_ticks(KLOG_POLL_MS));
+    }
+}
+
+void klog_get_stats(struct klog_stats* stats)
+{
+    stats->records = klog_seq();
+    stats->truncated = truncated;
+    stats->lost = lost;
+}
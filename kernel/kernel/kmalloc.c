@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <kernel/cpu.h>
+#include <kernel/klog.h>
+#include <kernel/kmalloc.h>
+#include <kernel/pmm.h>
+
+// Kernel heap
+// Every frame the heap owns is recorded in a two level page owner table, so kfree can find the slab (or the
+// size of a large allocation) from any pointer in O(1) without headers in front of the objects.
+// Owner entries: 0 = not ours, even = pointer to the owning struct slab, odd = (page count << 1) | 1 for large blocks
+
+#define SLAB_MAGIC 0x51AB51AB
+
+#ifdef KMALLOC_DEBUG
+#define KMALLOC_REDZONE 16 // bytes in front of and behind each object
+#define REDZONE_BYTE 0xCA
+#define POISON_BYTE 0x6B // freed objects are filled with this to make use-after-free obvious
+#else
+#define KMALLOC_REDZONE 0
+#endif
+
+struct slab { // lives at the start of the first frame of every slab
+    struct slab* next; // links in the class' partial list (slabs with at least one free object)
+    struct slab* prev;
+    void* free_list; // free objects, linked through their first word
+    uint32_t magic;
+    uint16_t inuse;
+    uint16_t total;
+    uint8_t cls;
+};
+
+struct kmalloc_class {
+    size_t size; // usable object size
+    unsigned pages; // frames per slab
+    struct slab* partial;
+};
+
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + 15) & ~15u)
+#define SLOT_SIZE(cls) (classes[cls].size + 2 * KMALLOC_REDZONE)
+
+static struct kmalloc_class classes[KMALLOC_CLASSES] = {
+    { 16, 1, NULL },
+    { 32, 1, NULL },
+    { 64, 1, NULL },
+    { 128, 1, NULL },
+    { 256, 1, NULL },
+    { 512, 2, NULL }, // bigger classes use multi page slabs so the header doesn't waste most of a frame
+    { 1024, 4, NULL },
+    { 2048, 4, NULL },
+};
+
+static uint32_t* page_owner_dir[1024]; // each leaf covers 1024 frames (4 MiB), so the directory spans 4 GiB
+static struct kmalloc_stats stats;
+
+static uint32_t page_owner_get(uint32_t addr)
+{
+    uint32_t frame = addr >> PAGE_SHIFT;
+    uint32_t* leaf = page_owner_dir[frame >> 10];
+    return leaf ? leaf[frame & 1023] : 0;
+}
+
+static int page_owner_set(uint32_t addr, size_t pages, uint32_t owner)
+{
+    for (size_t i = 0; i < pages; i++) {
+        uint32_t frame = (addr >> PAGE_SHIFT) + i;
+        uint32_t* leaf = page_owner_dir[frame >> 10];
+        if (leaf == NULL) {
+            leaf = (uint32_t*)pmm_alloc_page();
+            if (leaf == NULL) {
+                return -1;
+            }
+            memset(leaf, 0, PAGE_SIZE);
+            page_owner_dir[frame >> 10] = leaf;
+        }
+        leaf[frame & 1023] = owner;
+    }
+    return 0;
+}
+
+static inline unsigned size_to_class(size_t size)
+{
+    if (size <= KMALLOC_MIN_SIZE) {
+        return 0;
+    }
+    return 32 - __builtin_clz(size - 1) - 4; // log2 of the next power of two, minus log2(16)
+}
+
+static void account_alloc(size_t bytes)
+{
+    stats.allocs++;
+    stats.bytes_in_use += bytes;
+    if (stats.bytes_in_use > stats.high_water) {
+        stats.high_water = stats.bytes_in_use;
+    }
+}
+
+static struct slab* slab_create(unsigned cls)
+{
+    struct kmalloc_class* c = &classes[cls];
+    uint32_t base = pmm_alloc_pages(c->pages);
+    if (base == 0) {
+        return NULL;
+    }
+    struct slab* slab = (struct slab*)base;
+    if (page_owner_set(base, c->pages, (uint32_t)slab) != 0) {
+        pmm_free_pages(base, c->pages);
+        return NULL;
+    }
+
+    slab->magic = SLAB_MAGIC;
+    slab->cls = cls;
+    slab->inuse = 0;
+    slab->total = (c->pages * PAGE_SIZE - SLAB_HEADER_SIZE) / SLOT_SIZE(cls);
+    slab->free_list = NULL;
+
+    // thread the free list back to front so objects are handed out in address order
+    uint8_t* first = (uint8_t*)base + SLAB_HEADER_SIZE;
+    for (int i = slab->total - 1; i >= 0; i--) {
+        void** obj = (void**)(first + i * SLOT_SIZE(cls));
+        *obj = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    slab->prev = NULL;
+    slab->next = c->partial;
+    if (c->partial) {
+        c->partial->prev = slab;
+    }
+    c->partial = slab;
+    stats.slab_pages += c->pages;
+    return slab;
+}
+
+static void slab_unlink(struct slab* slab)
+{
+    struct kmalloc_class* c = &classes[slab->cls];
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        c->partial = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = slab->prev = NULL;
+}
+
+static void slab_destroy(struct slab* slab)
+{
+    unsigned pages = classes[slab->cls].pages;
+    slab_unlink(slab);
+    slab->magic = 0;
+    page_owner_set((uint32_t)slab, pages, 0);
+    pmm_free_pages((uint32_t)slab, pages);
+    stats.slab_pages -= pages;
+}
+
+#ifdef KMALLOC_DEBUG
+// Layout of a debug slot: [requested size (4 bytes) | redzone][object][redzone up to the end of the slot]
+static void redzone_fill(uint8_t* slot, unsigned cls, size_t size)
+{
+    memset(slot, REDZONE_BYTE, SLOT_SIZE(cls));
+    *(uint32_t*)slot = size;
+}
+
+static void redzone_check(uint8_t* slot, unsigned cls)
+{
+    size_t size = *(uint32_t*)slot;
+    for (size_t i = sizeof(uint32_t); i < KMALLOC_REDZONE; i++) {
+        if (slot[i] != REDZONE_BYTE) {
+            klog(KLOG_ERR, "[KMALLOC] underflow before %p (size %u)\n", slot + KMALLOC_REDZONE, (unsigned)size);
+            break;
+        }
+    }
+    for (size_t i = KMALLOC_REDZONE + size; i < SLOT_SIZE(cls); i++) {
+        if (slot[i] != REDZONE_BYTE) {
+            klog(KLOG_ERR, "[KMALLOC] overflow after %p (size %u)\n", slot + KMALLOC_REDZONE, (unsigned)size);
+            break;
+        }
+    }
+}
+#endif
+
+static void* kmalloc_large(size_t size)
+{
+    size_t pages = PAGE_ALIGN_UP(size) >> PAGE_SHIFT;
+    uint32_t base = pmm_alloc_pages(pages);
+    if (base == 0) {
+        return NULL;
+    }
+    if (page_owner_set(base, pages, (pages << 1) | 1) != 0) {
+        pmm_free_pages(base, pages);
+        return NULL;
+    }
+    stats.large_pages += pages;
+    account_alloc(pages * PAGE_SIZE);
+    return (void*)base;
+}
+
+void* kmalloc(size_t size)
+{
+    void* ptr = NULL;
+    uint32_t flags = irq_save();
+
+    if (size > KMALLOC_MAX_SMALL) {
+        ptr = kmalloc_large(size);
+    } else {
+        unsigned cls = size_to_class(size);
+        struct slab* slab = classes[cls].partial;
+        if (slab == NULL) {
+            slab = slab_create(cls);
+        }
+        if (slab != NULL) {
+            void** obj = slab->free_list;
+            slab->free_list = *obj;
+            slab->inuse++;
+            if (slab->free_list == NULL) { // full slabs aren't tracked, kfree puts them back on the list
+                slab_unlink(slab);
+            }
+            account_alloc(classes[cls].size);
+#ifdef KMALLOC_DEBUG
+            redzone_fill((uint8_t*)obj, cls, size);
+            ptr = (uint8_t*)obj + KMALLOC_REDZONE;
+#else
+            ptr = obj;
+#endif
+        }
+    }
+
+    if (ptr == NULL) {
+        stats.failures++;
+    }
+    irq_restore(flags);
+    return ptr;
+}
+
+void* kzalloc(size_t size)
+{
+    void* ptr = kmalloc(size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+void kfree(void* ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    uint32_t owner = page_owner_get((uint32_t)ptr);
+
+    if (owner & 1) { // large allocation
+        size_t pages = owner >> 1;
+        if ((uint32_t)ptr & (PAGE_SIZE - 1)) {
+            klog(KLOG_ERR, "[KMALLOC] kfree of bad pointer %p\n", ptr);
+        } else {
+            page_owner_set((uint32_t)ptr, pages, 0);
+            pmm_free_pages((uint32_t)ptr, pages);
+            stats.large_pages -= pages;
+            stats.bytes_in_use -= pages * PAGE_SIZE;
+            stats.frees++;
+        }
+    } else if (owner != 0 && ((struct slab*)owner)->magic == SLAB_MAGIC) {
+        struct slab* slab = (struct slab*)owner;
+        unsigned cls = slab->cls;
+        void** obj = (void**)((uint8_t*)ptr - KMALLOC_REDZONE);
+#ifdef KMALLOC_DEBUG
+        redzone_check((uint8_t*)obj, cls);
+        memset(obj, POISON_BYTE, SLOT_SIZE(cls));
+#endif
+        if (slab->free_list == NULL) { // was full, make it allocatable again
+            struct kmalloc_class* c = &classes[cls];
+            slab->prev = NULL;
+            slab->next = c->partial;
+            if (c->partial) {
+                c->partial->prev = slab;
+            }
+            c->partial = slab;
+        }
+        *obj = slab->free_list;
+        slab->free_list = obj;
+        slab->inuse--;
+        stats.bytes_in_use -= classes[cls].size;
+        stats.frees++;
+
+        // give empty slabs back to the pmm, but keep the last one around so alloc/free pairs don't thrash
+        if (slab->inuse == 0 && (slab->next != NULL || slab->prev != NULL)) {
+            slab_destroy(slab);
+        }
+    } else {
+        klog(KLOG_ERR, "[KMALLOC] kfree of bad pointer %p\n", ptr);
+    }
+
+    irq_restore(flags);
+}
+
+size_t kmalloc_usable_size(void* ptr)
+{
+    uint32_t owner = page_owner_get((uint32_t)ptr);
+    if (owner & 1) {
+        return (owner >> 1) * PAGE_SIZE;
+    }
+    if (owner != 0) {
+#ifdef KMALLOC_DEBUG
+        return *(uint32_t*)((uint8_t*)ptr - KMALLOC_REDZONE); // the redzone starts right after the requested size
+#else
+        return classes[((struct slab*)owner)->cls].size;
+#endif
+    }
+    return 0;
+}
+
+void* krealloc(void* ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return kmalloc(size);
+    }
+    if (size == 0) {
+        kfree(ptr);
+        return NULL;
+    }
+
+    size_t old_size = kmalloc_usable_size(ptr);
+    if (size <= old_size && size > old_size / 2) { // still a good fit, keep it where it is
+        return ptr;
+    }
+    void* new_ptr = kmalloc(size);
+    if (new_ptr) {
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        kfree(ptr);
+    }
+    return new_ptr;
+}
+
+void kmalloc_get_stats(struct kmalloc_stats* out)
+{
+    uint32_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
@@ -0,0 +1,56 @@
+#include <stddef.h>
+
+#include <kernel/ksyms.h>
+
+// Defined by the generated ksyms_table.S. Weak, so the first link pass (the one nm reads the addresses from) works
+// without it. The table only goes into .rodata, behind .text, so adding it doesn't move any function
+extern const struct ksym ksyms[] __attribute__((weak));
+extern const uint32_t ksyms_count __attribute__((weak));
+
+extern char _text_end[]; // linker.ld
+
+uint32_t ksym_count(void)
+{
+    return &ksyms_count != NULL ? ksyms_count : 0;
+}
+
+int ksym_index(uint32_t addr)
+{
+    uint32_t count = ksym_count();
+    if (count == 0 || addr < ksyms[0].addr || addr >= (uint32_t)_text_end) {
+        return -1;
+    }
+
+    // Binary search for the last symbol at or below addr, the table is sorted by address
+    uint32_t low = 0;
+    uint32_t high = count - 1;
+    while (low < high) {
+        uint32_t mid = (low + high + 1) / 2;
+        if (ksyms[mid].addr <= addr) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return (int)low;
+}
+
+const struct ksym* ksym_get(int index)
+{
+    if (index < 0 || (uint32_t)index >= ksym_count()) {
+        return NULL;
+    }
+    return &ksyms[index];
+}
+
+const char* ksym_lookup(uint32_t addr, uint32_t* offset)
+{
+    const struct ksym* sym = ksym_get(ksym_index(addr));
+    if (sym == NULL) {
+        return NULL;
+    }
+    if (offset) {
+        *offset = addr - sym->addr;
+    }
+    return sym->name;
+}
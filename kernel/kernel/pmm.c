@@ -0,0 +1,318 @@
+#include <string.h>
+
+#include <kernel/cpu.h>
+#include <kernel/klog.h>
+#include <kernel/pmm.h>
+
+// Physical memory manager
+// A bitmap records which frames are in use, and a buddy allocator keeps free frames on one list per block order.
+// The list nodes live inside the free frames themselves, so the only bookkeeping memory is the bitmap plus one
+// byte per frame, both carved out of RAM right after the kernel image at boot.
+
+extern uint8_t _kernel_start[]; // defined in linker.ld
+extern uint8_t _kernel_end[];
+
+struct pmm_free_block { // stored in the first frame of every free block
+    struct pmm_free_block* next;
+    struct pmm_free_block* prev;
+};
+
+struct pmm_range {
+    uint32_t start;
+    uint32_t end;
+};
+
+#define PMM_MAX_RESERVED 32
+
+static uint32_t* frame_bitmap; // 1 bit per frame, set = used
+static uint8_t* frame_order; // order + 1 if the frame is the head of a free block, 0 otherwise
+static struct pmm_free_block* free_lists[PMM_MAX_ORDER + 1];
+
+static uint32_t frame_count; // frames covered by the bitmap (up to the highest usable address)
+static size_t total_frames; // usable frames reported by the memory map
+static size_t free_frames;
+
+static struct pmm_range reserved[PMM_MAX_RESERVED];
+static int reserved_count;
+
+static inline void bitmap_set(uint32_t frame)
+{
+    frame_bitmap[frame >> 5] |= 1u << (frame & 31);
+}
+
+static inline void bitmap_clear(uint32_t frame)
+{
+    frame_bitmap[frame >> 5] &= ~(1u << (frame & 31));
+}
+
+static inline int bitmap_test(uint32_t frame)
+{
+    return (frame_bitmap[frame >> 5] >> (frame & 31)) & 1;
+}
+
+static void list_push(unsigned order, uint32_t frame)
+{
+    struct pmm_free_block* block = (struct pmm_free_block*)(frame << PAGE_SHIFT);
+    block->prev = NULL;
+    block->next = free_lists[order];
+    if (block->next) {
+        block->next->prev = block;
+    }
+    free_lists[order] = block;
+    frame_order[frame] = order + 1;
+}
+
+static void list_remove(unsigned order, uint32_t frame)
+{
+    struct pmm_free_block* block = (struct pmm_free_block*)(frame << PAGE_SHIFT);
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        free_lists[order] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    frame_order[frame] = 0;
+}
+
+// Returns a block to the free lists, merging it with its buddy for as long as the buddy is free too
+static void buddy_free(uint32_t frame, unsigned order)
+{
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = frame ^ (1u << order);
+        if (buddy >= frame_count || frame_order[buddy] != order + 1) {
+            break;
+        }
+        list_remove(order, buddy);
+        frame &= ~(1u << order);
+        order++;
+    }
+    list_push(order, frame);
+}
+
+// Takes a block of 2^order frames off the free lists, splitting a larger block if needed. Returns 0 on failure
+static uint32_t buddy_alloc(unsigned order)
+{
+    unsigned k = order;
+    while (k <= PMM_MAX_ORDER && free_lists[k] == NULL) {
+        k++;
+    }
+    if (k > PMM_MAX_ORDER) {
+        return 0; // frame 0 is always reserved, so it doubles as the failure value
+    }
+
+    uint32_t frame = (uint32_t)free_lists[k] >> PAGE_SHIFT;
+    list_remove(k, frame);
+    while (k > order) { // hand the upper halves back until the block is the requested size
+        k--;
+        list_push(k, frame + (1u << k));
+    }
+    return frame;
+}
+
+static void pmm_reserve(uint32_t start, uint32_t end)
+{
+    if (reserved_count == PMM_MAX_RESERVED || end <= start) {
+        return;
+    }
+    reserved[reserved_count].start = PAGE_ALIGN_DOWN(start);
+    reserved[reserved_count].end = PAGE_ALIGN_UP(end);
+    reserved_count++;
+}
+
+// Checks if [start, end) overlaps anything that must never be handed out, returns the overlapping range or NULL
+static const struct pmm_range* pmm_find_reserved(uint32_t start, uint32_t end)
+{
+    for (int i = 0; i < reserved_count; i++) {
+        if (start < reserved[i].end && end > reserved[i].start) {
+            return &reserved[i];
+        }
+    }
+    return NULL;
+}
+
+void pmm_init(struct multiboot_info* mbi)
+{
+    uint32_t highest = 0;
+
+    // Pass 1: find the top of usable RAM so we know how many frames to track
+    if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+        uint32_t ptr = mbi->mmap_addr;
+        while (ptr < mbi->mmap_addr + mbi->mmap_length) {
+            struct multiboot_mmap_entry* entry = (struct multiboot_mmap_entry*)ptr;
+            if (entry->type == MULTIBOOT_MEMORY_AVAILABLE && entry->addr < PMM_MAX_ADDR) {
+                uint64_t end = entry->addr + entry->len;
+                if (end > PMM_MAX_ADDR) {
+                    end = PMM_MAX_ADDR;
+                }
+                if (end > highest) {
+                    highest = (uint32_t)end;
+                }
+            }
+            ptr += entry->size + sizeof(entry->size);
+        }
+    } else if (mbi->flags & MULTIBOOT_INFO_MEMORY) { // no map, assume one block starting at 1 MiB
+        highest = 0x100000 + mbi->mem_upper * 1024;
+    }
+    frame_count = PAGE_ALIGN_DOWN(highest) >> PAGE_SHIFT;
+
+    // Everything the bootloader and the kernel are still using
+    pmm_reserve(0, 0x100000); // real mode IVT, BIOS data, VGA memory and option ROMs
+    pmm_reserve((uint32_t)_kernel_start, (uint32_t)_kernel_end);
+    pmm_reserve((uint32_t)mbi, (uint32_t)mbi + sizeof(struct multiboot_info));
+    if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+        pmm_reserve(mbi->mmap_addr, mbi->mmap_addr + mbi->mmap_length);
+    }
+    if (mbi->flags & MULTIBOOT_INFO_CMDLINE) {
+        pmm_reserve(mbi->cmdline, mbi->cmdline + strlen((const char*)mbi->cmdline) + 1);
+    }
+    if (mbi->flags & MULTIBOOT_INFO_MODS) {
+        struct multiboot_module* mods = (struct multiboot_module*)mbi->mods_addr;
+        pmm_reserve(mbi->mods_addr, mbi->mods_addr + mbi->mods_count * sizeof(struct multiboot_module));
+        for (uint32_t i = 0; i < mbi->mods_count; i++) {
+            pmm_reserve(mods[i].mod_start, mods[i].mod_end);
+            if (mods[i].cmdline) {
+                pmm_reserve(mods[i].cmdline, mods[i].cmdline + strlen((const char*)mods[i].cmdline) + 1);
+            }
+        }
+    }
+
+    // Place the bitmap and the order bytes in the first gap after the kernel that does not collide with the above
+    uint32_t bitmap_size = ((frame_count + 31) / 32) * sizeof(uint32_t);
+    uint32_t meta_size = PAGE_ALIGN_UP(bitmap_size + frame_count);
+    uint32_t meta = PAGE_ALIGN_UP((uint32_t)_kernel_end);
+    const struct pmm_range* hit;
+    while ((hit = pmm_find_reserved(meta, meta + meta_size)) != NULL) {
+        meta = hit->end;
+    }
+    frame_bitmap = (uint32_t*)meta;
+    frame_order = (uint8_t*)(meta + bitmap_size);
+    pmm_reserve(meta, meta + meta_size);
+
+    memset(frame_bitmap, 0xFF, bitmap_size); // start with everything used
+    memset(frame_order, 0, frame_count);
+
+    // Pass 2: free every usable frame that is not reserved, the buddy allocator merges them into large blocks
+    if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+        uint32_t ptr = mbi->mmap_addr;
+        while (ptr < mbi->mmap_addr + mbi->mmap_length) {
+            struct multiboot_mmap_entry* entry = (struct multiboot_mmap_entry*)ptr;
+            if (entry->type == MULTIBOOT_MEMORY_AVAILABLE && entry->addr < highest) {
+                uint64_t end = entry->addr + entry->len;
+                uint32_t first = PAGE_ALIGN_UP((uint32_t)entry->addr) >> PAGE_SHIFT;
+                uint32_t last = PAGE_ALIGN_DOWN(end > highest ? highest : (uint32_t)end) >> PAGE_SHIFT;
+                for (uint32_t frame = first; frame < last; frame++) {
+                    if (!bitmap_test(frame)) {
+                        continue; // overlapping map entries, already freed
+                    }
+                    total_frames++;
+                    uint32_t addr = frame << PAGE_SHIFT;
+                    if (pmm_find_reserved(addr, addr + PAGE_SIZE) == NULL) {
+                        bitmap_clear(frame);
+                        buddy_free(frame, 0);
+                        free_frames++;
+                    }
+                }
+            }
+            ptr += entry->size + sizeof(entry->size);
+        }
+    } else {
+        for (uint32_t frame = 0x100000 >> PAGE_SHIFT; frame < frame_count; frame++) {
+            total_frames++;
+            uint32_t addr = frame << PAGE_SHIFT;
+            if (pmm_find_reserved(addr, addr + PAGE_SIZE) == NULL) {
+                bitmap_clear(frame);
+                buddy_free(frame, 0);
+                free_frames++;
+            }
+        }
+    }
+}
+
+uint32_t pmm_alloc_page(void)
+{
+    uint32_t flags = irq_save();
+    uint32_t frame = buddy_alloc(0);
+    if (frame != 0) {
+        bitmap_set(frame);
+        free_frames--;
+    }
+    irq_restore(flags);
+    return frame << PAGE_SHIFT;
+}
+
+void pmm_free_page(uint32_t addr)
+{
+    pmm_free_pages(addr, 1);
+}
+
+uint32_t pmm_alloc_pages(size_t count)
+{
+    unsigned order = 0;
+    while ((1u << order) < count) {
+        order++;
+    }
+    if (count == 0 || order > PMM_MAX_ORDER) {
+        return 0;
+    }
+
+    uint32_t flags = irq_save();
+    uint32_t frame = buddy_alloc(order);
+    if (frame != 0) {
+        for (size_t i = 0; i < count; i++) {
+            bitmap_set(frame + i);
+        }
+        for (size_t i = count; i < (1u << order); i++) { // give back the tail of the power of two block
+            buddy_free(frame + i, 0);
+        }
+        free_frames -= count;
+    }
+    irq_restore(flags);
+    return frame << PAGE_SHIFT;
+}
+
+void pmm_free_pages(uint32_t addr, size_t count)
+{
+    uint32_t frame = addr >> PAGE_SHIFT;
+    uint32_t flags = irq_save();
+    for (size_t i = 0; i < count; i++, frame++) {
+        if (frame >= frame_count || !bitmap_test(frame)) {
+            klog(KLOG_ERR, "[PMM] double free of frame 0x%lx\n", frame << PAGE_SHIFT);
+            continue;
+        }
+        bitmap_clear(frame);
+        buddy_free(frame, 0);
+        free_frames++;
+    }
+    irq_restore(flags);
+}
+
+int pmm_is_used(uint32_t addr)
+{
+    uint32_t frame = addr >> PAGE_SHIFT;
+    if (frame >= frame_count) {
+        return 1;
+    }
+    return bitmap_test(frame);
+}
+
+uint32_t pmm_memory_top(void)
+{
+    return frame_count << PAGE_SHIFT;
+}
+
+size_t pmm_total_frames(void)
+{
+    return total_frames;
+}
+
+size_t pmm_free_frames(void)
+{
+    return free_frames;
+}
+
+size_t pmm_used_frames(void)
+{
+    return total_frames - free_frames;
+}
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <kernel/console.h>
+#include <kernel/cpu.h>
+#include <kernel/klog.h>
+#include <kernel/kmalloc.h>
+#include <kernel/ksyms.h>
+#include <kernel/profile.h>
+#include <kernel/serial.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <kernel/vmm.h>
+
+#define STACK_RECORD (PROFILE_MAX_DEPTH + 1) // depth followed by the return addresses, innermost first
+
+extern char _kernel_start[]; // linker.ld, code starts here
+
+static uint32_t histogram[PROFILE_BUCKETS];
+static volatile int running;
+static int want_backtraces;
+static uint32_t samples;
+static uint32_t outside; // samples outside the histogram range (e.g. past PROFILE_BUCKETS)
+
+static uint32_t* stack_log; // PROFILE_MAX_STACKS records of STACK_RECORD words, demand-zero: a short run only uses the first pages
+static uint32_t stacks_recorded;
+static uint32_t stacks_dropped;
+
+// Follows the saved EBP chain of the interrupted code. Every frame pointer has to lie inside the current thread's
+// stack and move towards its top, so a function built without frame pointers ends the walk instead of crashing it
+static uint32_t backtrace(const struct interrupt_frame* frame, uint32_t* pcs)
+{
+    uint32_t low, high;
+    thread_stack_bounds(thread_current(), &low, &high);
+
+    uint32_t depth = 0;
+    pcs[depth++] = frame->eip;
+    uint32_t ebp = frame->ebp;
+    while (depth < PROFILE_MAX_DEPTH && ebp >= low && ebp + 8 <= high && !(ebp & 3)) {
+        uint32_t next = ((uint32_t*)ebp)[0];
+        uint32_t ret = ((uint32_t*)ebp)[1];
+        if (ret == 0) { // the fake return address at the top of a new thread's stack
+            break;
+        }
+        pcs[depth++] = ret;
+        if (next <= ebp) {
+            break;
+        }
+        ebp = next;
+    }
+    return depth;
+}
+
+void profile_sample(const struct interrupt_frame* frame)
+{
+    if (!running) {
+        return;
+    }
+    samples++;
+
+    uint32_t offset = frame->eip - (uint32_t)_kernel_start;
+    if ((frame->cs & 3) == 0 && frame->eip >= (uint32_t)_kernel_start
+        && (offset >> PROFILE_BUCKET_SHIFT) < PROFILE_BUCKETS) {
+        histogram[offset >> PROFILE_BUCKET_SHIFT]++;
+    } else {
+        outside++;
+    }
+
+    if (want_backtraces) {
+        if (stacks_recorded < PROFILE_MAX_STACKS) {
+            uint32_t* record = stack_log + stacks_recorded * STACK_RECORD;
+            record[0] = backtrace(frame, record + 1);
+            stacks_recorded++;
+        } else {
+            stacks_dropped++;
+        }
+    }
+}
+
+int profile_start(int backtraces)
+{
+    if (backtraces && stack_log == NULL) {
+        stack_log = vmm_reserve(PROFILE_MAX_STACKS * STACK_RECORD * sizeof(uint32_t), 0, "profile");
+        if (stack_log == NULL) {
+            klog(KLOG_WARN, "[PROFILE] no memory for the backtrace buffer\n");
+            return -1;
+        }
+    }
+    uint32_t flags = irq_save();
+    want_backtraces = backtraces;
+    running = 1;
+    irq_restore(flags);
+    return 0;
+}
+
+void profile_stop(void)
+{
+    running = 0;
+}
+
+int profile_running(void)
+{
+    return running;
+}
+
+void profile_reset(void)
+{
+    uint32_t flags = irq_save();
+    memset(histogram, 0, sizeof(histogram));
+    samples = 0;
+    outside = 0;
+    stacks_recorded = 0;
+    stacks_dropped = 0;
+    irq_restore(flags);
+}
+
+void profile_report(unsigned top)
+{
+    int was_running = running;
+    running = 0; // a stable snapshot, sampling the report itself isn't interesting anyway
+
+    uint32_t count = ksym_count();
+    printf("profile: %lu samples (%lu Hz), %lu outside kernel code%s\n",
+        (unsigned long)samples, (unsigned long)timer_hz(), (unsigned long)outside,
+        count == 0 ? ", no symbol table" : "");
+
+    // Add the buckets up per function, slot 'count' collects code without a symbol
+    uint32_t* per_symbol = kzalloc((count + 1) * sizeof(uint32_t));
+    if (per_symbol == NULL) {
+        klog(KLOG_WARN, "[PROFILE] no memory for the report\n");
+        running = was_running;
+        return;
+    }
+    for (uint32_t bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+        if (histogram[bucket] == 0) {
+            continue;
+        }
+        int index = ksym_index((uint32_t)_kernel_start + (bucket << PROFILE_BUCKET_SHIFT));
+        per_symbol[index < 0 ? count : (uint32_t)index] += histogram[bucket];
+    }
+
+    // Selection of the top entries, zeroing each one after printing it
+    uint32_t total = samples ? samples : 1;
+    for (unsigned n = 0; n < top; n++) {
+        uint32_t best = 0;
+        for (uint32_t i = 1; i <= count; i++) {
+            if (per_symbol[i] > per_symbol[best]) {
+                best = i;
+            }
+        }
+        if (per_symbol[best] == 0) {
+            break;
+        }
+        uint32_t permille = (uint32_t)((uint64_t)per_symbol[best] * 1000 / total);
+        printf("%8lu %3lu.%lu%%  %s\n", (unsigned long)per_symbol[best], (unsigned long)(permille / 10),
+            (unsigned long)(permille % 10), best == count ? "[unknown]" : ksym_get((int)best)->name);
+        per_symbol[best] = 0;
+    }
+    kfree(per_symbol);
+    running = was_running;
+}
+
+static void dump_write(const char* data, size_t size)
+{
+    if (serial_present()) {
+        serial_write(data, size);
+    } else {
+        console_write(1, data, size);
+    }
+}
+
+void profile_dump_stacks(void)
+{
+    int was_running = running;
+    running = 0;
+
+    char line[64];
+    int len = snprintf(line, sizeof(line), "# profile stacks begin (%lu recorded, %lu dropped)\n",
+        (unsigned long)stacks_recorded, (unsigned long)stacks_dropped);
+    dump_write(line, (size_t)len);
+
+    for (uint32_t s = 0; s < stacks_recorded; s++) {
+        const uint32_t* record = stack_log + s * STACK_RECORD;
+        for (uint32_t depth = record[0]; depth > 0; depth--) { // outermost caller first
+            uint32_t pc = record[depth];
+            if (depth != record[0]) {
+                dump_write(";", 1);
+            }
+            // Return addresses point after the call, look up the call instruction itself
+            const char* name = ksym_lookup(depth == 1 ? pc : pc - 1, NULL);
+            if (name != NULL) {
+                dump_write(name, strlen(name));
+            } else {
+                len = snprintf(line, sizeof(line), "0x%08lx", (unsigned long)pc);
+                dump_write(line, (size_t)len);
+            }
+        }
+        dump_write(" 1\n", 3);
+    }
+    dump_write("# profile stacks end\n", 21);
+    running = was_running;
+}
@@ -0,0 +1,601 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <kernel/ata.h>
+#include <kernel/bcache.h>
+#include <kernel/bench.h>
+#include <kernel/boottrace.h>
+#include <kernel/clock.h>
+#include <kernel/console.h>
+#include <kernel/fbcon.h>
+#include <kernel/fpu.h>
+#include <kernel/keyboard.h>
+#include <kernel/klog.h>
+#include <kernel/kmalloc.h>
+#include <kernel/pmm.h>
+#include <kernel/profile.h>
+#include <kernel/serial.h>
+#include <kernel/shell.h>
+#include <kernel/smp.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <kernel/tsc.h>
+#include <kernel/user.h>
+#include <kernel/vfs.h>
+#include <kernel/vmm.h>
+
+struct shell_command {
+    const char* name;
+    const char* help;
+    shell_command_fn fn;
+    struct shell_command* hash_next;
+};
+
+// Registration happens at boot and every command runs on the shell thread, so none of this needs locking
+static struct shell_command commands[SHELL_MAX_COMMANDS]; // registration order, which is what help lists
+static uint32_t command_count;
+static struct shell_command* command_hash[SHELL_HASH_BUCKETS];
+
+static char history[SHELL_HISTORY][SHELL_LINE_MAX];
+static uint32_t history_count; // lines ever entered, line n (from 1) sits at history[(n - 1) % SHELL_HISTORY]
+
+static uint32_t name_hash(const char* name)
+{
+    uint32_t hash = 2166136261u; // FNV-1a, same as the dentry cache
+    while (*name != '\0') {
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    }
+    return hash;
+}
+
+static struct shell_command* find_command(const char* name)
+{
+    for (struct shell_command* cmd = command_hash[name_hash(name) & (SHELL_HASH_BUCKETS - 1)]; cmd != NULL;
+         cmd = cmd->hash_next) {
+        if (strcmp(cmd->name, name) == 0) {
+            return cmd;
+        }
+    }
+    return NULL;
+}
+
+int shell_register(const char* name, const char* help, shell_command_fn fn)
+{
+    if (command_count == SHELL_MAX_COMMANDS || find_command(name) != NULL) {
+        printf("[SHELL] can't register command '%s'\n", name);
+        return -1;
+    }
+    struct shell_command* cmd = &commands[command_count++];
+    uint32_t bucket = name_hash(name) & (SHELL_HASH_BUCKETS - 1);
+    cmd->name = name;
+    cmd->help = help;
+    cmd->fn = fn;
+    cmd->hash_next = command_hash[bucket];
+    command_hash[bucket] = cmd;
+    return 0;
+}
+
+// Splits 'line' in place into at most SHELL_MAX_ARGS arguments, quotes are removed
+static int tokenize(char* line, char** argv)
+{
+    int argc = 0;
+    char* p = line;
+    for (;;) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '\0' || argc == SHELL_MAX_ARGS) {
+            break;
+        }
+        argv[argc++] = p;
+        char* out = p;
+        int quoted = 0;
+        while (*p != '\0' && (quoted || (*p != ' ' && *p != '\t'))) {
+            if (*p == '"') {
+                quoted = !quoted;
+                p++;
+            } else {
+                *out++ = *p++;
+            }
+        }
+        if (*p != '\0') {
+            p++;
+        }
+        *out = '\0'; // never past p, so nothing that is still to be read gets overwritten
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+int shell_execute(const char* line)
+{
+    char buffer[SHELL_LINE_MAX];
+    char* argv[SHELL_MAX_ARGS + 1];
+    strncpy(buffer, line, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+
+    int argc = tokenize(buffer, argv);
+    if (argc == 0) {
+        return 0;
+    }
+    struct shell_command* cmd = find_command(argv[0]);
+    if (cmd == NULL) {
+        printf("command '%s' not recognized, try 'help'\n", argv[0]);
+        return -1;
+    }
+    return cmd->fn(argc, argv);
+}
+
+static const char* history_line(uint32_t n)
+{
+    if (n == 0 || n > history_count || history_count - n >= SHELL_HISTORY) {
+        return NULL;
+    }
+    return history[(n - 1) % SHELL_HISTORY];
+}
+
+static void history_add(const char* line)
+{
+    const char* last = history_line(history_count);
+    if (line[strspn(line, " \t")] == '\0' || (last != NULL && strcmp(last, line) == 0)) {
+        return;
+    }
+    strcpy(history[history_count % SHELL_HISTORY], line);
+    history_count++;
+}
+
+// Built-in commands
+
+static int cmd_help(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+    for (uint32_t i = 0; i < command_count; i++) {
+        printf("  %-10s %s\n", commands[i].name, commands[i].help);
+    }
+    return 0;
+}
+
+static int cmd_history(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+    uint32_t first = history_count > SHELL_HISTORY ? history_count - SHELL_HISTORY + 1 : 1;
+    for (uint32_t n = first; n <= history_count; n++) {
+        printf("%5lu  %s\n", (unsigned long)n, history_line(n));
+    }
+    return 0;
+}
+
+static int cmd_info(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+    struct keyboard_stats kbd;
+    keyboard_get_stats(&kbd);
+    printf("Nue Kernel v0.1\n");
+    printf("keyboard: %lu scancodes, %lu dropped, %lu lines dropped\n",
+        (unsigned long)kbd.scancodes, (unsigned long)kbd.dropped, (unsigned long)kbd.lines_dropped);
+    if (serial_present()) {
+        struct serial_stats com;
+        serial_get_stats(&com);
+        printf("serial: %lu bytes, %lu interrupts, %lu waits on a full ring\n",
+            (unsigned long)com.bytes, (unsigned long)com.interrupts, (unsigned long)com.ring_full);
+    }
+    if (fbcon_active()) {
+        struct fbcon_stats fb;
+        fbcon_get_stats(&fb);
+        printf("fbcon: %lu flushes, %lu glyphs drawn, %lu blank cells filled, %lu glyph cache misses, %lu rows scrolled\n",
+            (unsigned long)fb.flushes, (unsigned long)fb.cells_drawn, (unsigned long)fb.cells_filled,
+            (unsigned long)fb.glyph_misses, (unsigned long)fb.scrolls);
+    }
+    struct fpu_stats fpu;
+    fpu_get_stats(&fpu);
+    printf("fpu: %lu switches, %lu #NM traps, %lu saves (%lu switches needed none), %lu kept the owner\n",
+        (unsigned long)fpu.switches, (unsigned long)fpu.traps, (unsigned long)fpu.saves,
+        (unsigned long)(fpu.switches - fpu.saves), (unsigned long)fpu.owner_kept);
+    struct vfs_stats vfs;
+    vfs_get_stats(&vfs);
+    printf("vfs: %lu dentries, %lu path components looked up, %lu dentry cache hits\n",
+        (unsigned long)vfs.dentries, (unsigned long)vfs.lookups, (unsigned long)vfs.hits);
+    return 0;
+}
+
+static int cmd_meminfo(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+    printf("pmm: %lu KiB total, %lu KiB used, %lu KiB free\n",
+        (unsigned long)(pmm_total_frames() * (PAGE_SIZE / 1024)),
+        (unsigned long)(pmm_used_frames() * (PAGE_SIZE / 1024)),
+        (unsigned long)(pmm_free_frames() * (PAGE_SIZE / 1024)));
+    struct kmalloc_stats heap;
+    kmalloc_get_stats(&heap);
+    printf("kmalloc: %lu bytes in use (high water %lu), %lu slab pages, %lu large pages\n",
+        (unsigned long)heap.bytes_in_use, (unsigned long)heap.high_water, (unsigned long)heap.slab_pages,
+        (unsigned long)heap.large_pages);
+    printf("kmalloc: %lu allocations, %lu frees, %lu failed\n", (unsigned long)heap.allocs,
+        (unsigned long)heap.frees, (unsigned long)heap.failures);
+    struct vmm_stats vmm;
+    vmm_get_stats(&vmm);
+    printf("vmm: %lu areas, %lu KiB reserved, %lu KiB resident, %lu minor faults, %lu failed\n",
+        (unsigned long)vmm.areas, (unsigned long)(vmm.reserved_pages * (PAGE_SIZE / 1024)),
+        (unsigned long)(vmm.resident_pages * (PAGE_SIZE / 1024)), (unsigned long)vmm.minor_faults,
+        (unsigned long)vmm.failed_faults);
+    return 0;
+}
+
+static int cmd_irqstat(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+    printf(" VEC NAME                       COUNT  CYCLES/IRQ\n");
+    for (int vector = 0; vector < NO_IDT_ENTRIES; vector++) {
+        struct irq_stats irq;
+        irq_get_stats((uint8_t)vector, &irq);
+        if (irq.count != 0) {
+            printf("%4d %-20s %12llu %11llu\n", vector, irq_vector_name((uint8_t)vector),
+                (unsigned long long)irq.count, (unsigned long long)(irq.cycles / irq.count));
+        }
+    }
+    for (int id = 0; id < smp_cpu_count(); id++) {
+        struct cpu* cpu = smp_get_cpu(id);
+        printf("cpu%d: %llu interrupts, %llu IPIs\n", id, (unsigned long long)cpu->interrupts,
+            (unsigned long long)cpu->ipis);
+    }
+    return 0;
+}
+
+static void count_thread(struct thread* thread, void* arg)
+{
+    (void)thread;
+    (*(uint32_t*)arg)++;
+}
+
+static int cmd_uptime(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+    uint64_t ticks = timer_ticks();
+    uint32_t seconds = (uint32_t)(ticks / timer_hz());
+    uint32_t threads = 0;
+    thread_for_each(count_thread, &threads);
+    printf("up %lu:%02lu:%02lu.%02lu, %d cpu%s, %lu threads, %lu context switches\n",
+        (unsigned long)(seconds / 3600), (unsigned long)(seconds / 60 % 60), (unsigned long)(seconds % 60),
+        (unsigned long)(ticks % timer_hz() * 100 / timer_hz()), smp_cpu_count(), smp_cpu_count() == 1 ? "" : "s",
+        (unsigned long)threads, (unsigned long)sched_context_switches());
+    return 0;
+}
+
+static int cmd_date(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+    struct timeval tv;
+    struct tm tm;
+    gettimeofday(&tv, NULL);
+    gmtime_r(&tv.tv_sec, &tm);
+    printf("%04d-%02d-%02d %02d:%02d:%02d.%06ld UTC%s\n", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+        tm.tm_min, tm.tm_sec, (long)tv.tv_usec, clock_realtime_exact() ? "" : " (RTC second not pinned yet)");
+    return 0;
+}
+
+static const char* const level_names[] = { "err", "warn", "info", "debug" };
+
+static int cmd_dmesg(int argc, char** argv)
+{
+    int max_level = KLOG_DEBUG;
+    if (argc == 2) {
+        for (max_level = KLOG_ERR; max_level <= KLOG_DEBUG; max_level++) {
+            if (strcmp(argv[1], level_names[max_level]) == 0) {
+                break;
+            }
+        }
+    }
+    if (argc > 2 || max_level > KLOG_DEBUG) {
+        printf("usage: dmesg [err | warn | info | debug]\n");
+        return -1;
+    }
+
+    uint32_t end = klog_seq();
+    uint32_t seq = end > KLOG_RECORDS ? end - KLOG_RECORDS : 0;
+    struct klog_entry entry;
+    for (; seq != end; seq++) {
+        if (klog_get(seq, &entry) != 0 || entry.level > max_level) {
+            continue; // overwritten by now, or still being written
+        }
+        uint64_t us = tsc_cycles_to_us(entry.tsc - boot_tsc);
+        int newline = entry.length != 0 && entry.text[entry.length - 1] == '\n';
+        printf("[%5lu.%06lu] cpu%u %-5s %s%s", (unsigned long)(us / 1000000), (unsigned long)(us % 1000000),
+            entry.cpu, level_names[entry.level], entry.text, newline ? "" : "\n");
+    }
+    struct klog_stats stats;
+    klog_get_stats(&stats);
+    printf("%lu messages since boot, %lu truncated, %lu never reached the console\n", (unsigned long)stats.records,
+        (unsigned long)stats.truncated, (unsigned long)stats.lost);
+    return 0;
+}
+
+static int cmd_bench(int argc, char** argv)
+{
+    if (argc != 2) {
+        printf("usage: bench <name> | all | test\n");
+        bench_list();
+        return -1;
+    }
+    if (strcmp(argv[1], "test") == 0) {
+        int failures = selftest_run_all();
+        printf("%d test%s failed\n", failures, failures == 1 ? "" : "s");
+        return failures == 0 ? 0 : -1;
+    }
+    if (bench_run(strcmp(argv[1], "all") == 0 ? NULL : argv[1]) != 0) {
+        printf("bench: no benchmark '%s'\n", argv[1]);
+        return -1;
+    }
+    return 0;
+}
+
+#define TOP_MAX_THREADS 64
+
+struct top_sample {
+    uint32_t id;
+    char name[THREAD_NAME_LEN];
+    enum thread_state state;
+    enum thread_priority priority;
+    uint64_t cpu_ticks;
+};
+
+struct top_snapshot {
+    struct top_sample threads[TOP_MAX_THREADS];
+    uint32_t count;
+    uint64_t idle_cycles[SMP_MAX_CPUS];
+};
+
+static struct top_snapshot top_before, top_after; // too big for the shell's stack
+
+static void top_collect(struct thread* thread, void* arg)
+{
+    struct top_snapshot* snap = arg;
+    if (snap->count < TOP_MAX_THREADS) {
+        struct top_sample* sample = &snap->threads[snap->count++];
+        sample->id = thread->id;
+        memcpy(sample->name, thread->name, THREAD_NAME_LEN);
+        sample->state = thread->state;
+        sample->priority = thread->priority;
+        sample->cpu_ticks = thread->cpu_ticks;
+    }
+}
+
+static void top_snapshot(struct top_snapshot* snap)
+{
+    snap->count = 0;
+    thread_for_each(top_collect, snap);
+    for (int id = 1; id < smp_cpu_count(); id++) {
+        snap->idle_cycles[id] = smp_get_cpu(id)->idle_cycles;
+    }
+}
+
+// Thread CPU usage over an interval, from the ticks each thread was charged (the boot CPU's threads), and how
+// busy the other CPUs were, from the time they spent halted
+static int cmd_top(int argc, char** argv)
+{
+    static const char* states[] = { "running", "ready", "blocked", "dead" };
+    uint32_t ms = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 10) * 1000 : 1000;
+    if (ms == 0) {
+        printf("usage: top [seconds]\n");
+        return -1;
+    }
+
+    uint32_t switches = sched_context_switches();
+    top_snapshot(&top_before);
+    uint64_t start_ticks = timer_ticks();
+    uint64_t start_tsc = rdtsc();
+    sleep_ms(ms);
+    top_snapshot(&top_after);
+    uint64_t ticks = timer_ticks() - start_ticks;
+    uint64_t cycles = rdtsc() - start_tsc;
+
+    printf("top: %lu ms, %lu context switches\n", (unsigned long)tsc_cycles_to_us(cycles) / 1000,
+        (unsigned long)(sched_context_switches() - switches));
+    printf("  ID NAME             PRIO STATE    CPU%%\n");
+    for (uint32_t i = 0; i < top_after.count; i++) {
+        const struct top_sample* now = &top_after.threads[i];
+        uint64_t before = 0; // a thread that didn't exist yet started from 0
+        for (uint32_t j = 0; j < top_before.count; j++) {
+            if (top_before.threads[j].id == now->id) {
+                before = top_before.threads[j].cpu_ticks;
+                break;
+            }
+        }
+        printf("%4lu %-16s %4d %-8s %4lu\n", (unsigned long)now->id, now->name, (int)now->priority,
+            states[now->state], (unsigned long)(ticks ? (now->cpu_ticks - before) * 100 / ticks : 0));
+    }
+    for (int id = 1; id < smp_cpu_count(); id++) {
+        uint64_t idle = top_after.idle_cycles[id] - top_before.idle_cycles[id];
+        printf("cpu%d: %lu%% busy, %llu smp_run calls so far\n", id,
+            (unsigned long)(idle < cycles ? (cycles - idle) * 100 / cycles : 0),
+            (unsigned long long)smp_get_cpu(id)->work_done);
+    }
+    return 0;
+}
+
+static int cmd_profile(int argc, char** argv)
+{
+    const char* arg = argc > 1 ? argv[1] : "";
+    if (strcmp(arg, "start") == 0 && (argc == 2 || (argc == 3 && strcmp(argv[2], "bt") == 0))) {
+        if (profile_start(argc == 3) == 0) {
+            printf("profiling%s\n", argc == 3 ? " with backtraces" : "");
+        }
+    } else if (argc == 2 && strcmp(arg, "stop") == 0) {
+        profile_stop();
+    } else if (argc == 2 && strcmp(arg, "reset") == 0) {
+        profile_reset();
+    } else if (argc == 2 && strcmp(arg, "report") == 0) {
+        profile_report(20);
+    } else if (argc == 2 && strcmp(arg, "stacks") == 0) {
+        profile_dump_stacks();
+    } else {
+        printf("usage: profile start [bt] | stop | reset | report | stacks\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void print_entry(const struct dentry* entry, void* arg)
+{
+    (void)arg;
+    if (entry->node->type == VNODE_DIR) {
+        printf("  %s/\n", entry->name);
+    } else {
+        printf("  %-24s %lu\n", entry->name, (unsigned long)entry->node->size);
+    }
+}
+
+static int cmd_ls(int argc, char** argv)
+{
+    const char* path = argc > 1 ? argv[1] : "/";
+    if (vfs_readdir(path, print_entry, NULL) != 0) {
+        printf("ls: %s: no such directory\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int cmd_cat(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++) {
+        size_t size;
+        const char* data = vfs_map(argv[i], &size);
+        if (data == NULL) {
+            printf("cat: %s: no such file\n", argv[i]);
+            return -1;
+        }
+        fflush(stdout);
+        console_write(1, data, size); // straight from the initrd, no copy
+    }
+    return 0;
+}
+
+static int cmd_disk(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+    for (int d = 0; d < ATA_MAX_DRIVES; d++) {
+        const struct ata_drive* drive = ata_get_drive(d);
+        if (drive != NULL) {
+            printf("hd%c: %s, %lu sectors\n", 'a' + d, drive->model, (unsigned long)drive->sectors);
+        }
+    }
+    struct ata_stats ata;
+    ata_get_stats(&ata);
+    printf("ata: %lu requests in %lu commands (%lu DMA, %lu merged), %lu sectors read, %lu written, %lu errors, %lu timeouts\n",
+        (unsigned long)ata.requests, (unsigned long)ata.commands, (unsigned long)ata.dma_commands,
+        (unsigned long)ata.merged, (unsigned long)ata.sectors_read, (unsigned long)ata.sectors_written,
+        (unsigned long)ata.errors, (unsigned long)ata.timeouts);
+    struct bcache_stats cache;
+    bcache_get_stats(&cache);
+    printf("bcache: %lu hits, %lu misses, %lu read ahead, %lu written back, %lu evicted, %lu errors\n",
+        (unsigned long)cache.hits, (unsigned long)cache.misses, (unsigned long)cache.readahead,
+        (unsigned long)cache.writebacks, (unsigned long)cache.evictions, (unsigned long)cache.errors);
+    return 0;
+}
+
+static int cmd_sync(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+    if (bcache_sync(-1) != 0) {
+        printf("sync: write error\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void print_program(const struct user_program* program, void* arg)
+{
+    int* first = arg;
+    printf("%s%s", *first ? "" : ", ", program->name);
+    *first = 0;
+}
+
+static int cmd_user(int argc, char** argv)
+{
+    const struct user_program* program = argc == 2 ? user_find(argv[1]) : NULL;
+    if (program == NULL) {
+        int first = 1;
+        printf("no user program '%s' (", argc == 2 ? argv[1] : "");
+        user_for_each(print_program, &first);
+        printf(")\n");
+        return -1;
+    }
+    if (user_spawn(program, 0) != 0) {
+        printf("couldn't start '%s'\n", program->name);
+        return -1;
+    }
+    printf("'%s' exited with %d\n", program->name, user_wait());
+    return 0;
+}
+
+void shell_init(void)
+{
+    shell_register("help", "list the commands", cmd_help);
+    shell_register("history", "list the last commands, !! or !<n> runs one again", cmd_history);
+    shell_register("info", "driver statistics", cmd_info);
+    shell_register("meminfo", "physical memory, kernel heap and reserved address space", cmd_meminfo);
+    shell_register("irqstat", "interrupt counts and cost per vector and CPU", cmd_irqstat);
+    shell_register("uptime", "time since boot, threads and context switches", cmd_uptime);
+    shell_register("date", "wall clock time, the RTC kept up by the TSC", cmd_date);
+    shell_register("dmesg", "[level] kernel messages still in the log, up to the given level", cmd_dmesg);
+    shell_register("top", "[seconds] CPU usage per thread and CPU", cmd_top);
+    shell_register("bench", "<name> | all | test: run a benchmark or the self tests", cmd_bench);
+    shell_register("profile", "start [bt] | stop | reset | report | stacks", cmd_profile);
+    shell_register("ls", "[path] list a directory", cmd_ls);
+    shell_register("cat", "<file>... print files", cmd_cat);
+    shell_register("disk", "drives, ATA and block cache statistics", cmd_disk);
+    shell_register("sync", "write back the block cache", cmd_sync);
+    shell_register("user", "<program> run a ring 3 program", cmd_user);
+}
+
+// Replaces "!!" / "!<n>" with the line from the history, returns NULL (after saying why) if there is none
+static const char* expand_history(const char* line)
+{
+    if (line[0] != '!') {
+        return line;
+    }
+    const char* found = strcmp(line, "!!") == 0 ? history_line(history_count)
+                                                : history_line((uint32_t)strtoul(line + 1, NULL, 10));
+    if (found == NULL) {
+        printf("%s: not in the history\n", line);
+        return NULL;
+    }
+    printf("%s\n", found);
+    return found;
+}
+
+void shell_main(void* arg)
+{
+    (void)arg;
+    char line[SHELL_LINE_MAX];
+
+    for (;;) {
+        printf(">");
+        fflush(stdout); // stdout is line buffered, push the prompt out before blocking
+        if (fgets(line, sizeof(line), stdin) == NULL) {
+            clearerr(stdin);
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+
+        const char* command = expand_history(line);
+        if (command == NULL) {
+            continue;
+        }
+        char copy[SHELL_LINE_MAX];
+        strcpy(copy, command); // the history slot it came from may get reused by history_add
+        history_add(copy);
+        shell_execute(copy);
+    }
+}
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <kernel/klog.h>
+#include <kernel/kmalloc.h>
+#include <kernel/tarfs.h>
+#include <kernel/vfs.h>
+
+#define TAR_BLOCK 512
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char linkname[100];
+    char magic[6]; // "ustar\0" (POSIX) or "ustar " (GNU)
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} __attribute__((packed));
+
+static uint32_t next_ino = 2; // 1 is the root
+
+static uint32_t octal(const char* field, size_t length)
+{
+    uint32_t value = 0;
+    for (size_t i = 0; i < length && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (uint32_t)(field[i] - '0');
+    }
+    return value;
+}
+
+// The checksum is the byte sum of the header with the checksum field itself counted as spaces
+static int header_valid(const struct tar_header* header)
+{
+    const uint8_t* bytes = (const uint8_t*)header;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; i++) {
+        sum += (i >= offsetof(struct tar_header, checksum) && i < offsetof(struct tar_header, type)) ? ' ' : bytes[i];
+    }
+    return strncmp(header->magic, "ustar", 5) == 0 && sum == octal(header->checksum, sizeof(header->checksum));
+}
+
+static struct vnode* new_vnode(enum vnode_type type, const uint8_t* data, uint32_t size)
+{
+    struct vnode* node = kzalloc(sizeof(struct vnode));
+    if (node != NULL) {
+        node->type = type;
+        node->ino = next_ino++;
+        node->data = data;
+        node->size = size;
+    }
+    return node;
+}
+
+// Creates the directories leading up to the last component of path (archives don't always list them) and
+// returns the parent of that component. *name / *length are set to the last component
+static struct dentry* make_parents(const char* path, const char** name, size_t* length)
+{
+    struct dentry* dir = vfs_root();
+    for (;;) {
+        while (*path == '/') {
+            path++;
+        }
+        size_t n = strcspn(path, "/");
+        const char* rest = path + n;
+        while (*rest == '/') {
+            rest++;
+        }
+        if (*rest == '\0') { // last component
+            *name = path;
+            *length = n;
+            return dir;
+        }
+        if (!(n == 1 && path[0] == '.')) {
+            struct dentry* sub = vfs_add(dir, path, n, NULL);
+            if (sub == NULL) {
+                return NULL;
+            }
+            if (sub->node == NULL) {
+                sub->node = new_vnode(VNODE_DIR, NULL, 0);
+                if (sub->node == NULL) {
+                    return NULL;
+                }
+            }
+            dir = sub;
+        }
+        path = rest;
+    }
+}
+
+int tarfs_mount(const void* image, size_t size)
+{
+    const uint8_t* base = image;
+    int files = 0;
+
+    for (size_t offset = 0; offset + TAR_BLOCK <= size;) {
+        const struct tar_header* header = (const struct tar_header*)(base + offset);
+        if (header->name[0] == '\0') { // end of archive (two zero blocks, the first one is enough)
+            break;
+        }
+        if (!header_valid(header)) {
+            if (offset == 0) {
+                return -1;
+            }
+            klog(KLOG_WARN, "[TARFS] bad header at offset %lu, ignoring the rest\n", (unsigned long)offset);
+            break;
+        }
+
+        uint32_t file_size = octal(header->size, sizeof(header->size));
+        const uint8_t* data = base + offset + TAR_BLOCK;
+        offset += TAR_BLOCK + ((file_size + TAR_BLOCK - 1) & ~(TAR_BLOCK - 1));
+        if (offset > size) {
+            klog(KLOG_WARN, "[TARFS] archive truncated\n");
+            break;
+        }
+
+        // Long paths are split into prefix and name
+        char path[VFS_PATH_MAX];
+        if (header->prefix[0] != '\0') {
+            snprintf(path, sizeof(path), "%.155s/%.100s", header->prefix, header->name);
+        } else {
+            snprintf(path, sizeof(path), "%.100s", header->name);
+        }
+
+        const char* name;
+        size_t length;
+        struct dentry* parent = make_parents(path, &name, &length);
+        if (parent == NULL) {
+            klog(KLOG_WARN, "[TARFS] out of memory\n");
+            return -1;
+        }
+        if (length == 0 || (length == 1 && name[0] == '.')) { // "./" itself
+            continue;
+        }
+
+        if (header->type == '5') {
+            struct dentry* d = vfs_add(parent, name, length, NULL);
+            if (d != NULL && d->node == NULL) {
+                d->node = new_vnode(VNODE_DIR, NULL, 0);
+            }
+        } else if (header->type == '0' || header->type == '\0') {
+            struct vnode* node = new_vnode(VNODE_FILE, data, file_size);
+            if (node == NULL || vfs_add(parent, name, length, node) == NULL) {
+                klog(KLOG_WARN, "[TARFS] out of memory\n");
+                return -1;
+            }
+            files++;
+        } // links, devices and the like aren't supported
+    }
+    return files;
+}
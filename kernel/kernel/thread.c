@@ -0,0 +1,333 @@
+#include <string.h>
+
+#include <kernel/fpu.h>
+#include <kernel/gdt.h>
+#include <kernel/klog.h>
+#include <kernel/kmalloc.h>
+#include <kernel/thread.h>
+#include <kernel/vmm.h>
+
+// Scheduler: one FIFO run queue per priority plus a bitmap of the non-empty ones, so picking the next thread is a
+// find-first-set and a list pop. Threads of the same priority share the CPU round robin with SCHED_SLICE_MS slices,
+// a higher priority thread that wakes up preempts a lower one at the next interrupt return.
+// Everything here runs with interrupts disabled, which on a single CPU is all the locking that is needed.
+
+extern void sched_yield_switch(void); // isr.s
+extern char stack_bottom[]; // boot.S, the boot stack the idle thread keeps using
+extern char stack_top[];
+
+static struct list_node run_queue[THREAD_PRIORITIES];
+static uint32_t ready_mask; // bit n set = run_queue[n] is not empty
+static struct list_node all_threads;
+static struct list_node zombies; // exited threads whose stacks still need freeing
+
+static struct thread idle_thread; // the boot context from kernel_main, runs when nothing else can
+static struct thread* current;
+static volatile int need_resched;
+static uint32_t next_id;
+static uint32_t slice_ticks;
+static uint32_t context_switches;
+
+static void enqueue(struct thread* thread)
+{
+    thread->state = THREAD_READY;
+    list_add_tail(&run_queue[thread->priority], &thread->run_node);
+    ready_mask |= 1u << thread->priority;
+}
+
+static struct thread* pick_next(void)
+{
+    int priority = __builtin_ctz(ready_mask); // never empty, the idle thread is queued whenever it isn't running
+    struct list_node* node = run_queue[priority].next;
+    list_remove(node);
+    if (list_empty(&run_queue[priority])) {
+        ready_mask &= ~(1u << priority);
+    }
+    return container_of(node, struct thread, run_node);
+}
+
+// Makes a blocked thread runnable, asks for a switch if it should run before the current one
+static void wake_thread(struct thread* thread)
+{
+    if (thread->state != THREAD_BLOCKED) {
+        return;
+    }
+    list_remove(&thread->run_node); // off the wait queue, if it was on one
+    enqueue(thread);
+    if (thread->priority < current->priority) {
+        need_resched = 1;
+    }
+}
+
+// Called after waking threads from thread context, switches right away if one of them should run before us
+static void preempt_check(void)
+{
+    if (need_resched && !in_interrupt()) {
+        sched_yield_switch();
+    }
+}
+
+static void sleep_timeout(void* arg)
+{
+    wake_thread((struct thread*)arg);
+}
+
+static void thread_init(struct thread* thread, const char* name, enum thread_priority priority)
+{
+    thread->id = next_id++;
+    strncpy(thread->name, name, THREAD_NAME_LEN - 1);
+    thread->name[THREAD_NAME_LEN - 1] = '\0';
+    thread->priority = priority;
+    thread->slice = slice_ticks;
+    list_init(&thread->run_node);
+    timer_setup(&thread->sleep_timer, sleep_timeout, thread);
+    list_add_tail(&all_threads, &thread->all_node);
+}
+
+void sched_init(void)
+{
+    for (int i = 0; i < THREAD_PRIORITIES; i++) {
+        list_init(&run_queue[i]);
+    }
+    list_init(&all_threads);
+    list_init(&zombies);
+    slice_ticks = timer_ms_to_ticks(SCHED_SLICE_MS);
+    if (slice_ticks == 0) {
+        slice_ticks = 1;
+    }
+
+    uint32_t flags = irq_save();
+    thread_init(&idle_thread, "idle", THREAD_PRIO_IDLE);
+    if (fpu_thread_init(&idle_thread) != 0) {
+        kprintf("[SCHED] out of memory, the boot context won't keep its FPU state\n");
+    }
+    idle_thread.state = THREAD_RUNNING;
+    current = &idle_thread;
+    fpu_switch(&idle_thread); // sets TS: the boot context's next FPU use makes it the owner, so its state gets saved
+    irq_restore(flags);
+}
+
+// First code every new thread runs, reached through the iret of its initial frame
+static void thread_start(void)
+{
+    current->entry(current->arg);
+    thread_exit();
+}
+
+struct thread* thread_create(const char* name, void (*entry)(void* arg), void* arg, enum thread_priority priority)
+{
+    if (priority >= THREAD_PRIO_IDLE) {
+        priority = THREAD_PRIO_LOW;
+    }
+
+    struct thread* thread = kzalloc(sizeof(struct thread));
+    // Mapped up front, a thread can't take a #PF on its own stack. Running off the bottom hits the guard page
+    void* stack = vmm_reserve(THREAD_STACK_SIZE, VMM_GUARD | VMM_COMMIT, name);
+    if (thread == NULL || stack == NULL || fpu_thread_init(thread) != 0) {
+        kprintf("[SCHED] out of memory creating thread '%s'\n", name);
+        if (thread != NULL) {
+            fpu_release(thread);
+        }
+        kfree(thread);
+        vmm_release(stack);
+        return NULL;
+    }
+    thread->stack = stack;
+    thread->entry = entry;
+    thread->arg = arg;
+
+    // Fake an interrupt frame at the top of the stack, as if the thread had been preempted right before
+    // thread_start. Above it sits a dummy return address so thread_start sees a normal, ABI aligned call frame
+    uint32_t* top = (uint32_t*)((char*)stack + THREAD_STACK_SIZE);
+    *--top = 0;
+    struct interrupt_frame* frame = (struct interrupt_frame*)((char*)top - sizeof(struct interrupt_frame));
+    memset(frame, 0, sizeof(struct interrupt_frame));
+    frame->ds = 0x10;
+    frame->cs = 0x08;
+    frame->eip = (uint32_t)thread_start;
+    frame->eflags = 0x202; // IF set, bit 1 is always 1
+    thread->frame = frame;
+
+    uint32_t flags = irq_save();
+    thread_init(thread, name, priority);
+    enqueue(thread);
+    if (thread->priority < current->priority) {
+        need_resched = 1;
+    }
+    preempt_check();
+    irq_restore(flags);
+    return thread;
+}
+
+void thread_exit(void)
+{
+    (void)irq_save(); // never restored, the next thread gets its own flags from its frame
+    current->state = THREAD_DEAD;
+    list_remove(&current->all_node);
+    list_add_tail(&zombies, &current->run_node); // can't free the stack we are running on, the idle thread does it
+    sched_yield_switch();
+    for (;;) { // a dead thread is never picked again
+    }
+}
+
+void thread_reap(void)
+{
+    for (;;) {
+        uint32_t flags = irq_save();
+        struct thread* thread = NULL;
+        if (!list_empty(&zombies)) {
+            thread = container_of(zombies.next, struct thread, run_node);
+            list_remove(&thread->run_node);
+        }
+        irq_restore(flags);
+
+        if (thread == NULL) {
+            return;
+        }
+        fpu_release(thread);
+        vmm_release(thread->stack);
+        kfree(thread);
+    }
+}
+
+struct thread* thread_current(void)
+{
+    return current;
+}
+
+void thread_yield(void)
+{
+    if (current != NULL) {
+        sched_yield_switch();
+    }
+}
+
+void thread_sleep(uint32_t ticks)
+{
+    uint32_t flags = irq_save();
+    current->state = THREAD_BLOCKED;
+    timer_add(&current->sleep_timer, ticks);
+    sched_yield_switch();
+    irq_restore(flags);
+}
+
+int sched_can_block(void)
+{
+    return current != NULL && current != &idle_thread && !in_interrupt();
+}
+
+void sched_tick(void)
+{
+    if (current == NULL) {
+        return;
+    }
+    current->cpu_ticks++;
+    if (current->slice > 0 && --current->slice == 0) {
+        // Only worth a switch if something of the same or higher priority is waiting
+        if (ready_mask & ((2u << current->priority) - 1)) {
+            need_resched = 1;
+        } else {
+            current->slice = slice_ticks;
+        }
+    }
+}
+
+int sched_need_resched(void)
+{
+    return need_resched;
+}
+
+struct interrupt_frame* sched_switch(struct interrupt_frame* frame)
+{
+    need_resched = 0;
+    struct thread* prev = current;
+    prev->frame = frame;
+    if (prev->state == THREAD_RUNNING) {
+        enqueue(prev);
+    }
+
+    struct thread* next = pick_next();
+    next->state = THREAD_RUNNING;
+    next->slice = slice_ticks;
+    if (next != prev) {
+        context_switches++;
+        fpu_switch(next);
+        uint32_t low, high;
+        thread_stack_bounds(next, &low, &high);
+        tss_set_kernel_stack(high); // where an interrupt from ring 3 lands while next runs
+    }
+    current = next;
+    return next->frame;
+}
+
+void thread_stack_bounds(const struct thread* thread, uint32_t* low, uint32_t* high)
+{
+    if (thread == NULL || thread->stack == NULL) {
+        *low = (uint32_t)stack_bottom;
+        *high = (uint32_t)stack_top;
+    } else {
+        *low = (uint32_t)thread->stack;
+        *high = (uint32_t)thread->stack + THREAD_STACK_SIZE;
+    }
+}
+
+void thread_for_each(void (*fn)(struct thread* thread, void* arg), void* arg)
+{
+    uint32_t flags = irq_save();
+    for (struct list_node* node = all_threads.next; node != &all_threads; node = node->next) {
+        fn(container_of(node, struct thread, all_node), arg);
+    }
+    irq_restore(flags);
+}
+
+uint32_t sched_context_switches(void)
+{
+    return context_switches;
+}
+
+void sched_idle(void)
+{
+    for (;;) {
+        thread_reap();
+        if (need_resched) { // a timer fired from thread context made something runnable
+            thread_yield();
+        } else {
+            timer_idle();
+        }
+    }
+}
+
+void wait_queue_init(struct wait_queue* wq)
+{
+    list_init(&wq->waiters);
+}
+
+void wait_queue_sleep(struct wait_queue* wq)
+{
+    current->state = THREAD_BLOCKED;
+    list_add_tail(&wq->waiters, &current->run_node);
+    sched_yield_switch();
+}
+
+static void wake_up_common(struct wait_queue* wq, int all)
+{
+    uint32_t flags = irq_save();
+    while (!list_empty(&wq->waiters)) {
+        wake_thread(container_of(wq->waiters.next, struct thread, run_node));
+        if (!all) {
+            break;
+        }
+    }
+    preempt_check();
+    irq_restore(flags);
+}
+
+void wake_up(struct wait_queue* wq)
+{
+    wake_up_common(wq, 1);
+}
+
+void wake_up_one(struct wait_queue* wq)
+{
+    wake_up_common(wq, 0);
+}
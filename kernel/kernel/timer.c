@@ -0,0 +1,327 @@
+#include <kernel/apic.h>
+#include <kernel/cpu.h>
+#include <kernel/pit.h>
+#include <kernel/profile.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+
+// Hierarchical timer wheel (same layout as the classic Linux one)
+// tv1 has one slot per tick for the next 256 ticks. Timers further out go into one of 4 coarser levels of
+// 64 slots; whenever tv1 wraps around, the next slot of the level above is emptied and its timers are
+// re-sorted one level down ("cascading"). Inserting and cancelling never has to look at other timers.
+
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 4 // 8 + 4 * 6 = 32 bits of range
+#define TVN_INDEX(level) ((wheel_ticks >> (TVR_BITS + (level) * TVN_BITS)) & TVN_MASK)
+
+static struct list_node tv1[TVR_SIZE];
+static struct list_node tvn[TVN_LEVELS][TVN_SIZE];
+static uint32_t wheel_ticks; // next tick the wheel hasn't processed yet
+
+static volatile uint64_t ticks; // the jiffies counter
+static uint32_t hz;
+static uint16_t pit_divisor; // PIT channel 0 keeps running at this rate even when it isn't the tick, udelay reads it
+
+// The tick comes from the local APIC timer when the APIC is active (no port I/O to reprogram it, and every CPU
+// has its own), otherwise from PIT channel 0. Either way it's counted in input clocks of that timer
+static int use_lapic;
+static uint32_t tick_count; // input clocks per tick
+static uint32_t max_count; // largest count a one-shot can be armed with
+
+static void clock_periodic(void)
+{
+    if (use_lapic) {
+        lapic_timer_periodic(tick_count);
+    } else {
+        pit_set_periodic((uint16_t)tick_count);
+    }
+}
+
+static void clock_oneshot(uint32_t count)
+{
+    if (use_lapic) {
+        lapic_timer_oneshot(count);
+    } else {
+        pit_set_oneshot((uint16_t)count);
+    }
+}
+
+static uint32_t clock_remaining(void)
+{
+    return use_lapic ? lapic_timer_current() : pit_read_count();
+}
+
+static volatile int oneshot_active; // the PIT is currently armed for a single long interrupt
+static uint32_t oneshot_ticks; // how many ticks that interrupt stands for
+
+static void wheel_insert(struct timer* timer)
+{
+    uint32_t expires = timer->expires;
+    uint32_t delta = expires - wheel_ticks;
+    struct list_node* slot;
+
+    if ((int32_t)delta < 0) { // already due, run it on the next tick
+        slot = &tv1[wheel_ticks & TVR_MASK];
+    } else if (delta < TVR_SIZE) {
+        slot = &tv1[expires & TVR_MASK];
+    } else {
+        int level = 0;
+        while (level < TVN_LEVELS - 1 && delta >= (1u << (TVR_BITS + (level + 1) * TVN_BITS))) {
+            level++;
+        }
+        slot = &tvn[level][(expires >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK];
+    }
+    list_add_tail(slot, &timer->node);
+}
+
+// Re-sorts every timer in one slot of a coarse level into the finer levels, returns the slot index
+static uint32_t cascade(int level, uint32_t index)
+{
+    struct list_node moving;
+    list_init(&moving);
+    list_splice_tail(&moving, &tvn[level][index]);
+    while (!list_empty(&moving)) {
+        struct list_node* node = moving.next;
+        list_remove(node);
+        wheel_insert(container_of(node, struct timer, node));
+    }
+    return index;
+}
+
+// Fires everything due up to and including tick 'now'
+static void run_timers(uint32_t now)
+{
+    while ((int32_t)(now - wheel_ticks) >= 0) {
+        uint32_t index = wheel_ticks & TVR_MASK;
+        if (index == 0) { // tv1 wrapped, pull the next batch down from the coarser levels
+            for (int level = 0; level < TVN_LEVELS; level++) {
+                if (cascade(level, TVN_INDEX(level)) != 0) {
+                    break;
+                }
+            }
+        }
+
+        struct list_node expired;
+        list_init(&expired);
+        list_splice_tail(&expired, &tv1[index]);
+        wheel_ticks++;
+
+        while (!list_empty(&expired)) {
+            struct timer* timer = container_of(expired.next, struct timer, node);
+            list_remove(&timer->node); // unlinked before the call so the callback may re-arm it
+            timer->fn(timer->arg);
+        }
+    }
+}
+
+// Number of ticks the CPU may sleep through from 'now' without missing a timer or a cascade, at most 'limit'
+static uint32_t idle_ticks(uint32_t now, uint32_t limit)
+{
+    // On a tv1 wrap the next tick to process is the cascade itself, it may pull in a timer due right after it
+    uint32_t to_cascade = (wheel_ticks & TVR_MASK) ? TVR_SIZE - (wheel_ticks & TVR_MASK) : 1;
+    if (limit > to_cascade) {
+        limit = to_cascade;
+    }
+    for (uint32_t tick = wheel_ticks; tick - wheel_ticks < limit; tick++) {
+        if (!list_empty(&tv1[tick & TVR_MASK])) {
+            return tick - now;
+        }
+    }
+    return wheel_ticks + limit - 1 - now;
+}
+
+// IRQ0 (or the LAPIC timer): advances the tick counter, fires expired timers, charges the tick to the running
+// thread and hands the interrupted context to the profiler
+static void timer_irq(struct interrupt_frame* frame, void* ctx)
+{
+    (void)ctx;
+    profile_sample(frame);
+    timer_interrupt();
+    sched_tick();
+}
+
+void timer_init(uint32_t rate)
+{
+    uint32_t divisor = PIT_FREQUENCY / rate;
+    if (divisor == 0) {
+        divisor = 1;
+    } else if (divisor > 0xFFFF) {
+        divisor = 0xFFFF;
+    }
+    pit_divisor = (uint16_t)divisor;
+    hz = PIT_FREQUENCY / divisor;
+
+    for (int i = 0; i < TVR_SIZE; i++) {
+        list_init(&tv1[i]);
+    }
+    for (int level = 0; level < TVN_LEVELS; level++) {
+        for (int i = 0; i < TVN_SIZE; i++) {
+            list_init(&tvn[level][i]);
+        }
+    }
+    ticks = 0;
+    wheel_ticks = 0;
+
+    if (apic_active() && lapic_timer_khz() != 0) {
+        pit_set_periodic(pit_divisor); // free running, IRQ0 stays masked and channel 0 only counts for udelay
+        use_lapic = 1;
+        tick_count = (uint32_t)((uint64_t)lapic_timer_khz() * 1000 / hz);
+        max_count = 0xFFFFFFFF;
+        irq_register(LAPIC_TIMER_VECTOR, timer_irq, NULL);
+    } else {
+        tick_count = pit_divisor;
+        max_count = 0xFFFF;
+        irq_register(IRQ_VECTOR(0), timer_irq, NULL);
+    }
+    clock_periodic();
+}
+
+void timer_setup(struct timer* timer, void (*fn)(void* arg), void* arg)
+{
+    list_init(&timer->node);
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+void timer_add(struct timer* timer, uint32_t delay)
+{
+    uint32_t flags = irq_save();
+    list_remove(&timer->node);
+    timer->expires = (uint32_t)ticks + delay;
+    wheel_insert(timer);
+    irq_restore(flags);
+}
+
+int timer_cancel(struct timer* timer)
+{
+    uint32_t flags = irq_save();
+    int pending = timer_pending(timer);
+    list_remove(&timer->node);
+    irq_restore(flags);
+    return pending;
+}
+
+int timer_pending(const struct timer* timer)
+{
+    return timer->node.next != &timer->node;
+}
+
+void timer_interrupt(void)
+{
+    uint32_t elapsed = 1;
+    if (oneshot_active) { // the long one-shot interrupt from timer_idle, go back to regular ticks
+        elapsed = oneshot_ticks;
+        oneshot_active = 0;
+        clock_periodic();
+    }
+    ticks += elapsed;
+    run_timers((uint32_t)ticks);
+}
+
+uint64_t timer_ticks(void)
+{
+    uint32_t flags = irq_save(); // a 64 bit read isn't atomic on i386
+    uint64_t now = ticks;
+    irq_restore(flags);
+    return now;
+}
+
+uint32_t timer_hz(void)
+{
+    return hz;
+}
+
+uint64_t timer_uptime_ms(void)
+{
+    return timer_ticks() * 1000 / hz;
+}
+
+uint32_t timer_ms_to_ticks(uint32_t ms)
+{
+    return (uint32_t)(((uint64_t)ms * hz + 999) / 1000);
+}
+
+static void sleep_wakeup(void* arg)
+{
+    *(volatile int*)arg = 1;
+}
+
+void sleep_ms(uint32_t ms)
+{
+    uint32_t delay = timer_ms_to_ticks(ms) + 1; // +1 because the current tick is already partly over
+    if (sched_can_block()) { // let other threads have the CPU meanwhile
+        thread_sleep(delay);
+        return;
+    }
+
+    volatile int done = 0;
+    struct timer timer;
+    timer_setup(&timer, sleep_wakeup, (void*)&done);
+    timer_add(&timer, delay);
+    while (!done) {
+        timer_idle();
+    }
+}
+
+void udelay(uint32_t us)
+{
+    uint32_t target = (uint32_t)((uint64_t)us * PIT_FREQUENCY / 1000000);
+    uint32_t elapsed = 0;
+    uint16_t last = pit_read_count();
+
+    while (elapsed < target) {
+        uint16_t now = pit_read_count();
+        if (now <= last) {
+            elapsed += last - now;
+        } else { // the counter reloaded with the divisor in between
+            elapsed += last + (pit_divisor - now);
+        }
+        last = now;
+    }
+}
+
+void timer_wake(void)
+{
+    if (!oneshot_active) {
+        return;
+    }
+    // Woken early by another interrupt, account for the ticks that did pass and go back to regular ticks so the
+    // scheduler gets its time slices again
+    uint32_t programmed = oneshot_ticks * tick_count;
+    uint32_t left = clock_remaining();
+    uint32_t elapsed;
+    if (left > programmed || (use_lapic && left == 0)) {
+        elapsed = oneshot_ticks - 1; // ran out just now, the pending timer interrupt adds the last tick
+    } else {
+        elapsed = (programmed - left) / tick_count;
+    }
+    oneshot_active = 0;
+    clock_periodic();
+    if (elapsed > 0) {
+        ticks += elapsed;
+        run_timers((uint32_t)ticks);
+    }
+}
+
+void timer_idle(void)
+{
+    uint32_t flags = irq_save();
+    uint32_t now = (uint32_t)ticks;
+    uint32_t idle = idle_ticks(now, max_count / tick_count);
+
+    if (idle > 1) {
+        oneshot_ticks = idle;
+        oneshot_active = 1;
+        clock_oneshot(idle * tick_count);
+    }
+
+    __asm__ volatile("sti; hlt; cli"); // sti only takes effect after hlt, so no wakeup can slip in between
+
+    timer_wake(); // normally already done by the interrupt that woke us
+    irq_restore(flags);
+}
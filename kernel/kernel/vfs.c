@@ -0,0 +1,257 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <kernel/cpu.h>
+#include <kernel/kmalloc.h>
+#include <kernel/vfs.h>
+
+struct file {
+    struct vnode* node; // NULL = slot free
+    uint32_t offset;
+};
+
+static struct vnode root_node = { VNODE_DIR, 1, 0, NULL, NULL };
+static struct dentry root;
+static struct dentry* dcache[DCACHE_BUCKETS];
+static struct file files[VFS_MAX_FILES];
+static struct vfs_stats stats;
+
+// FNV-1a over the name, seeded with the parent so equal names in different directories spread out
+static uint32_t name_hash(const struct dentry* parent, const char* name, size_t length)
+{
+    uint32_t hash = 2166136261u ^ (uint32_t)parent;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static struct dentry* dcache_find(const struct dentry* parent, const char* name, size_t length, uint32_t hash)
+{
+    for (struct dentry* d = dcache[hash & (DCACHE_BUCKETS - 1)]; d != NULL; d = d->hash_next) {
+        if (d->hash == hash && d->parent == parent && strncmp(d->name, name, length) == 0 && d->name[length] == '\0') {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+void vfs_init(void)
+{
+    root.name = "";
+    root.parent = &root;
+    root.node = &root_node;
+    list_init(&root.children);
+}
+
+struct dentry* vfs_root(void)
+{
+    return &root;
+}
+
+struct dentry* vfs_add(struct dentry* parent, const char* name, size_t length, struct vnode* node)
+{
+    uint32_t hash = name_hash(parent, name, length);
+    struct dentry* existing = dcache_find(parent, name, length, hash);
+    if (existing != NULL) {
+        return existing;
+    }
+
+    struct dentry* d = kzalloc(sizeof(struct dentry));
+    char* copy = kmalloc(length + 1);
+    if (d == NULL || copy == NULL) {
+        kfree(d);
+        kfree(copy);
+        return NULL;
+    }
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    d->name = copy;
+    d->hash = hash;
+    d->parent = parent;
+    d->node = node;
+    list_init(&d->children);
+
+    uint32_t flags = irq_save();
+    list_add_tail(&parent->children, &d->sibling);
+    d->hash_next = dcache[hash & (DCACHE_BUCKETS - 1)];
+    dcache[hash & (DCACHE_BUCKETS - 1)] = d;
+    stats.dentries++;
+    irq_restore(flags);
+    return d;
+}
+
+struct dentry* vfs_lookup(const char* path)
+{
+    struct dentry* d = &root;
+    while (*path != '\0') {
+        while (*path == '/') {
+            path++;
+        }
+        size_t length = strcspn(path, "/");
+        if (length == 0) {
+            break;
+        }
+        if (d->node->type != VNODE_DIR) {
+            return NULL;
+        }
+
+        stats.lookups++;
+        if (length == 1 && path[0] == '.') {
+            // stays in d
+        } else if (length == 2 && path[0] == '.' && path[1] == '.') {
+            d = d->parent;
+        } else {
+            // Everything a mounted filesystem has is in the cache, a miss means the name doesn't exist
+            d = dcache_find(d, path, length, name_hash(d, path, length));
+            if (d == NULL) {
+                return NULL;
+            }
+            stats.hits++;
+        }
+        path += length;
+    }
+    return d;
+}
+
+int vfs_readdir(const char* path, void (*fn)(const struct dentry* entry, void* arg), void* arg)
+{
+    struct dentry* dir = vfs_lookup(path);
+    if (dir == NULL) {
+        return -ENOENT;
+    }
+    if (dir->node->type != VNODE_DIR) {
+        return -ENOTDIR;
+    }
+    for (struct list_node* n = dir->children.next; n != &dir->children; n = n->next) {
+        fn(container_of(n, struct dentry, sibling), arg);
+    }
+    return 0;
+}
+
+const void* vfs_map(const char* path, size_t* size)
+{
+    struct dentry* d = vfs_lookup(path);
+    if (d == NULL || d->node->type != VNODE_FILE || d->node->data == NULL) {
+        return NULL;
+    }
+    *size = d->node->size;
+    return d->node->data;
+}
+
+static struct file* get_file(int fd)
+{
+    if (fd < VFS_FD_BASE || fd >= VFS_FD_BASE + VFS_MAX_FILES || files[fd - VFS_FD_BASE].node == NULL) {
+        return NULL;
+    }
+    return &files[fd - VFS_FD_BASE];
+}
+
+int vfs_open(const char* path)
+{
+    struct dentry* d = vfs_lookup(path);
+    if (d == NULL) {
+        return -ENOENT;
+    }
+
+    uint32_t flags = irq_save();
+    for (int i = 0; i < VFS_MAX_FILES; i++) {
+        if (files[i].node == NULL) {
+            files[i].node = d->node;
+            files[i].offset = 0;
+            irq_restore(flags);
+            return VFS_FD_BASE + i;
+        }
+    }
+    irq_restore(flags);
+    return -EMFILE;
+}
+
+int vfs_read(int fd, void* buf, size_t size)
+{
+    struct file* file = get_file(fd);
+    if (file == NULL) {
+        return -EBADF;
+    }
+    struct vnode* node = file->node;
+    if (node->type == VNODE_DIR) {
+        return -EISDIR;
+    }
+    if (file->offset >= node->size) {
+        return 0;
+    }
+    if (size > node->size - file->offset) {
+        size = node->size - file->offset;
+    }
+
+    int n;
+    if (node->data != NULL) {
+        memcpy(buf, node->data + file->offset, size); // the only copy: straight from the module into the caller
+        n = (int)size;
+    } else if (node->ops != NULL && node->ops->read != NULL) {
+        n = node->ops->read(node, buf, size, file->offset);
+    } else {
+        return -EIO;
+    }
+    if (n > 0) {
+        file->offset += n;
+    }
+    return n;
+}
+
+int vfs_lseek(int fd, int32_t offset, int whence)
+{
+    struct file* file = get_file(fd);
+    if (file == NULL) {
+        return -EBADF;
+    }
+    int32_t base;
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = (int32_t)file->offset;
+        break;
+    case SEEK_END:
+        base = (int32_t)file->node->size;
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (base + offset < 0) {
+        return -EINVAL;
+    }
+    file->offset = (uint32_t)(base + offset); // past the end is allowed, reads there return 0
+    return (int)file->offset;
+}
+
+int vfs_fstat(int fd, struct vfs_stat* stat)
+{
+    struct file* file = get_file(fd);
+    if (file == NULL) {
+        return -EBADF;
+    }
+    stat->type = file->node->type;
+    stat->ino = file->node->ino;
+    stat->size = file->node->size;
+    return 0;
+}
+
+int vfs_close(int fd)
+{
+    struct file* file = get_file(fd);
+    if (file == NULL) {
+        return -EBADF;
+    }
+    file->node = NULL;
+    return 0;
+}
+
+void vfs_get_stats(struct vfs_stats* out)
+{
+    uint32_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
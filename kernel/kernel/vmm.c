@@ -0,0 +1,211 @@
+#include <string.h>
+
+#include <kernel/cpu.h>
+#include <kernel/klog.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+#include <kernel/vmm.h>
+
+// Areas live in a fixed array sorted by address, the fault handler finds its area with a binary search.
+// A guard page belongs to the area above it: nothing else may be placed there
+
+static struct vmm_area areas[VMM_MAX_AREAS];
+static uint32_t area_count;
+static struct vmm_stats stats;
+
+static uint32_t guard_size(const struct vmm_area* area)
+{
+    return (area->flags & VMM_GUARD) ? PAGE_SIZE : 0;
+}
+
+// First area that ends above addr: the one holding it, or the one whose guard page does, if there is one
+static uint32_t find_index(uint32_t addr)
+{
+    uint32_t low = 0, high = area_count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (areas[mid].start + areas[mid].size <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Maps a zeroed frame at 'page', called with interrupts disabled
+static int populate(struct vmm_area* area, uint32_t page)
+{
+    uint32_t frame = pmm_alloc_page();
+    if (frame == 0) {
+        stats.failed_faults++;
+        return -1;
+    }
+    memset((void*)frame, 0, PAGE_SIZE); // through the identity map
+    if (paging_map(page, frame, PAGE_SIZE, PAGE_WRITE | ((area->flags & VMM_USER) ? PAGE_USER : 0)) != 0) {
+        pmm_free_page(frame);
+        stats.failed_faults++;
+        return -1;
+    }
+    area->resident++;
+    stats.resident_pages++;
+    return 0;
+}
+
+static void release_index(uint32_t i)
+{
+    struct vmm_area* area = &areas[i];
+    stats.resident_pages -= area->resident;
+    for (uint32_t page = area->start; area->resident > 0 && page < area->start + area->size; page += PAGE_SIZE) {
+        uint32_t phys;
+        if (paging_query(page, &phys, NULL) == 0) {
+            paging_unmap(page, PAGE_SIZE);
+            pmm_free_page(PAGE_ALIGN_DOWN(phys));
+            area->resident--;
+        }
+    }
+    stats.reserved_pages -= area->size >> PAGE_SHIFT;
+    area_count--;
+    memmove(&areas[i], &areas[i + 1], (area_count - i) * sizeof(struct vmm_area));
+}
+
+// Puts the area at index i, the caller checked it fits there. Called with interrupts disabled
+static int insert(uint32_t i, uint32_t start, uint32_t size, unsigned flags, const char* name)
+{
+    if (area_count == VMM_MAX_AREAS) {
+        return -1;
+    }
+    memmove(&areas[i + 1], &areas[i], (area_count - i) * sizeof(struct vmm_area));
+    area_count++;
+    struct vmm_area* area = &areas[i];
+    area->start = start;
+    area->size = size;
+    area->resident = 0;
+    area->flags = flags;
+    strncpy(area->name, name, VMM_NAME_LEN - 1);
+    area->name[VMM_NAME_LEN - 1] = '\0';
+    stats.reserved_pages += size >> PAGE_SHIFT;
+
+    if (flags & VMM_COMMIT) {
+        for (uint32_t page = start; page < start + size; page += PAGE_SIZE) {
+            if (populate(area, page) != 0) {
+                release_index(i);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+void* vmm_reserve(size_t size, unsigned flags, const char* name)
+{
+    if (size == 0 || size > VMM_END - VMM_BASE) {
+        return NULL;
+    }
+    size = PAGE_ALIGN_UP(size);
+    uint32_t guard = (flags & VMM_GUARD) ? PAGE_SIZE : 0;
+
+    // First fit over the gaps between the areas
+    uint32_t irq = irq_save();
+    uint32_t gap = VMM_BASE;
+    uint32_t i = 0;
+    for (;; i++) {
+        uint32_t gap_end = VMM_END;
+        if (i < area_count && areas[i].start - guard_size(&areas[i]) < VMM_END) {
+            gap_end = areas[i].start - guard_size(&areas[i]);
+        }
+        if (gap_end > gap && gap_end - gap >= guard + size) {
+            break;
+        }
+        if (i == area_count || gap_end == VMM_END) {
+            irq_restore(irq);
+            return NULL;
+        }
+        uint32_t end = areas[i].start + areas[i].size;
+        if (end > gap) {
+            gap = end;
+        }
+    }
+    int ret = insert(i, gap + guard, size, flags, name);
+    irq_restore(irq);
+    return ret == 0 ? (void*)(gap + guard) : NULL;
+}
+
+int vmm_reserve_at(uint32_t addr, size_t size, unsigned flags, const char* name)
+{
+    size = PAGE_ALIGN_UP(size);
+    uint32_t guard = (flags & VMM_GUARD) ? PAGE_SIZE : 0;
+    if ((addr & (PAGE_SIZE - 1)) || size == 0 || addr < guard || size >= 0u - addr) {
+        return -1;
+    }
+
+    uint32_t irq = irq_save();
+    uint32_t i = find_index(addr - guard);
+    int ret = -1;
+    if (i == area_count || areas[i].start - guard_size(&areas[i]) >= addr + size) {
+        ret = insert(i, addr, size, flags, name);
+    }
+    irq_restore(irq);
+    return ret;
+}
+
+void vmm_release(void* addr)
+{
+    if (addr == NULL) {
+        return;
+    }
+    uint32_t flags = irq_save();
+    uint32_t i = find_index((uint32_t)addr);
+    if (i < area_count && areas[i].start == (uint32_t)addr) {
+        release_index(i);
+        irq_restore(flags);
+        return;
+    }
+    irq_restore(flags);
+    klog(KLOG_ERR, "[VMM] release of %p, no area starts there\n", addr);
+}
+
+int vmm_fault(uint32_t addr, int user)
+{
+    uint32_t flags = irq_save();
+    int ret = -1;
+    uint32_t i = find_index(addr);
+    if (i < area_count && areas[i].start <= addr && (!user || (areas[i].flags & VMM_USER))) {
+        uint32_t page = PAGE_ALIGN_DOWN(addr);
+        if (paging_query(page, NULL, NULL) == 0) {
+            ret = 0; // another CPU faulted on it at the same time and won
+        } else if (populate(&areas[i], page) == 0) {
+            stats.minor_faults++;
+            ret = 0;
+        }
+    }
+    irq_restore(flags);
+    return ret;
+}
+
+const char* vmm_guard_owner(uint32_t addr)
+{
+    // No irq_save, the double fault handler calls this and it must not depend on anything
+    uint32_t i = find_index(addr);
+    if (i < area_count && (areas[i].flags & VMM_GUARD) && addr < areas[i].start && addr >= areas[i].start - PAGE_SIZE) {
+        return areas[i].name;
+    }
+    return NULL;
+}
+
+void vmm_for_each(void (*fn)(const struct vmm_area* area, void* arg), void* arg)
+{
+    uint32_t flags = irq_save();
+    for (uint32_t i = 0; i < area_count; i++) {
+        fn(&areas[i], arg);
+    }
+    irq_restore(flags);
+}
+
+void vmm_get_stats(struct vmm_stats* out)
+{
+    uint32_t flags = irq_save();
+    *out = stats;
+    out->areas = area_count;
+    irq_restore(flags);
+}
@@ -0,0 +1,49 @@
+#include <kernel/thread.h>
+#include <kernel/workqueue.h>
+
+static struct list_node work_list;
+static struct wait_queue work_wait;
+
+static void kworker(void* arg)
+{
+    (void)arg;
+    for (;;) {
+        uint32_t flags = irq_save();
+        while (list_empty(&work_list)) {
+            wait_queue_sleep(&work_wait);
+        }
+        struct work* work = container_of(work_list.next, struct work, node);
+        list_remove(&work->node);
+        work->pending = 0; // cleared before running, so work queued while fn runs isn't lost
+        irq_restore(flags);
+
+        work->fn(work);
+    }
+}
+
+void workqueue_init(void)
+{
+    list_init(&work_list);
+    wait_queue_init(&work_wait);
+    thread_create("kworker", kworker, NULL, THREAD_PRIO_HIGH); // above normal threads, input should feel instant
+}
+
+void work_init(struct work* work, void (*fn)(struct work* work))
+{
+    list_init(&work->node);
+    work->fn = fn;
+    work->pending = 0;
+}
+
+int schedule_work(struct work* work)
+{
+    uint32_t flags = irq_save();
+    int queued = !work->pending;
+    if (queued) {
+        work->pending = 1;
+        list_add_tail(&work_list, &work->node);
+        wake_up_one(&work_wait);
+    }
+    irq_restore(flags);
+    return queued;
+}
@@ -2,4 +2,12 @@
 set -e
 . ./iso.sh
 
-qemu-system-$(./target-triplet-to-arch.sh $HOST) -cdrom nue_kernel.iso
+# Attaches $DISK (disk.img by default) as the primary master if it exists, e.g. after: truncate -s 64M disk.img
+DISK=${DISK:-disk.img}
+if [ -f "$DISK" ]; then
+  DISK_ARGS="-drive file=$DISK,format=raw,if=ide,index=0"
+fi
+
+SMP=${SMP:-4} # CPUs, the boot log lists every one that came online
+
+qemu-system-$(./target-triplet-to-arch.sh $HOST) -cdrom nue_kernel.iso -serial stdio -smp $SMP $DISK_ARGS